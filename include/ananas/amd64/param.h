@@ -9,4 +9,7 @@
 
 #define PAGE_SIZE 4096
 
+/* Virtual address of the read-only clock page, see <ananas/clockpage.h> */
+#define CLOCK_PAGE_ADDR 0x7f000
+
 #endif // AMD64_PARAM_H
@@ -0,0 +1,37 @@
+/*-
+ * SPDX-License-Identifier: Zlib
+ *
+ * Copyright (c) 2009-2018 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#ifndef ANANAS_CLOCKPAGE_H
+#define ANANAS_CLOCKPAGE_H
+
+#include <ananas/types.h>
+
+#define CLOCK_PAGE_VERSION 1
+
+/*
+ * The kernel maps this structure read-only in every process, allowing the time
+ * to be read without entering the kernel. Its address (CLOCK_PAGE_ADDR) is
+ * passed using the AT_CLOCKPAGE auxv entry, which is absent if there is no
+ * page. The counter is the TSC on amd64; the number of nanoseconds since boot is
+ *
+ *   cp_ns_base + (((counter - cp_counter_base) * cp_mult) >> cp_shift)
+ *
+ * using 128-bit intermediates. Add cp_realtime_offset for the time since the
+ * epoch. cp_seq is odd while the kernel is updating the page; readers must
+ * retry if it was odd or changed while reading. If cp_version does not match
+ * CLOCK_PAGE_VERSION, the page cannot be used and the system call must be.
+ */
+struct ANANAS_CLOCK_PAGE {
+    uint32_t cp_version;
+    uint32_t cp_seq;
+    uint64_t cp_counter_base;
+    uint64_t cp_ns_base;
+    uint64_t cp_mult;
+    uint32_t cp_shift;
+    int64_t cp_realtime_offset;
+};
+
+#endif /* ANANAS_CLOCKPAGE_H */
@@ -382,5 +382,7 @@ typedef struct {
 #define AT_EUID 12
 #define AT_GID 13
 #define AT_EGID 14
+/* Ananas-specific */
+#define AT_CLOCKPAGE 15 /* Address of the clock page, if there is one */
 
 #endif /* __ELF_H__ */
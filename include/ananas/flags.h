@@ -29,6 +29,12 @@
 #define F_SETFD 2
 #define F_GETFL 3
 #define F_SETFL 4
+#define F_ADVISE 5
+
+/* F_ADVISE */
+#define POSIX_FADV_NORMAL 0
+#define POSIX_FADV_RANDOM 1
+#define POSIX_FADV_SEQUENTIAL 2
 
 #define FD_CLOEXEC 1
 
@@ -37,6 +37,11 @@ namespace util
         };
     }
 
+    /*
+     * Maps intervals to values; entries are kept sorted by interval so that
+     * they can be located using a binary search. Lookups by value assume
+     * the intervals do not overlap.
+     */
     template<typename IntervalValueType, typename ValueType>
     struct interval_map {
         using interval_value_type = IntervalValueType;
@@ -57,10 +62,8 @@ namespace util
         constexpr iterator end() { return iterator{&i_entries, size()}; }
 
         void insert(const interval_type& interval, const value_type& value) {
-            auto it = i_entries.begin();
-            while(it != i_entries.end() && (it->interval) < interval)
-                ++it;
-            i_entries.insert(it, entry{ interval, util::move(value) });
+            const auto position = i_entries.begin() + lower_bound(interval);
+            i_entries.insert(position, entry{ interval, util::move(value) });
         }
 
         constexpr bool remove(const value_type& value) {
@@ -75,30 +78,42 @@ namespace util
         }
 
         constexpr bool remove(const interval_type& interval) {
-            auto it = i_entries.begin();
-            while(it != i_entries.end() && it->interval != interval)
-                ++it;
-            if (it != i_entries.end()) {
-                i_entries.erase(it);
-                return true;
-            }
-            return false;
+            const auto n = lower_bound(interval);
+            if (n == size() || i_entries[n].interval != interval)
+                return false;
+            i_entries.erase(i_entries.begin() + n);
+            return true;
         }
 
         constexpr auto find_interval(const interval_type& interval) {
-            auto it = i_entries.begin();
-            size_t n = 0;
-            while(it != i_entries.end() && it->interval != interval)
-                ++it, ++n;
+            const auto n = lower_bound(interval);
+            if (n == size() || i_entries[n].interval != interval)
+                return end();
             return iterator{&i_entries, n};
         }
 
+        // Yields the entry containing value if there is one, otherwise the first entry beyond it
+        constexpr auto lower_bound_by_value(const interval_value_type& value) {
+            // Find the first entry starting beyond value...
+            size_t first = 0, last = size();
+            while(first < last) {
+                const auto mid = first + (last - first) / 2;
+                if (i_entries[mid].interval.begin <= value)
+                    first = mid + 1;
+                else
+                    last = mid;
+            }
+            // ... the entry in front of it is the only one that can contain value
+            if (first > 0 && i_entries[first - 1].interval.end > value)
+                --first;
+            return iterator{&i_entries, first};
+        }
+
         constexpr auto find_by_value(const interval_value_type& value) {
-            auto it = i_entries.begin();
-            size_t n = 0;
-            while(it != i_entries.end() && !it->interval.contains(value))
-                ++it, ++n;
-            return iterator{&i_entries, n};
+            auto it = lower_bound_by_value(value);
+            if (it != end() && !it->interval.contains(value))
+                return end();
+            return it;
         }
 
         void clear()
@@ -107,6 +122,19 @@ namespace util
         }
 
     private:
+        // Returns the index of the first entry which does not sort before interval
+        constexpr size_t lower_bound(const interval_type& interval) const {
+            size_t first = 0, last = size();
+            while(first < last) {
+                const auto mid = first + (last - first) / 2;
+                if ((i_entries[mid].interval) < interval)
+                    first = mid + 1;
+                else
+                    last = mid;
+            }
+            return first;
+        }
+
         vector<entry> i_entries;
     };
 
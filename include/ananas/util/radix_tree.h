@@ -0,0 +1,272 @@
+/*-
+ * SPDX-License-Identifier: Zlib
+ *
+ * Copyright (c) 2009-2021 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#ifndef ANANAS_UTIL_RADIX_TREE_H
+#define ANANAS_UTIL_RADIX_TREE_H
+
+#include "atomic.h"
+
+#ifdef __Ananas__
+#include "kernel/mm.h"
+#endif
+
+namespace util
+{
+    /*
+     * Sparse array of T*, indexed by an unsigned integer. This is a radix tree
+     * of 64-way nodes, which grows in height as larger indices are stored.
+     *
+     * Modifications must be serialised by the caller, but lookup() can be
+     * used without any locking: nodes are never freed until clear() is
+     * called, and new nodes are fully set up before they are published.
+     *
+     * Every entry can carry NumTags independent tags. Nodes track which of
+     * their slots lead to tagged entries, so that those can be found without
+     * visiting the entire tree. Tags are protected by the same lock as the
+     * modifications.
+     */
+    template<typename T>
+    class radix_tree
+    {
+      public:
+        using index_type = unsigned long;
+        static constexpr unsigned int NumTags = 2;
+
+        radix_tree() = default;
+        ~radix_tree() { clear(); }
+        radix_tree(const radix_tree&) = delete;
+        radix_tree& operator=(const radix_tree&) = delete;
+
+        bool empty() const { return r_root.load(memory_order::relaxed) == nullptr; }
+
+        T* lookup(const index_type index) const
+        {
+            const node* n = r_root.load(memory_order::acquire);
+            if (n == nullptr || !fits(*n, index))
+                return nullptr;
+            while (true) {
+                void* p = n->n_slot[slot_of(*n, index)].load(memory_order::acquire);
+                if (n->n_shift == 0)
+                    return static_cast<T*>(p);
+                if (p == nullptr)
+                    return nullptr;
+                n = static_cast<const node*>(p);
+            }
+        }
+
+        // Stores value at index; returns false if the index is already in use
+        bool insert(const index_type index, T* value)
+        {
+            node* n = grow_to(index);
+            while (n->n_shift > 0) {
+                auto& slot = n->n_slot[slot_of(*n, index)];
+                auto child = static_cast<node*>(slot.load(memory_order::relaxed));
+                if (child == nullptr) {
+                    child = new node(n->n_shift - Shift);
+                    slot.store(child, memory_order::release);
+                }
+                n = child;
+            }
+
+            auto& slot = n->n_slot[slot_of(*n, index)];
+            if (slot.load(memory_order::relaxed) != nullptr)
+                return false;
+            slot.store(value, memory_order::release);
+            return true;
+        }
+
+        // Removes the entry at index, along with its tags; returns the entry removed
+        T* remove(const index_type index)
+        {
+            path p;
+            if (!walk(index, p))
+                return nullptr;
+            auto value = static_cast<T*>(
+                p.p_node[0]->n_slot[slot_of(*p.p_node[0], index)].exchange(nullptr));
+            for (unsigned int tag = 0; tag < NumTags; ++tag)
+                clear_tag(p, index, tag);
+            return value;
+        }
+
+        // Tags the entry at index; returns false if there is no such entry
+        bool set_tag(const index_type index, const unsigned int tag)
+        {
+            path p;
+            if (!walk(index, p))
+                return false;
+            for (unsigned int n = 0; n < p.p_depth; ++n)
+                p.p_node[n]->n_tags[tag] |= bit_of(*p.p_node[n], index);
+            return true;
+        }
+
+        void clear_tag(const index_type index, const unsigned int tag)
+        {
+            path p;
+            if (walk(index, p))
+                clear_tag(p, index, tag);
+        }
+
+        bool get_tag(const index_type index, const unsigned int tag) const
+        {
+            path p;
+            if (!walk(index, p))
+                return false;
+            return (p.p_node[0]->n_tags[tag] & bit_of(*p.p_node[0], index)) != 0;
+        }
+
+        bool any_tagged(const unsigned int tag) const
+        {
+            const node* root = r_root.load(memory_order::relaxed);
+            return root != nullptr && root->n_tags[tag] != 0;
+        }
+
+        // Invokes fn(index, value) for every entry, in order of index
+        template<typename Fn>
+        void for_each(Fn fn)
+        {
+            if (auto root = r_root.load(memory_order::relaxed); root != nullptr)
+                visit(*root, 0, nullptr, fn);
+        }
+
+        // Invokes fn(index, value) for every entry with the given tag, in order of index
+        template<typename Fn>
+        void for_each_tagged(const unsigned int tag, Fn fn)
+        {
+            if (auto root = r_root.load(memory_order::relaxed); root != nullptr)
+                visit(*root, 0, &tag, fn);
+        }
+
+        // Throws away all entries; this must not race with lookup()
+        void clear()
+        {
+            if (auto root = r_root.exchange(nullptr); root != nullptr)
+                destroy(root);
+        }
+
+      private:
+        static constexpr unsigned int Shift = 6;
+        static constexpr unsigned int SlotsPerNode = 1 << Shift;
+        static constexpr unsigned int IndexBits = sizeof(index_type) * 8;
+        static constexpr unsigned int MaximumDepth = (IndexBits + Shift - 1) / Shift;
+
+        struct node {
+            node(unsigned int shift) : n_shift(shift) {}
+
+            const unsigned int n_shift; // Number of index bits below our slots
+            atomic<void*> n_slot[SlotsPerNode];
+            unsigned long long n_tags[NumTags]{}; // Slots leading to tagged entries
+        };
+
+        // Nodes leading to an entry, starting at the bottom
+        struct path {
+            node* p_node[MaximumDepth];
+            unsigned int p_depth = 0;
+        };
+
+        static bool fits(const node& n, const index_type index)
+        {
+            return n.n_shift + Shift >= IndexBits || (index >> (n.n_shift + Shift)) == 0;
+        }
+
+        static unsigned int slot_of(const node& n, const index_type index)
+        {
+            return (index >> n.n_shift) & (SlotsPerNode - 1);
+        }
+
+        static unsigned long long bit_of(const node& n, const index_type index)
+        {
+            return 1ULL << slot_of(n, index);
+        }
+
+        // Adds levels on top of the tree until index can be stored
+        node* grow_to(const index_type index)
+        {
+            node* root = r_root.load(memory_order::relaxed);
+            if (root == nullptr)
+                root = new node(0);
+            while (!fits(*root, index)) {
+                auto new_root = new node(root->n_shift + Shift);
+                new_root->n_slot[0].store(root, memory_order::relaxed);
+                for (unsigned int tag = 0; tag < NumTags; ++tag) {
+                    if (root->n_tags[tag] != 0)
+                        new_root->n_tags[tag] = 1;
+                }
+                root = new_root;
+            }
+            r_root.store(root, memory_order::release);
+            return root;
+        }
+
+        // Locates the nodes leading to the entry at index; returns false if there is no entry
+        bool walk(const index_type index, path& p) const
+        {
+            node* n = r_root.load(memory_order::relaxed);
+            if (n == nullptr || !fits(*n, index))
+                return false;
+
+            node* nodes[MaximumDepth];
+            unsigned int depth = 0;
+            while (true) {
+                nodes[depth++] = n;
+                void* ptr = n->n_slot[slot_of(*n, index)].load(memory_order::relaxed);
+                if (ptr == nullptr)
+                    return false;
+                if (n->n_shift == 0)
+                    break;
+                n = static_cast<node*>(ptr);
+            }
+
+            for (unsigned int i = 0; i < depth; ++i)
+                p.p_node[i] = nodes[depth - i - 1];
+            p.p_depth = depth;
+            return true;
+        }
+
+        void clear_tag(const path& p, const index_type index, const unsigned int tag)
+        {
+            // Work our way up for as long as nothing else below us is tagged
+            for (unsigned int n = 0; n < p.p_depth; ++n) {
+                p.p_node[n]->n_tags[tag] &= ~bit_of(*p.p_node[n], index);
+                if (p.p_node[n]->n_tags[tag] != 0)
+                    break;
+            }
+        }
+
+        template<typename Fn>
+        void visit(node& n, const index_type base, const unsigned int* tag, Fn& fn)
+        {
+            for (unsigned int slot = 0; slot < SlotsPerNode; ++slot) {
+                if (tag != nullptr && (n.n_tags[*tag] & (1ULL << slot)) == 0)
+                    continue;
+                void* ptr = n.n_slot[slot].load(memory_order::relaxed);
+                if (ptr == nullptr)
+                    continue;
+
+                const index_type index = base | (static_cast<index_type>(slot) << n.n_shift);
+                if (n.n_shift == 0)
+                    fn(index, static_cast<T*>(ptr));
+                else
+                    visit(*static_cast<node*>(ptr), index, tag, fn);
+            }
+        }
+
+        void destroy(node* n)
+        {
+            if (n->n_shift > 0) {
+                for (auto& slot : n->n_slot) {
+                    if (auto child = slot.load(memory_order::relaxed); child != nullptr)
+                        destroy(static_cast<node*>(child));
+                }
+            }
+            delete n;
+        }
+
+        atomic<node*> r_root{nullptr};
+    };
+
+} // namespace util
+
+#endif // ANANAS_UTIL_RADIX_TREE_H
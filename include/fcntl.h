@@ -9,6 +9,7 @@
 
 #include <machine/_types.h>
 #include <ananas/_types/mode.h>
+#include <ananas/_types/off.h>
 #include <sys/cdefs.h>
 
 /* open() */
@@ -31,6 +32,12 @@
 #define F_SETFD 2
 #define F_GETFL 3
 #define F_SETFL 4
+#define F_ADVISE 5
+
+/* posix_fadvise() */
+#define POSIX_FADV_NORMAL 0
+#define POSIX_FADV_RANDOM 1
+#define POSIX_FADV_SEQUENTIAL 2
 
 #define FD_CLOEXEC 1
 
@@ -39,6 +46,7 @@ __BEGIN_DECLS
 int creat(const char*, mode_t);
 int open(const char*, int, ...);
 int fcntl(int fildes, int cmd, ...);
+int posix_fadvise(int fd, off_t offset, off_t len, int advice);
 
 __END_DECLS
 
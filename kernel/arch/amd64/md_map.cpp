@@ -8,12 +8,17 @@
 #include <machine/param.h>
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
+#include "kernel/lock.h"
 #include "kernel/mm.h"
 #include "kernel/pcpu.h"
 #include "kernel/process.h"
 #include "kernel/thread.h"
 #include "kernel/vm.h"
 #include "kernel/vmspace.h"
+#include "kernel-md/interrupts.h"
+#include "kernel-md/macro.h"
+#include "kernel-md/md.h"
+#include "kernel-md/param.h"
 #include "kernel-md/vm.h"
 
 namespace vm_flag = vm::flag;
@@ -24,7 +29,8 @@ namespace md::vm
     {
         auto get_nextpage(VMSpace& vs, uint64_t page_flags)
         {
-            Page* p = page_alloc_single();
+            // We may be mapping on behalf of kmem or the pools themselves
+            Page* p = page_alloc_single(page::flag::Zero | page::flag::NoSleep);
             KASSERT(p != NULL, "out of pages");
 
             /*
@@ -36,8 +42,7 @@ namespace md::vm
 
             /* Map this page in kernel-space XXX How do we clean it up? */
             addr_t phys = p->GetPhysicalAddress();
-            void* va = kmem_map(phys, PAGE_SIZE, vm_flag::Read | vm_flag::Write);
-            memset(va, 0, PAGE_SIZE);
+            kmem_map(phys, PAGE_SIZE, vm_flag::Read | vm_flag::Write);
             return phys | page_flags;
         }
 
@@ -47,6 +52,183 @@ namespace md::vm
             return (uint64_t*)(KMEM_DIRECT_VA_START + (entry & addressMask));
         }
 
+        constexpr uint64_t CR4_PGE = 1 << 7;
+        constexpr uint64_t CR4_PCIDE = 1 << 17;
+        constexpr uint64_t CR3_NOFLUSH = 1ULL << 63;
+        constexpr uint32_t CPUID1_ECX_PCID = 1 << 17;
+
+        // Shootdowns of more pages than this flush the entire TLB instead
+        constexpr size_t ShootdownMaximumPages = 32;
+
+        constexpr size_t NumberOfPCIDs = 4096;
+
+        bool pcidEnabled = false;
+        Spinlock pcidLock;
+        uint64_t pcidInUse[NumberOfPCIDs / 64] = {1}; // PCID 0 belongs to the kernel
+        size_t pcidNext = 1;
+
+        /*
+         * The shootdown in flight; there can only be one at a time. The initiator
+         * fills out the request and sets the bits of the CPU's that must process
+         * it in sr_pending; each CPU clears its bit once it is done.
+         */
+        struct ShootdownRequest {
+            VMSpace* sr_vmspace = nullptr; // nullptr for global mappings
+            addr_t sr_virt = 0;
+            size_t sr_num_pages = 0;
+            md::smp::CPUSet sr_pending;
+        } shootdownRequest;
+        util::atomic<int> shootdownBusy{0};
+
+        // CPU's which have not yet switched threads still use the kernel page tables
+        inline VMSpace& GetActiveVMSpace()
+        {
+            auto vs = PCPU_GET(vmspace);
+            return vs != nullptr ? *vs : *kernel_vmspace;
+        }
+
+        void Invalidate(addr_t virt, size_t num_pages, bool global)
+        {
+            if (num_pages > ShootdownMaximumPages) {
+                if (global) {
+                    // Toggling global pages flushes everything, regardless of PCID
+                    const auto cr4 = read_cr4();
+                    write_cr4(cr4 & ~CR4_PGE);
+                    write_cr4(cr4);
+                } else {
+                    // Reloading %cr3 flushes all non-global entries of the current PCID
+                    uint64_t cr3;
+                    __asm __volatile("movq %%cr3, %0" : "=r"(cr3));
+                    __asm __volatile("movq %0, %%cr3" : : "r"(cr3) : "memory");
+                }
+                return;
+            }
+
+            for (/* nothing */; num_pages > 0; --num_pages, virt += PAGE_SIZE)
+                __asm __volatile("invlpg %0" : : "m"(*(char*)virt) : "memory");
+        }
+
+        void SendShootdown(
+            VMSpace* vs, addr_t virt, size_t num_pages, const md::smp::CPUSet& targets)
+        {
+            /*
+             * Keep processing requests while we wait our turn: the CPU currently
+             * holding the request may be waiting for us, with interrupts disabled.
+             */
+            while (true) {
+                int expected = 0;
+                if (shootdownBusy.compare_exchange_weak(expected, 1))
+                    break;
+                ProcessShootdown();
+                md::interrupts::Pause();
+            }
+
+            auto& sr = shootdownRequest;
+            sr.sr_vmspace = vs;
+            sr.sr_virt = virt;
+            sr.sr_num_pages = num_pages;
+            sr.sr_pending.Merge(targets); // empty, as the previous request has completed
+            md::smp::SendShootdown(targets);
+
+            while (!sr.sr_pending.IsEmpty())
+                md::interrupts::Pause();
+            shootdownBusy = 0;
+        }
+
+        /*
+         * Invalidates the translations of 'num_pages' pages at 'virt' in vmspace
+         * 'vs' on all CPU's that may have them cached; returns once this is done.
+         */
+        void Shootdown(VMSpace& vs, addr_t virt, size_t num_pages, bool global)
+        {
+            const auto state = md::interrupts::SaveAndDisable();
+            const int cpuid = PCPU_GET(cpuid);
+
+            md::smp::CPUSet targets;
+            if (global) {
+                Invalidate(virt, num_pages, true);
+                targets.Merge(md::smp::GetOnlineCPUs());
+            } else {
+                // Anyone not currently running 'vs' must flush it once they do
+                vs.vs_md_stale_cpus.Fill();
+                if (&GetActiveVMSpace() == &vs) {
+                    Invalidate(virt, num_pages, false);
+                    vs.vs_md_stale_cpus.Remove(cpuid);
+                }
+                targets.Merge(vs.vs_md_active_cpus);
+            }
+            targets.Remove(cpuid);
+
+            if (!targets.IsEmpty())
+                SendShootdown(global ? nullptr : &vs, virt, num_pages, targets);
+            md::interrupts::Restore(state);
+        }
+
+        /*
+         * Keeps track of the pages whose translations must be invalidated once we
+         * are done changing the page tables, so that only a single shootdown is
+         * needed per operation.
+         */
+        struct InvalidationRange {
+            addr_t ir_begin = 0;
+            addr_t ir_end = 0;
+            bool ir_global = false;
+
+            void Add(addr_t virt, size_t num_pages, bool global)
+            {
+                const addr_t end = virt + num_pages * PAGE_SIZE;
+                if (ir_begin == ir_end) {
+                    ir_begin = virt;
+                    ir_end = end;
+                } else {
+                    if (virt < ir_begin)
+                        ir_begin = virt;
+                    if (end > ir_end)
+                        ir_end = end;
+                }
+                ir_global |= global;
+            }
+
+            void Flush(VMSpace& vs)
+            {
+                if (ir_begin != ir_end)
+                    Shootdown(vs, ir_begin, (ir_end - ir_begin) / PAGE_SIZE, ir_global);
+            }
+        };
+
+        constexpr size_t PagesPerLargePage = LARGE_PAGE_SIZE / PAGE_SIZE;
+        constexpr addr_t LargePageAddressMask = 0xfffffffe00000; // bits 21 .. 51
+
+        inline bool IsLargePageAligned(addr_t addr) { return (addr & (LARGE_PAGE_SIZE - 1)) == 0; }
+
+        // Number of pages from 'virt' up to the end of its large page
+        inline size_t GetPagesLeftInLargePage(addr_t virt)
+        {
+            return PagesPerLargePage - ((virt >> 12) & 0x1ff);
+        }
+
+        /*
+         * Replaces the large page in 'pde' by a page table which maps the same
+         * memory using small pages, so that part of it can be changed.
+         */
+        void DemoteLargePage(
+            VMSpace& vs, uint64_t& pde, addr_t virt, uint64_t pd_flags,
+            InvalidationRange& invalidate)
+        {
+            const addr_t phys = pde & LargePageAddressMask;
+            const uint64_t pt_flags = pde & ~(LargePageAddressMask | PE_PS);
+
+            const uint64_t new_pde = get_nextpage(vs, pd_flags);
+            uint64_t* pte = pt_resolve_addr(new_pde);
+            for (size_t n = 0; n < PagesPerLargePage; n++)
+                pte[n] = (phys + n * PAGE_SIZE) | pt_flags;
+            pde = new_pde;
+
+            // The large translation may be cached, so it must go
+            if (pt_flags & PE_P)
+                invalidate.Add(virt & ~(LARGE_PAGE_SIZE - 1), 1, (pt_flags & PE_G) != 0);
+        }
+
     } // unnamed namespace
 
     void MapPages(VMSpace& vs, addr_t virt, addr_t phys, size_t num_pages, int flags)
@@ -69,7 +251,8 @@ namespace md::vm
 
         /* XXX we don't yet strip off bits 52-63 yet */
         auto pagedir = vs.vs_md_pagedir;
-        while (num_pages--) {
+        InvalidationRange invalidate;
+        while (num_pages > 0) {
             if (pagedir[(virt >> 39) & 0x1ff] == 0) {
                 pagedir[(virt >> 39) & 0x1ff] = get_nextpage(vs, pd_flags);
             }
@@ -90,31 +273,64 @@ namespace md::vm
                 pdpe[(virt >> 30) & 0x1ff] = get_nextpage(vs, pd_flags);
             }
 
-            uint64_t* pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff]);
-            if (pde[(virt >> 21) & 0x1ff] == 0) {
-                pde[(virt >> 21) & 0x1ff] = get_nextpage(vs, pd_flags);
+            uint64_t& pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff])[(virt >> 21) & 0x1ff];
+            if (pde & PE_C_L) {
+                // Direct-mapped memory never changes; we can skip the entire large page
+                KASSERT(
+                    (pde & LargePageAddressMask) == (phys & ~(LARGE_PAGE_SIZE - 1)),
+                    "remapping direct mapped memory at %p to %p", virt, phys);
+                size_t n = GetPagesLeftInLargePage(virt);
+                if (n > num_pages)
+                    n = num_pages;
+                virt += n * PAGE_SIZE;
+                phys += n * PAGE_SIZE;
+                num_pages -= n;
+                continue;
+            }
+
+            /*
+             * Use a large page if we are to map an entire aligned one; we do not
+             * bother to throw away page tables that are already in place.
+             */
+            if ((pde == 0 || (pde & PE_PS)) && (pt_flags & PE_P) && IsLargePageAligned(virt) &&
+                IsLargePageAligned(phys) && num_pages >= PagesPerLargePage) {
+                const uint64_t old_pde = pde;
+                pde = (uint64_t)phys | pt_flags | PE_PS;
+                if (old_pde & PE_P)
+                    invalidate.Add(virt, PagesPerLargePage, ((old_pde | pt_flags) & PE_G) != 0);
+
+                virt += LARGE_PAGE_SIZE;
+                phys += LARGE_PAGE_SIZE;
+                num_pages -= PagesPerLargePage;
+                continue;
+            }
+
+            if (pde == 0) {
+                pde = get_nextpage(vs, pd_flags);
+            } else if (pde & PE_PS) {
+                DemoteLargePage(vs, pde, virt, pd_flags, invalidate);
             }
 
             // Ensure we'll flush the mapping if it was already present - it may be in the TLB
-            uint64_t* pte = pt_resolve_addr(pde[(virt >> 21) & 0x1ff]);
-            bool need_invalidate = (pte[(virt >> 12) & 0x1ff] & PE_P) != 0;
+            uint64_t* pte = pt_resolve_addr(pde);
+            const uint64_t old_pte = pte[(virt >> 12) & 0x1ff];
             pte[(virt >> 12) & 0x1ff] = (uint64_t)phys | pt_flags;
-            if (need_invalidate)
-                __asm __volatile("invlpg %0" : : "m"(*(char*)virt) : "memory");
+            if (old_pte & PE_P)
+                invalidate.Add(virt, 1, ((old_pte | pt_flags) & PE_G) != 0);
 
             virt += PAGE_SIZE;
             phys += PAGE_SIZE;
+            num_pages--;
         }
+        invalidate.Flush(vs);
     }
 
     void UnmapPages(VMSpace& vs, addr_t virt, size_t num_pages)
     {
-        const auto& process = process::GetCurrent();
-        const bool is_cur_vmspace = &process.p_vmspace == &vs;
-
         /* XXX we don't yet strip off bits 52-63 yet */
         auto pagedir = vs.vs_md_pagedir;
-        while (num_pages--) {
+        InvalidationRange invalidate;
+        while (num_pages > 0) {
             if (pagedir[(virt >> 39) & 0x1ff] == 0) {
                 panic(
                     "vs=%p, virt=%p -> l1 not mapped (%p)", &vs, virt,
@@ -128,26 +344,46 @@ namespace md::vm
                     pagedir[(virt >> 30) & 0x1ff]);
             }
 
-            uint64_t* pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff]);
-            if (pde[(virt >> 21) & 0x1ff] == 0) {
-                panic(
-                    "vs=%p, virt=%p -> l3 not mapped (%p)", &vs, virt,
-                    pagedir[(virt >> 21) & 0x1ff]);
+            uint64_t& pde = pt_resolve_addr(pdpe[(virt >> 30) & 0x1ff])[(virt >> 21) & 0x1ff];
+            if (pde == 0) {
+                panic("vs=%p, virt=%p -> l3 not mapped (%p)", &vs, virt, pde);
             }
 
-            /* XXX perhaps we should check if this is actually mapped */
-            uint64_t* pte = pt_resolve_addr(pde[(virt >> 21) & 0x1ff]);
-            int global = (pte[(virt >> 12) & 0x1ff] & PE_G);
-            pte[(virt >> 12) & 0x1ff] = 0;
-            if (global || is_cur_vmspace) {
-                /*
-                 * We just unmapped a global virtual address or something that belongs to
-                 * the current thread; this means we'll have to * explicitely invalidate it.
-                 */
-                __asm __volatile("invlpg %0" : : "m"(*(char*)virt) : "memory");
+            if (pde & PE_C_L) {
+                // Direct-mapped memory is never unmapped; skip the entire large page
+                size_t n = GetPagesLeftInLargePage(virt);
+                if (n > num_pages)
+                    n = num_pages;
+                virt += n * PAGE_SIZE;
+                num_pages -= n;
+                continue;
             }
+
+            if (pde & PE_PS) {
+                if (IsLargePageAligned(virt) && num_pages >= PagesPerLargePage) {
+                    const uint64_t old_pde = pde;
+                    pde = 0;
+                    if (old_pde & PE_P)
+                        invalidate.Add(virt, PagesPerLargePage, (old_pde & PE_G) != 0);
+                    virt += LARGE_PAGE_SIZE;
+                    num_pages -= PagesPerLargePage;
+                    continue;
+                }
+
+                // Only part of the large page goes; the rest must stay
+                DemoteLargePage(vs, pde, virt, PE_US | PE_P | PE_RW, invalidate);
+            }
+
+            // Only mappings that were present can be in the TLB of any CPU
+            uint64_t* pte = pt_resolve_addr(pde);
+            const uint64_t old_pte = pte[(virt >> 12) & 0x1ff];
+            pte[(virt >> 12) & 0x1ff] = 0;
+            if (old_pte & PE_P)
+                invalidate.Add(virt, 1, (old_pte & PE_G) != 0);
             virt += PAGE_SIZE;
+            num_pages--;
         }
+        invalidate.Flush(vs);
     }
 
     void MapKernel(addr_t phys, addr_t virt, size_t num_pages, int flags)
@@ -157,6 +393,109 @@ namespace md::vm
 
     void UnmapKernel(addr_t virt, size_t num_pages) { UnmapPages(*kernel_vmspace, virt, num_pages); }
 
+    void ZeroPage(void* va)
+    {
+        /*
+         * Use non-temporal stores: this is used to zero pages ahead of time, so
+         * whoever gets the page will not touch it any time soon and there is no
+         * point in evicting useful cache lines.
+         */
+        auto p = static_cast<uint64_t*>(va);
+        for (size_t n = 0; n < PAGE_SIZE / sizeof(uint64_t); n += 4, p += 4) {
+            __asm __volatile("movnti %1, 0(%0)\n"
+                             "movnti %1, 8(%0)\n"
+                             "movnti %1, 16(%0)\n"
+                             "movnti %1, 24(%0)\n"
+                             :
+                             : "r"(p), "r"(0ULL)
+                             : "memory");
+        }
+        __asm __volatile("sfence" : : : "memory");
+    }
+
+    void InitializePCID()
+    {
+        uint32_t eax = 1, ebx, ecx, edx;
+        __asm __volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+        if ((ecx & CPUID1_ECX_PCID) == 0)
+            return;
+
+        // Note that this requires %cr3 to refer to PCID 0, which is what the kernel uses
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcidEnabled = true;
+    }
+
+    uint16_t AllocatePCID()
+    {
+        SpinlockGuard g(pcidLock);
+        for (size_t n = 0; n < NumberOfPCIDs; ++n) {
+            const size_t pcid = (pcidNext + n) % NumberOfPCIDs;
+            auto& word = pcidInUse[pcid / 64];
+            const uint64_t bit = 1ULL << (pcid % 64);
+            if (word & bit)
+                continue;
+            word |= bit;
+            pcidNext = pcid + 1;
+            return pcid;
+        }
+
+        // All taken; PCID 0 is flushed on every switch, so it can be shared
+        return 0;
+    }
+
+    void FreePCID(uint16_t pcid)
+    {
+        if (pcid == 0)
+            return;
+        SpinlockGuard g(pcidLock);
+        pcidInUse[pcid / 64] &= ~(1ULL << (pcid % 64));
+    }
+
+    void Activate(VMSpace& vs)
+    {
+        KASSERT(md::interrupts::Save() == 0, "interrupts must be disabled");
+
+        // Threads of the same vmspace share everything, including the TLB entries
+        auto prev = PCPU_GET(vmspace);
+        if (prev == &vs)
+            return;
+
+        /*
+         * Announce that we are using 'vs' before checking whether our
+         * translations are stale; Shootdown() does this in the reverse order, so
+         * either we see the stale bit or it sees us as active and sends an IPI.
+         */
+        const int cpuid = PCPU_GET(cpuid);
+        if (prev != nullptr)
+            prev->vs_md_active_cpus.Remove(cpuid);
+        vs.vs_md_active_cpus.Add(cpuid);
+        PCPU_SET(vmspace, &vs);
+
+        uint64_t cr3 = KVTOP(reinterpret_cast<addr_t>(vs.vs_md_pagedir));
+        if (pcidEnabled) {
+            const bool stale = vs.vs_md_stale_cpus.TestAndRemove(cpuid);
+            cr3 |= vs.vs_md_pcid;
+            if (vs.vs_md_pcid != 0 && !stale)
+                cr3 |= CR3_NOFLUSH;
+        }
+        __asm __volatile("movq %0, %%cr3" : : "r"(cr3) : "memory");
+    }
+
+    void ProcessShootdown()
+    {
+        auto& sr = shootdownRequest;
+        const int cpuid = PCPU_GET(cpuid);
+        if (!sr.sr_pending.Contains(cpuid))
+            return;
+
+        // If we aren't running the vmspace, we'll flush it once we switch to it
+        if (sr.sr_vmspace == nullptr)
+            Invalidate(sr.sr_virt, sr.sr_num_pages, true);
+        else if (sr.sr_vmspace == &GetActiveVMSpace())
+            Invalidate(sr.sr_virt, sr.sr_num_pages, false);
+        sr.sr_pending.Remove(cpuid);
+    }
+
     void MapKernelSpace(VMSpace& vs)
     {
         /* We can just copy the entire kernel pagemap over; it's shared with everything else */
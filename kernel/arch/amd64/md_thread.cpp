@@ -16,6 +16,7 @@
 #include "kernel/vmspace.h"
 #include "kernel-md/interrupts.h"
 #include "kernel-md/frame.h"
+#include "kernel-md/md.h"
 #include "kernel-md/param.h"
 #include "kernel-md/vm.h"
 #include "../sys/syscall.h"
@@ -41,7 +42,7 @@ namespace md::thread
         t.md_kstack_page = page_alloc_length(KERNEL_STACK_SIZE + PAGE_SIZE);
         t.md_kstack = kmem_map(
             t.md_kstack_page->GetPhysicalAddress() + PAGE_SIZE, KERNEL_STACK_SIZE,
-            vm::flag::Read | vm::flag::Write);
+            ::vm::flag::Read | ::vm::flag::Write);
 
         /* Set up a stackframe so that we can return to the kernel code */
         struct STACKFRAME* sf =
@@ -54,7 +55,7 @@ namespace md::thread
         sf->sf_rflags = 0x200; /* IF */
 
         /* Fill out our MD fields */
-        t.md_cr3 = KVTOP(reinterpret_cast<addr_t>(proc.p_vmspace.vs_md_pagedir));
+        t.md_vmspace = &proc.p_vmspace;
         t.md_rsp = reinterpret_cast<addr_t>(sf);
         t.md_rsp0 = reinterpret_cast<addr_t>(t.md_kstack) + KERNEL_STACK_SIZE;
         t.md_rip = reinterpret_cast<addr_t>(&thread_trampoline);
@@ -77,7 +78,7 @@ namespace md::thread
         t.md_kstack_page = page_alloc_length(KERNEL_STACK_SIZE + PAGE_SIZE);
         t.md_kstack = kmem_map(
             t.md_kstack_page->GetPhysicalAddress() + PAGE_SIZE, KERNEL_STACK_SIZE,
-            vm::flag::Read | vm::flag::Write);
+            ::vm::flag::Read | ::vm::flag::Write);
         t.t_md_flags = THREAD_MDFLAG_FULLRESTORE;
 
         /* Set up a stackframe so that we can return to the kernel code */
@@ -94,7 +95,7 @@ namespace md::thread
         sf->sf_rsp = ((addr_t)t.md_kstack + KERNEL_STACK_SIZE - 16);
 
         /* Set up the thread context */
-        t.md_cr3 = KVTOP((addr_t)kernel_vmspace->vs_md_pagedir);
+        t.md_vmspace = kernel_vmspace;
         t.md_rsp = (addr_t)sf;
         t.md_rip = (addr_t)&thread_trampoline;
     }
@@ -136,7 +137,7 @@ namespace md::thread
                  "r" (&new_thread.md_fpu_ctx));
 
         // Activate the new_thread thread's page tables
-        __asm __volatile("movq %0, %%cr3" : : "r"(new_thread.md_cr3));
+        md::vm::Activate(*new_thread.md_vmspace);
 
         /*
          * This will only be called from kernel -> kernel transitions, and the
@@ -175,7 +176,7 @@ namespace md::thread
         KASSERT(&::thread::GetCurrent() == &parent, "must clone active thread");
 
         /* Restore the thread's own page directory */
-        t.md_cr3 = KVTOP(reinterpret_cast<addr_t>(t.t_process.p_vmspace.vs_md_pagedir));
+        t.md_vmspace = &t.t_process.p_vmspace;
 
         /*
          * We need to copy the the stack frame so we can return return safely to the
@@ -8,8 +8,11 @@
 #include <ananas/errno.h>
 #include "kernel/lib.h"
 #include "kernel/result.h"
+#include "kernel/time.h"
 #include "kernel/vm.h"
+#include "kernel/vmarea.h"
 #include "kernel/vmspace.h"
+#include "kernel-md/interrupts.h"
 #include "kernel-md/md.h"
 #include "kernel-md/param.h"
 #include "kernel-md/vm.h"
@@ -18,6 +21,18 @@ extern Page* usupport_page;
 
 namespace vm_flag = vm::flag;
 
+namespace
+{
+    void MapFixedPage(VMSpace& vs, addr_t virt, addr_t phys, int flags)
+    {
+        md::vm::MapPages(vs, virt, phys, 1, flags);
+
+        // Register the page so nothing else can be mapped on top of it
+        const VAInterval interval{ virt, virt + PAGE_SIZE };
+        vs.vs_areamap.insert(interval, new VMArea(virt, PAGE_SIZE, flags | vm_flag::MD));
+    }
+} // unnamed namespace
+
 namespace md::vmspace
 {
     Result Init(VMSpace& vs)
@@ -29,17 +44,35 @@ namespace md::vmspace
             return Result::Failure(ENOMEM);
         vs.vs_md_pages.push_back(*pagedir_page);
 
+        // Whoever used our PCID before may have left translations behind; flush them on first use
+        vs.vs_md_pcid = md::vm::AllocatePCID();
+        vs.vs_md_stale_cpus.Fill();
+
         /* Map the kernel pages in there */
         memset(vs.vs_md_pagedir, 0, PAGE_SIZE);
         md::vm::MapKernelSpace(vs);
 
         // Map the userland support page
-        md::vm::MapPages(
-            vs, USERLAND_SUPPORT_ADDR, usupport_page->GetPhysicalAddress(), 1,
+        MapFixedPage(
+            vs, USERLAND_SUPPORT_ADDR, usupport_page->GetPhysicalAddress(),
             vm_flag::User | vm_flag::Read | vm_flag::Execute);
+
+        // Map the clock page, which allows userland to obtain the time without a system call
+        MapFixedPage(
+            vs, CLOCK_PAGE_ADDR, time::GetClockPage().GetPhysicalAddress(),
+            vm_flag::User | vm_flag::Read);
         return Result::Success();
     }
 
-    void Destroy(VMSpace& vs) {}
+    void Destroy(VMSpace& vs)
+    {
+        /*
+         * A CPU may still be switching away from us, using our page tables; it
+         * must be done before they can be freed and our PCID can be reused.
+         */
+        while (!vs.vs_md_active_cpus.IsEmpty())
+            md::interrupts::Pause();
+        md::vm::FreePCID(vs.vs_md_pcid);
+    }
 
 } // namespace md::vmspace
@@ -10,13 +10,16 @@
 #include "kernel/result.h"
 #include "kernel/time.h"
 #include "kernel-md/io.h"
+#include "kernel-md/md.h"
 #include "kernel-md/pit.h"
 #include "kernel-md/interrupts.h"
 
 namespace
 {
     inline constexpr int timerFreq = 1193182;
+    inline constexpr int calibrationFreq = 100; // in Hz
     int cpuFrequency = -1;
+    uint64_t tscFrequency; // in Hz
 
     uint64_t tsc_boot_time;
 
@@ -35,13 +38,20 @@ uint32_t x86_get_ms_since_boot()
 
 int x86_get_cpu_frequency() { return cpuFrequency; }
 
+namespace md::timer
+{
+    uint64_t ReadCounter() { return rdtsc(); }
+
+    uint64_t GetCounterFrequency() { return tscFrequency; }
+} // namespace md::timer
+
 void x86_pit_calc_cpuspeed_mhz()
 {
     // Use PIT timer 2 to wait one tick - this is the only timer we can read the
     // output from, which prevents having to use interrupts
+    const uint16_t count = timerFreq / calibrationFreq;
     {
         outb(PIT_KBD_B_CTRL, (inb(PIT_KBD_B_CTRL) & PIT_KBD_B_MASK1) | PIT_KBD_B_T2GATE);
-        const uint16_t count = timerFreq / time::GetPeriodicyInHz();
         outb(PIT_CH2_DATA, (count & 0xff));
         outb(PIT_CH2_DATA, (count >> 8));
     }
@@ -60,9 +70,12 @@ void x86_pit_calc_cpuspeed_mhz()
     uint64_t tsc_current = rdtsc();
     // We use the tsc_current value as the boot time
     tsc_boot_time = tsc_current;
-    cpuFrequency = ((tsc_current - tsc_base) * time::GetPeriodicyInHz()) / 1000000;
+    // Use the exact PIT period; the rounding of 'count' would otherwise skew the result
+    tscFrequency = ((tsc_current - tsc_base) * timerFreq) / count;
+    cpuFrequency = tscFrequency / 1000000;
     if (cpuFrequency < 100) {
         cpuFrequency = 1000;
+        tscFrequency = static_cast<uint64_t>(cpuFrequency) * 1000000;
         kprintf(
             "unable to properly measure CPU frequency (is this an emulator/VM?) - using %d Hz\n",
             cpuFrequency);
@@ -5,6 +5,7 @@
  * For conditions of distribution and use, see LICENSE file
  */
 #include <ananas/util/algorithm.h>
+#include <ananas/util/atomic.h>
 #include <ananas/types.h>
 #include <ananas/errno.h>
 #include "kernel/init.h"
@@ -26,6 +27,7 @@
 #include "kernel-md/smp.h"
 #include "kernel-md/interrupts.h"
 #include "kernel-md/macro.h"
+#include "kernel-md/md.h"
 #include "kernel-md/param.h"
 #include "kernel-md/vm.h"
 #include "../../dev/acpi/acpica/acpi.h"
@@ -48,6 +50,8 @@ namespace smp
     namespace
     {
         constexpr uint32_t maxLAPICTimerCount = 0xffffffff;
+        constexpr uint64_t maxLAPICTimerShotInNs = 10'000'000'000; // 10 seconds
+        constexpr uint64_t initialTimerShotInNs = 10'000'000;      // 10 ms
         constexpr size_t numberOfISAInterrupts = 16;
         constexpr int irqVectorBase = 32;
 
@@ -61,6 +65,29 @@ namespace smp
             return *(reinterpret_cast<volatile uint32_t*>(lapic_base + reg));
         }
 
+        // Must be called with interrupts disabled, so that nothing else can use the ICR meanwhile
+        void WriteICR(uint32_t hi, uint32_t lo)
+        {
+            while (ReadLAPIC(LAPIC_ICR_LO) & LAPIC_ICR_STATUS_PENDING)
+                md::interrupts::Pause();
+            WriteLAPIC(LAPIC_ICR_HI, hi);
+            WriteLAPIC(LAPIC_ICR_LO, lo);
+        }
+
+        void SendIPI(int cpuid, int vector)
+        {
+            WriteICR(
+                x86_cpus[cpuid].cpu_lapic_id << 24, LAPIC_ICR_DEST_FIELD | LAPIC_ICR_LEVEL_ASSERT |
+                                                        LAPIC_ICR_DELIVERY_FIXED | vector);
+        }
+
+        void SendIPIToOthers(int vector)
+        {
+            WriteICR(
+                0, LAPIC_ICR_DEST_ALL_EXC_SELF | LAPIC_ICR_LEVEL_ASSERT | LAPIC_ICR_DELIVERY_FIXED |
+                       vector);
+        }
+
         template<typename Func>
         void WalkMADT(const ACPI_TABLE_MADT* madt, Func func)
         {
@@ -75,6 +102,7 @@ namespace smp
         Page* ap_page = nullptr;
         volatile int can_smp_launch = 0;
         int num_cpus = 0;
+        md::smp::CPUSet online_cpus;
 
         struct IPISource final : irq::IRQSource {
             int GetFirstInterruptNumber() const override;
@@ -94,21 +122,17 @@ namespace smp
 
         void IPISource::Acknowledge(int no) { X86_IOAPIC::AcknowledgeAll(); }
 
-        struct IPIPeriodicHandler : irq::IHandler {
+        // Used for both the local timer and reschedule IPI's; the scheduler re-arms the timer
+        struct IPIRescheduleHandler : irq::IHandler {
             irq::IRQResult OnIRQ() override
             {
-                // If we are the BSP, advance time by one tick
-                int cpuid = PCPU_GET(cpuid);
-                if (cpuid == 0)
-                    time::OnTick();
-
                 // Set the reschedule flag of the current thread; this makes the IRQ reschedule us
                 // as needed
                 auto& curThread = thread::GetCurrent();
                 curThread.t_flags |= THREAD_FLAG_RESCHEDULE;
                 return irq::IRQResult::Processed;
             }
-        } ipiPeriodicHandler;
+        } ipiRescheduleHandler;
 
         struct IPIPanicHandler : irq::IHandler {
             irq::IRQResult OnIRQ() override
@@ -122,6 +146,14 @@ namespace smp
             }
         } ipiPanicHandler;
 
+        struct IPIShootdownHandler : irq::IHandler {
+            irq::IRQResult OnIRQ() override
+            {
+                md::vm::ProcessShootdown();
+                return irq::IRQResult::Processed;
+            }
+        } ipiShootdownHandler;
+
         template<typename T>
         static T map_device(addr_t phys)
         {
@@ -354,11 +386,15 @@ namespace smp
             WriteLAPIC(LAPIC_LVT_DCR, dv);
         }
 
-        void StartLAPICPeriodicTimer()
+        void StartLAPICTimer()
         {
-            const auto count = lapic_freq / time::GetPeriodicyInHz();
-            WriteLAPIC(LAPIC_LVT_TR, LAPIC_LVT_TM_PERIODIC | SMP_IPI_PERIODIC);
-            WriteLAPIC(LAPIC_LVT_ICR, count);
+            /*
+             * The timer is used in one-shot mode: the scheduler arms it for whatever
+             * comes first, the end of the current timeslice or the next timeout. We
+             * arm an initial shot here to get things going.
+             */
+            WriteLAPIC(LAPIC_LVT_TR, LAPIC_LVT_TM_ONESHOT | SMP_IPI_TIMER);
+            md::timer::ArmOneShot(initialTimerShotInNs);
         }
 
     } // unnamed namespace
@@ -380,6 +416,9 @@ namespace smp
      */
     void Init(struct PCPU& bsp_pcpu)
     {
+        // The BSP is always online
+        online_cpus.Add(0);
+
         /*
          * The AP's start in real mode, so we need to provide them with a stub so
          * they can run in protected mode. This stub must be located in the lower
@@ -416,6 +455,9 @@ namespace smp
             if (lapic->LapicFlags & ACPI_MADT_ENABLED)
                 num_cpus++;
         });
+        if (num_cpus > md::smp::MaximumCPUs)
+            panic(
+                "too many CPU's (%d), at most %d are supported", num_cpus, md::smp::MaximumCPUs);
 
         // Allocate tables for the resources we found
         InitializeCPUs(bsp_pcpu);
@@ -489,7 +531,15 @@ namespace smp
         if (auto result = irq::Register(SMP_IPI_PANIC, NULL, irq::type::IPI, ipiPanicHandler);
             result.IsFailure())
             panic("can't register ipi");
-        if (auto result = irq::Register(SMP_IPI_PERIODIC, NULL, irq::type::IPI, ipiPeriodicHandler);
+        if (auto result = irq::Register(SMP_IPI_TIMER, NULL, irq::type::IPI, ipiRescheduleHandler);
+            result.IsFailure())
+            panic("can't register ipi");
+        if (auto result =
+                irq::Register(SMP_IPI_RESCHEDULE, NULL, irq::type::IPI, ipiRescheduleHandler);
+            result.IsFailure())
+            panic("can't register ipi");
+        if (auto result =
+                irq::Register(SMP_IPI_SHOOTDOWN, NULL, irq::type::IPI, ipiShootdownHandler);
             result.IsFailure())
             panic("can't register ipi");
         for (auto& ioapic : x86_ioapics) {
@@ -546,9 +596,7 @@ namespace smp
     void PanicOthers()
     {
         if (num_smp_launched > 1)
-            WriteLAPIC(
-                LAPIC_ICR_LO, LAPIC_ICR_DEST_ALL_EXC_SELF | LAPIC_ICR_LEVEL_ASSERT |
-                                  LAPIC_ICR_DELIVERY_FIXED | SMP_IPI_PANIC);
+            SendIPIToOthers(SMP_IPI_PANIC);
     }
 
     void InitTimer()
@@ -571,23 +619,61 @@ namespace smp
         if (divisor > 128)
             panic("lapic divisor too large");
         kprintf("lapic: divisor %d, frequency %d Hz\n", divisor, lapic_freq);
-        StartLAPICPeriodicTimer();
+        StartLAPICTimer();
     }
 
 } // namespace smp
 
+namespace md::timer
+{
+    void ArmOneShot(uint64_t ns)
+    {
+        uint32_t count = 0;
+        if (ns > 0) {
+            // Longer shots just fire early; the scheduler will re-arm the timer
+            if (ns > ::smp::maxLAPICTimerShotInNs)
+                ns = ::smp::maxLAPICTimerShotInNs;
+            // Round up, so that we never fire before the deadline
+            const uint64_t c = (ns * (lapic_freq / 1000)) / 1'000'000 + 1;
+            count = c < ::smp::maxLAPICTimerCount ? c : ::smp::maxLAPICTimerCount;
+        }
+        // Writing the initial count (re)starts the timer; zero stops it
+        ::smp::WriteLAPIC(LAPIC_LVT_ICR, count);
+    }
+} // namespace md::timer
+
+namespace md::smp
+{
+    void Reschedule(int cpuid)
+    {
+        // Interrupts must be disabled so that nothing else can use the ICR meanwhile
+        ::smp::SendIPI(cpuid, SMP_IPI_RESCHEDULE);
+    }
+
+    const CPUSet& GetOnlineCPUs() { return ::smp::online_cpus; }
+
+    void SendShootdown(const CPUSet& targets)
+    {
+        // Interrupts must be disabled so that nothing else can use the ICR meanwhile
+        targets.ForEach([](int cpuid) { ::smp::SendIPI(cpuid, SMP_IPI_SHOOTDOWN); });
+    }
+} // namespace md::smp
+
 /*
  * Called by mp_stub.S for every Application Processor. Should not return.
  */
 extern "C" void mp_ap_startup(uint32_t lapic_id)
 {
+    /* We may have cached kernel mappings already; ensure we take part in TLB shootdowns */
+    smp::online_cpus.Add(PCPU_GET(cpuid));
+
     /* Switch to our idle thread */
     Thread* idlethread = PCPU_GET(idlethread);
     PCPU_SET(curthread, idlethread);
     scheduler::ResumeThread(*idlethread);
 
     smp::InitializeLAPIC(lapic_id);
-    smp::StartLAPICPeriodicTimer();
+    smp::StartLAPICTimer();
 
     /* Wait for it ... */
     while (!smp::can_smp_launch)
@@ -8,7 +8,6 @@
 #include <loader/module.h>
 #include <machine/param.h>
 #include "kernel/cmdline.h"
-#include "kernel/fd.h"
 #include "kernel/init.h"
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
@@ -16,12 +15,15 @@
 #include "kernel/pcpu.h"
 #include "kernel/process.h"
 #include "kernel/result.h"
+#include "kernel/slab.h"
 #include "kernel/thread.h"
+#include "kernel/time.h"
 #include "kernel/mm.h"
 #include "kernel/vm.h"
 #include "kernel/vmspace.h"
 #include "kernel-md/acpi.h"
 #include "kernel-md/macro.h"
+#include "kernel-md/md.h"
 #include "kernel-md/multiboot.h"
 #include "kernel-md/interrupts.h"
 #include "kernel-md/param.h"
@@ -71,7 +73,8 @@ extern void* exception17;
 extern void* exception18;
 extern void* exception19;
 extern void* lapic_irq_range_1;
-extern void* ipi_periodic;
+extern void* ipi_timer;
+extern void* ipi_reschedule;
 extern void* ipi_panic;
 extern void* irq_spurious;
 
@@ -94,17 +97,24 @@ namespace
         return ptr;
     }
 
+    struct PHYSMEM_CHUNK {
+        addr_t addr, len;
+    };
+
     /*
      * Maps num_pages of phys -> virt; when pages are needed, *avail is used and incremented.
      *
      * get_flags(phys, virt) will be called for every actual mapping to determine the
-     * mapping-specific flags that are to be used.
+     * mapping-specific flags that are to be used. If use_large_page(phys, virt) returns true
+     * for a 2MB aligned piece, it is mapped as a permanent large page instead.
      */
-    template<typename T>
-    void
-    map_kernel_pages(uint64_t* kernel_pagedir, addr_t phys, addr_t virt, unsigned int num_pages, addr_t& avail, T get_flags)
+    template<typename T, typename L>
+    void map_kernel_pages(
+        uint64_t* kernel_pagedir, addr_t phys, addr_t virt, unsigned int num_pages, addr_t& avail,
+        T get_flags, L use_large_page)
     {
         static constexpr uint64_t addr_mask = 0xffffffffff000; /* bits 12 .. 51 */
+        constexpr unsigned int pages_per_large_page = LARGE_PAGE_SIZE / PAGE_SIZE;
 
         for (unsigned int n = 0; n < num_pages; n++) {
             uint64_t* pml4e = &kernel_pagedir[(virt >> 39) & 0x1ff];
@@ -120,6 +130,14 @@ namespace
             }
             uint64_t* q = (uint64_t*)(*pdpe & addr_mask);
             uint64_t* pde = &q[(virt >> 21) & 0x1ff];
+            if (*pde == 0 && (virt & (LARGE_PAGE_SIZE - 1)) == 0 &&
+                n + pages_per_large_page <= num_pages && use_large_page(phys, virt)) {
+                *pde = phys | PE_PS | PE_G | PE_RW | PE_P | PE_C_L;
+                virt += LARGE_PAGE_SIZE;
+                phys += LARGE_PAGE_SIZE;
+                n += pages_per_large_page - 1;
+                continue;
+            }
             if (*pde == 0) {
                 *pde = avail | PE_RW | PE_P | PE_C_G;
                 avail += PAGE_SIZE;
@@ -152,7 +170,20 @@ namespace
         length_in_pages = num_pte;
     }
 
-    auto setup_paging(addr_t& avail, addr_t mem_end, size_t kernel_size)
+    // Returns whether the 2MB piece at phys is usable memory in its entirety
+    bool is_large_page_of_memory(const PHYSMEM_CHUNK* chunks, int num_chunks, addr_t phys)
+    {
+        for (int n = 0; n < num_chunks; n++) {
+            const auto& chunk = chunks[n];
+            if (phys >= chunk.addr && phys + LARGE_PAGE_SIZE <= chunk.addr + chunk.len)
+                return true;
+        }
+        return false;
+    }
+
+    auto setup_paging(
+        addr_t& avail, addr_t mem_end, size_t kernel_size, const PHYSMEM_CHUNK* chunks,
+        int num_chunks)
     {
         constexpr auto KMAP_KVA_START = KMEM_DIRECT_VA_START;
         constexpr auto KMAP_KVA_END = KMEM_DYNAMIC_VA_END;
@@ -163,7 +194,8 @@ namespace
          * following regions:
          *
          * - KMAP_KVA_START .. KMAP_KVA_END: the kernel's KVA
-         *   This may be mapped as 4KB pages; however, we can lower the estimate if
+         *   Memory is mapped here using permanent 2MB pages wherever possible;
+         *   the remainder may be mapped as 4KB pages. We can lower the estimate if
          *   there is less memory available than the total size of this region.
          * - KERNBASE ... KERNEND: the kernel code/data
          *   We always map this as 4KB pages to ensure we can benefit most optimally
@@ -183,6 +215,11 @@ namespace
         uint64_t kva_size = kmap_kva_end - KMAP_KVA_START;
         unsigned int kva_pages_needed, kva_size_in_pages;
         calculate_num_pages_required(kva_size, kva_pages_needed, kva_size_in_pages);
+        for (addr_t phys = 0; phys + LARGE_PAGE_SIZE <= kva_size; phys += LARGE_PAGE_SIZE) {
+            // Large pages do not need a page table
+            if (is_large_page_of_memory(chunks, num_chunks, phys))
+                --kva_pages_needed;
+        }
         addr_t kva_pages = (addr_t)bootstrap_get_pages(avail, kva_pages_needed);
 
         /* Finally, allocate the kernel pagedir itself */
@@ -233,6 +270,9 @@ namespace
                 if (phys >= avail_start && phys <= avail)
                     flags = PE_G | PE_RW | PE_P;
                 return flags;
+            },
+            [&](addr_t phys, addr_t virt) {
+                return is_large_page_of_memory(chunks, num_chunks, phys);
             });
         KASSERT(
             kva_avail_ptr == (addr_t)kva_pages + kva_pages_needed * PAGE_SIZE,
@@ -252,7 +292,8 @@ namespace
                 if (virt >= kernel_text_end)
                     flags |= PE_RW;
                 return flags;
-            });
+            },
+            [](addr_t phys, addr_t virt) { return false; });
         KASSERT(
             kernel_avail_ptr <= (addr_t)kernel_pages + kernel_pages_needed * PAGE_SIZE,
             "not all kernel pages used (used %d, expected %d)",
@@ -266,7 +307,8 @@ namespace
             [](addr_t phys, addr_t virt) {
                 // We just setup space for mappings; not the actual mappings themselves
                 return 0;
-            });
+            },
+            [](addr_t phys, addr_t virt) { return false; });
         KASSERT(
             dyn_kva_avail_ptr == (addr_t)dyn_kva_pages + dyn_kva_pages_needed * PAGE_SIZE,
             "not all dynamic KVA pages used (used %d, expected %d)",
@@ -297,9 +339,7 @@ namespace
 
         // Convert multiboot memory map to chunks, excluding the kernel space
         constexpr size_t max_chunks = 32;
-        struct PHYSMEM_CHUNK {
-            addr_t addr, len;
-        } phys_chunk[max_chunks];
+        PHYSMEM_CHUNK phys_chunk[max_chunks];
         int phys_chunk_index = 0;
 
         addr_t mem_end = 0;
@@ -342,7 +382,8 @@ namespace
 
         uint64_t prev_avail = avail;
         new (kernel_vmspace) VMSpace;
-        kernel_vmspace->vs_md_pagedir = setup_paging(avail, mem_end, kernel_phys_end - kernel_phys_start);
+        kernel_vmspace->vs_md_pagedir = setup_paging(
+            avail, mem_end, kernel_phys_end - kernel_phys_start, phys_chunk, phys_chunk_index);
 
         // All memory is accessible; register with the zone allocator
         for (int n = 0; n < phys_chunk_index; n++) {
@@ -424,7 +465,8 @@ static void setup_descriptors()
         SetIDTEntry(idt, (32 + n), SEG_IGATE_TYPE, 0, &lapic_irq_range_1);
     }
 
-    SetIDTEntry(idt, SMP_IPI_PERIODIC, SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, &ipi_periodic);
+    SetIDTEntry(idt, SMP_IPI_TIMER, SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, &ipi_timer);
+    SetIDTEntry(idt, SMP_IPI_RESCHEDULE, SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, &ipi_reschedule);
     SetIDTEntry(idt, SMP_IPI_PANIC, SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, &ipi_panic);
     SetIDTEntry(idt, 0xff, SEG_TGATE_TYPE, SEG_DPL_SUPERVISOR, &irq_spurious);
 }
@@ -481,6 +523,9 @@ static void setup_cpu(addr_t gdt, addr_t pcpu, TSS& tss)
     /* Enable global pages */
     write_cr4(read_cr4() | 0x80); /* PGE */
 
+    // Tag TLB entries by vmspace, so that context switches need not flush them
+    md::vm::InitializePCID();
+
     /* Enable FPU use; the kernel will save/restore it as needed */
     write_cr4(read_cr4() | 0x600); /* OSFXSR | OSXMMEXCPT */
 
@@ -547,6 +592,9 @@ extern "C" void md_startup(const struct MULTIBOOT* multiboot)
     // but there's no new/delete yet so do not allocate things from constructors!
     __run_global_ctors();
 
+    // Now that we know the TSC frequency, we can start the clock
+    time::InitializeClock();
+
     /*
      * Process the boot information passed by the multiboot stub; this ensures
      * it cannot be overwritten and tells us where available memory for our
@@ -556,13 +604,12 @@ extern "C" void md_startup(const struct MULTIBOOT* multiboot)
     char* boot_args;
     setup_multiboot(*multiboot, avail, boot_args);
 
+    // Prepare the kernel memory allocator; setup_memory() will already need it
+    slab::Initialize();
+
     // Initialize our memory mappings
     setup_memory(*multiboot, avail);
 
-    // Initialize the handles; this is needed by the per-CPU code as it initialize threads XXX Is
-    // this still true?
-    fd::Initialize();
-
     // Initialize the commandline arguments, if we have any
     cmdline_init(boot_args);
 
@@ -591,8 +638,9 @@ extern "C" void md_startup(const struct MULTIBOOT* multiboot)
      */
     smp::Init(bsp_pcpu);
 
-    // Prepare the userland support page
+    // Prepare the userland support and clock pages
     usupport_init();
+    time::InitializeClockPage();
 
     /*
      * Enable interrupts. We do this right before the machine-independant code
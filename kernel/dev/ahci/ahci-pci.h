@@ -269,16 +269,13 @@ namespace ahci
 #define AHCI_PRDE_DW3_DBC(x) (x)
     } __attribute__((packed));
 
-    /* Command Table */
+    /* Command Table; we use a fixed number of PRD's per table */
+#define AHCI_CT_MAX_PRDS 136
     struct AHCI_PCI_CT {
         uint8_t ct_cfis[64];
         uint8_t ct_acmd[16];
         uint8_t ct_rsvd[48];
-        /*
-         * Note that even though AHCI supports multiple PRD's, we only use a
-         * single one.
-         */
-        struct AHCI_PCI_PRDE ct_prd[1];
+        struct AHCI_PCI_PRDE ct_prd[AHCI_CT_MAX_PRDS];
     } __attribute__((packed));
 
 #if AHCI_DEBUG
@@ -13,11 +13,76 @@
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
 #include "kernel/result.h"
+#include "kernel-md/param.h"
 #include "ahci.h"
 #include "ahci-pci.h"
 
 namespace ahci
 {
+    namespace
+    {
+        /*
+         * Fills the PRD entries of a command table, merging pieces of data that
+         * are physically contiguous.
+         */
+        class PRDBuilder
+        {
+          public:
+            PRDBuilder(struct AHCI_PCI_CT& ct) : pb_ct(ct) {}
+
+            void Add(void* data, size_t len)
+            {
+                auto virt = reinterpret_cast<addr_t>(data);
+                while (len > 0) {
+                    // Pages need not be physically contiguous; handle them one by one
+                    size_t chunk = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+                    if (chunk > len)
+                        chunk = len;
+                    const uint64_t phys = kmem_get_phys(reinterpret_cast<void*>(virt));
+                    if (pb_length > 0 && pb_phys + pb_length == phys &&
+                        pb_length + chunk <= MaximumBytesPerPRD) {
+                        pb_length += chunk;
+                    } else {
+                        Flush();
+                        pb_phys = phys;
+                        pb_length = chunk;
+                    }
+                    virt += chunk;
+                    len -= chunk;
+                }
+            }
+
+            // Returns the number of PRD entries used
+            int Finish()
+            {
+                Flush();
+                return pb_count;
+            }
+
+          private:
+            static constexpr size_t MaximumBytesPerPRD = 4 * 1024 * 1024;
+
+            void Flush()
+            {
+                if (pb_length == 0)
+                    return;
+                KASSERT(pb_count < AHCI_CT_MAX_PRDS, "out of prd entries");
+                auto& prd = pb_ct.ct_prd[pb_count];
+                prd.prde_dw0 = AHCI_PRDE_DW0_DBA(pb_phys & 0xffffffff);
+                prd.prde_dw1 = AHCI_PRDE_DW1_DBAU(pb_phys >> 32);
+                prd.prde_dw2 = 0;
+                prd.prde_dw3 = AHCI_PRDE_DW3_DBC(pb_length - 1);
+                ++pb_count;
+                pb_length = 0;
+            }
+
+            struct AHCI_PCI_CT& pb_ct;
+            int pb_count = 0;
+            uint64_t pb_phys = 0;
+            size_t pb_length = 0;
+        };
+    } // unnamed namespace
+
     Port::Port(const CreateDeviceProperties& cdp)
         : Device(cdp), p_device(static_cast<AHCIDevice&>(*cdp.cdp_Parent))
     {
@@ -182,22 +247,23 @@ namespace ahci
             Request* pr = &p_request[i];
             struct SATA_REQUEST* sr = &pr->pr_request;
 
-            /* XXX use dma for data_ptr */
-            uint64_t data_ptr;
-            if (sr->sr_buffer != NULL)
-                data_ptr = kmem_get_phys(sr->sr_buffer);
-            else
-                data_ptr = kmem_get_phys(sr->sr_bio->Data());
-
-            /* Construct the command table; it will always have 1 PRD entry */
+            /*
+             * Construct the command table; every buffer of a BIO cluster gets
+             * its own PRD entries, unless they happen to be contiguous.
+             *
+             * XXX use dma for the data
+             */
             struct AHCI_PCI_CT* ct = pr->pr_ct;
             memset(ct, 0, sizeof(struct AHCI_PCI_CT));
 
-            ct->ct_prd[0].prde_dw0 = AHCI_PRDE_DW0_DBA(data_ptr & 0xffffffff);
-            ct->ct_prd[0].prde_dw1 = AHCI_PRDE_DW1_DBAU(data_ptr >> 32);
-            ct->ct_prd[0].prde_dw2 = 0;
-            ct->ct_prd[0].prde_dw3 = AHCI_PRDE_DW3_I | AHCI_PRDE_DW3_DBC(sr->sr_count - 1);
-            ct->ct_prd[0].prde_dw3 = AHCI_PRDE_DW3_DBC(sr->sr_count - 1);
+            PRDBuilder prds(*ct);
+            if (sr->sr_buffer != NULL) {
+                prds.Add(sr->sr_buffer, sr->sr_count);
+            } else {
+                for (BIO* bio = sr->sr_bio; bio != nullptr; bio = bio->b_cluster)
+                    prds.Add(bio->Data(), bio->b_length);
+            }
+            const int num_prds = prds.Finish();
             /* XXX handle atapi */
             memcpy(&ct->ct_cfis[0], &sr->sr_fis.fis_h2d, sizeof(struct SATA_FIS_H2D));
             pr->pr_dmabuf_ct->Synchronise(dma::Sync::Out);
@@ -206,7 +272,7 @@ namespace ahci
             struct AHCI_PCI_CLE* cle = &p_cle[i];
             uint64_t addr_ct = pr->pr_dmabuf_ct->GetSegments().front().s_phys;
             memset(cle, 0, sizeof(struct AHCI_PCI_CLE));
-            cle->cle_dw0 = AHCI_CLE_DW0_PRDTL(1) | AHCI_CLE_DW0_PMP(0) |
+            cle->cle_dw0 = AHCI_CLE_DW0_PRDTL(num_prds) | AHCI_CLE_DW0_PMP(0) |
                            AHCI_CLE_DW0_CFL(sr->sr_fis_length / 4);
             if (sr->sr_flags & SATA_REQUEST_FLAG_WRITE)
                 cle->cle_dw0 |= AHCI_CLE_DW0_W;
@@ -27,6 +27,9 @@ namespace ahci
 {
     struct AHCI_PCI_CT;
 
+    // Largest request we will issue; a cluster of BIO's never exceeds this
+    constexpr size_t MaximumTransferSize = 65536;
+
     class AHCIDevice;
 
     struct Request {
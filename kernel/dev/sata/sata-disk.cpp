@@ -35,6 +35,7 @@ namespace
 
         void ReadBIO(BIO& bio) override;
         void WriteBIO(BIO& bio) override;
+        size_t GetMaximumTransferSize() override { return ahci::MaximumTransferSize; }
 
         void Execute(struct SATA_REQUEST& sr);
 
@@ -114,17 +115,18 @@ namespace
 
     void SATADisk::ReadBIO(BIO& bio)
     {
-        KASSERT(bio.b_length > 0, "invalid length");
-        KASSERT(bio.b_length % 512 == 0, "invalid length"); /* XXX */
+        const auto length = bio.GetClusterLength();
+        KASSERT(length > 0, "invalid length");
+        KASSERT(length % 512 == 0, "invalid length"); /* XXX */
+        KASSERT(length <= ahci::MaximumTransferSize, "request too large");
 
         struct SATA_REQUEST sr;
         memset(&sr, 0, sizeof(sr));
         /* XXX  we shouldn't always use lba-48 */
         sata_fis_h2d_make_cmd_lba48(
-            &sr.sr_fis.fis_h2d, ATA_CMD_DMA_READ_EXT, bio.b_ioblock,
-            bio.b_length / BIO_SECTOR_SIZE);
+            &sr.sr_fis.fis_h2d, ATA_CMD_DMA_READ_EXT, bio.b_ioblock, length / BIO_SECTOR_SIZE);
         sr.sr_fis_length = 20;
-        sr.sr_count = bio.b_length;
+        sr.sr_count = length;
         sr.sr_bio = &bio;
         sr.sr_flags = SATA_REQUEST_FLAG_READ;
         Execute(sr);
@@ -132,14 +134,16 @@ namespace
 
     void SATADisk::WriteBIO(BIO& bio)
     {
+        const auto length = bio.GetClusterLength();
+        KASSERT(length <= ahci::MaximumTransferSize, "request too large");
+
         struct SATA_REQUEST sr;
         memset(&sr, 0, sizeof(sr));
         /* XXX  we shouldn't always use lba-48 */
         sata_fis_h2d_make_cmd_lba48(
-            &sr.sr_fis.fis_h2d, ATA_CMD_DMA_WRITE_EXT, bio.b_ioblock,
-            bio.b_length / BIO_SECTOR_SIZE);
+            &sr.sr_fis.fis_h2d, ATA_CMD_DMA_WRITE_EXT, bio.b_ioblock, length / BIO_SECTOR_SIZE);
         sr.sr_fis_length = 20;
-        sr.sr_count = bio.b_length;
+        sr.sr_count = length;
         sr.sr_bio = &bio;
         sr.sr_flags = SATA_REQUEST_FLAG_WRITE;
         Execute(sr);
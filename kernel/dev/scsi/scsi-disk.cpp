@@ -19,6 +19,9 @@ using Direction = ISCSIDeviceOperations::Direction;
 
 namespace
 {
+    // Largest request we issue at once; clusters are read into a bounce buffer of this size
+    constexpr size_t MaximumTransferSize = 64 * 1024;
+
     template<typename T, size_t dest_len>
     void copy_string(T (&dest)[dest_len], const uint8_t* src, int src_len)
     {
@@ -73,6 +76,7 @@ namespace
 
         void ReadBIO(BIO& bio) override;
         void WriteBIO(BIO& bio) override;
+        size_t GetMaximumTransferSize() override { return MaximumTransferSize; }
     };
 
     Result SCSIDisk::HandleRequest(
@@ -154,20 +158,37 @@ namespace
 
     void SCSIDisk::ReadBIO(struct BIO& bio)
     {
-        KASSERT(bio.b_length > 0, "invalid length");
-        KASSERT(bio.b_length % 512 == 0, "invalid length"); /* XXX */
+        const auto length = bio.GetClusterLength();
+        KASSERT(length > 0, "invalid length");
+        KASSERT(length % 512 == 0, "invalid length"); /* XXX */
+        KASSERT(length <= MaximumTransferSize, "request too large");
 
         // XXX we could schedule things here, but seeing that this is only for USB
         // there is no real benefit right now
 
+        // Every request is a round trip over USB, so read a cluster in one go and
+        // spread the data over its buffers afterwards
+        const bool clustered = bio.b_cluster != nullptr;
+        auto data = static_cast<char*>(clustered ? kmalloc(length) : bio.Data());
+
         struct SCSI_READ_10_CMD r_cmd;
         memset(&r_cmd, 0, sizeof r_cmd);
         r_cmd.c_code = SCSI_CMD_READ_10;
         r_cmd.c_lba = htobe32(bio.b_ioblock);
-        r_cmd.c_transfer_len = htobe16(bio.b_length / 512);
-        size_t reply_len = bio.b_length;
-        auto result =
-            HandleRequest(0, Direction::D_In, &r_cmd, sizeof(r_cmd), bio.Data(), &reply_len);
+        r_cmd.c_transfer_len = htobe16(length / 512);
+        size_t reply_len = length;
+        auto result = HandleRequest(0, Direction::D_In, &r_cmd, sizeof(r_cmd), data, &reply_len);
+
+        if (clustered) {
+            if (result.IsSuccess()) {
+                size_t offset = 0;
+                for (auto b = &bio; b != nullptr; b = b->b_cluster) {
+                    memcpy(b->Data(), data + offset, b->b_length);
+                    offset += b->b_length;
+                }
+            }
+            kfree(data);
+        }
         bio.Done(result);
     }
 
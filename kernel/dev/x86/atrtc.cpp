@@ -8,6 +8,7 @@
 #include "kernel/driver.h"
 #include "kernel/lock.h"
 #include "kernel/result.h"
+#include "kernel/thread.h"
 #include "kernel/time.h"
 #include "kernel-md/io.h"
 #include "kernel/lib.h"
@@ -26,6 +27,17 @@ namespace
     const int reg_statusA = 0x0a;
     const int reg_statusA_updating = (1 << 7);
 
+    // Interval at which the system clock is synchronised with the RTC
+    constexpr unsigned int syncIntervalInMs = 64 * 1000;
+    // Used to find the approximate start of a second by watching the seconds change
+    constexpr unsigned int updatePollIntervalInMs = 1;
+    constexpr unsigned int maxUpdatePolls = 1100;
+    // How long before the expected update we start spinning for it
+    constexpr unsigned int updateMarginInMs = 20;
+    constexpr uint64_t maxUpdateWaitInNs = 2 * updateMarginInMs * 1'000'000ULL;
+    // An update takes at most 1984us to complete, plus the 244us warning before it starts
+    constexpr uint64_t maxUpdateDurationInNs = 2'500'000;
+
     inline uint8_t BCDToU8(uint8_t bcd) { return (bcd & 0x0f) + (bcd >> 4) * 10; }
 
     class ATRTC : public Device, private IDeviceOperations
@@ -41,10 +53,20 @@ namespace
 
       protected:
         uint8_t ReadRegister(int reg);
+        void ReadTime(struct tm& tm);
+        bool WaitForUpdate();
+        bool WaitForUpdateToComplete();
+        void SyncThread();
 
       private:
+        static void SyncThreadWrapper(void* context)
+        {
+            static_cast<ATRTC*>(context)->SyncThread();
+        }
+
         int atrtc_ioport;
         Spinlock atrtc_lock;
+        Thread* atrtc_syncthread = nullptr;
     };
 
     uint8_t ATRTC::ReadRegister(int reg)
@@ -54,6 +76,94 @@ namespace
         return inb(atrtc_ioport + 1);
     }
 
+    // Must be called with interrupts disabled, while the RTC isn't updating
+    void ATRTC::ReadTime(struct tm& tm)
+    {
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = BCDToU8(ReadRegister(reg_year));
+        tm.tm_mon = BCDToU8(ReadRegister(reg_month));
+        tm.tm_mday = BCDToU8(ReadRegister(reg_day));
+        tm.tm_hour = BCDToU8(ReadRegister(reg_hour));
+        tm.tm_min = BCDToU8(ReadRegister(reg_minute));
+        tm.tm_sec = BCDToU8(ReadRegister(reg_second));
+        tm.tm_year += 1900;
+        if (tm.tm_year < 1980)
+            tm.tm_year += 100; // start at 2000 for years < 1980
+    }
+
+    /*
+     * Waits until the RTC starts updating, which happens just before the next
+     * second begins; returns false if we did not see it happen. The
+     * update-in-progress flag is only set for about 2ms, so rather than trying
+     * to catch it by sleeping, we sleep until we are close and spin from there.
+     */
+    bool ATRTC::WaitForUpdate()
+    {
+        const auto second = ReadRegister(reg_second);
+        unsigned int n = 0;
+        for (/* nothing */; n < maxUpdatePolls; ++n) {
+            if (ReadRegister(reg_second) != second)
+                break;
+            thread_sleep_ms(updatePollIntervalInMs);
+        }
+        if (n == maxUpdatePolls)
+            return false;
+
+        // A second has just begun, so the next update is nearly a second away
+        thread_sleep_ms(1000 - updateMarginInMs);
+        const auto deadline = time::GetNanosecondsSinceBoot() + maxUpdateWaitInNs;
+        while ((ReadRegister(reg_statusA) & reg_statusA_updating) == 0) {
+            if (time::GetNanosecondsSinceBoot() > deadline)
+                return false;
+            md::interrupts::Pause();
+        }
+        return true;
+    }
+
+    /*
+     * Spins until the current RTC update completes; must be called with interrupts
+     * disabled so that we notice the moment it happens. Returns false if the update
+     * took implausibly long.
+     */
+    bool ATRTC::WaitForUpdateToComplete()
+    {
+        const auto deadline = time::GetNanosecondsSinceBoot() + maxUpdateDurationInNs;
+        while (ReadRegister(reg_statusA) & reg_statusA_updating) {
+            if (time::GetNanosecondsSinceBoot() > deadline)
+                return false;
+            md::interrupts::Pause();
+        }
+        return true;
+    }
+
+    void ATRTC::SyncThread()
+    {
+        while (true) {
+            /*
+             * The moment the update completes is exactly the start of a new second,
+             * so if we catch it, we know the current time with far better precision
+             * than the one second the RTC gives us.
+             */
+            if (WaitForUpdate()) {
+                /*
+                 * Interrupts must stay disabled until we have synchronised: if we were
+                 * interrupted between noticing the update completed and sampling the
+                 * clock, we'd be off by however long that took.
+                 */
+                register_t state = md::interrupts::Save();
+                md::interrupts::Disable();
+                if (WaitForUpdateToComplete()) {
+                    struct tm tm;
+                    ReadTime(tm);
+                    time::Synchronize(tm);
+                }
+                md::interrupts::Restore(state);
+            }
+
+            thread_sleep_ms(syncIntervalInMs);
+        }
+    }
+
     Result ATRTC::Attach()
     {
         void* res_io = d_ResourceSet.AllocateResource(Resource::RT_IO, 2);
@@ -62,26 +172,16 @@ namespace
 
         atrtc_ioport = (uintptr_t)res_io;
 
-        struct tm tm;
-        memset(&tm, 0, sizeof(tm));
-
         /* Ensure a time-update isn't active */
         while (ReadRegister(reg_statusA) & reg_statusA_updating)
             /* nothing */;
 
         /* RTC isn't updating - we have some amount of time to read it */
+        struct tm tm;
         {
             register_t state = md::interrupts::Save();
             md::interrupts::Disable();
-            tm.tm_year = BCDToU8(ReadRegister(reg_year));
-            tm.tm_mon = BCDToU8(ReadRegister(reg_month));
-            tm.tm_mday = BCDToU8(ReadRegister(reg_day));
-            tm.tm_hour = BCDToU8(ReadRegister(reg_hour));
-            tm.tm_min = BCDToU8(ReadRegister(reg_minute));
-            tm.tm_sec = BCDToU8(ReadRegister(reg_second));
-            tm.tm_year += 1900;
-            if (tm.tm_year < 1980)
-                tm.tm_year += 100; // start at 2000 for years < 1980
+            ReadTime(tm);
             md::interrupts::Restore(state);
         }
         time::SetTime(tm);
@@ -91,6 +191,11 @@ namespace
         Printf("time: %02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
 #endif
 
+        /* Keep the system clock in line with the RTC from now on */
+        if (auto result = kthread_alloc("atrtc", &SyncThreadWrapper, this, atrtc_syncthread);
+            result.IsFailure())
+            return result;
+        atrtc_syncthread->Resume();
         return Result::Success();
     }
 
@@ -92,7 +92,13 @@ struct EXT2_SUPERBLOCK {
     uint8_t _padding1[3];
     uint32_t s_default_mount_options;
     uint32_t s_first_meta_bg;
-    uint8_t _reserved[760];
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint8_t _padding2[16];
+    uint32_t s_flags;
+#define EXT2_FLAGS_SIGNED_HASH 0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+    uint8_t _reserved[668];
 } __attribute__((packed));
 
 struct EXT2_BLOCKGROUP {
@@ -149,10 +155,10 @@ struct EXT2_INODE {
 #define EXT2_COMPRBLK_FL 0x00000200
 #define EXT2_NOCOMPR_FL 0x00000400
 #define EXT2_ECOMPR_FL 0x00000800
-#define EXT2_BTREE_FL 0x00010000
-#define EXT2_INDEX_FL 0x00010000 /* ? */
-#define EXT2_IMAGIC_FL 0x00020000
-#define EXT2_JOURNAL_DATA_FL 0x00040000
+#define EXT2_BTREE_FL 0x00001000
+#define EXT2_INDEX_FL 0x00001000
+#define EXT2_IMAGIC_FL 0x00002000
+#define EXT2_JOURNAL_DATA_FL 0x00004000
 #define EXT2_RESERVED_FL 0x80000000
 
     uint32_t i_osd1;
@@ -188,7 +194,46 @@ struct EXT2_DIRENTRY {
     uint8_t name[0];
 } __attribute__((packed));
 
+/*
+ * Hashed directories (dir_index) - the first block of the directory starts
+ * with the '.' and '..' entries, where '..' spans the remainder of the block.
+ * The index root information is stored after these entries, followed by the
+ * index entries. Any further index blocks consist of a single empty directory
+ * entry spanning the block, followed by the index entries. The first index
+ * entry stores the limit and count rather than a hash.
+ */
+struct EXT2_DX_ROOT_INFO {
+    uint32_t reserved_zero;
+    uint8_t hash_version;
+#define EXT2_DX_HASH_LEGACY 0
+#define EXT2_DX_HASH_HALF_MD4 1
+#define EXT2_DX_HASH_TEA 2
+#define EXT2_DX_HASH_LEGACY_UNSIGNED 3
+#define EXT2_DX_HASH_HALF_MD4_UNSIGNED 4
+#define EXT2_DX_HASH_TEA_UNSIGNED 5
+    uint8_t info_length;
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+} __attribute__((packed));
+
+#define EXT2_DX_ROOT_INFO_OFFSET 24
+#define EXT2_DX_NODE_OFFSET 8
+
+struct EXT2_DX_COUNTLIMIT {
+    uint16_t limit;
+    uint16_t count;
+} __attribute__((packed));
+
+struct EXT2_DX_ENTRY {
+    uint32_t hash;
+    uint32_t block;
+} __attribute__((packed));
+
+/* Byte offset of the superblock, regardless of the block size */
+#define EXT2_SUPERBLOCK_OFFSET 1024
+
 /* Values for old filesystems (that have the good old revision) */
 #define EXT2_GOOD_OLD_INODE_SIZE 128
+#define EXT2_GOOD_OLD_FIRST_INO 11
 
 #endif /* __EXT2_H__ */
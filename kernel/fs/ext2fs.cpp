@@ -35,9 +35,11 @@
 #include "kernel/lib.h"
 #include "kernel/result.h"
 #include "kernel/mm.h"
+#include "kernel/time.h"
 #include "kernel/vfs/core.h"
 #include "kernel/vfs/dentry.h"
 #include "kernel/vfs/generic.h"
+#include "kernel/vfs/icache.h"
 #include "kernel/vfs/mount.h"
 #include "ext2.h"
 
@@ -46,16 +48,44 @@ template<typename Value> constexpr Value EXT2_TO_LE32(Value v) { return v; }
 
 namespace
 {
+    /*
+     * Preallocation windows: whenever a block is allocated to an inode, the
+     * blocks following it are set aside for that inode so that files which are
+     * appended to at the same time do not end up interleaved on disk. The
+     * windows are merely a hint to the allocator: nothing is marked on disk, and
+     * the blocks are handed out to others if nothing else is available.
+     */
+    constexpr unsigned int EXT2_NUM_RESERVATIONS = 32;
+    constexpr unsigned int EXT2_RESERVATION_BLOCKS = 32;
+
+    struct EXT2_RESERVATION {
+        const INode* owner;
+        blocknr_t start;
+        blocknr_t end; /* first block beyond the window */
+    };
+
     struct EXT2_FS_PRIVDATA {
         struct EXT2_SUPERBLOCK sb;
 
         unsigned int num_blockgroups;
         struct EXT2_BLOCKGROUP* blockgroup;
         unsigned int log_blocksize;
+        bool writable;
+
+        /* Protects the bitmaps, free counts and reservations */
+        Mutex mtx_alloc{"ext2alloc"};
+        struct EXT2_RESERVATION reservation[EXT2_NUM_RESERVATIONS];
+        unsigned int next_reservation;
     };
 
     struct EXT2_INODE_PRIVDATA {
         uint32_t block[EXT2_INODE_BLOCKS];
+        uint32_t flags;
+        bool freed; /* inode and blocks have been released */
+
+        /* Most recently allocated data block; used to place the next one */
+        blocknr_t last_alloc_logical;
+        blocknr_t last_alloc_physical;
     };
 
     static void ext2_conv_superblock(struct EXT2_SUPERBLOCK* sb)
@@ -72,7 +102,331 @@ namespace
         return Result::Success();
     }
 
-    static void ext2_discard_inode(INode& inode) { kfree(inode.i_privdata); }
+    static void ext2_drop_reservation(INode& inode)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(inode.i_fs->fs_privdata);
+        MutexGuard g(privdata->mtx_alloc);
+        for (auto& rsv : privdata->reservation) {
+            if (rsv.owner == &inode)
+                rsv.owner = nullptr;
+        }
+    }
+
+    static void ext2_discard_inode(INode& inode)
+    {
+        ext2_drop_reservation(inode);
+        kfree(inode.i_privdata);
+    }
+
+    static uint32_t ext2_now() { return time::GetTime().tv_sec; }
+
+    static blocknr_t
+    ext2_group_first_block(const struct EXT2_FS_PRIVDATA& privdata, unsigned int group)
+    {
+        return privdata.sb.s_first_data_block + group * privdata.sb.s_blocks_per_group;
+    }
+
+    static unsigned int
+    ext2_blocks_in_group(const struct EXT2_FS_PRIVDATA& privdata, unsigned int group)
+    {
+        // The final group may be shorter than the others
+        const blocknr_t left = privdata.sb.s_blocks_count - ext2_group_first_block(privdata, group);
+        return left < privdata.sb.s_blocks_per_group ? left : privdata.sb.s_blocks_per_group;
+    }
+
+    /*
+     * Writes the free counts of a block group and the superblock back to disk;
+     * must be called with mtx_alloc held. Only the primary copies are updated,
+     * as is customary.
+     */
+    static Result ext2_write_counts(struct VFS_MOUNTED_FS* fs, unsigned int group)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+
+        const uint32_t bg_offset = group * sizeof(struct EXT2_BLOCKGROUP);
+        BIO* bio;
+        if (auto result = vfs_bread(
+                fs, privdata->sb.s_first_data_block + 1 + bg_offset / fs->fs_block_size, &bio);
+            result.IsFailure())
+            return result;
+        memcpy(
+            static_cast<char*>(bio->Data()) + bg_offset % fs->fs_block_size,
+            &privdata->blockgroup[group], sizeof(struct EXT2_BLOCKGROUP));
+        bio->Write();
+
+        if (auto result = vfs_bread(fs, EXT2_SUPERBLOCK_OFFSET / fs->fs_block_size, &bio);
+            result.IsFailure())
+            return result;
+        auto sb = reinterpret_cast<struct EXT2_SUPERBLOCK*>(
+            static_cast<char*>(bio->Data()) + EXT2_SUPERBLOCK_OFFSET % fs->fs_block_size);
+        sb->s_free_blocks_count = EXT2_TO_LE32(privdata->sb.s_free_blocks_count);
+        sb->s_free_inodes_count = EXT2_TO_LE32(privdata->sb.s_free_inodes_count);
+        return bio->Write();
+    }
+
+    /* Returns the first clear bit in [first, last) of a bitmap, or last if there is none */
+    static unsigned int
+    ext2_find_clear_bit(const uint8_t* bitmap, unsigned int first, unsigned int last)
+    {
+        for (unsigned int n = first; n < last; /* nothing */) {
+            if ((n & 7) == 0 && bitmap[n / 8] == 0xff) {
+                n += 8; // skip fully used bytes in one go
+                continue;
+            }
+            if ((bitmap[n / 8] & (1 << (n & 7))) == 0)
+                return n;
+            n++;
+        }
+        return last;
+    }
+
+    /*
+     * Marks a block as used or free in the block bitmap and updates the free
+     * counts; must be called with mtx_alloc held.
+     */
+    static Result ext2_mark_block(struct VFS_MOUNTED_FS* fs, blocknr_t block, bool in_use)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+        const unsigned int group =
+            (block - privdata->sb.s_first_data_block) / privdata->sb.s_blocks_per_group;
+        const unsigned int index =
+            (block - privdata->sb.s_first_data_block) % privdata->sb.s_blocks_per_group;
+        auto& bg = privdata->blockgroup[group];
+
+        BIO* bio;
+        if (auto result = vfs_bread(fs, bg.bg_block_bitmap, &bio); result.IsFailure())
+            return result;
+        auto& bits = static_cast<uint8_t*>(bio->Data())[index / 8];
+        const uint8_t mask = 1 << (index % 8);
+        if (((bits & mask) != 0) == in_use) {
+            bio->Release();
+            kprintf("ext2: block %u is already %s\n", (int)block, in_use ? "in use" : "free");
+            return Result::Failure(EIO);
+        }
+        if (in_use) {
+            bits |= mask;
+            bg.bg_free_blocks_count--;
+            privdata->sb.s_free_blocks_count--;
+        } else {
+            bits &= ~mask;
+            bg.bg_free_blocks_count++;
+            privdata->sb.s_free_blocks_count++;
+        }
+        bio->Write();
+        return ext2_write_counts(fs, group);
+    }
+
+    /* Returns the end of another inode's window covering the block, or zero */
+    static blocknr_t ext2_reserved_by_other(
+        const struct EXT2_FS_PRIVDATA& privdata, const INode& inode, blocknr_t block)
+    {
+        for (const auto& rsv : privdata.reservation) {
+            if (rsv.owner != nullptr && rsv.owner != &inode && block >= rsv.start &&
+                block < rsv.end)
+                return rsv.end;
+        }
+        return 0;
+    }
+
+    static void ext2_set_reservation(
+        struct EXT2_FS_PRIVDATA& privdata, const INode& inode, blocknr_t block)
+    {
+        struct EXT2_RESERVATION* rsv = nullptr;
+        for (auto& r : privdata.reservation) {
+            if (r.owner == &inode)
+                rsv = &r;
+        }
+        if (rsv == nullptr) {
+            // Take the next slot in turn; whoever owned it loses their window
+            rsv = &privdata.reservation[privdata.next_reservation];
+            privdata.next_reservation = (privdata.next_reservation + 1) % EXT2_NUM_RESERVATIONS;
+        }
+        rsv->owner = &inode;
+        rsv->start = block + 1;
+        rsv->end = block + 1 + EXT2_RESERVATION_BLOCKS;
+    }
+
+    /*
+     * Finds a free block, looking from the goal onwards through all block groups
+     * and finally the part of the goal's group before it. Must be called with
+     * mtx_alloc held.
+     */
+    static Result ext2_find_free_block(
+        struct VFS_MOUNTED_FS* fs, const INode& inode, blocknr_t goal, bool avoid_reserved,
+        blocknr_t& block_out)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+        const unsigned int goal_group =
+            (goal - privdata->sb.s_first_data_block) / privdata->sb.s_blocks_per_group;
+        for (unsigned int n = 0; n <= privdata->num_blockgroups; n++) {
+            const unsigned int group = (goal_group + n) % privdata->num_blockgroups;
+            auto& bg = privdata->blockgroup[group];
+            if (bg.bg_free_blocks_count == 0)
+                continue;
+
+            const blocknr_t group_first = ext2_group_first_block(*privdata, group);
+            unsigned int first = 0, last = ext2_blocks_in_group(*privdata, group);
+            if (n == 0)
+                first = goal - group_first;
+            else if (n == privdata->num_blockgroups)
+                last = goal - group_first;
+
+            BIO* bio;
+            if (auto result = vfs_bread(fs, bg.bg_block_bitmap, &bio); result.IsFailure())
+                return result;
+            const auto bitmap = static_cast<const uint8_t*>(bio->Data());
+            for (unsigned int bit = first; (bit = ext2_find_clear_bit(bitmap, bit, last)) < last;
+                 bit++) {
+                if (avoid_reserved) {
+                    const blocknr_t end =
+                        ext2_reserved_by_other(*privdata, inode, group_first + bit);
+                    if (end != 0) {
+                        bit = end - group_first - 1;
+                        continue;
+                    }
+                }
+                bio->Release();
+                block_out = group_first + bit;
+                return Result::Success();
+            }
+            bio->Release();
+        }
+        return Result::Failure(ENOSPC);
+    }
+
+    static Result ext2_alloc_block(INode& inode, blocknr_t goal, blocknr_t& block_out)
+    {
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+        MutexGuard g(privdata->mtx_alloc);
+        if (goal < privdata->sb.s_first_data_block || goal >= privdata->sb.s_blocks_count)
+            goal = privdata->sb.s_first_data_block;
+
+        // Stay clear of other windows unless we have no other choice
+        blocknr_t block;
+        auto result = ext2_find_free_block(fs, inode, goal, true, block);
+        if (result.IsFailure() && result.AsErrno() == ENOSPC)
+            result = ext2_find_free_block(fs, inode, goal, false, block);
+        if (result.IsFailure())
+            return result;
+        if (auto result = ext2_mark_block(fs, block, true); result.IsFailure())
+            return result;
+
+        ext2_set_reservation(*privdata, inode, block);
+        inode.i_sb.st_blocks += fs->fs_block_size / 512;
+        block_out = block;
+        return Result::Success();
+    }
+
+    static Result ext2_free_block(INode& inode, blocknr_t block)
+    {
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+        MutexGuard g(privdata->mtx_alloc);
+        if (auto result = ext2_mark_block(fs, block, false); result.IsFailure())
+            return result;
+        inode.i_sb.st_blocks -= fs->fs_block_size / 512;
+        return Result::Success();
+    }
+
+    /*
+     * Allocates a block and clears it; this ensures nothing stale can ever be
+     * read from it. Only needed for blocks that are not overwritten in full,
+     * such as indirect blocks.
+     */
+    static Result ext2_alloc_zeroed_block(INode& inode, blocknr_t goal, blocknr_t& block_out)
+    {
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        blocknr_t block;
+        if (auto result = ext2_alloc_block(inode, goal, block); result.IsFailure())
+            return result;
+
+        BIO* bio;
+        if (auto result = vfs_bget(fs, block, &bio); result.IsFailure()) {
+            ext2_free_block(inode, block);
+            return result;
+        }
+        memset(bio->Data(), 0, fs->fs_block_size);
+        bio->Write();
+        block_out = block;
+        return Result::Success();
+    }
+
+    /*
+     * Determines where a new block of the inode should go: directly after its
+     * previous block if we know where that is, otherwise in the inode's group.
+     */
+    static blocknr_t ext2_find_goal(INode& inode, blocknr_t block_in)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(inode.i_fs->fs_privdata);
+        auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
+        if (in_privdata->last_alloc_physical != 0 &&
+            in_privdata->last_alloc_logical + 1 == block_in)
+            return in_privdata->last_alloc_physical + 1;
+        if (block_in > 0 && block_in <= 12 && in_privdata->block[block_in - 1] != 0)
+            return in_privdata->block[block_in - 1] + 1;
+        return ext2_group_first_block(
+            *privdata, (inode.i_inum - 1) / privdata->sb.s_inodes_per_group);
+    }
+
+    /*
+     * Allocates an inode, preferably in the same group as the directory it will
+     * be placed in.
+     */
+    static Result ext2_alloc_inode(INode& dir, ino_t& inum_out)
+    {
+        struct VFS_MOUNTED_FS* fs = dir.i_fs;
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+        const unsigned int inodes_per_group = privdata->sb.s_inodes_per_group;
+        MutexGuard g(privdata->mtx_alloc);
+
+        const unsigned int dir_group = (dir.i_inum - 1) / inodes_per_group;
+        for (unsigned int n = 0; n < privdata->num_blockgroups; n++) {
+            const unsigned int group = (dir_group + n) % privdata->num_blockgroups;
+            auto& bg = privdata->blockgroup[group];
+            if (bg.bg_free_inodes_count == 0)
+                continue;
+
+            BIO* bio;
+            if (auto result = vfs_bread(fs, bg.bg_inode_bitmap, &bio); result.IsFailure())
+                return result;
+            auto bitmap = static_cast<uint8_t*>(bio->Data());
+            // The first inodes are reserved, and inode numbers start at 1
+            const unsigned int first = group == 0 ? privdata->sb.s_first_ino - 1 : 0;
+            const unsigned int bit = ext2_find_clear_bit(bitmap, first, inodes_per_group);
+            if (bit == inodes_per_group) {
+                bio->Release();
+                continue;
+            }
+            bitmap[bit / 8] |= 1 << (bit % 8);
+            bio->Write();
+
+            bg.bg_free_inodes_count--;
+            privdata->sb.s_free_inodes_count--;
+            inum_out = group * inodes_per_group + bit + 1;
+            return ext2_write_counts(fs, group);
+        }
+        return Result::Failure(ENOSPC);
+    }
+
+    static Result ext2_free_inode(struct VFS_MOUNTED_FS* fs, ino_t inum)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+        MutexGuard g(privdata->mtx_alloc);
+        const unsigned int group = (inum - 1) / privdata->sb.s_inodes_per_group;
+        const unsigned int bit = (inum - 1) % privdata->sb.s_inodes_per_group;
+        auto& bg = privdata->blockgroup[group];
+
+        BIO* bio;
+        if (auto result = vfs_bread(fs, bg.bg_inode_bitmap, &bio); result.IsFailure())
+            return result;
+        static_cast<uint8_t*>(bio->Data())[bit / 8] &= ~(1 << (bit % 8));
+        bio->Write();
+
+        bg.bg_free_inodes_count++;
+        privdata->sb.s_free_inodes_count++;
+        return ext2_write_counts(fs, group);
+    }
 
 #if 0
 static void	
@@ -144,7 +498,8 @@ ext2_dump_inode(struct EXT2_INODE* inode)
         auto privdata = (struct EXT2_FS_PRIVDATA*)fs->fs_privdata;
         auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
         auto orig_block_in = block_in;
-        KASSERT(!create, "ext2: readonly filesystem");
+        if (create && !privdata->writable)
+            return Result::Failure(EROFS);
 
         /*
          * We need to figure out whether we have to look up the block in the single,
@@ -155,10 +510,32 @@ ext2_dump_inode(struct EXT2_INODE* inode)
          * (c) The double-indirect block contains blocks 12 + (block_size / 4) to
          *     (block_size / 4)^2 + (block_size / 4) + 11
          * (d) The triple-indirect block contains everything else.
+         *
+         * Any blocks that are missing are allocated if we are asked to create the
+         * block; otherwise, the hole is reported as block zero. New data blocks
+         * are not cleared; the caller is to fill them.
          */
+        if (create && in_privdata->freed)
+            return Result::Failure(ENOENT); // released; nothing can be added anymore
+        const blocknr_t goal = create ? ext2_find_goal(inode, orig_block_in) : 0;
+        auto allocateDataBlock = [&](blocknr_t& block) {
+            auto result = ext2_alloc_block(inode, goal, block);
+            if (result.IsSuccess()) {
+                in_privdata->last_alloc_logical = orig_block_in;
+                in_privdata->last_alloc_physical = block;
+            }
+            return result;
+        };
 
         /* (a) Direct blocks are easy */
         if (block_in < 12) {
+            if (in_privdata->block[block_in] == 0 && create) {
+                blocknr_t block;
+                if (auto result = allocateDataBlock(block); result.IsFailure())
+                    return result;
+                in_privdata->block[block_in] = block;
+                vfs_set_inode_dirty(inode);
+            }
             block_out = in_privdata->block[block_in];
             return Result::Success();
         }
@@ -169,6 +546,14 @@ ext2_dump_inode(struct EXT2_INODE* inode)
         if (!ext2_determine_indirect(inode, block_in, level, indirect))
             return Result::Failure(ERANGE);
 
+        bool inode_dirty = false;
+        if (indirect == 0 && create) {
+            if (auto result = ext2_alloc_zeroed_block(inode, goal, indirect); result.IsFailure())
+                return result;
+            in_privdata->block[12 + level] = indirect;
+            inode_dirty = true;
+        }
+
         /*
          * A 1KB block has spots for 1024/4 = 256 indirect block numbers; this
          * number needs to double for 2KB blocks, etc, so it is easiest just to
@@ -178,25 +563,84 @@ ext2_dump_inode(struct EXT2_INODE* inode)
          * This approach is inspired by GRUB's ext2fs code.
          */
         int block_shift = privdata->log_blocksize + 8;
-        do {
+        Result result = Result::Success();
+        while (indirect != 0 && level >= 0) {
             // Read the indirect block
             BIO* bio;
-            if (auto result = vfs_bread(fs, indirect, &bio); result.IsFailure())
-                return result;
+            if (result = vfs_bread(fs, indirect, &bio); result.IsFailure())
+                break;
             // Extract the next block to read
-            indirect = [&]() {
-                const auto blocks = reinterpret_cast<uint32_t*>(static_cast<char*>(bio->Data()));
-                int blockIndex = (block_in >> (block_shift * level)) % (fs->fs_block_size / 4);
-                return EXT2_TO_LE32(blocks[blockIndex]);
-            }();
-            bio->Release();
-        } while (--level >= 0);
+            const auto blocks = reinterpret_cast<uint32_t*>(static_cast<char*>(bio->Data()));
+            int blockIndex = (block_in >> (block_shift * level)) % (fs->fs_block_size / 4);
+            blocknr_t next = EXT2_TO_LE32(blocks[blockIndex]);
+            if (next == 0 && create) {
+                // Anything but the final level is yet another indirect block
+                result = level > 0 ? ext2_alloc_zeroed_block(inode, goal, next)
+                                   : allocateDataBlock(next);
+                if (result.IsFailure()) {
+                    bio->Release();
+                    break;
+                }
+                blocks[blockIndex] = EXT2_TO_LE32(next);
+                bio->Write();
+                inode_dirty = true;
+            } else {
+                bio->Release();
+            }
+            indirect = next;
+            --level;
+        }
 
+        if (inode_dirty)
+            vfs_set_inode_dirty(inode);
+        if (result.IsFailure())
+            return result;
         block_out = indirect;
 
         return Result::Success();
     }
 
+    /* Frees an indirect block and all blocks it refers to */
+    static Result ext2_free_indirect(INode& inode, blocknr_t indirect, int level)
+    {
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        BIO* bio;
+        if (auto result = vfs_bread(fs, indirect, &bio); result.IsFailure())
+            return result;
+        const auto blocks = static_cast<uint32_t*>(bio->Data());
+        Result result = Result::Success();
+        for (unsigned int n = 0; result.IsSuccess() && n < fs->fs_block_size / 4; n++) {
+            const blocknr_t block = EXT2_TO_LE32(blocks[n]);
+            if (block == 0)
+                continue;
+            result = level > 0 ? ext2_free_indirect(inode, block, level - 1)
+                               : ext2_free_block(inode, block);
+        }
+        bio->Release();
+        if (result.IsFailure())
+            return result;
+        return ext2_free_block(inode, indirect);
+    }
+
+    static Result ext2_free_all_blocks(INode& inode)
+    {
+        auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
+        for (unsigned int n = 0; n < EXT2_INODE_BLOCKS; n++) {
+            const blocknr_t block = in_privdata->block[n];
+            if (block == 0)
+                continue;
+            // Blocks 12, 13 and 14 are the single, double and triple indirect blocks
+            auto result =
+                n < 12 ? ext2_free_block(inode, block) : ext2_free_indirect(inode, block, n - 12);
+            if (result.IsFailure())
+                return result;
+            in_privdata->block[n] = 0;
+        }
+        in_privdata->last_alloc_physical = 0;
+        ext2_drop_reservation(inode);
+        return Result::Success();
+    }
+
     static Result ext2_readdir(struct VFS_FILE* file, void* dirents, size_t len)
     {
         INode& inode = *file->f_dentry->d_inode;
@@ -263,35 +707,375 @@ ext2_dump_inode(struct EXT2_INODE* inode)
         return Result::Success(written);
     }
 
-    static struct VFS_INODE_OPS ext2_file_ops = {.block_map = ext2_block_map, .read = vfs_generic_read,};
+    /*
+     * Directory hash functions, as used by hashed (dir_index) directories. These
+     * must yield the exact same values as the Linux implementation, as the hashes
+     * are stored on disk.
+     */
+    constexpr uint32_t EXT2_DX_HASH_EOF = 0x7fffffff;
 
-    static struct VFS_INODE_OPS ext2_dir_ops = {.readdir = ext2_readdir,
-                                                .lookup = vfs_generic_lookup};
+    static uint32_t ext2_rol32(uint32_t v, int shift) { return (v << shift) | (v >> (32 - shift)); }
 
-    static Result ext2_read_link(INode& inode, char* buffer, size_t buflen)
+    static void ext2_tea_transform(uint32_t buf[4], const uint32_t in[4])
     {
-        auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
+        uint32_t sum = 0;
+        uint32_t b0 = buf[0], b1 = buf[1];
+        const uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+        for (int n = 0; n < 16; n++) {
+            sum += 0x9e3779b9;
+            b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+            b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+        }
+        buf[0] += b0;
+        buf[1] += b1;
+    }
 
-        // XXX i_block[] may be byte-swapped - how to deal with this?
-        size_t len = buflen;
-        KASSERT(len > 0, "empty buffer?");
-        buffer[len - 1] = '\0';
-        if (len > 60)
-            len = 60;
-        memcpy(buffer, in_privdata->block, len);
-        return Result::Success(len);
+    static void ext2_half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+    {
+        auto F = [](uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+        auto G = [](uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); };
+        auto H = [](uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+        constexpr uint32_t K2 = 013240474631, K3 = 015666365641;
+
+        uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ext2_rol32(a, s))
+        ROUND(F, a, b, c, d, in[0], 3);
+        ROUND(F, d, a, b, c, in[1], 7);
+        ROUND(F, c, d, a, b, in[2], 11);
+        ROUND(F, b, c, d, a, in[3], 19);
+        ROUND(F, a, b, c, d, in[4], 3);
+        ROUND(F, d, a, b, c, in[5], 7);
+        ROUND(F, c, d, a, b, in[6], 11);
+        ROUND(F, b, c, d, a, in[7], 19);
+
+        ROUND(G, a, b, c, d, in[1] + K2, 3);
+        ROUND(G, d, a, b, c, in[3] + K2, 5);
+        ROUND(G, c, d, a, b, in[5] + K2, 9);
+        ROUND(G, b, c, d, a, in[7] + K2, 13);
+        ROUND(G, a, b, c, d, in[0] + K2, 3);
+        ROUND(G, d, a, b, c, in[2] + K2, 5);
+        ROUND(G, c, d, a, b, in[4] + K2, 9);
+        ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+        ROUND(H, a, b, c, d, in[3] + K3, 3);
+        ROUND(H, d, a, b, c, in[7] + K3, 9);
+        ROUND(H, c, d, a, b, in[2] + K3, 11);
+        ROUND(H, b, c, d, a, in[6] + K3, 15);
+        ROUND(H, a, b, c, d, in[1] + K3, 3);
+        ROUND(H, d, a, b, c, in[5] + K3, 9);
+        ROUND(H, c, d, a, b, in[0] + K3, 11);
+        ROUND(H, b, c, d, a, in[4] + K3, 15);
+#undef ROUND
+
+        buf[0] += a;
+        buf[1] += b;
+        buf[2] += c;
+        buf[3] += d;
     }
 
-    static struct VFS_INODE_OPS ext2_symlink_ops = {.read_link = ext2_read_link,
-                                                    .follow_link = vfs_generic_follow_link};
+    // Whether characters are treated as signed depends on the hash version
+    static int ext2_hash_char(const char* name, int n, bool is_unsigned)
+    {
+        if (is_unsigned)
+            return static_cast<unsigned char>(name[n]);
+        return static_cast<signed char>(name[n]);
+    }
+
+    static uint32_t ext2_legacy_hash(const char* name, int len, bool is_unsigned)
+    {
+        uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+        for (int n = 0; n < len; n++) {
+            uint32_t hash = hash1 + (hash0 ^ (ext2_hash_char(name, n, is_unsigned) * 7152373));
+            if (hash & 0x80000000)
+                hash -= 0x7fffffff;
+            hash1 = hash0;
+            hash0 = hash;
+        }
+        return hash0 << 1;
+    }
+
+    static void ext2_str2hashbuf(const char* msg, int len, uint32_t* buf, int num, bool is_unsigned)
+    {
+        uint32_t pad = static_cast<uint32_t>(len) | (static_cast<uint32_t>(len) << 8);
+        pad |= pad << 16;
+
+        uint32_t val = pad;
+        if (len > num * 4)
+            len = num * 4;
+        for (int n = 0; n < len; n++) {
+            val = ext2_hash_char(msg, n, is_unsigned) + (val << 8);
+            if ((n % 4) == 3) {
+                *buf++ = val;
+                val = pad;
+                num--;
+            }
+        }
+        if (--num >= 0)
+            *buf++ = val;
+        while (--num >= 0)
+            *buf++ = pad;
+    }
+
+    static uint32_t ext2_dirhash(
+        const EXT2_SUPERBLOCK& sb, unsigned int hash_version, const char* name, int len)
+    {
+        uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+        for (unsigned int n = 0; n < 4; n++) {
+            if (sb.s_hash_seed[n] == 0)
+                continue;
+            for (unsigned int m = 0; m < 4; m++)
+                buf[m] = EXT2_TO_LE32(sb.s_hash_seed[m]);
+            break;
+        }
+
+        uint32_t hash = 0;
+        uint32_t in[8];
+        switch (hash_version) {
+            case EXT2_DX_HASH_LEGACY:
+            case EXT2_DX_HASH_LEGACY_UNSIGNED:
+                hash = ext2_legacy_hash(name, len, hash_version == EXT2_DX_HASH_LEGACY_UNSIGNED);
+                break;
+            case EXT2_DX_HASH_HALF_MD4:
+            case EXT2_DX_HASH_HALF_MD4_UNSIGNED:
+                for (; len > 0; len -= 32, name += 32) {
+                    ext2_str2hashbuf(
+                        name, len, in, 8, hash_version == EXT2_DX_HASH_HALF_MD4_UNSIGNED);
+                    ext2_half_md4_transform(buf, in);
+                }
+                hash = buf[1];
+                break;
+            case EXT2_DX_HASH_TEA:
+            case EXT2_DX_HASH_TEA_UNSIGNED:
+                for (; len > 0; len -= 16, name += 16) {
+                    ext2_str2hashbuf(name, len, in, 4, hash_version == EXT2_DX_HASH_TEA_UNSIGNED);
+                    ext2_tea_transform(buf, in);
+                }
+                hash = buf[0];
+                break;
+        }
+
+        // The lowest bit is used to mark hash collisions that continue in the next block
+        hash &= ~1;
+        if (hash == (EXT2_DX_HASH_EOF << 1))
+            hash = (EXT2_DX_HASH_EOF - 1) << 1;
+        return hash;
+    }
 
     /*
-     * Reads a filesystem inode and fills a corresponding inode structure.
+     * Looks for a name in a single directory block.
      */
-    static Result ext2_read_inode(INode& inode, ino_t inum)
+    static Result
+    ext2_find_in_block(INode& inode, blocknr_t block, const char* name, int len, ino_t& inum)
     {
         struct VFS_MOUNTED_FS* fs = inode.i_fs;
-        struct EXT2_FS_PRIVDATA* privdata = (struct EXT2_FS_PRIVDATA*)inode.i_fs->fs_privdata;
+        blocknr_t cur_block;
+        if (auto result = ext2_block_map(inode, block, cur_block, false); result.IsFailure())
+            return result;
+        if (cur_block == 0)
+            return Result::Failure(ENOTSUP);
+
+        BIO* bio;
+        if (auto result = vfs_bread(fs, cur_block, &bio); result.IsFailure())
+            return result;
+
+        auto data = static_cast<char*>(bio->Data());
+        for (uint32_t offset = 0; offset + sizeof(struct EXT2_DIRENTRY) <= fs->fs_block_size;) {
+            auto ext2de = reinterpret_cast<struct EXT2_DIRENTRY*>(data + offset);
+            const uint16_t rec_len = EXT2_TO_LE16(ext2de->rec_len);
+            if (rec_len < sizeof(struct EXT2_DIRENTRY) || offset + rec_len > fs->fs_block_size)
+                break; // corrupt entry; don't trust the remainder of the block
+            if (EXT2_TO_LE32(ext2de->inode) != 0 && ext2de->name_len == len &&
+                memcmp(ext2de->name, name, len) == 0) {
+                inum = EXT2_TO_LE32(ext2de->inode);
+                bio->Release();
+                return Result::Success();
+            }
+            offset += rec_len;
+        }
+
+        bio->Release();
+        return Result::Failure(ENOENT);
+    }
+
+    /*
+     * Looks up a name in a hashed directory by walking the index down to the
+     * leaf block that must contain it. Yields ENOTSUP if the index cannot be
+     * used, in which case the caller should resort to scanning the directory.
+     */
+    static Result ext2_htree_lookup(INode& inode, const char* name, ino_t& inum)
+    {
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+        const int len = strlen(name);
+        if (len > 255)
+            return Result::Failure(ENOENT);
+
+        // Index levels as we walk down; the root level is always present
+        constexpr unsigned int maxLevels = 3;
+        struct Level {
+            BIO* l_bio;
+            struct EXT2_DX_ENTRY* l_entries;
+            unsigned int l_count;
+            unsigned int l_at;
+        } level[maxLevels];
+        unsigned int num_levels = 0;
+        auto releaseLevels = [&]() {
+            while (num_levels > 0)
+                level[--num_levels].l_bio->Release();
+        };
+
+        uint32_t hash = 0;
+        unsigned int indirect_levels = 0;
+        blocknr_t block = 0;
+        while (true) {
+            blocknr_t cur_block;
+            if (auto result = ext2_block_map(inode, block, cur_block, false); result.IsFailure()) {
+                releaseLevels();
+                return result;
+            }
+            if (cur_block == 0) {
+                releaseLevels();
+                return Result::Failure(ENOTSUP);
+            }
+            BIO* bio;
+            if (auto result = vfs_bread(fs, cur_block, &bio); result.IsFailure()) {
+                releaseLevels();
+                return result;
+            }
+
+            auto data = static_cast<char*>(bio->Data());
+            unsigned int offset = EXT2_DX_NODE_OFFSET;
+            if (num_levels == 0) {
+                auto info =
+                    reinterpret_cast<struct EXT2_DX_ROOT_INFO*>(data + EXT2_DX_ROOT_INFO_OFFSET);
+                unsigned int hash_version = info->hash_version;
+                if (hash_version <= EXT2_DX_HASH_TEA &&
+                    (privdata->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+                    hash_version += EXT2_DX_HASH_LEGACY_UNSIGNED;
+                indirect_levels = info->indirect_levels;
+                if (info->reserved_zero != 0 || hash_version > EXT2_DX_HASH_TEA_UNSIGNED ||
+                    info->info_length < sizeof(*info) || indirect_levels >= maxLevels) {
+                    bio->Release();
+                    return Result::Failure(ENOTSUP);
+                }
+                offset = EXT2_DX_ROOT_INFO_OFFSET + info->info_length;
+                hash = ext2_dirhash(privdata->sb, hash_version, name, len);
+            }
+
+            auto countlimit = reinterpret_cast<struct EXT2_DX_COUNTLIMIT*>(data + offset);
+            const unsigned int count = EXT2_TO_LE16(countlimit->count);
+            const unsigned int limit = EXT2_TO_LE16(countlimit->limit);
+            if (count == 0 || count > limit ||
+                offset + limit * sizeof(struct EXT2_DX_ENTRY) > fs->fs_block_size) {
+                bio->Release();
+                releaseLevels();
+                return Result::Failure(ENOTSUP);
+            }
+
+            /*
+             * Find the last entry whose hash does not exceed ours; the first entry
+             * has no hash (it holds the count and limit) and covers everything below
+             * the hash of the second entry.
+             */
+            auto entries = reinterpret_cast<struct EXT2_DX_ENTRY*>(data + offset);
+            unsigned int lo = 1, hi = count;
+            while (lo < hi) {
+                const unsigned int mid = lo + (hi - lo) / 2;
+                if (EXT2_TO_LE32(entries[mid].hash) > hash)
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+            level[num_levels++] = Level{bio, entries, count, lo - 1};
+            block = EXT2_TO_LE32(entries[lo - 1].block) & 0x0fffffff;
+            if (num_levels > indirect_levels)
+                break;
+        }
+
+        while (true) {
+            auto result = ext2_find_in_block(inode, block, name, len, inum);
+            if (result.IsSuccess() || result.AsErrno() != ENOENT) {
+                releaseLevels();
+                return result;
+            }
+
+            /*
+             * Not in this leaf; if the names with our hash continue in the next
+             * block, the hash of that block has the collision bit set - we need to
+             * look there as well. This may require walking up the index.
+             */
+            unsigned int n = num_levels;
+            while (n > 0 && level[n - 1].l_at + 1 >= level[n - 1].l_count)
+                n--;
+            if (n == 0 ||
+                (EXT2_TO_LE32(level[n - 1].l_entries[level[n - 1].l_at + 1].hash) & ~1) != hash) {
+                releaseLevels();
+                return Result::Failure(ENOENT);
+            }
+            level[n - 1].l_at++;
+            block = EXT2_TO_LE32(level[n - 1].l_entries[level[n - 1].l_at].block) & 0x0fffffff;
+
+            // Descend to the leftmost leaf of the next subtree
+            const unsigned int depth = num_levels;
+            while (num_levels > n)
+                level[--num_levels].l_bio->Release();
+            while (num_levels < depth) {
+                blocknr_t cur_block;
+                BIO* bio;
+                result = ext2_block_map(inode, block, cur_block, false);
+                if (result.IsSuccess())
+                    result = cur_block != 0 ? vfs_bread(fs, cur_block, &bio)
+                                            : Result::Failure(ENOTSUP);
+                if (result.IsFailure()) {
+                    releaseLevels();
+                    return result;
+                }
+                auto data = static_cast<char*>(bio->Data());
+                auto countlimit =
+                    reinterpret_cast<struct EXT2_DX_COUNTLIMIT*>(data + EXT2_DX_NODE_OFFSET);
+                auto entries =
+                    reinterpret_cast<struct EXT2_DX_ENTRY*>(data + EXT2_DX_NODE_OFFSET);
+                const unsigned int count = EXT2_TO_LE16(countlimit->count);
+                level[num_levels++] = Level{bio, entries, count, 0};
+                if (count == 0 || count > EXT2_TO_LE16(countlimit->limit) ||
+                    EXT2_DX_NODE_OFFSET + count * sizeof(struct EXT2_DX_ENTRY) >
+                        fs->fs_block_size) {
+                    releaseLevels();
+                    return Result::Failure(ENOTSUP);
+                }
+                block = EXT2_TO_LE32(entries[0].block) & 0x0fffffff;
+            }
+        }
+    }
+
+    static Result ext2_lookup(DEntry& parent, INode*& destinode, const char* dentry)
+    {
+        INode& inode = *parent.d_inode;
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(inode.i_fs->fs_privdata);
+        auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
+
+        // '.' and '..' live in the first block, which is never reached via the index
+        if ((privdata->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+            (in_privdata->flags & EXT2_INDEX_FL) && strcmp(dentry, ".") != 0 &&
+            strcmp(dentry, "..") != 0) {
+            ino_t inum;
+            auto result = ext2_htree_lookup(inode, dentry, inum);
+            if (result.IsSuccess())
+                return vfs_get_inode(inode.i_fs, inum, destinode);
+            if (result.AsErrno() != ENOTSUP)
+                return result;
+            /* The index is unusable; it is safe to treat the directory as unindexed */
+        }
+        return vfs_generic_lookup_indexed(parent, destinode, dentry);
+    }
+
+    /*
+     * Fetches the block containing an inode and yields a pointer to it.
+     */
+    static Result ext2_bread_inode(
+        struct VFS_MOUNTED_FS* fs, ino_t inum, BIO*& bio, struct EXT2_INODE*& ext2inode)
+    {
+        struct EXT2_FS_PRIVDATA* privdata = (struct EXT2_FS_PRIVDATA*)fs->fs_privdata;
 
         /*
          * Inode number zero does not exists within ext2 (or Linux for that matter),
@@ -313,12 +1097,448 @@ ext2_dump_inode(struct EXT2_INODE* inode)
                           (iindex * privdata->sb.s_inode_size) / fs->fs_block_size;
 
         /* Fetch the block and make a pointer to the inode */
-        BIO* bio;
         if (auto result = vfs_bread(fs, block, &bio); result.IsFailure())
             return result;
         unsigned int idx = (iindex * privdata->sb.s_inode_size) % fs->fs_block_size;
-        auto ext2inode =
-            reinterpret_cast<struct EXT2_INODE*>(static_cast<char*>(bio->Data()) + idx);
+        ext2inode = reinterpret_cast<struct EXT2_INODE*>(static_cast<char*>(bio->Data()) + idx);
+        return Result::Success();
+    }
+
+    static Result ext2_read_inode(INode& inode, ino_t inum);
+
+    /* Stores an inode in the on-disk inode table; 'dtime' is only set if non-zero */
+    static Result ext2_store_inode(INode& inode, uint32_t dtime)
+    {
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
+        BIO* bio;
+        struct EXT2_INODE* ext2inode;
+        if (auto result = ext2_bread_inode(fs, inode.i_inum, bio, ext2inode); result.IsFailure())
+            return result;
+        ext2inode->i_mode = EXT2_TO_LE16(inode.i_sb.st_mode);
+        ext2inode->i_uid = EXT2_TO_LE16(inode.i_sb.st_uid);
+        ext2inode->i_gid = EXT2_TO_LE16(inode.i_sb.st_gid);
+        ext2inode->i_links_count = EXT2_TO_LE16(inode.i_sb.st_nlink);
+        ext2inode->i_size = EXT2_TO_LE32(inode.i_sb.st_size);
+        ext2inode->i_atime = EXT2_TO_LE32(inode.i_sb.st_atime);
+        ext2inode->i_mtime = EXT2_TO_LE32(inode.i_sb.st_mtime);
+        ext2inode->i_ctime = EXT2_TO_LE32(inode.i_sb.st_ctime);
+        ext2inode->i_blocks = EXT2_TO_LE32(inode.i_sb.st_blocks);
+        ext2inode->i_flags = EXT2_TO_LE32(in_privdata->flags);
+        if (dtime != 0)
+            ext2inode->i_dtime = EXT2_TO_LE32(dtime);
+        for (unsigned int i = 0; i < EXT2_INODE_BLOCKS; i++)
+            ext2inode->i_block[i] = EXT2_TO_LE32(in_privdata->block[i]);
+        return bio->Write();
+    }
+
+    /*
+     * Writes an inode back to disk. An inode without links is kept as-is until
+     * the final reference is gone; see ext2_release_inode().
+     */
+    static Result ext2_write_inode(INode& inode)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(inode.i_fs->fs_privdata);
+        auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
+        if (!privdata->writable)
+            return Result::Failure(EROFS);
+        if (in_privdata->freed)
+            return Result::Success(); // the inode number may have been handed out again
+        return ext2_store_inode(inode, 0);
+    }
+
+    /* Releases the inode and its blocks once the final link and reference are gone */
+    static void ext2_release_inode(INode& inode)
+    {
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+        auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
+        if (inode.i_sb.st_nlink != 0 || in_privdata->freed || !privdata->writable)
+            return;
+
+        // The inode number can be handed out again, so nothing of us may remain cached
+        vfs_drop_inode_pages(inode);
+
+        // Fast symlinks store their target in the block pointers; don't free those
+        Result result = Result::Success();
+        if (!S_ISLNK(inode.i_sb.st_mode) || inode.i_sb.st_blocks != 0)
+            result = ext2_free_all_blocks(inode);
+        if (result.IsSuccess()) {
+            // The inode must be on disk before its number can be handed out again
+            inode.i_sb.st_size = 0;
+            result = ext2_store_inode(inode, ext2_now());
+        }
+        if (result.IsSuccess()) {
+            in_privdata->freed = true;
+            result = ext2_free_inode(fs, inode.i_inum);
+        }
+        if (result.IsFailure())
+            kprintf(
+                "ext2: cannot release inode %d: error %d\n", (int)inode.i_inum,
+                result.AsErrno());
+    }
+
+    constexpr unsigned int ext2_direntry_length(unsigned int name_len)
+    {
+        return (sizeof(struct EXT2_DIRENTRY) + name_len + 3) & ~3;
+    }
+
+    static uint8_t ext2_file_type(const INode& inode)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(inode.i_fs->fs_privdata);
+        if ((privdata->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) == 0)
+            return EXT2_FT_UNKNOWN;
+        if (S_ISDIR(inode.i_sb.st_mode))
+            return EXT2_FT_DIR;
+        if (S_ISLNK(inode.i_sb.st_mode))
+            return EXT2_FT_SYMLINK;
+        return EXT2_FT_REG_FILE;
+    }
+
+    static void ext2_touch_directory(INode& dir)
+    {
+        dir.i_sb.st_mtime = ext2_now();
+        dir.i_sb.st_ctime = dir.i_sb.st_mtime;
+        vfs_set_inode_dirty(dir);
+    }
+
+    /*
+     * Walks through the entries of a directory, calling fn(block, prev, de) for
+     * every entry until it returns true; prev is the preceding entry in the same
+     * block, if any. fn must release the block when it returns true, typically by
+     * writing it. Yields ENOENT if fn never returned true.
+     */
+    template<typename Fn>
+    static Result ext2_walk_directory(INode& dir, Fn fn)
+    {
+        struct VFS_MOUNTED_FS* fs = dir.i_fs;
+        const blocknr_t num_blocks = dir.i_sb.st_size / fs->fs_block_size;
+        for (blocknr_t n = 0; n < num_blocks; n++) {
+            blocknr_t cur_block;
+            if (auto result = ext2_block_map(dir, n, cur_block, false); result.IsFailure())
+                return result;
+            if (cur_block == 0)
+                continue;
+
+            BIO* bio;
+            if (auto result = vfs_bread(fs, cur_block, &bio); result.IsFailure())
+                return result;
+            auto data = static_cast<char*>(bio->Data());
+            struct EXT2_DIRENTRY* prev = nullptr;
+            for (uint32_t offset = 0; offset + sizeof(struct EXT2_DIRENTRY) <= fs->fs_block_size;) {
+                auto ext2de = reinterpret_cast<struct EXT2_DIRENTRY*>(data + offset);
+                const uint16_t rec_len = EXT2_TO_LE16(ext2de->rec_len);
+                if (rec_len < sizeof(struct EXT2_DIRENTRY) || offset + rec_len > fs->fs_block_size)
+                    break; // corrupt entry; don't trust the remainder of the block
+                if (fn(*bio, prev, *ext2de))
+                    return Result::Success();
+                prev = ext2de;
+                offset += rec_len;
+            }
+            bio->Release();
+        }
+        return Result::Failure(ENOENT);
+    }
+
+    /*
+     * Adds an entry referring to 'inode' to a directory, using the first spot
+     * that has enough room; the directory is enlarged if there is none.
+     */
+    static Result ext2_add_direntry(INode& dir, const char* name, const INode& inode)
+    {
+        struct VFS_MOUNTED_FS* fs = dir.i_fs;
+        auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(dir.i_privdata);
+        const size_t name_len = strlen(name);
+        if (name_len > 255)
+            return Result::Failure(ENAMETOOLONG);
+        const unsigned int needed = ext2_direntry_length(name_len);
+
+        auto fillEntry = [&](struct EXT2_DIRENTRY& ext2de, uint16_t rec_len) {
+            ext2de.inode = EXT2_TO_LE32(inode.i_inum);
+            ext2de.rec_len = EXT2_TO_LE16(rec_len);
+            ext2de.name_len = name_len;
+            ext2de.file_type = ext2_file_type(inode);
+            memcpy(ext2de.name, name, name_len);
+        };
+
+        auto result = ext2_walk_directory(
+            dir, [&](BIO& bio, struct EXT2_DIRENTRY*, struct EXT2_DIRENTRY& ext2de) {
+                const unsigned int rec_len = EXT2_TO_LE16(ext2de.rec_len);
+                const unsigned int used =
+                    EXT2_TO_LE32(ext2de.inode) != 0 ? ext2_direntry_length(ext2de.name_len) : 0;
+                if (rec_len < used + needed)
+                    return false;
+
+                if (used == 0) {
+                    fillEntry(ext2de, rec_len);
+                } else {
+                    // Split the slack off the end of the entry
+                    ext2de.rec_len = EXT2_TO_LE16(used);
+                    fillEntry(
+                        *reinterpret_cast<struct EXT2_DIRENTRY*>(
+                            reinterpret_cast<char*>(&ext2de) + used),
+                        rec_len - used);
+                }
+                bio.Write();
+                return true;
+            });
+        if (result.IsFailure()) {
+            if (result.AsErrno() != ENOENT)
+                return result;
+
+            // No room anywhere; add a block to hold the entry
+            blocknr_t cur_block;
+            if (result = ext2_block_map(dir, dir.i_sb.st_size / fs->fs_block_size, cur_block, true);
+                result.IsFailure())
+                return result;
+            BIO* bio;
+            if (result = vfs_bget(fs, cur_block, &bio); result.IsFailure())
+                return result;
+            memset(bio->Data(), 0, fs->fs_block_size);
+            fillEntry(*static_cast<struct EXT2_DIRENTRY*>(bio->Data()), fs->fs_block_size);
+            bio->Write();
+            dir.i_sb.st_size += fs->fs_block_size;
+        }
+
+        // We do not maintain the hash tree, so it can no longer be used
+        in_privdata->flags &= ~EXT2_INDEX_FL;
+        ext2_touch_directory(dir);
+        return Result::Success();
+    }
+
+    static Result ext2_remove_direntry(INode& dir, const char* name)
+    {
+        const size_t name_len = strlen(name);
+        auto result = ext2_walk_directory(
+            dir, [&](BIO& bio, struct EXT2_DIRENTRY* prev, struct EXT2_DIRENTRY& ext2de) {
+                if (EXT2_TO_LE32(ext2de.inode) == 0 || ext2de.name_len != name_len ||
+                    memcmp(ext2de.name, name, name_len) != 0)
+                    return false;
+
+                // Merge the entry with the previous one; if there is none, mark it as unused
+                if (prev != nullptr)
+                    prev->rec_len = EXT2_TO_LE16(
+                        EXT2_TO_LE16(prev->rec_len) + EXT2_TO_LE16(ext2de.rec_len));
+                else
+                    ext2de.inode = 0;
+                bio.Write();
+                return true;
+            });
+        if (result.IsFailure())
+            return result;
+
+        ext2_touch_directory(dir);
+        return Result::Success();
+    }
+
+    /* Updates the '..' entry of a directory, which is always the second entry */
+    static Result ext2_set_parent(INode& dir, const INode& parent)
+    {
+        int n = 0;
+        bool corrupt = false;
+        auto result = ext2_walk_directory(
+            dir, [&](BIO& bio, struct EXT2_DIRENTRY*, struct EXT2_DIRENTRY& ext2de) {
+                if (n++ != 1)
+                    return false;
+                if (ext2de.name_len != 2 || memcmp(ext2de.name, "..", 2) != 0) {
+                    corrupt = true;
+                    bio.Release();
+                    return true;
+                }
+                ext2de.inode = EXT2_TO_LE32(parent.i_inum);
+                bio.Write();
+                return true;
+            });
+        if (result.IsSuccess() && corrupt)
+            return Result::Failure(EIO); // second entry isn't '..'
+        return result;
+    }
+
+    static Result ext2_create(INode& dir, DEntry* de, int mode)
+    {
+        struct VFS_MOUNTED_FS* fs = dir.i_fs;
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(fs->fs_privdata);
+        if (!privdata->writable)
+            return Result::Failure(EROFS);
+
+        ino_t inum;
+        if (auto result = ext2_alloc_inode(dir, inum); result.IsFailure())
+            return result;
+
+        // Initialise the on-disk inode as an empty file
+        {
+            BIO* bio;
+            struct EXT2_INODE* ext2inode;
+            if (auto result = ext2_bread_inode(fs, inum, bio, ext2inode); result.IsFailure()) {
+                ext2_free_inode(fs, inum);
+                return result;
+            }
+            const uint32_t now = ext2_now();
+            memset(ext2inode, 0, privdata->sb.s_inode_size);
+            ext2inode->i_mode = EXT2_TO_LE16(EXT2_S_IFREG | (mode & 07777));
+            ext2inode->i_links_count = EXT2_TO_LE16(1);
+            ext2inode->i_atime = EXT2_TO_LE32(now);
+            ext2inode->i_mtime = EXT2_TO_LE32(now);
+            ext2inode->i_ctime = EXT2_TO_LE32(now);
+            bio->Write();
+        }
+
+        INode* inode;
+        if (auto result = vfs_get_inode(fs, inum, inode); result.IsFailure()) {
+            ext2_free_inode(fs, inum);
+            return result;
+        }
+
+        /*
+         * The inode number may have been used before, in which case the inode
+         * can still be cached - ensure it reflects what we just wrote.
+         */
+        inode->Lock();
+        auto result = ext2_read_inode(*inode, inum);
+        inode->Unlock();
+
+        if (result.IsSuccess())
+            result = ext2_add_direntry(dir, de->d_entry, *inode);
+        if (result.IsFailure()) {
+            // Throw the inode away again
+            inode->i_sb.st_nlink = 0;
+            vfs_set_inode_dirty(*inode);
+            vfs_deref_inode(*inode);
+            return result;
+        }
+
+        dcache_set_inode(*de, *inode);
+        vfs_deref_inode(*inode);
+        return Result::Success();
+    }
+
+    static Result ext2_unlink(INode& dir, DEntry& de)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(dir.i_fs->fs_privdata);
+        if (!privdata->writable)
+            return Result::Failure(EROFS);
+        if (de.d_inode == NULL || de.d_flags & DENTRY_FLAG_NEGATIVE)
+            return Result::Failure(EINVAL);
+        INode& inode = *de.d_inode;
+        if (S_ISDIR(inode.i_sb.st_mode))
+            return Result::Failure(EPERM);
+
+        if (auto result = ext2_remove_direntry(dir, de.d_entry); result.IsFailure())
+            return result;
+
+        /* The inode is released by ext2_release_inode() once it is no longer used */
+        inode.i_sb.st_nlink--;
+        inode.i_sb.st_ctime = ext2_now();
+        vfs_set_inode_dirty(inode);
+        return Result::Success();
+    }
+
+    static Result
+    ext2_rename(INode& old_dir, DEntry& old_dentry, INode& new_dir, DEntry& new_dentry)
+    {
+        auto privdata = static_cast<struct EXT2_FS_PRIVDATA*>(old_dir.i_fs->fs_privdata);
+        if (!privdata->writable)
+            return Result::Failure(EROFS);
+        INode& inode = *old_dentry.d_inode;
+
+        // Inode numbers are stable, so all we need to do is move the name
+        if (auto result = ext2_add_direntry(new_dir, new_dentry.d_entry, inode);
+            result.IsFailure())
+            return result;
+        if (auto result = ext2_remove_direntry(old_dir, old_dentry.d_entry); result.IsFailure()) {
+            ext2_remove_direntry(new_dir, new_dentry.d_entry);
+            return result;
+        }
+
+        // A directory changing parents must have its '..' point to the new one
+        if (S_ISDIR(inode.i_sb.st_mode) && &old_dir != &new_dir) {
+            if (auto result = ext2_set_parent(inode, new_dir); result.IsFailure())
+                return result;
+            old_dir.i_sb.st_nlink--;
+            new_dir.i_sb.st_nlink++;
+            vfs_set_inode_dirty(old_dir);
+            vfs_set_inode_dirty(new_dir);
+        }
+
+        dcache_set_inode(new_dentry, inode);
+        dentry_unlink(old_dentry);
+        return Result::Success();
+    }
+
+    static Result ext2_write(struct VFS_FILE* file, const void* buf, size_t len)
+    {
+        INode& inode = *file->f_dentry->d_inode;
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        if (len == 0)
+            return Result::Success(0);
+
+        /*
+         * vfs_generic_write() only allocates blocks beyond the end of the file;
+         * any holes we are about to write to must be filled here. Holes that are
+         * only partially written must be cleared, as the remainder is read back.
+         */
+        const blocknr_t num_blocks =
+            (inode.i_sb.st_size + fs->fs_block_size - 1) / (blocknr_t)fs->fs_block_size;
+        const off_t end = file->f_offset + len;
+        const blocknr_t last = (end - 1) / (blocknr_t)fs->fs_block_size;
+        for (blocknr_t block = file->f_offset / (blocknr_t)fs->fs_block_size;
+             block <= last && block < num_blocks; block++) {
+            blocknr_t cur_block;
+            if (auto result = ext2_block_map(inode, block, cur_block, false); result.IsFailure())
+                return result;
+            if (cur_block != 0)
+                continue;
+            if (auto result = ext2_block_map(inode, block, cur_block, true); result.IsFailure())
+                return result;
+
+            const off_t block_offset = block * (off_t)fs->fs_block_size;
+            if (file->f_offset <= block_offset && block_offset + fs->fs_block_size <= end)
+                continue; // overwritten in full by vfs_generic_write()
+            BIO* bio;
+            if (auto result = vfs_bget(fs, cur_block, &bio); result.IsFailure())
+                return result;
+            memset(bio->Data(), 0, fs->fs_block_size);
+            bio->Write();
+        }
+        return vfs_generic_write(file, buf, len);
+    }
+
+    static struct VFS_INODE_OPS ext2_file_ops = {
+        .block_map = ext2_block_map, .read = vfs_generic_read, .write = ext2_write};
+
+    static struct VFS_INODE_OPS ext2_dir_ops = {.readdir = ext2_readdir,
+                                                .lookup = ext2_lookup,
+                                                .create = ext2_create,
+                                                .unlink = ext2_unlink,
+                                                .rename = ext2_rename};
+
+    static Result ext2_read_link(INode& inode, char* buffer, size_t buflen)
+    {
+        auto in_privdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
+
+        // XXX i_block[] may be byte-swapped - how to deal with this?
+        size_t len = buflen;
+        KASSERT(len > 0, "empty buffer?");
+        buffer[len - 1] = '\0';
+        if (len > 60)
+            len = 60;
+        memcpy(buffer, in_privdata->block, len);
+        return Result::Success(len);
+    }
+
+    static struct VFS_INODE_OPS ext2_symlink_ops = {.read_link = ext2_read_link,
+                                                    .follow_link = vfs_generic_follow_link};
+
+    /*
+     * Reads a filesystem inode and fills a corresponding inode structure.
+     */
+    static Result ext2_read_inode(INode& inode, ino_t inum)
+    {
+        BIO* bio;
+        struct EXT2_INODE* ext2inode;
+        if (auto result = ext2_bread_inode(inode.i_fs, inum, bio, ext2inode); result.IsFailure())
+            return result;
+        inum--;
 
         /* Fill the stat buffer with date */
         inode.i_sb.st_ino = inum;
@@ -339,6 +1559,10 @@ ext2_dump_inode(struct EXT2_INODE* inode)
         auto iprivdata = static_cast<struct EXT2_INODE_PRIVDATA*>(inode.i_privdata);
         for (unsigned int i = 0; i < EXT2_INODE_BLOCKS; i++)
             iprivdata->block[i] = EXT2_TO_LE32(ext2inode->i_block[i]);
+        iprivdata->flags = EXT2_TO_LE32(ext2inode->i_flags);
+        iprivdata->freed = false;
+        iprivdata->last_alloc_logical = 0;
+        iprivdata->last_alloc_physical = 0;
 
         /* Fill out the inode operations - this depends on the inode type */
         uint16_t imode = EXT2_TO_LE16(ext2inode->i_mode);
@@ -386,6 +1610,10 @@ ext2_dump_inode(struct EXT2_INODE* inode)
         /* Fill out some fields with the defaults for very old ext2 filesystems */
         if (sb->s_rev_level == EXT2_GOOD_OLD_REV) {
             sb->s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+            sb->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+            sb->s_feature_compat = 0;
+            sb->s_feature_incompat = 0;
+            sb->s_feature_ro_compat = 0;
         }
 
         /* Victory */
@@ -398,6 +1626,15 @@ ext2_dump_inode(struct EXT2_INODE* inode)
         privdata->blockgroup = new EXT2_BLOCKGROUP[privdata->num_blockgroups];
         privdata->log_blocksize = sb->s_log_block_size;
 
+        /* We can only safely write if we know about every feature that affects it */
+        privdata->writable =
+            (sb->s_feature_incompat & ~EXT2_FEATURE_INCOMPAT_FILETYPE) == 0 &&
+            (sb->s_feature_ro_compat &
+             ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE |
+               EXT2_FEATURE_RO_COMPAT_BTREE_DIR)) == 0;
+        memset(privdata->reservation, 0, sizeof(privdata->reservation));
+        privdata->next_reservation = 0;
+
         /* Fill out filesystem fields */
         fs->fs_block_size = 1024L << sb->s_log_block_size;
 
@@ -448,7 +1685,9 @@ ext2_dump_inode(struct EXT2_INODE* inode)
     struct VFS_FILESYSTEM_OPS fsops_ext2 = {.mount = ext2_mount,
                                             .prepare_inode = ext2_prepare_inode,
                                             .discard_inode = ext2_discard_inode,
-                                            .read_inode = ext2_read_inode};
+                                            .read_inode = ext2_read_inode,
+                                            .write_inode = ext2_write_inode,
+                                            .release_inode = ext2_release_inode};
 
     VFSFileSystem fs_ext2("ext2", &fsops_ext2);
 
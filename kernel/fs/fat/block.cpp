@@ -9,6 +9,7 @@
 #include "kernel/bio.h"
 #include "kernel/lib.h"
 #include "kernel/lock.h"
+#include "kernel/mm.h"
 #include "kernel/result.h"
 #include "kernel/schedule.h" // XXX
 #include "kernel/vfs/types.h"
@@ -50,6 +51,37 @@ static inline void fat_make_cluster_block_offset(
     *offset = block % fs_privdata->sector_size;
 }
 
+static inline uint32_t fat_end_cluster(const struct FAT_FS_PRIVDATA* fs_privdata)
+{
+    /* Cluster numbers start at 2 */
+    return fs_privdata->total_clusters + 2;
+}
+
+static inline bool fat_cluster_avail(const struct FAT_FS_PRIVDATA* fs_privdata, uint32_t cluster)
+{
+    return (fs_privdata->avail_map[cluster / 32] & (1U << (cluster % 32))) != 0;
+}
+
+static inline void
+fat_set_cluster_avail(struct FAT_FS_PRIVDATA* fs_privdata, uint32_t cluster, bool avail)
+{
+    if (avail)
+        fs_privdata->avail_map[cluster / 32] |= 1U << (cluster % 32);
+    else
+        fs_privdata->avail_map[cluster / 32] &= ~(1U << (cluster % 32));
+}
+
+static inline uint32_t fat_read_entry(const struct FAT_FS_PRIVDATA* fs_privdata, const char* entry)
+{
+    switch (fs_privdata->fat_type) {
+        case 16:
+            return FAT_FROM_LE16(entry);
+        case 32: /* actually FAT-28... */
+            return FAT_FROM_LE32(entry) & 0xfffffff;
+    }
+    panic("unsupported fat type %d", fs_privdata->fat_type);
+}
+
 /*
  * Used to obtain the clusternum'th cluster of a file starting at
  * first_cluster. Returns BAD_RANGE error if end-of-file was found (but
@@ -186,11 +218,14 @@ try_cache:; /* dummy ; to keep gcc happy */
 }
 
 /*
- * Sets a cluster value to a given value.
+ * Sets a cluster value to a given value. Only the first FAT is updated here;
+ * the sector is remembered so that fat_flush_fat() can mirror it to the other
+ * FATs later on. Must be called with the allocation mutex held.
  */
 static Result fat_set_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster_num, uint32_t cluster_val)
 {
     auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+    fs_privdata->mtx_alloc.AssertLocked();
 
     /* Calculate the block and offset within that block of the cluster */
     blocknr_t sector_num;
@@ -202,89 +237,141 @@ static Result fat_set_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster_num, u
     if (auto result = vfs_bread(fs, sector_num, &bio); result.IsFailure())
         return result;
 
+    auto entry = static_cast<char*>(bio->Data()) + offset;
     switch (fs_privdata->fat_type) {
         case 16:
-            FAT_TO_LE16((char*)(static_cast<char*>(bio->Data()) + offset), cluster_val);
+            FAT_TO_LE16(entry, cluster_val);
             break;
         case 32: /* actually FAT-28... */
-            FAT_TO_LE32((char*)(static_cast<char*>(bio->Data()) + offset), cluster_val);
+            /* The upper 4 bits are reserved and must be preserved */
+            FAT_TO_LE32(entry, (FAT_FROM_LE32(entry) & 0xf0000000) | (cluster_val & 0xfffffff));
             break;
         default:
             panic("unsuported fat type");
     }
+    bio->Write();
 
+    /* Mark the sector so that it will be synced to all other FAT tables */
+    const uint32_t fat_sector = sector_num - fs_privdata->reserved_sectors;
+    const uint32_t mask = 1U << (fat_sector % 32);
+    if ((fs_privdata->dirty_fat_map[fat_sector / 32] & mask) == 0) {
+        fs_privdata->dirty_fat_map[fat_sector / 32] |= mask;
+        fs_privdata->num_dirty_fat++;
+    }
+    return Result::Success();
+}
 
-    /* Sync all other FAT tables as well */
-    for (int i = 1; i < fs_privdata->num_fats; i++) {
-        sector_num += fs_privdata->num_fat_sectors;
-        BIO* bio2;
-        if (auto result = vfs_bread(fs, sector_num, &bio2); result.IsFailure()) {
-            /* XXX we should free the cluster */
-            bio->Release();
-            kprintf("fat_set_cluster(): XXX leaking cluster %u\n", sector_num);
-            return result;
+/*
+ * Locates the first available cluster in [first, end) which starts a run of
+ * at least 'run' available clusters; returns 0 if there is no such cluster.
+ */
+static uint32_t fat_find_avail_run(
+    const struct FAT_FS_PRIVDATA* fs_privdata, uint32_t first, uint32_t end, uint32_t run)
+{
+    uint32_t cluster = first;
+    while (cluster < end) {
+        /* Skip over words without any available clusters at once */
+        if ((cluster % 32) == 0 && fs_privdata->avail_map[cluster / 32] == 0) {
+            cluster += 32;
+            continue;
+        }
+        if (!fat_cluster_avail(fs_privdata, cluster)) {
+            cluster++;
+            continue;
         }
-        memcpy(bio2->Data(), bio->Data(), fs_privdata->sector_size);
-        bio2->Write();
-    }
-    bio->Write();
 
-    return Result::Success();
+        uint32_t len = 1;
+        while (len < run && cluster + len < end && fat_cluster_avail(fs_privdata, cluster + len))
+            len++;
+        if (len == run)
+            return cluster;
+        cluster += len;
+    }
+    return 0;
 }
 
 /*
- * Obtains the first available cluster and marks it as being used.
+ * Obtains an available cluster and marks it as being used. If 'goal' is
+ * available, it will be used as this keeps the cluster chain contiguous;
+ * otherwise, we start at a run of available clusters so the chain has some
+ * room to grow.
  */
-static Result fat_claim_avail_cluster(struct VFS_MOUNTED_FS* fs, uint32_t* cluster_out)
+static Result
+fat_claim_avail_cluster(struct VFS_MOUNTED_FS* fs, uint32_t goal, uint32_t* cluster_out)
 {
     auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+    MutexGuard g(fs_privdata->mtx_alloc);
 
-    /* XXX We do a dumb find-first on the filesystem for now */
-    for (uint32_t clusterno = fs_privdata->next_avail_cluster;
-         clusterno < fs_privdata->total_clusters; clusterno++) {
-        /* Obtain the FAT block, if necessary */
-        uint32_t offset;
-        blocknr_t cur_block;
-        fat_make_cluster_block_offset(fs, clusterno, &cur_block, &offset);
+    const uint32_t end_cluster = fat_end_cluster(fs_privdata);
+    const uint32_t rotor = fs_privdata->next_avail_cluster;
+    uint32_t cluster = 0;
+    bool fresh_run = false;
+    if (goal >= 2 && goal < end_cluster && fat_cluster_avail(fs_privdata, goal))
+        cluster = goal;
+    if (cluster == 0) {
+        cluster = fat_find_avail_run(fs_privdata, rotor, end_cluster, FAT_ALLOC_RUN);
+        if (cluster == 0)
+            cluster = fat_find_avail_run(fs_privdata, 2, rotor, FAT_ALLOC_RUN);
+        fresh_run = cluster != 0;
+    }
+    if (cluster == 0) {
+        /* No runs left; settle for any available cluster */
+        cluster = fat_find_avail_run(fs_privdata, rotor, end_cluster, 1);
+        if (cluster == 0)
+            cluster = fat_find_avail_run(fs_privdata, 2, rotor, 1);
+        if (cluster == 0)
+            return Result::Failure(ENOSPC);
+    }
 
-        BIO* bio;
-        if (auto result = vfs_bread(fs, cur_block, &bio); result.IsFailure())
-            return result;
+    /* Claim it by marking it as the end of the chain */
+    uint32_t eoc;
+    switch (fs_privdata->fat_type) {
+        case 16:
+            eoc = 0xfff8;
+            break;
+        case 32: /* actually FAT-28... */
+            eoc = 0xffffff8;
+            break;
+        default:
+            panic("unsuported fat type");
+    }
+    if (auto result = fat_set_cluster(fs, cluster, eoc); result.IsFailure())
+        return result;
+    fat_set_cluster_avail(fs_privdata, cluster, false);
+    fs_privdata->num_avail_clusters--;
 
-        /* Obtain the cluster value */
-        uint32_t val = -1;
-        switch (fs_privdata->fat_type) {
-            case 16:
-                val = FAT_FROM_LE16((char*)(static_cast<char*>(bio->Data()) + offset));
-                if (val == 0) { /* available cluster? */
-                    /* Yes; claim it */
-                    FAT_TO_LE16((char*)(static_cast<char*>(bio->Data()) + offset), 0xfff8);
-                }
-                break;
-            case 32: /* actually FAT-28... */
-                val =
-                    FAT_FROM_LE32((char*)(static_cast<char*>(bio->Data()) + offset)) & 0xfffffff;
-                if (val == 0) { /* available cluster? */
-                    /* Yes; claim it */
-                    FAT_TO_LE32((char*)(static_cast<char*>(bio->Data()) + offset), 0xffffff8);
-                }
-                break;
-        }
-        if (val != 0) {
-            bio->Release();
-            continue;
-        }
+    /*
+     * Advance the next available cluster; if we started a fresh run, skip it
+     * entirely to keep other files from being interleaved with this one.
+     */
+    uint32_t next_avail = rotor;
+    if (fresh_run)
+        next_avail = cluster + FAT_ALLOC_RUN;
+    else if (cluster >= rotor)
+        next_avail = cluster + 1;
+    fs_privdata->next_avail_cluster = next_avail < end_cluster ? next_avail : 2;
+
+    *cluster_out = cluster;
+    return Result::Success();
+}
 
-        /* OK; this one is available (and we just claimed it) - flush the FAT entry */
-        bio->Write();
+/*
+ * Marks a cluster as being available again.
+ */
+static Result fat_release_cluster(struct VFS_MOUNTED_FS* fs, uint32_t cluster)
+{
+    auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+    MutexGuard g(fs_privdata->mtx_alloc);
 
-        /* XXX should update second fat */
-        *cluster_out = clusterno;
-        return Result::Success();
+    if (cluster < 2 || cluster >= fat_end_cluster(fs_privdata))
+        return Result::Failure(EIO);
+    if (auto result = fat_set_cluster(fs, cluster, 0); result.IsFailure())
+        return result;
+    if (!fat_cluster_avail(fs_privdata, cluster)) {
+        fat_set_cluster_avail(fs_privdata, cluster, true);
+        fs_privdata->num_avail_clusters++;
     }
-
-    /* Out of available clusters */
-    return Result::Failure(ENOSPC);
+    return Result::Success();
 }
 
 /*
@@ -310,9 +397,13 @@ static Result fat_append_cluster(INode& inode, uint32_t* cluster_out)
         privdata->last_cluster = last_cluster;
     }
 
-    /* Obtain the next cluster - this will also mark it as being in use */
+    /*
+     * Obtain the next cluster - this will also mark it as being in use. We'd
+     * like the one directly following our final cluster, if possible.
+     */
     uint32_t new_cluster = 0;
-    if (auto result = fat_claim_avail_cluster(fs, &new_cluster); result.IsFailure())
+    const uint32_t goal = last_cluster != 0 ? last_cluster + 1 : 0;
+    if (auto result = fat_claim_avail_cluster(fs, goal, &new_cluster); result.IsFailure())
         return result;
 
     /* If the file didn't have any clusters before, it sure does now */
@@ -321,6 +412,7 @@ static Result fat_append_cluster(INode& inode, uint32_t* cluster_out)
         vfs_set_inode_dirty(inode);
     } else {
         /* Append this cluster to the file chain */
+        MutexGuard g(fs_privdata->mtx_alloc);
         if (auto result = fat_set_cluster(fs, last_cluster, new_cluster); result.IsFailure())
             return result; // XXX leaks clusterno
     }
@@ -336,12 +428,14 @@ static Result fat_append_cluster(INode& inode, uint32_t* cluster_out)
             struct FAT_CLUSTER_CACHEITEM* ci = &fs_privdata->cluster_cache[cache_item];
             if (ci->f_clusterno == privdata->first_cluster && ci->f_nextcluster == -1) {
                 /* Found empty item - use it (we assume this always occurs at the end of the items)
+                 * - directories have no size, so we can only verify this for files
                  */
                 KASSERT(
-                    ci->f_index ==
-                        (inode.i_sb.st_size +
-                         ((fs_privdata->sector_size * fs_privdata->sectors_per_cluster) - 1)) /
-                            (fs_privdata->sector_size * fs_privdata->sectors_per_cluster),
+                    S_ISDIR(inode.i_sb.st_mode) ||
+                        ci->f_index ==
+                            (inode.i_sb.st_size +
+                             ((fs_privdata->sector_size * fs_privdata->sectors_per_cluster) - 1)) /
+                                (fs_privdata->sector_size * fs_privdata->sectors_per_cluster),
                     "empty cache item isn't final item?");
                 ci->f_nextcluster = new_cluster;
                 break;
@@ -381,10 +475,10 @@ Result fat_truncate_clusterchain(INode& inode)
         }
 
         /*
-         * Throw away this cluster; note that fat_set_cluster() will not update the
-         * cluster map, which is fine as we'll just flush the cache soon.
+         * Throw away this cluster; note that this will not update the cluster
+         * cache, which is fine as we'll just flush the cache soon.
          */
-        result = fat_set_cluster(fs, cluster, 0);
+        result = fat_release_cluster(fs, cluster);
         if (result.IsFailure())
             break;
     }
@@ -424,6 +518,10 @@ Result fat_block_map(INode& inode, blocknr_t block_in, blocknr_t& block_out, boo
         uint32_t cluster;
         Result result = fat_get_cluster(
             fs, privdata->first_cluster, block_in / fs_privdata->sectors_per_cluster, &cluster);
+        /*
+         * Note that we may be asked to create a block within a cluster that
+         * already exists, as a cluster spans multiple blocks; this is fine.
+         */
         if (result.IsFailure() && result.AsErrno() == ERANGE) {
             /* end of the chain */
             if (!create) {
@@ -431,12 +529,7 @@ Result fat_block_map(INode& inode, blocknr_t block_in, blocknr_t& block_out, boo
             }
             if (auto result = fat_append_cluster(inode, &cluster); result.IsFailure())
                 return result;
-        } else if (result.IsSuccess()) {
-            KASSERT(
-                create == 0,
-                "request to create block that already exists (blocknum=%u, cluster=%u)",
-                (int)(block_in / fs_privdata->sectors_per_cluster), cluster);
-        } else {
+        } else if (result.IsFailure()) {
             return result;
         }
 
@@ -529,3 +622,104 @@ Result fat_update_infosector(struct VFS_MOUNTED_FS* fs)
 
     return Result::Success();
 }
+
+/*
+ * Builds the map of available clusters by walking the first FAT once; this
+ * saves us from having to scan the FAT whenever we need a cluster.
+ */
+Result fat_init_allocator(struct VFS_MOUNTED_FS* fs)
+{
+    auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+    const uint32_t end_cluster = fat_end_cluster(fs_privdata);
+    const size_t avail_map_size = ((end_cluster + 31) / 32) * sizeof(uint32_t);
+    const size_t dirty_fat_map_size = ((fs_privdata->num_fat_sectors + 31) / 32) * sizeof(uint32_t);
+    fs_privdata->avail_map = static_cast<uint32_t*>(kmalloc(avail_map_size));
+    memset(fs_privdata->avail_map, 0, avail_map_size);
+    fs_privdata->dirty_fat_map = static_cast<uint32_t*>(kmalloc(dirty_fat_map_size));
+    memset(fs_privdata->dirty_fat_map, 0, dirty_fat_map_size);
+    fs_privdata->num_dirty_fat = 0;
+
+    const blocknr_t end_sector = fs_privdata->reserved_sectors + fs_privdata->num_fat_sectors;
+    blocknr_t cur_sector = 0;
+    BIO* bio = nullptr;
+    uint32_t num_avail = 0;
+    for (uint32_t cluster = 2; cluster < end_cluster; cluster++) {
+        blocknr_t sector_num;
+        uint32_t offset;
+        fat_make_cluster_block_offset(fs, cluster, &sector_num, &offset);
+        if (sector_num >= end_sector)
+            break; /* FAT is shorter than the number of clusters; can't use the rest */
+        if (bio == nullptr || sector_num != cur_sector) {
+            if (bio != nullptr)
+                bio->Release();
+            if (auto result = vfs_bread(fs, sector_num, &bio); result.IsFailure()) {
+                fat_exit_allocator(fs);
+                return result;
+            }
+            cur_sector = sector_num;
+        }
+
+        if (fat_read_entry(fs_privdata, static_cast<char*>(bio->Data()) + offset) == 0) {
+            fat_set_cluster_avail(fs_privdata, cluster, true);
+            num_avail++;
+        }
+    }
+    if (bio != nullptr)
+        bio->Release();
+
+    /* The info sector only holds hints; we now know better */
+    fs_privdata->num_avail_clusters = num_avail;
+    if (fs_privdata->next_avail_cluster < 2 || fs_privdata->next_avail_cluster >= end_cluster)
+        fs_privdata->next_avail_cluster = 2;
+    return Result::Success();
+}
+
+void fat_exit_allocator(struct VFS_MOUNTED_FS* fs)
+{
+    auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+    kfree(fs_privdata->avail_map);
+    kfree(fs_privdata->dirty_fat_map);
+    fs_privdata->avail_map = nullptr;
+    fs_privdata->dirty_fat_map = nullptr;
+}
+
+/*
+ * Copies all sectors of the first FAT that were modified since the previous
+ * call to the other FATs, and updates the info sector. This is done in a
+ * single pass as mirroring every individual cluster update is costly.
+ */
+Result fat_flush_fat(struct VFS_MOUNTED_FS* fs)
+{
+    auto fs_privdata = static_cast<struct FAT_FS_PRIVDATA*>(fs->fs_privdata);
+    MutexGuard g(fs_privdata->mtx_alloc);
+    if (fs_privdata->num_dirty_fat == 0)
+        return Result::Success(); /* nothing changed */
+
+    for (uint32_t word = 0; fs_privdata->num_dirty_fat > 0; word++) {
+        uint32_t& dirty = fs_privdata->dirty_fat_map[word];
+        while (dirty != 0) {
+            const uint32_t bit = __builtin_ctz(dirty);
+            const blocknr_t sector_num = fs_privdata->reserved_sectors + word * 32 + bit;
+            BIO* bio;
+            if (auto result = vfs_bread(fs, sector_num, &bio); result.IsFailure())
+                return result;
+
+            for (int i = 1; i < fs_privdata->num_fats; i++) {
+                const blocknr_t mirror_sector = sector_num + i * fs_privdata->num_fat_sectors;
+                BIO* bio2;
+                if (auto result = vfs_bread(fs, mirror_sector, &bio2); result.IsFailure()) {
+                    bio->Release();
+                    return result;
+                }
+                memcpy(bio2->Data(), bio->Data(), fs_privdata->sector_size);
+                bio2->Write();
+            }
+            bio->Release();
+
+            dirty &= ~(1U << bit);
+            fs_privdata->num_dirty_fat--;
+        }
+    }
+
+    return fat_update_infosector(fs);
+}
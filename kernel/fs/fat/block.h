@@ -17,6 +17,9 @@ void fat_dump_cache(struct VFS_MOUNTED_FS* fs);
 int fat_clear_cache(struct VFS_MOUNTED_FS* fs, uint32_t first_cluster);
 Result fat_truncate_clusterchain(INode& inode);
 Result fat_update_infosector(struct VFS_MOUNTED_FS* fs);
+Result fat_init_allocator(struct VFS_MOUNTED_FS* fs);
+void fat_exit_allocator(struct VFS_MOUNTED_FS* fs);
+Result fat_flush_fat(struct VFS_MOUNTED_FS* fs);
 
 extern struct VFS_INODE_OPS fat_inode_ops;
 
@@ -214,6 +214,7 @@ Result fat_add_directory_entry(INode& dir, const char* dentry, struct FAT_ENTRY*
         if (result.IsFailure()) {
             if (result.AsErrno() == ERANGE) {
                 /* We've hit an end-of-file - this means we'll have to enlarge the directory */
+                current_filename_offset = cur_dir_offset;
                 cur_lfn_chain = -1;
                 break;
             }
@@ -296,11 +297,13 @@ Result fat_add_directory_entry(INode& dir, const char* dentry, struct FAT_ENTRY*
      */
     int filename_len = strlen(dentry);
     for (int cur_entry_idx = 0; cur_entry_idx < chain_needed; cur_entry_idx++) {
-        /* Fetch/allocate the desired block */
+        /*
+         * Fetch/allocate the desired block; even if we found room, the chain may
+         * extend beyond the final block of the directory.
+         */
         blocknr_t cur_block;
         if (auto result = fat_block_map(
-                dir, (current_filename_offset / (blocknr_t)fs->fs_block_size), cur_block,
-                (cur_lfn_chain < 0));
+                dir, (current_filename_offset / (blocknr_t)fs->fs_block_size), cur_block, true);
             result.IsFailure())
             return result;
         BIO* bio;
@@ -340,7 +343,8 @@ Result fat_add_directory_entry(INode& dir, const char* dentry, struct FAT_ENTRY*
         current_filename_offset += sizeof(struct FAT_ENTRY);
     }
 
-    return Result::Success();
+    /* Sync the FAT copies in case we had to enlarge the directory */
+    return fat_flush_fat(fs);
 }
 
 Result fat_remove_directory_entry(INode& dir, const char* dentry)
@@ -358,9 +362,9 @@ Result fat_remove_directory_entry(INode& dir, const char* dentry)
     while (1) {
         /* Obtain the current directory block data */
         blocknr_t cur_block;
-        Result result =
-            fat_block_map(dir, (cur_dir_offset / (blocknr_t)fs->fs_block_size), cur_block, 0);
-        if (result.IsFailure()) {
+        if (auto result =
+                fat_block_map(dir, (cur_dir_offset / (blocknr_t)fs->fs_block_size), cur_block, 0);
+            result.IsFailure()) {
             if (result.AsErrno() == ERANGE) {
                 /* We've hit an end-of-file */
                 break;
@@ -550,7 +554,7 @@ Result fat_rename(INode& old_dir, DEntry& old_dentry, INode& new_dir, DEntry& ne
 
 struct VFS_INODE_OPS fat_dir_ops = {
     .readdir = fat_readdir,
-    .lookup = vfs_generic_lookup,
+    .lookup = vfs_generic_lookup_indexed,
     .create = fat_create,
     .unlink = fat_unlink,
     .rename = fat_rename,
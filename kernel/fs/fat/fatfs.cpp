@@ -95,8 +95,7 @@ namespace {
         const auto bpb = *reinterpret_cast<struct FAT_BPB*>(bio->Data());
         bio->Release();
 
-        auto privdata = new FAT_FS_PRIVDATA;
-        memset(privdata, 0, sizeof(struct FAT_FS_PRIVDATA));
+        auto privdata = new FAT_FS_PRIVDATA{};
         fs->fs_privdata = privdata; /* immediately, this is used by other functions */
 
         privdata->sector_size = FAT_FROM_LE16(bpb.bpb_bytespersector);
@@ -183,7 +182,13 @@ namespace {
             }
         }
 
+        if (auto result = fat_init_allocator(fs); result.IsFailure()) {
+            kfree(privdata);
+            return result;
+        }
+
         if (auto result = vfs_get_inode(fs, FAT_ROOTINODE_INUM, root_inode); result.IsFailure()) {
+            fat_exit_allocator(fs);
             kfree(privdata);
             return result;
         }
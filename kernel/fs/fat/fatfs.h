@@ -8,6 +8,7 @@
 #define __FATFS_H__
 
 #include <ananas/types.h>
+#include "kernel/lock.h"
 
 /*
  * Used to uniquely identify a FAT16 root inode; it appears on a
@@ -27,8 +28,8 @@ template<typename T>
 uint32_t FAT_FROM_LE32(const T* x)
 {
     auto p = reinterpret_cast<const uint8_t*>(x);
-    return static_cast<uint32_t>(x[0]) | (static_cast<uint32_t>(x[1]) << 8) |
-           (static_cast<uint32_t>(x[2]) << 16) | static_cast<uint32_t>(x[3] << 24);
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
 }
 
 template<typename T>
@@ -49,6 +50,13 @@ void FAT_TO_LE32(T* out, const uint32_t v)
     p[3] = (v >> 24) & 0xff;
 }
 
+/*
+ * When a cluster chain cannot simply be extended by the cluster following it,
+ * we look for a run of at least this many available clusters so that the file
+ * has room to grow contiguously.
+ */
+static inline constexpr uint32_t FAT_ALLOC_RUN = 16;
+
 /* Number of cache items per filesystem */
 static inline constexpr auto FAT_NUM_CACHEITEMS = 1000;
 
@@ -69,9 +77,13 @@ struct FAT_FS_PRIVDATA {
     uint32_t first_rootdir_sector; /* First sector containing root dir */
     uint32_t first_data_sector;    /* First sector containing file data */
     uint32_t total_clusters;       /* Total number of clusters on filesystem */
+    uint32_t infosector_num;       /* Info sector, or 0 if not present */
+    Mutex mtx_alloc{"fatalloc"};   /* Protects the allocation state below */
     uint32_t next_avail_cluster;   /* Next available cluster */
     uint32_t num_avail_clusters;   /* Number of available clusters */
-    uint32_t infosector_num;       /* Info sector, or 0 if not present */
+    uint32_t* avail_map;           /* Bit set for each available cluster */
+    uint32_t* dirty_fat_map;       /* Bit set for each first FAT sector to mirror */
+    uint32_t num_dirty_fat;        /* Number of bits set in dirty_fat_map */
     Spinlock spl_cache;
     struct FAT_CLUSTER_CACHEITEM cluster_cache[FAT_NUM_CACHEITEMS];
 };
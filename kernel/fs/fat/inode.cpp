@@ -149,8 +149,10 @@ Result fat_write_inode(INode& inode)
         }
     }
 
-    /* And off it goes */
-    return bio->Write();
+    /* And off it goes; this is also a good time to sync the FAT copies */
+    if (auto result = bio->Write(); result.IsFailure())
+        return result;
+    return fat_flush_fat(fs);
 }
 
 struct VFS_INODE_OPS fat_inode_ops = {
@@ -1,8 +1,8 @@
 // PCPU struct
 #define PCPU_SYSCALLRSP     0x08
 #define PCPU_RSP0           0x10
-#define PCPU_CURTHREAD      0x28
-#define PCPU_NESTEDIRQ      0x38
+#define PCPU_CURTHREAD      0x30
+#define PCPU_NESTEDIRQ      0x40
 
 // Stack frame
 #define SF_TRAPNO   0x00
@@ -0,0 +1,79 @@
+/*-
+ * SPDX-License-Identifier: Zlib
+ *
+ * Copyright (c) 2009-2018 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <ananas/types.h>
+#include <ananas/util/atomic.h>
+
+namespace md::smp
+{
+    // The xAPIC addresses CPU's using an 8-bit ID; we can never start more than this
+    constexpr int MaximumCPUs = 256;
+
+    /*
+     * Set of CPU's, indexed by cpuid. Adding and removing a single CPU is
+     * atomic; operations on the set as a whole are done word by word.
+     */
+    class CPUSet
+    {
+        static constexpr int BitsPerWord = 64;
+        static constexpr int NumberOfWords = MaximumCPUs / BitsPerWord;
+
+      public:
+        void Add(int cpuid) { Word(cpuid) |= Bit(cpuid); }
+        void Remove(int cpuid) { Word(cpuid) &= ~Bit(cpuid); }
+        bool Contains(int cpuid) const { return (Word(cpuid).load() & Bit(cpuid)) != 0; }
+
+        // Removes 'cpuid' from the set; returns whether it was a member
+        bool TestAndRemove(int cpuid)
+        {
+            return (Word(cpuid).fetch_and(~Bit(cpuid)) & Bit(cpuid)) != 0;
+        }
+
+        void Fill()
+        {
+            for (auto& word : cs_word)
+                word = ~0ULL;
+        }
+
+        void Merge(const CPUSet& other)
+        {
+            for (int n = 0; n < NumberOfWords; ++n)
+                cs_word[n] |= other.cs_word[n].load();
+        }
+
+        bool IsEmpty() const
+        {
+            for (auto& word : cs_word)
+                if (word.load() != 0)
+                    return false;
+            return true;
+        }
+
+        template<typename Func>
+        void ForEach(Func func) const
+        {
+            for (int n = 0; n < NumberOfWords; ++n) {
+                auto word = cs_word[n].load();
+                for (int bit = 0; word != 0; ++bit, word >>= 1)
+                    if (word & 1)
+                        func(n * BitsPerWord + bit);
+            }
+        }
+
+      private:
+        static uint64_t Bit(int cpuid) { return 1ULL << (cpuid % BitsPerWord); }
+        util::atomic<uint64_t>& Word(int cpuid) { return cs_word[cpuid / BitsPerWord]; }
+        const util::atomic<uint64_t>& Word(int cpuid) const
+        {
+            return cs_word[cpuid / BitsPerWord];
+        }
+
+        util::atomic<uint64_t> cs_word[NumberOfWords];
+    };
+
+} // namespace md::smp
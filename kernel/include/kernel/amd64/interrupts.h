@@ -6,6 +6,8 @@
  */
 #pragma once
 
+#include <ananas/types.h>
+
 #define MAX_IRQS 256
 
 namespace md
@@ -16,7 +18,7 @@ namespace md
 
         static inline void Disable() { __asm __volatile("cli"); }
 
-        static inline void Restore(int enabled)
+        static inline void Restore(register_t enabled)
         {
             __asm __volatile(
                 // get flags in %rdx
@@ -24,7 +26,7 @@ namespace md
                 "popq %%rdx\n"
                 // mask interrupt flag and re-enable flag if needed
                 "andq $~0x200, %%rdx\n"
-                "orl %0, %%edx\n"
+                "orq %0, %%rdx\n"
                 // activate new flags
                 "pushq %%rdx\n"
                 "popfq\n"
@@ -33,25 +35,25 @@ namespace md
                 : "%rdx");
         }
 
-        static inline int Save()
+        static inline register_t Save()
         {
-            int r;
+            register_t r;
             __asm __volatile(
                 // get flags
                 "pushfq\n"
                 "popq %%rdx\n"
                 // but only the interrupt flag
                 "andq $0x200, %%rdx\n"
-                "movl %%edx, %0"
+                "movq %%rdx, %0"
                 : "=r"(r)
                 :
                 : "%rdx");
             return r;
         }
 
-        static inline int SaveAndDisable()
+        static inline register_t SaveAndDisable()
         {
-            int status = Save();
+            register_t status = Save();
             Disable();
             return status;
         }
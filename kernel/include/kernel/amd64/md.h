@@ -7,6 +7,7 @@
 #pragma once
 
 #include <ananas/types.h>
+#include "kernel-md/cpuset.h"
 
 class Result;
 struct Thread;
@@ -51,6 +52,23 @@ namespace md
         // Unmaps 'num_pages' at virtual address virt for vmspace 'vs'
         void UnmapPages(VMSpace& vs, addr_t virt, size_t num_pages);
 
+        // Zero-fills a page at kernel address 'va' without dragging it into the caches;
+        // only useful for pages that won't be used any time soon
+        void ZeroPage(void* va);
+
+        // Enables process-context identifiers on the current CPU, if supported
+        void InitializePCID();
+
+        // Allocates/frees the process-context identifier used to tag the TLB entries of a vmspace
+        uint16_t AllocatePCID();
+        void FreePCID(uint16_t pcid);
+
+        // Loads the page tables of vmspace 'vs' on the current CPU
+        void Activate(VMSpace& vs);
+
+        // Performs the TLB invalidations another CPU asked us to do, if any
+        void ProcessShootdown();
+
     } // namespace vm
 
     namespace vmspace
@@ -60,6 +78,31 @@ namespace md
 
     } // namespace vmspace
 
+    namespace timer
+    {
+        // Returns the value of a free-running, monotonic counter shared by all CPU's
+        uint64_t ReadCounter();
+        // Returns the rate at which ReadCounter() increments, in Hz
+        uint64_t GetCounterFrequency();
+
+        // Fires the CPU-local timer interrupt once, 'ns' nanoseconds from now; zero disarms it
+        void ArmOneShot(uint64_t ns);
+
+    } // namespace timer
+
+    namespace smp
+    {
+        // Asks CPU 'cpuid' to reschedule as soon as possible
+        void Reschedule(int cpuid);
+
+        // Returns the set of all CPU's that are up and running
+        const CPUSet& GetOnlineCPUs();
+
+        // Asks all CPU's in 'targets' to process the pending TLB shootdown
+        void SendShootdown(const CPUSet& targets);
+
+    } // namespace smp
+
     void PowerDown();
     void Reboot();
 
@@ -33,6 +33,10 @@
 /* Number of Interrupt Descriptor Table entries */
 #define IDT_NUM_ENTRIES 256
 
+/* Large pages are 2MB, which is a single block of the highest buddy order */
+#define LARGE_PAGE_SIZE (1UL << 21)
+#define LARGE_PAGE_ORDER 9
+
 /* Kernel stack size */
 #define KERNEL_STACK_SIZE 0x4000
 
@@ -15,7 +15,8 @@
      */                                                                    \
     addr_t syscall_rsp;                                                    \
     addr_t rsp0;                                                           \
-    addr_t tss;
+    addr_t tss;                                                            \
+    struct VMSpace* vmspace; /* page tables currently loaded */
 
 #define PCPU_TYPE(x) __typeof(((struct PCPU*)0)->x)
 
@@ -8,8 +8,10 @@
 
 #define SMP_IPI_FIRST 0xf0
 #define SMP_IPI_COUNT 4
-#define SMP_IPI_PANIC 0xf0    /* IPI used to trigger panic situation on other CPU's */
-#define SMP_IPI_PERIODIC 0xf1 /* periodic cpu-local timer interrupt */
+#define SMP_IPI_PANIC 0xf0      /* IPI used to trigger panic situation on other CPU's */
+#define SMP_IPI_TIMER 0xf1      /* cpu-local one-shot timer interrupt */
+#define SMP_IPI_RESCHEDULE 0xf2 /* IPI used to make another CPU reschedule */
+#define SMP_IPI_SHOOTDOWN 0xf3  /* IPI used to invalidate TLB entries of other CPU's */
 
 #ifndef ASM
 
@@ -11,6 +11,8 @@
 #include <ananas/types.h>
 #include "kernel-md/frame.h"
 
+struct VMSpace;
+
 /* Details a 64-bit Task State Segment */
 struct TSS {
     uint32_t _reserved0;
@@ -81,7 +83,7 @@ static_assert(sizeof(FPUREGS) == 512);
     register_t md_rsp;                                      \
     register_t md_rsp0;                                     \
     register_t md_rip;                                      \
-    register_t md_cr3;                                      \
+    VMSpace* md_vmspace;                                    \
     Page* md_kstack_page;                                   \
     FPUREGS md_fpu_ctx __attribute__((aligned(16)));        \
     void* md_stack;                                         \
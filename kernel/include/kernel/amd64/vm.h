@@ -74,7 +74,8 @@
 #define PE_NX (1ULL << 63)
 
 /* Custom page entry flags */
-#define PE_C_G (1ULL << 9) /* avl bit 9: page has global mappings */
+#define PE_C_G (1ULL << 9)  /* avl bit 9: page has global mappings */
+#define PE_C_L (1ULL << 10) /* avl bit 10: permanent large page of the direct map */
 
 /* Segment Register privilege levels */
 #define SEG_DPL_SUPERVISOR 0 /* Descriptor Privilege Level (kernel) */
@@ -6,7 +6,19 @@
  */
 #pragma once
 
-#define MD_VMSPACE_FIELDS uint64_t* vs_md_pagedir;
+#include "kernel-md/cpuset.h"
+
+/*
+ * vs_md_active_cpus holds the CPU's which have the page tables loaded; they
+ * must be sent an IPI if a mapping changes. Any other CPU may still hold
+ * translations tagged with our PCID; these CPU's are listed in
+ * vs_md_stale_cpus and flush them once they load the page tables again.
+ */
+#define MD_VMSPACE_FIELDS              \
+    uint64_t* vs_md_pagedir;           \
+    uint16_t vs_md_pcid = 0;           \
+    md::smp::CPUSet vs_md_active_cpus; \
+    md::smp::CPUSet vs_md_stale_cpus;
 
 struct VMSpace;
 
@@ -53,11 +53,17 @@ typedef util::List<BIO, bio::internal::BIOChainNodeAccessor<BIO>> BIOChainList;
  * as there are different users. We have:
  *
  * [b] Buffer owner, whoever holds CFLAG_BUSY
- * [c] Cache lock, mtx_cache
+ * [h] Lock of the hash bucket the buffer is on
+ * [f] Freelist lock, mtx_freelist
+ * [d] Completion queue lock, spl_donelist
  * [o] Object mutex
+ *
+ * Bucket locks must be taken before the freelist lock. A buffer is only
+ * hashed if it has a device; b_device and b_block can only change while
+ * the buffer is busy and removed from its bucket.
  */
 struct BIO {
-    int b_cflags = 0;                       // [c] Flags, protected by mtx_cache
+    int b_cflags = 0;                       // [h] Flags, protected by the bucket lock
     int b_oflags = 0;                       // [o] Flags, protected by objlock
     Device* b_device = nullptr;             // [b] Device I/O'ing from
     blocknr_t b_block = 0;                  // [b] Block number to I/O
@@ -65,22 +71,41 @@ struct BIO {
     unsigned int b_length = 0;              // [b] Length in bytes
     void* b_data = nullptr;                 // [b] Pointer to BIO data */
     Result b_status = Result::Success();    // [b] Last status
+    tick_t b_dirtytime = 0;                 // [h] When the buffer became dirty
+    void (*b_iodone)(BIO&) = nullptr;       // [b] Called in thread context once async I/O is done
+    BIO* b_cluster = nullptr;               // [b] Next buffer in the same I/O request
     Mutex* b_objlock = nullptr;             // [o] Associated lock
     ConditionVariable b_cv_done{"biodone"}; // [o] Condition variable for done
-    ConditionVariable b_cv_busy{"biobusy"}; // [c] Condition variable for busy
+    ConditionVariable b_cv_busy{"biobusy"}; // [h] Condition variable for busy
 
-    util::List<BIO>::Node b_NodeBucket /* Bucket list */;
-    util::List<BIO>::Node b_NodeChain; /* Chain list */
+    util::List<BIO>::Node b_NodeBucket /* [h] Bucket list */;
+    util::List<BIO>::Node b_NodeChain; /* [f] Chain list, [d] once async I/O completed */
 
     void* Data() { return b_data; }
 
+    // Total length of the request this buffer heads
+    size_t GetClusterLength() const
+    {
+        size_t length = 0;
+        for (auto bio = this; bio != nullptr; bio = bio->b_cluster)
+            length += bio->b_length;
+        return length;
+    }
+
     void Release();    // brelse()
-    Result Write();    // brwrite()
+    Result Write();    // bdwrite(): mark dirty and release; errors are reported by bsync()
+    void WriteAsync(); // bawrite(): write, release once done
     Result Wait();     // biowait()
     void Done(Result); // biodone()
+
+    void StartWrite(bool async);
 };
 
 Result bread(Device* device, blocknr_t block, size_t len, BIO*& result);
-Result bwrite(BIO& bio);
+// Like bread(), but doesn't read the data; the caller must overwrite all of it
+Result bget(Device* device, blocknr_t block, size_t len, BIO*& result);
+Result bwrite(BIO& bio); // write, wait and release
+void breada(Device* device, blocknr_t block, size_t len, size_t count); // start reads only
 
-void bsync();
+// Writes back dirty buffers of 'device' (all devices if nullptr) and waits for them
+Result bsync(Device* device = nullptr);
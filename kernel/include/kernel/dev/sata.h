@@ -46,9 +46,9 @@ struct SATA_REQUEST {
         struct SATA_FIS_H2D fis_h2d;
     } sr_fis;
     unsigned int sr_fis_length; /* FIS length, in bytes */
-    uint16_t sr_count;          /* request length in bytes */
+    uint32_t sr_count;          /* request length in bytes */
     void* sr_buffer;            /* data buffer, if not NULL */
-    struct BIO* sr_bio;         /* associated I/O buffer, if not NULL */
+    struct BIO* sr_bio;         /* associated I/O buffer (or cluster), if not NULL */
     Semaphore* sr_semaphore;    /* Semaphore to signal on completion, if any */
     uint32_t sr_flags;
 #define SATA_REQUEST_FLAG_READ (1 << 0)  /* Read request */
@@ -8,6 +8,7 @@
 
 #include <ananas/types.h>
 #include <ananas/errno.h>
+#include <ananas/util/atomic.h>
 #include <ananas/util/list.h>
 #include "kernel/lock.h"
 #include "kernel/result.h"
@@ -103,6 +104,13 @@ class IBIODeviceOperations
   public:
     virtual void ReadBIO(struct BIO& bio) = 0;
     virtual void WriteBIO(struct BIO& bio) = 0;
+
+    /*
+     * Maximum length of a single request, in bytes. If non-zero, ReadBIO() and
+     * WriteBIO() may be given a cluster of buffers for consecutive blocks, chained
+     * using b_cluster; Done() must be called on the first buffer only.
+     */
+    virtual size_t GetMaximumTransferSize() { return 0; }
 };
 
 class IUSBDeviceOperations
@@ -178,6 +186,7 @@ class Device
     unsigned int d_Unit = -1;
     ResourceSet d_ResourceSet;
     dma::Tag* d_DMA_tag = nullptr;
+    util::atomic<unsigned int> d_WriteError{0}; // errno of a failed delayed write, if any
 
     Device(const Device&) = delete;
     Device& operator=(const Device&) = delete;
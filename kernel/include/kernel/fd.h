@@ -24,7 +24,7 @@ class Result;
 
 namespace net { struct LocalSocket; }
 
-struct FD : util::List<FD>::NodePtr {
+struct FD {
     int fd_type = 0;                      /* one of FD_TYPE_... */
     int fd_flags = 0;                     /* flags */
     Process* fd_process = nullptr;        /* owning process */
@@ -93,7 +93,6 @@ struct FDType : util::List<FDType>::NodePtr {
 
 namespace fd
 {
-    void Initialize();
     Result
     Allocate(int type, Process& proc, fdindex_t index_from, FD*& fd_out, fdindex_t& index_out);
     Result Lookup(Process& proc, fdindex_t index, int type, FD*& fd_out);
@@ -25,6 +25,9 @@ struct Page : util::List<Page>::NodePtr {
 
     /* Owning zone */
     PageZone* p_zone;
+
+    /* Allocator-specific owner of the page, i.e. the pool slab it belongs to */
+    void* p_owner;
 };
 
 typedef util::List<Page> PageList;
@@ -39,6 +42,9 @@ struct PageZone : util::List<PageZone>::NodePtr {
     /* Total number of pages */
     unsigned int z_num_pages;
 
+    /* Pages before this index do not exist; they only align the buddies */
+    unsigned int z_first_index;
+
     /* Available number of pages */
     unsigned int z_avail_pages;
 
@@ -56,13 +62,23 @@ typedef util::List<PageZone> PageZoneList;
 /* Add a chunk of memory to use for page allocation */
 void page_zone_add(addr_t base, size_t length);
 
-/* Allocates a block of 2^order pages */
-Page* page_alloc_order(int order);
+namespace page::flag
+{
+    inline constexpr auto Zero = (1 << 0); // Pages must be zero-filled
+    inline constexpr auto Try = (1 << 1);  // Fail rather than reclaim memory if nothing is free
+    inline constexpr auto NoSleep = (1 << 2); // Caller cannot sleep; never reclaim pool memory
+}
+
+/* Allocates a block of 2^order pages; flags are page::flag::... */
+Page* page_alloc_order(int order, int flags = 0);
 
 /* Allocates a single page */
-inline static Page* page_alloc_single() { return page_alloc_order(0); }
+inline static Page* page_alloc_single(int flags = 0) { return page_alloc_order(0, flags); }
 void page_free(Page& p);
 
+/* Turns an allocated block of 2^order pages into as many order-0 pages, to be freed one by one */
+void page_split(Page& p);
+
 /* Allocates 2^order pages and maps it to kernel memory using vm_flags */
 void* page_alloc_order_mapped(int order, Page*& p, int vm_flags);
 
@@ -78,5 +94,8 @@ struct Page* page_alloc_length(size_t length);
 /* Allocates enough pages to hold length bytes and maps it to kernel memory */
 void* page_alloc_length_mapped(size_t length, struct Page*& p, int vm_flags);
 
+/* Retrieves the page backing a physical address, or nullptr if it is not managed by us */
+Page* page_find(addr_t phys);
+
 /* Retrieve the page statistics */
 void page_get_stats(unsigned int* total_pages, unsigned int* avail_pages);
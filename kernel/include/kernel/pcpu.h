@@ -10,14 +10,24 @@
 #include "kernel-md/pcpu.h"
 
 struct Thread;
+namespace scheduler
+{
+    struct RunQueue;
+}
+namespace slab
+{
+    struct CPUCaches;
+}
 
 /* Per-CPU information pointer */
 struct PCPU {
-    MD_PCPU_FIELDS      /* Machine-dependant data */
-    uint32_t cpuid;     /* CPU ID */
-    Thread* curthread;  /* current thread */
-    Thread* idlethread; /* idle thread */
-    int nested_irq;     /* number of nested IRQ functions */
+    MD_PCPU_FIELDS                 /* Machine-dependant data */
+    uint32_t cpuid;                /* CPU ID */
+    Thread* curthread;             /* current thread */
+    Thread* idlethread;            /* idle thread */
+    int nested_irq;                /* number of nested IRQ functions */
+    scheduler::RunQueue* runqueue; /* runqueue of this CPU */
+    slab::CPUCaches* slabcaches;   /* kmalloc() magazines of this CPU */
 };
 
 /* Introduce a per-cpu structure */
@@ -7,31 +7,138 @@
 #pragma once
 
 #include <ananas/util/list.h>
+#include <machine/param.h>
 #include "kernel/lock.h"
+#include "kernel/mm.h"
 #include "kernel/page.h"
 
 namespace pool
 {
-    // Page-backed memory pool with elements of a fixed size
-    struct Pool final : util::List<Pool>::NodePtr
+    // Number of CPUs which get their own free list; any others use the slabs directly
+    inline constexpr size_t MaximumCPUs = 16;
+    // Number of items each per-CPU free list can hold
+    inline constexpr size_t CPUFreeListSize = 15;
+
+    /*
+     * Page-backed cache of items of a fixed size. Items are carved from slabs of
+     * one or more pages; each slab starts its items at a different cache line
+     * offset (colouring) so that items of different slabs do not all compete for
+     * the same cache lines.
+     *
+     * If a constructor is given, it is invoked once for every item when its slab
+     * is created and the destructor is invoked once the slab is given back to
+     * the page allocator: items must therefore be freed in their constructed
+     * state.
+     *
+     * Every CPU has a small free list which it allocates from and frees to
+     * without touching the pool mutex; only when it runs empty or full is a batch
+     * of items exchanged with the slabs. Empty slabs are kept around until
+     * Shrink() is called, which happens when we run out of memory.
+     */
+    class Pool : public util::List<Pool>::NodePtr
     {
-        Pool(const char*, size_t);
+      public:
+        using Hook = void (*)(void*);
+
+        Pool(
+            const char* name, size_t itemSize, size_t alignment = 0, Hook constructor = nullptr,
+            Hook destructor = nullptr);
         ~Pool();
+        Pool(const Pool&) = delete;
+        Pool& operator=(const Pool&) = delete;
 
-        struct Item : util::List<Item>::NodePtr
-        {
+        void* AllocateItem();
+        void FreeItem(void*);
+
+        // Frees all cached items and unused slabs; returns the number of pages freed
+        size_t Shrink();
+
+        void Dump();
+
+      private:
+        struct Item {
+            Item* i_next;
+        };
+
+        struct Slab : util::List<Slab>::NodePtr {
+            Pool* s_pool = nullptr;
+            Page* s_page = nullptr;
+            char* s_base = nullptr;  // First item
+            Item* s_free = nullptr;  // Available items
+            size_t s_inuse = 0;      // Number of items handed out
+        };
+        typedef util::List<Slab> SlabList;
+
+        // Slab administration is stored at the end of the slab itself
+        static constexpr size_t SlabHeaderSize = (sizeof(Slab) + 15) & ~15;
+
+        struct CPUFreeList {
+            Spinlock cf_lock;
+            unsigned int cf_count = 0;
+            void* cf_item[CPUFreeListSize];
         };
 
-        Mutex p_Mutex;
+        Item& GetLink(void* ptr) const
+        {
+            return *reinterpret_cast<Item*>(static_cast<char*>(ptr) + p_LinkOffset);
+        }
+        size_t GetSlabSize() const { return PAGE_SIZE << p_SlabOrder; }
+        size_t GetItemsPerSlab(unsigned int order) const
+        {
+            return ((PAGE_SIZE << order) - SlabHeaderSize) / p_Stride;
+        }
+        CPUFreeList* GetCPUFreeList();
+
+        void* AllocateFromSlab();
+        void FreeToSlab(void* ptr);
+        void CreateSlab();
+        size_t DestroySlab(Slab& slab);
+        void DrainCPUFreeLists();
+        void DetachEmptySlabs(SlabList& slabs);
+
+        friend size_t Reclaim();
+
+        Mutex p_Mutex{"pool"};
         char p_Name[16];
-        PageList p_AllocatedPages;
-        util::List<Item> p_AvailableItems;
-        const size_t p_ItemSize{};
+        const size_t p_ItemSize;
+        const Hook p_Constructor;
+        const Hook p_Destructor;
+        size_t p_Stride = 0;     // Distance between items
+        size_t p_LinkOffset = 0; // Offset of the free list link within a free item
+        size_t p_ColourStep = 0;
+        size_t p_MaximumColour = 0;
+        unsigned int p_SlabOrder = 0;
+        size_t p_ItemsPerSlab = 0;
 
-        void* AllocateItem();
-        void FreeItem(void*);
+        // Everything below is protected by p_Mutex
+        size_t p_NextColour = 0;
+        SlabList p_PartialSlabs;
+        SlabList p_FullSlabs;
+        SlabList p_EmptySlabs;
+        size_t p_NumSlabs = 0;
+        size_t p_ItemsInUse = 0; // Also counts items in per-CPU free lists
 
-    private:
-        void Grow();
+        CPUFreeList p_CPU[MaximumCPUs];
     };
-}
+
+    /*
+     * Pool of objects of type T; objects are default-constructed when their slab
+     * is created, so they must be handed back in that state.
+     */
+    template<typename T>
+    class ObjectPool final : public Pool
+    {
+      public:
+        ObjectPool(const char* name) : Pool(name, sizeof(T), alignof(T), &Construct, &Destruct) {}
+
+        T& Allocate() { return *static_cast<T*>(AllocateItem()); }
+        void Free(T& obj) { FreeItem(&obj); }
+
+      private:
+        static void Construct(void* ptr) { new (ptr) T; }
+        static void Destruct(void* ptr) { static_cast<T*>(ptr)->~T(); }
+    };
+
+    // Shrinks all pools which are not currently in use; returns the number of pages freed
+    size_t Reclaim();
+} // namespace pool
@@ -8,10 +8,12 @@
 
 #include <ananas/util/list.h>
 
+struct PCPU;
 struct Thread;
 
 namespace scheduler
 {
+    void InitCPU(PCPU& pcpu);
     void InitThread(Thread& t);
     void ResumeThread(Thread& t);
     void SuspendThread(Thread& t);
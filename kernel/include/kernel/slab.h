@@ -0,0 +1,26 @@
+/*-
+ * SPDX-License-Identifier: Zlib
+ *
+ * Copyright (c) 2009-2018 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <ananas/types.h>
+
+struct PCPU;
+
+namespace slab
+{
+    struct CPUCaches;
+
+    // Allocates/frees kernel memory; used to implement kmalloc() and kfree()
+    void* Allocate(size_t len);
+    void Free(void* ptr);
+
+    // Sets up the caches; must be called before anything is allocated
+    void Initialize();
+
+    // Sets up the per-CPU magazines; until this is called, the CPU uses the slabs directly
+    void InitCPU(PCPU& pcpu);
+} // namespace slab
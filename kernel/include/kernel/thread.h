@@ -7,6 +7,7 @@
 #pragma once
 
 #include <ananas/types.h>
+#include <ananas/util/atomic.h>
 #include <ananas/util/list.h>
 #include "kernel/page.h"
 #include "kernel/schedule.h"
@@ -50,10 +51,11 @@ struct Thread {
 
     refcount_t t_refcount{}; /* Reference count of the thread, >0 */
 
-    // Scheduler flags are protected by sched_lock
-    unsigned int t_sched_flags{};
+    // Scheduler flags are atomic as they are changed under different runqueue locks
+    util::atomic<unsigned int> t_sched_flags{};
 #define THREAD_SCHED_ACTIVE 0x0001    /* Thread is active on some CPU (curthread==this) */
 #define THREAD_SCHED_SUSPENDED 0x0002 /* Thread is currently suspended */
+#define THREAD_SCHED_QUEUED 0x0004    /* Thread is on a runqueue */
 
     unsigned int t_flags{};
 #define THREAD_FLAG_ZOMBIE 0x0004     /* Thread has no more resources */
@@ -76,6 +78,8 @@ struct Thread {
 #define THREAD_PRIORITY_IDLE 255
     int t_affinity{}; /* thread CPU */
 #define THREAD_AFFINITY_ANY -1
+    int t_sched_cpu{};  /* CPU whose timer wheel holds the thread */
+    int t_sched_slot{}; /* timer wheel slot holding the thread */
 
     util::List<Thread>::Node t_NodeAllThreads;
     util::List<Thread>::Node t_NodeSchedulerList;
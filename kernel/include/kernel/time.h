@@ -25,14 +25,25 @@ struct tm {
     int tm_isdst;
 };
 
+struct Page;
+
 void delay(int ms);
 
 namespace time
 {
+    /*
+     * Ticks are the unit in which timeouts are expressed; they are derived from
+     * the high-resolution clock and need not correspond to timer interrupts.
+     */
     unsigned int GetPeriodicyInHz();
 
-    void OnTick();
     tick_t GetTicks();
+    uint64_t GetNanosecondsSinceBoot();
+
+    inline uint64_t TicksToNanoseconds(tick_t t)
+    {
+        return t * (1'000'000'000 / GetPeriodicyInHz());
+    }
 
     /*
      * Tick counter comparison functions.
@@ -41,8 +52,21 @@ namespace time
 
     inline bool IsTickAfter(tick_t a, tick_t b) { return IsTickBefore(b, a); }
 
+    void InitializeClock();
+
+    // Sets up the page that allows userland to read the clock; see <ananas/clockpage.h>
+    void InitializeClockPage();
+    Page& GetClockPage();
+
     void SetTime(const struct tm& tm);
     void SetTime(const struct timespec& ts);
+
+    /*
+     * Synchronises the clock with an external reference, which must be the time
+     * at this very moment; repeated calls are used to correct the clock rate.
+     */
+    void Synchronize(const struct tm& tm);
+
     struct timespec GetTime();
     struct timespec GetTimeSinceBoot();
 
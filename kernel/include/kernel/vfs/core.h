@@ -30,6 +30,18 @@ Result vfs_get_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, INode*& destinode);
  */
 Result vfs_bread(struct VFS_MOUNTED_FS* fs, blocknr_t block, struct BIO** bio);
 
+/*
+ * Retrieves a given block for the given filesystem to a bio without reading
+ * it; for blocks whose contents are to be replaced entirely.
+ */
+Result vfs_bget(struct VFS_MOUNTED_FS* fs, blocknr_t block, struct BIO** bio);
+
+/*
+ * Starts reading 'count' consecutive blocks for the given filesystem, without
+ * waiting for them.
+ */
+void vfs_breada(struct VFS_MOUNTED_FS* fs, blocknr_t block, size_t count);
+
 #define VFS_LOOKUP_FLAG_DEFAULT 0
 #define VFS_LOOKUP_FLAG_NO_FOLLOW 1
 Result vfs_lookup(
@@ -6,6 +6,7 @@
  */
 #pragma once
 
+#include <ananas/util/atomic.h>
 #include <ananas/util/list.h>
 #include <ananas/types.h>
 
@@ -14,14 +15,25 @@
 struct VFS_MOUNTED_FS;
 struct INode;
 
+/*
+ * Directory entries are hashed on (d_parent, d_hash) by the dentry cache;
+ * unreferenced entries remain hashed and are kept on a LRU list using the
+ * NodePtr. A cached entry holds a reference to its parent.
+ *
+ * An entry without inode that isn't negative is pending: its lookup is in
+ * progress. Only the dcache_set_...() functions may change this state.
+ */
 struct DEntry : util::List<DEntry>::NodePtr {
-    refcount_t d_refcount{}; /* Reference count, >0 */
+    util::atomic<refcount_t> d_refcount{}; /* Reference count */
     struct VFS_MOUNTED_FS* d_fs = nullptr;
     DEntry* d_parent = nullptr;             /* Parent directory entry */
     INode* d_inode = nullptr;               /* Backing entry inode, or NULL */
     uint32_t d_flags = 0;                   /* Item flags */
 #define DENTRY_FLAG_NEGATIVE 0x0001         /* Negative entry; does not exist */
 #define DENTRY_FLAG_ROOT 0x0002             /* Root dentry; must not be removed */
+    uint32_t d_hash = 0;                    /* Hash of d_entry */
+    util::List<DEntry>* d_lru = nullptr;    /* LRU list the entry is on, if any */
+    util::List<DEntry>::Node d_NodeBucket;  /* Hash bucket list */
     char d_entry[DCACHE_MAX_NAME_LEN] = {}; /* Entry name */
 };
 
@@ -32,13 +44,19 @@ DEntry* dcache_lookup(DEntry& parent, const char* entry);
 void dcache_purge_old_entries();
 void dcache_set_inode(DEntry& de, INode& inode);
 
+/* Marks a dentry as negative, waking up anyone waiting for it */
+void dcache_set_negative(DEntry& de);
+
+/* Marks a negative dentry as pending; used while the entry is being created */
+void dcache_set_pending(DEntry& de);
+
 /* Adds a reference to dentry d */
 void dentry_ref(DEntry& d);
 
-/* Removes a reference from d; cleans up the item when out of references */
+/* Removes a reference from d; the item stays cached until it is recycled */
 void dentry_deref(DEntry& d);
 
-/* Purges an entry from the cache; used when the dentry name is unlinked from the filesystem */
+/* Makes an entry negative; used when the dentry name is unlinked from the filesystem */
 void dentry_unlink(DEntry& d);
 
 /* Creates the full path to a dentry - it is always zero-terminated */
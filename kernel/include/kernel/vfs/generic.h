@@ -7,10 +7,39 @@
 #pragma once
 
 struct DEntry;
+struct DirectoryIndex;
 struct INode;
 class Result;
 
 Result vfs_generic_lookup(DEntry& dirinode, INode*& destinode, const char* dentry);
+
+/*
+ * Like vfs_generic_lookup(), but builds an in-memory index of the directory's
+ * names during the first scan, which is used for any lookups that follow. This
+ * is only suitable for filesystems whose directories are solely changed using
+ * create, unlink and rename, as these keep the index up to date.
+ */
+Result vfs_generic_lookup_indexed(DEntry& dirinode, INode*& destinode, const char* dentry);
+
+/*
+ * Takes the name index away from a directory that is about to be changed, so
+ * that lookups scan the directory meanwhile; the index, if any, is returned.
+ */
+DirectoryIndex* vfs_begin_directory_change(INode& inode);
+
+/*
+ * Puts the index obtained using vfs_begin_directory_change() back, with
+ * 'removed_name' removed from and 'added_name' added to it (either may be
+ * nullptr). The index is thrown away if the change failed or the directory
+ * was changed by someone else meanwhile.
+ */
+void vfs_end_directory_change(
+    INode& inode, DirectoryIndex* index, bool changed, const char* removed_name,
+    const char* added_name, ino_t added_inum);
+
+/* Frees the name index of an inode which is locked and about to be discarded */
+void vfs_discard_directory_index(INode& inode);
+
 Result vfs_generic_read(struct VFS_FILE* file, void* buf, size_t len);
 Result vfs_generic_write(struct VFS_FILE* file, const void* buf, size_t len);
 Result vfs_generic_follow_link(INode& inode, DEntry& base, DEntry*& result);
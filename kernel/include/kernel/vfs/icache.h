@@ -28,5 +28,11 @@ void vfs_ref_inode(INode& inode);
 /* Marks an inode as dirty; will trigger the filesystem's 'write_inode' function */
 void vfs_set_inode_dirty(INode& inode);
 
+/*
+ * Throws away the cached pages of an inode whose contents are gone; the
+ * caller must hold the only reference.
+ */
+void vfs_drop_inode_pages(INode& inode);
+
 /* Internal interface only */
 void vfs_dump_inode(INode& inode);
@@ -8,6 +8,7 @@
 
 #include <ananas/stat.h> /* for 'struct stat' */
 #include <ananas/dirent.h>
+#include <ananas/util/radix_tree.h>
 #include <ananas/util/vector.h>
 #include "kernel/list.h"
 #include "kernel/lock.h"
@@ -15,6 +16,7 @@
 
 class Device;
 struct DEntry;
+struct DirectoryIndex;
 struct Process;
 struct VFS_MOUNTED_FS;
 struct VFS_INODE_OPS;
@@ -25,6 +27,9 @@ class Result;
  * This is our defacto inode; it must be locked before any fields can be
  * updated. The refcount protects the inode from disappearing while it is still
  * being used.
+ *
+ * Inodes are hashed on (i_fs, i_inum) by the inode cache; unreferenced inodes
+ * are kept on the cache's LRU list using the NodePtr, until they are evicted.
  */
 struct INode : util::List<INode>::NodePtr {
     refcount_t i_refcount;          /* Refcount, must be >=0 */
@@ -39,7 +44,12 @@ struct INode : util::List<INode>::NodePtr {
     void* i_privdata;            /* Filesystem-specific data */
     ino_t i_inum;                /* Inode number */
 
-    util::vector<VMPage*> i_pages; // Backing VM pages, if any
+    util::radix_tree<VMPage> i_pages; // Backing VM pages by page index, if any
+
+    util::List<INode>::Node i_NodeBucket; // Inode cache bucket list
+
+    DirectoryIndex* i_dirindex = nullptr; // Name index of the directory, if built
+    unsigned int i_dirindex_gen = 0;      // Incremented whenever the index is invalidated
 
     void Lock() { i_mutex.Lock(); }
 
@@ -62,6 +72,12 @@ struct VFS_FILE {
      */
     DEntry* f_dentry;
     Device* f_device;
+
+    /* Read-ahead state, in filesystem blocks */
+    int f_advice;           /* POSIX_FADV_... */
+    blocknr_t f_ra_next;    /* Block we expect the next sequential read to start at */
+    blocknr_t f_ra_ahead;   /* First block not yet read ahead */
+    unsigned int f_ra_size; /* Current read-ahead window */
 };
 
 /*
@@ -111,9 +127,9 @@ struct VFS_FILESYSTEM_OPS {
     void (*discard_inode)(INode& inode);
 
     /*
-     * Read an inode from disk; inode is locked and pre-allocated using
-     * alloc_inode().  The 'fs' field of the inode is guaranteed to be
-     * filled out.
+     * Read an inode from disk; inode is pre-allocated using alloc_inode()
+     * and is pending, so nobody else will touch it (it is not locked). The
+     * 'fs' field of the inode is guaranteed to be filled out.
      */
     Result (*read_inode)(INode& inode, ino_t num);
 
@@ -121,6 +137,13 @@ struct VFS_FILESYSTEM_OPS {
      * Writes an inode back to disk; inode is locked.
      */
     Result (*write_inode)(INode& inode);
+
+    /*
+     * Called when the final reference to an inode is about to be dropped; the
+     * inode is not locked. Can be used to release inodes which have no links
+     * left. Optional.
+     */
+    void (*release_inode)(INode& inode);
 };
 
 struct VFS_INODE_OPS {
@@ -19,6 +19,12 @@ namespace vmpage::flag {
     inline constexpr auto Promoted = (1 << 1); // Page is writable (used for COW)
 }
 
+// Tags of pages in the inode page cache
+namespace vmpage::tag {
+    inline constexpr unsigned int Dirty = 0;   // Page must be written back
+    inline constexpr unsigned int Pending = 1; // Page is pending a read
+}
+
 class VMArea;
 class VMSpace;
 struct INode;
@@ -34,6 +40,10 @@ struct VMPage final {
     {
     }
 
+    // VMPage's are allocated from their own pool
+    static void* operator new(size_t len);
+    static void operator delete(void* ptr);
+
     int vp_flags;
     Page* vp_page = nullptr; // backing page
     const off_t vp_offset{}; // offset within inode
@@ -76,7 +86,6 @@ struct VMPage final {
     void AssertLocked();
 
     void Map(VMSpace&, VMArea&, addr_t virt);
-    void Zero(VMSpace&, VMArea&, addr_t virt);
     void Dump(const char* prefix) const;
 
     VMPage& Clone(VMSpace&, VMArea& va_source, addr_t virt);
@@ -91,7 +100,12 @@ struct VMPage final {
 
 namespace vmpage
 {
-    VMPage& Allocate(int flags);
+    // page_flags are passed to the page allocator, i.e. page::flag::Zero for a zeroed page
+    VMPage& Allocate(int flags, int page_flags = 0);
+    // Takes over a page that has already been allocated
+    VMPage& Allocate(int flags, Page& page);
 
     util::locked<VMPage> LookupOrCreateINodePage(INode& inode, off_t offs, int flags);
+    // Must be called once a page created as pending has been filled
+    void MarkINodePageFilled(INode& inode, VMPage& vp);
 }
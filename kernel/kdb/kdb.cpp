@@ -297,7 +297,7 @@ namespace kdb
             return;
 
         /* Kill interrupts */
-        int ints = md::interrupts::SaveAndDisable();
+        register_t ints = md::interrupts::SaveAndDisable();
 
         // XXX We can't recover from this - so we can't ever leave the debugger...
         smp::PanicOthers();
@@ -11,9 +11,22 @@
  * in "The Design Of The Unix Operating System" by Maurice J. Bach.
  *
  * A few things to note:
- * - BIO's are always in a bucket queue, and may or may not be on the freelist
- *   (this is in line with [Bach])
- * - There are three locks (details are in the header file)
+ * - BIO's are hashed on (device, block) into a bucket queue once they hold a
+ *   block, and may or may not be on the freelist (this is in line with [Bach])
+ * - Every bucket has its own lock, so lookups of unrelated blocks do not
+ *   contend; the freelist has a lock of its own (details are in the header file)
+ * - The number of buffers grows on demand, up to a limit derived from the
+ *   amount of memory available when we start
+ * - Writes are delayed: BIO::Write() only marks the buffer as dirty, and dirty
+ *   buffers are kept on a list of their own until the flusher thread writes
+ *   them back in block order, or we run out of clean buffers
+ * - Errors writing back delayed writes are latched on the device, and are
+ *   reported by the next bsync() of that device (which is what fsync() uses)
+ * - Asynchronous I/O completes in interrupt context, where we cannot take the
+ *   sleeping locks needed to release a buffer; such buffers are queued and
+ *   handed to the biodone thread instead
+ * - Write-back and read-ahead merge buffers of consecutive blocks into a single
+ *   request (a cluster, chained using b_cluster) if the device supports it
  * - b_objlock is intended to become the INode lock
  *   Currently, this is yet to be implemented
  * - We do not have a relation to INode's yet
@@ -25,46 +38,99 @@
 #include "kernel/lib.h"
 #include "kernel/lock.h"
 #include "kernel/mm.h"
+#include "kernel/page.h"
 #include "kernel/pool.h"
 #include "kernel/result.h"
 #include "kernel/thread.h"
+#include "kernel/time.h"
 #include "kernel/vfs/types.h"
 #include <ananas/util/array.h>
+#include <ananas/util/atomic.h>
 
 namespace
 {
-    // Number of buckets used to hash a block number to
-    constexpr int NumberOfBuckets = 16;
+    // Number of BIO pools, from BIO_SECTOR_SIZE upwards (512, 1024, 2048, 4096 bytes)
+    inline constexpr auto NumberOfPools = 4;
+
+    // Part of the available memory the cache may use for buffers
+    constexpr size_t MemoryFractionForCache = 8;
+    // Buffer size used to determine how many buffers fit in that part
+    constexpr size_t TypicalBufferSize = BIO_SECTOR_SIZE * 2;
+
+    // Limits on the number of BIO buffers
+    constexpr size_t MinimumNumberOfBuffers = 256;
+    constexpr size_t MaximumNumberOfBuffers = 65536;
+
+    // Number of BIO buffers allocated at once once we run out
+    constexpr size_t BuffersPerChunk = 256;
+
+    // Average number of buffers per bucket we aim for once all buffers are in use
+    constexpr size_t BuffersPerBucket = 4;
+
+    // Number of object locks; buffers are spread over these
+    constexpr size_t NumberOfObjectLocks = 32;
+
+    // Time a buffer may stay dirty before the flusher writes it back
+    constexpr unsigned int WritebackDelayInMs = 5000;
+    // Interval at which the flusher looks for buffers to write back
+    constexpr unsigned int FlushIntervalInMs = 1000;
+    // Maximum number of buffers we write back in a single go
+    constexpr size_t MaximumFlushBatch = 128;
+
+    struct Bucket {
+        Mutex bu_mutex{"biobucket"};
+        BIOBucketList bu_bios;
+    };
+
+    Bucket* bio_bucket;
+    unsigned int bucketShift; // log2 of the number of buckets
+    size_t numberOfBuckets;
+
+    Mutex mtx_freelist{"biofree"};
+    BIOChainList bio_freelist;        // [f] clean buffers, least recently used first
+    BIOChainList bio_dirtylist;       // [f] dirty buffers that are not busy
+    size_t numberOfBuffers = 0;       // [f]
+    size_t numberOfDirtyBuffers = 0;  // [f]
+    size_t maxNumberOfBuffers = 0; // fixed after initialization
 
-    // Number of BIO buffers available
-    constexpr int NumberOfBuffers = 1024;
-
-    // Number of BIO pools, from BIO_SECTOR_SIZE upwards
-    inline constexpr auto NumberOfPools = 2;
-
-    constexpr unsigned int BucketForBlock(blocknr_t block) { return block % NumberOfBuckets; }
-
-    constexpr unsigned int BucketForBIO(const BIO& bio) { return BucketForBlock(bio.b_block); }
-
-    BIOChainList bio_freelist;
     util::array<pool::Pool*, NumberOfPools> bio_pool;
-    util::array<BIOBucketList, NumberOfBuckets> bio_bucket;
-
-    Mutex mtx_cache{"biocache"};
-    Mutex mtx_buffer{"biobuf"};
+    util::array<Mutex*, NumberOfObjectLocks> mtx_buffer;
 
     ConditionVariable cv_buffer_needed{"bioneeded"};
 
+    Spinlock spl_donelist;
+    BIOChainList bio_donelist; // [d] buffers whose asynchronous I/O completed
+    Semaphore sem_done{"biodone", 0};
+    Thread* doneThread;
+
+    namespace stats
+    {
+        util::atomic<uint64_t> hits;
+        util::atomic<uint64_t> misses;
+        util::atomic<uint64_t> busyWaits;
+        util::atomic<uint64_t> lostRaces;
+        util::atomic<uint64_t> delayedWrites;
+        util::atomic<uint64_t> writebacks;
+        util::atomic<uint64_t> readAheads;
+        util::atomic<uint64_t> clustered;
+    } // namespace stats
+
+    Thread* flusherThread;
+
     namespace cflag
     {
         constexpr int Busy = (1 << 0);    // Also known as locked
         constexpr int Invalid = (1 << 1); // Data is invalid
+        constexpr int Dirty = (1 << 2);   // Data must be written back
     }                                     // namespace cflag
 
     namespace oflag
     {
-        constexpr int Done(1 << 0); // I/O completed
-    }
+        constexpr int Done(1 << 0);  // I/O completed
+        constexpr int Async(1 << 1); // Release once the I/O completes
+    }                                // namespace oflag
+
+    size_t FlushDirtyBuffers(bool all);
 
     constexpr auto Calculate2Log(size_t n)
     {
@@ -77,6 +143,16 @@ namespace
 
     constexpr auto bioSectorSize2log = Calculate2Log(BIO_SECTOR_SIZE);
 
+    // Fibonacci hashing; the top bits are the best mixed
+    Bucket& BucketForBlock(const Device* device, blocknr_t block)
+    {
+        const uint64_t key = block ^ (reinterpret_cast<uintptr_t>(device) >> 4);
+        return bio_bucket[(key * 0x9e3779b97f4a7c15ULL) >> (64 - bucketShift)];
+    }
+
+    // Only valid for buffers that are hashed, i.e. which have a device
+    Bucket& BucketForBIO(const BIO& bio) { return BucketForBlock(bio.b_device, bio.b_block); }
+
     auto& GetPoolForLength(size_t len)
     {
         size_t index = Calculate2Log(len);
@@ -86,19 +162,17 @@ namespace
         return *bio_pool[index];
     }
 
-    bool AllocateData(BIO& bio, size_t len)
+    // Must be called by the buffer owner
+    void AllocateData(BIO& bio, size_t len)
     {
-        mtx_cache.AssertLocked();
-
         auto& pool = GetPoolForLength(len);
         bio.b_data = pool.AllocateItem();
         bio.b_length = len;
-        return true;
     }
 
+    // Must be called by the buffer owner
     void FreeData(BIO& bio)
     {
-        mtx_cache.AssertLocked();
         if (bio.b_data == nullptr)
             return; // already freed
 
@@ -108,58 +182,99 @@ namespace
         bio.b_length = 0;
     }
 
-    BIO* GetNewBuffer()
+    // Must be called with mtx_freelist held
+    bool GrowBuffers()
     {
-        mtx_cache.AssertLocked();
-
-        if (bio_freelist.empty())
-            return nullptr;
-
-        auto& bio = bio_freelist.front();
-        bio_freelist.pop_front();
-
-        bio.b_cflags = cflag::Busy;
-        bio.b_oflags = 0;
-        bio.b_status = Result::Success();
-        bio.b_objlock = &mtx_buffer;
-        return &bio;
+        mtx_freelist.AssertLocked();
+        if (numberOfBuffers >= maxNumberOfBuffers)
+            return false;
+
+        auto bios = new BIO[BuffersPerChunk];
+        for (size_t n = 0; n < BuffersPerChunk; ++n) {
+            auto& bio = bios[n];
+            bio.b_objlock = mtx_buffer[(numberOfBuffers + n) % NumberOfObjectLocks];
+            bio_freelist.push_back(bio);
+        }
+        numberOfBuffers += BuffersPerChunk;
+        return true;
     }
 
-    void CleanupBIO(BIO& bio)
+    /*
+     * Claims a buffer from the freelist and removes it from its bucket; the
+     * result is busy and not hashed. The freelist lock is taken after bucket
+     * locks, so we can only try to lock the bucket of a candidate here.
+     */
+    BIO& GetNewBuffer()
     {
-        mtx_cache.AssertLocked();
-
-        FreeData(bio);
-        bio.b_cflags |= cflag::Busy | cflag::Invalid;
-        mtx_cache.Unlock();
-        bio.Release();
-        mtx_cache.Lock();
-    }
+        MutexGuard g(mtx_freelist);
+        while (true) {
+            Bucket* contendedBucket = nullptr;
+            for (auto& bio : bio_freelist) {
+                Bucket* bucket = nullptr;
+                if (bio.b_device != nullptr) {
+                    bucket = &BucketForBIO(bio);
+                    if (!bucket->bu_mutex.TryLock()) {
+                        if (contendedBucket == nullptr)
+                            contendedBucket = bucket;
+                        continue;
+                    }
+                }
+                KASSERT((bio.b_cflags & cflag::Busy) == 0, "busy bio %p on freelist", &bio);
+
+                bio_freelist.remove(bio);
+                if (bucket != nullptr) {
+                    bucket->bu_bios.remove(bio);
+                    bucket->bu_mutex.Unlock();
+                }
+
+                bio.b_cflags = cflag::Busy;
+                bio.b_oflags = 0;
+                bio.b_status = Result::Success();
+                bio.b_device = nullptr;
+                return bio;
+            }
 
-    void CleanupBuffers()
-    {
-        mtx_cache.AssertLocked();
+            if (contendedBucket != nullptr) {
+                // All candidates were in use; wait for one of them and try again
+                mtx_freelist.Unlock();
+                contendedBucket->bu_mutex.Lock();
+                contendedBucket->bu_mutex.Unlock();
+                mtx_freelist.Lock();
+                continue;
+            }
 
-        // Grab the first thing from the free list that contains data
-        for (auto& bio : bio_freelist) {
-            if (bio.b_data == nullptr) {
+            if (GrowBuffers())
                 continue;
+
+            if (numberOfDirtyBuffers > 0) {
+                // Everything is dirty; start writing back so that buffers will become clean
+                mtx_freelist.Unlock();
+                const auto numFlushed = FlushDirtyBuffers(true);
+                mtx_freelist.Lock();
+                if (numFlushed > 0)
+                    continue; // rescan; writes may have completed already
             }
 
-            bio_freelist.remove(bio);
-            CleanupBIO(bio);
-            return;
+            // No bio's available; wait until anything becomes free XXX timeout?
+            cv_buffer_needed.Wait(mtx_freelist);
         }
-        kprintf("CleanupBIO: nothing to clean\n");
     }
 
-    BIO* incore(Device* device, blocknr_t block)
+    // Places a buffer that is not hashed back on the freelist
+    void ReleaseUnhashed(BIO& bio)
     {
-        mtx_cache.AssertLocked();
+        MutexGuard g(mtx_freelist);
+        bio.b_cflags = cflag::Invalid;
+        bio_freelist.push_front(bio);
+        cv_buffer_needed.Signal();
+    }
+
+    BIO* incore(Bucket& bucket, Device* device, blocknr_t block)
+    {
+        bucket.bu_mutex.AssertLocked();
 
         // See if we can find the block in the bucket queue; if so, we can just return it
-        auto& bucket = bio_bucket[BucketForBlock(block)];
-        for (auto& bio : bucket) {
+        for (auto& bio : bucket.bu_bios) {
             if (bio.b_device != device || bio.b_block != block)
                 continue;
 
@@ -172,6 +287,39 @@ namespace
         return nullptr;
     }
 
+    /*
+     * Obtains a new busy buffer for the given device/block and adds it to the
+     * bucket. Returns nullptr if the block was added by someone else in the
+     * meantime. Must be called without holding the bucket lock.
+     */
+    BIO* HashNewBuffer(Bucket& bucket, Device* device, blocknr_t block, size_t len)
+    {
+        BIO& bio = GetNewBuffer();
+
+        // Arrange storage
+        if (bio.b_data == nullptr || bio.b_length != len) {
+            FreeData(bio);
+            AllocateData(bio, len);
+        }
+
+        MutexGuard g(bucket.bu_mutex);
+        if (incore(bucket, device, block) != nullptr) {
+            ++stats::lostRaces;
+            ReleaseUnhashed(bio);
+            return nullptr;
+        }
+
+        // Set up the bio; flags are filled out by GetNewBuffer()
+        bio.b_device = device;
+        bio.b_block = block;
+        bio.b_ioblock = block;
+        // bio.b_length is filled out by AllocateData()
+
+        // Put buffer on corresponding queue
+        bucket.bu_bios.push_front(bio);
+        return &bio;
+    }
+
     /*
      * Return a given bio buffer. This will use any cached item if possible, or
      * allocate a new one as required (Bach, p44). The resulting BIO is always
@@ -181,9 +329,11 @@ namespace
     {
         KASSERT((len % BIO_SECTOR_SIZE) == 0, "length %u not a multiple of bio sector size", len);
 
-        mtx_cache.Lock();
+        auto& bucket = BucketForBlock(device, block);
+        bucket.bu_mutex.Lock();
+        bool counted = false;
     bio_restart:
-        if (auto bio = incore(device, block); bio != nullptr) {
+        if (auto bio = incore(bucket, device, block); bio != nullptr) {
             // Block found in the cache
             KASSERT(
                 bio->b_length == len, "bio item found with length %u, requested length %u",
@@ -192,49 +342,39 @@ namespace
 
             if (bio->b_cflags & cflag::Busy) {
                 // Bio is busy - wait until the owner calls Release()
-                bio->b_cv_busy.Wait(mtx_cache);
+                ++stats::busyWaits;
+                bio->b_cv_busy.Wait(bucket.bu_mutex);
                 goto bio_restart;
             }
             bio->b_cflags |= cflag::Busy;
+            if (!counted)
+                ++stats::hits;
 
-            // The bio was not busy, so it must be on the freelist - claim it
+            // The bio was not busy, so it must be on the freelist or dirty list - claim it
             // from there so that active bio's are never freed
-            bio_freelist.remove(*bio);
-            mtx_cache.Unlock();
-            return *bio;
-        }
-
-        // Block is not on the bucket queue
-        BIO* newBio = GetNewBuffer();
-        if (newBio == nullptr) {
-            // No bio's available; wait until anything becomes free XXX timeout?
-            cv_buffer_needed.Wait(mtx_cache);
-            goto bio_restart;
-        }
-        BIO& bio = *newBio;
-
-        // Remove buffer from old queue
-        bio_bucket[BucketForBIO(bio)].remove(bio);
-
-        // Arrange storage
-        if (bio.b_data == nullptr || bio.b_length != len) {
-            FreeData(bio);
-            while (!AllocateData(bio, len)) {
-                // Out of data buffers; make room and retry
-                CleanupBuffers();
+            {
+                MutexGuard g(mtx_freelist);
+                if (bio->b_cflags & cflag::Dirty) {
+                    bio_dirtylist.remove(*bio);
+                    --numberOfDirtyBuffers;
+                } else {
+                    bio_freelist.remove(*bio);
+                }
             }
+            bucket.bu_mutex.Unlock();
+            return *bio;
         }
 
-        // Set up the bio; flags are filled out by GetNewBuffer()
-        bio.b_device = device;
-        bio.b_block = block;
-        bio.b_ioblock = block;
-        // bio.b_length is filled out by AllocateData()
+        // Block is not on the bucket queue; get a new buffer without holding our bucket lock
+        ++stats::misses;
+        counted = true;
+        bucket.bu_mutex.Unlock();
+        if (auto bio = HashNewBuffer(bucket, device, block, len); bio != nullptr)
+            return *bio;
 
-        // Put buffer on corresponding queue
-        bio_bucket[BucketForBIO(bio)].push_front(bio);
-        mtx_cache.Unlock();
-        return bio;
+        // Someone else added the block while we were unlocked; use theirs
+        bucket.bu_mutex.Lock();
+        goto bio_restart;
     }
 
 } // unnamed namespace
@@ -246,20 +386,36 @@ const init::OnInit initBIO(init::SubSystem::BIO, init::Order::First, []() {
         for(size_t n = 0; n < NumberOfPools; ++n) {
             char name[32];
             sprintf(name, "bio%db", poolSize);
-            bio_pool[n] = new pool::Pool(name, poolSize);
+            // Align buffers to their size so that they never straddle a page
+            bio_pool[n] = new pool::Pool(name, poolSize, poolSize);
             poolSize *= 2;
         }
     }
 
-    // Initialize bio buffers and hook them up to the freelist/queue
+    for (auto& mtx : mtx_buffer)
+        mtx = new Mutex("biobuf");
+
+    // Size the cache based on the memory we have
     {
-        struct BIO* bios = new BIO[NumberOfBuffers];
-        for (unsigned int i = 0; i < NumberOfBuffers; i++, bios++) {
-            BIO& bio = *bios;
-            bio_freelist.push_back(bio);
-            bio_bucket[BucketForBIO(bio)].push_back(bio);
-        }
+        unsigned int totalPages, availPages;
+        page_get_stats(&totalPages, &availPages);
+        size_t n = (static_cast<size_t>(availPages) * PAGE_SIZE / MemoryFractionForCache) /
+                   TypicalBufferSize;
+        if (n < MinimumNumberOfBuffers)
+            n = MinimumNumberOfBuffers;
+        if (n > MaximumNumberOfBuffers)
+            n = MaximumNumberOfBuffers;
+        maxNumberOfBuffers = n;
+
+        bucketShift = 1;
+        while ((size_t(1) << bucketShift) * BuffersPerBucket < maxNumberOfBuffers)
+            ++bucketShift;
+        numberOfBuckets = size_t(1) << bucketShift;
+        bio_bucket = new Bucket[numberOfBuckets];
     }
+
+    MutexGuard g(mtx_freelist);
+    GrowBuffers();
 });
 
 Result BIO::Wait()
@@ -281,19 +437,32 @@ void BIO::Release()
 {
     KASSERT((b_cflags & cflag::Busy) != 0, "release on non-busy bio %p", this);
 
-    // Wake up event: waiting for any buffer to become free
-    cv_buffer_needed.Signal();
+    if (b_device == nullptr) {
+        // Not hashed, so nobody can be waiting for this specific buffer
+        ReleaseUnhashed(*this);
+        return;
+    }
 
-    // If the I/O operation failed, mark the data as invalid
+    auto& bucket = BucketForBIO(*this);
     {
-        MutexGuard g(mtx_cache);
+        MutexGuard g(bucket.bu_mutex);
+        // If the I/O operation failed, mark the data as invalid
         if (b_status.IsFailure())
             b_cflags |= cflag::Invalid;
 
-        if (b_cflags & cflag::Invalid) {
-            bio_freelist.push_front(*this);
-        } else {
-            bio_freelist.push_back(*this);
+        {
+            MutexGuard fg(mtx_freelist);
+            if (b_cflags & cflag::Invalid) {
+                b_cflags &= ~cflag::Dirty; // nothing sensible to write back
+                bio_freelist.push_front(*this);
+            } else if (b_cflags & cflag::Dirty) {
+                bio_dirtylist.push_back(*this);
+                ++numberOfDirtyBuffers;
+            } else {
+                bio_freelist.push_back(*this);
+            }
+            // Wake up event: waiting for any buffer to become free
+            cv_buffer_needed.Signal();
         }
         b_cflags &= ~cflag::Busy;
     }
@@ -317,46 +486,400 @@ Result bread(Device* device, blocknr_t block, size_t len, BIO*& result)
     return bio.b_status;
 }
 
+Result bget(Device* device, blocknr_t block, size_t len, BIO*& result)
+{
+    BIO& bio = getblk(device, block, len);
+
+    // The caller will overwrite all data, so whatever is on disk does not matter
+    bio.b_objlock->Lock();
+    bio.b_oflags |= oflag::Done;
+    bio.b_objlock->Unlock();
+    bio.b_status = Result::Success();
+    result = &bio;
+    return Result::Success();
+}
+
+namespace
+{
+    void CompleteIO(BIO& bio, Result status)
+    {
+        bio.b_objlock->Lock();
+        KASSERT((bio.b_oflags & oflag::Done) == 0, "bio %p already done", &bio);
+        bio.b_oflags |= oflag::Done;
+        bio.b_status = status;
+
+        const bool async = (bio.b_oflags & oflag::Async) != 0;
+        bio.b_oflags &= ~oflag::Async;
+        bio.b_objlock->Unlock();
+
+        if (async) {
+            // Nobody is waiting for us; we own the buffer, but may be in interrupt
+            // context - let the biodone thread get rid of it
+            {
+                SpinlockGuard g(spl_donelist);
+                bio_donelist.push_back(bio);
+            }
+            sem_done.Signal();
+        } else {
+            bio.b_cv_done.Broadcast();
+        }
+    }
+
+    void DoneThread(void*)
+    {
+        while (true) {
+            sem_done.Wait();
+
+            while (true) {
+                BIO* bio;
+                {
+                    SpinlockGuard g(spl_donelist);
+                    if (bio_donelist.empty())
+                        break;
+                    bio = &bio_donelist.front();
+                    bio_donelist.pop_front();
+                }
+
+                if (auto iodone = bio->b_iodone; iodone != nullptr) {
+                    bio->b_iodone = nullptr;
+                    iodone(*bio);
+                }
+                bio->Release();
+            }
+        }
+    }
+
+    void PrepareWrite(BIO& bio, bool async)
+    {
+        KASSERT((bio.b_cflags & cflag::Busy) != 0, "buffer not busy");
+
+        // We are writing the data now, so it will no longer be dirty
+        if (bio.b_cflags & cflag::Dirty) {
+            MutexGuard g(BucketForBIO(bio).bu_mutex);
+            bio.b_cflags &= ~cflag::Dirty;
+        }
+
+        // Update request: set as write and not done yet
+        bio.b_status = Result::Success();
+        bio.b_cluster = nullptr;
+        {
+            MutexGuard g(*bio.b_objlock);
+            bio.b_oflags &= ~oflag::Done;
+            if (async)
+                bio.b_oflags |= oflag::Async;
+        }
+    }
+
+    size_t GetMaximumTransferSize(Device& device)
+    {
+        return device.GetBIODeviceOperations()->GetMaximumTransferSize();
+    }
+
+    // Can 'bio' be added to the cluster of 'length' bytes ending with 'last'?
+    bool CanExtendCluster(const BIO& last, size_t length, const BIO& bio)
+    {
+        return bio.b_device == last.b_device &&
+               bio.b_block == last.b_block + last.b_length / BIO_SECTOR_SIZE &&
+               length + bio.b_length <= GetMaximumTransferSize(*bio.b_device);
+    }
+
+    /*
+     * Writes all buffers in 'bios', which must be busy and sorted by block; adjacent
+     * buffers are clustered into a single request. For synchronous writes, the
+     * buffers are moved to 'issued' so that the caller can wait for them.
+     */
+    void IssueWrites(BIOChainList& bios, bool async, BIOChainList& issued)
+    {
+        while (!bios.empty()) {
+            auto& head = bios.front();
+            bios.pop_front();
+            PrepareWrite(head, async);
+            if (!async)
+                issued.push_back(head);
+
+            BIO* last = &head;
+            size_t length = head.b_length;
+            while (!bios.empty() && CanExtendCluster(*last, length, bios.front())) {
+                auto& bio = bios.front();
+                bios.pop_front();
+                PrepareWrite(bio, async);
+                if (!async)
+                    issued.push_back(bio);
+
+                last->b_cluster = &bio;
+                last = &bio;
+                length += bio.b_length;
+                ++stats::clustered;
+            }
+
+            // Initiate disk write
+            head.b_device->GetBIODeviceOperations()->WriteBIO(head);
+        }
+    }
+} // unnamed namespace
+
+/*
+ * Starts reading 'count' consecutive blocks we expect to need soon; the buffers
+ * are released once the reads complete, so that a later bread() will find them
+ * in the cache. Blocks that are already cached are skipped.
+ */
+void breada(Device* device, blocknr_t block, size_t len, size_t count)
+{
+    BIO* head = nullptr;
+    BIO* last = nullptr;
+    size_t length = 0;
+    auto issueCluster = [&]() {
+        if (head != nullptr)
+            device->GetBIODeviceOperations()->ReadBIO(*head);
+        head = nullptr;
+    };
+
+    for (size_t n = 0; n < count; ++n, block += len / BIO_SECTOR_SIZE) {
+        auto& bucket = BucketForBlock(device, block);
+        bool cached;
+        {
+            MutexGuard g(bucket.bu_mutex);
+            cached = incore(bucket, device, block) != nullptr;
+        }
+        BIO* bio = cached ? nullptr : HashNewBuffer(bucket, device, block, len);
+        if (bio == nullptr) {
+            // Already cached or being read; this ends the current cluster
+            issueCluster();
+            continue;
+        }
+
+        {
+            MutexGuard g(*bio->b_objlock);
+            bio->b_oflags |= oflag::Async;
+        }
+        bio->b_cluster = nullptr;
+        ++stats::readAheads;
+
+        if (head != nullptr && CanExtendCluster(*last, length, *bio)) {
+            last->b_cluster = bio;
+            length += bio->b_length;
+            ++stats::clustered;
+        } else {
+            issueCluster();
+            head = bio;
+            length = bio->b_length;
+        }
+        last = bio;
+    }
+    issueCluster();
+}
+
 void BIO::Done(Result status)
 {
-    b_objlock->Lock();
-    KASSERT((b_oflags & oflag::Done) == 0, "bio %p already done", this);
-    b_oflags |= oflag::Done;
-    b_status = status;
-
-    bool async = false;
-    if (async) {
-        b_objlock->Unlock();
-        Release();
-    } else {
-        b_objlock->Unlock();
-        b_cv_done.Broadcast();
+    // Complete every buffer of the cluster; completion may release the buffer, so
+    // we have to fetch the next one first
+    for (BIO* bio = this; bio != nullptr;) {
+        BIO* next = bio->b_cluster;
+        bio->b_cluster = nullptr;
+        CompleteIO(*bio, status);
+        bio = next;
     }
 }
 
+void BIO::StartWrite(bool async)
+{
+    PrepareWrite(*this, async);
+
+    // Initiate disk write
+    b_device->GetBIODeviceOperations()->WriteBIO(*this);
+}
+
+namespace
+{
+    void LatchWriteError(BIO& bio) { bio.b_device->d_WriteError.store(bio.b_status.AsErrno()); }
+} // unnamed namespace
+
 Result BIO::Write()
 {
     KASSERT((b_cflags & cflag::Busy) != 0, "buffer not busy");
 
-    // Update request: set as write and not done yet
-    b_status = Result::Success();
+    {
+        MutexGuard g(BucketForBIO(*this).bu_mutex);
+        if ((b_cflags & cflag::Dirty) == 0) {
+            b_cflags |= cflag::Dirty;
+            b_dirtytime = time::GetTicks();
+        }
+    }
+    // The buffer contents are authoritative now; never read over them
     {
         MutexGuard g(*b_objlock);
-        b_oflags &= ~oflag::Done;
+        b_oflags |= oflag::Done;
     }
+    b_status = Result::Success();
+    ++stats::delayedWrites;
 
-    // Initiate disk write
-    b_device->GetBIODeviceOperations()->WriteBIO(*this);
-
-    // Wait for the result XXX sync only
-    auto result = Wait();
+    // Any error surfaces once the buffer is written back, so there is nothing to report yet
     Release();
+    return Result::Success();
+}
+
+void BIO::WriteAsync() { StartWrite(true); }
+
+Result bwrite(BIO& bio)
+{
+    bio.StartWrite(false);
+    auto result = bio.Wait();
+    bio.Release();
     return result;
 }
 
-void bsync()
+namespace
 {
-    // TODO - we do everything sync now so this does not matter
+    void InsertInBlockOrder(BIOChainList& list, BIO& bio)
+    {
+        for (auto& b : list) {
+            if (b.b_device > bio.b_device ||
+                (b.b_device == bio.b_device && b.b_block > bio.b_block)) {
+                list.insert(b, bio);
+                return;
+            }
+        }
+        list.push_back(bio);
+    }
+
+    /*
+     * Claims up to MaximumFlushBatch dirty buffers of 'device' (any device if
+     * nullptr) that are due (or all of them, if 'all' is set), making them busy
+     * and sorting them in block order. As with recycling, we can only try to lock
+     * the buckets here; 'contended' is set to a bucket we had to skip, if any.
+     */
+    void ClaimDirtyBuffers(BIOChainList& claimed, Device* device, bool all, Bucket*& contended)
+    {
+        const auto now = time::GetTicks();
+        const tick_t delay = (WritebackDelayInMs * time::GetPeriodicyInHz()) / 1000;
+
+        contended = nullptr;
+        MutexGuard g(mtx_freelist);
+        size_t numClaimed = 0;
+        for (auto it = bio_dirtylist.begin(); it != bio_dirtylist.end();) {
+            auto& bio = *it;
+            ++it;
+            if (device != nullptr && bio.b_device != device)
+                continue;
+            if (!all && time::IsTickBefore(now, bio.b_dirtytime + delay))
+                continue;
+
+            auto& bucket = BucketForBIO(bio);
+            if (!bucket.bu_mutex.TryLock()) {
+                if (contended == nullptr)
+                    contended = &bucket;
+                continue;
+            }
+            KASSERT((bio.b_cflags & cflag::Busy) == 0, "busy bio %p on dirty list", &bio);
+            bio.b_cflags |= cflag::Busy;
+            bucket.bu_mutex.Unlock();
+
+            bio_dirtylist.remove(bio);
+            --numberOfDirtyBuffers;
+            InsertInBlockOrder(claimed, bio);
+            if (++numClaimed == MaximumFlushBatch)
+                break;
+        }
+    }
+
+    void ReportWritebackError(BIO& bio)
+    {
+        kprintf("bio: unable to write back block %u\n", static_cast<unsigned int>(bio.b_block));
+    }
+
+    void OnWritebackDone(BIO& bio)
+    {
+        if (bio.b_status.IsFailure()) {
+            ReportWritebackError(bio);
+            LatchWriteError(bio);
+        }
+    }
+
+    /*
+     * Starts writing back a batch of dirty buffers; they will be released
+     * as their I/O completes. Returns the number of buffers written.
+     */
+    size_t FlushDirtyBuffers(bool all)
+    {
+        BIOChainList claimed;
+        Bucket* contended;
+        ClaimDirtyBuffers(claimed, nullptr, all, contended);
+
+        size_t numFlushed = 0;
+        for (auto& bio : claimed) {
+            bio.b_iodone = &OnWritebackDone;
+            ++numFlushed;
+        }
+
+        BIOChainList issued; // unused for asynchronous writes
+        IssueWrites(claimed, true, issued);
+        stats::writebacks += numFlushed;
+        return numFlushed;
+    }
+
+    void FlusherThread(void*)
+    {
+        while (true) {
+            thread_sleep_ms(FlushIntervalInMs);
+            while (FlushDirtyBuffers(false) == MaximumFlushBatch)
+                ;
+        }
+    }
+
+    const init::OnInit initBIOThreads(init::SubSystem::BIO, init::Order::Second, []() {
+        if (auto result = kthread_alloc("biodone", &DoneThread, nullptr, doneThread);
+            result.IsFailure())
+            panic("cannot create biodone thread");
+        doneThread->Resume();
+
+        if (auto result = kthread_alloc("bioflush", &FlusherThread, nullptr, flusherThread);
+            result.IsFailure())
+            panic("cannot create bioflush thread");
+        flusherThread->Resume();
+    });
+} // unnamed namespace
+
+Result bsync(Device* device)
+{
+    /*
+     * Write everything that is dirty and wait for it; we do not use asynchronous
+     * I/O here so that we can wait for the entire batch at once.
+     */
+    auto result = Result::Success();
+    while (true) {
+        BIOChainList claimed;
+        Bucket* contended;
+        ClaimDirtyBuffers(claimed, device, true, contended);
+        if (claimed.empty()) {
+            if (contended == nullptr)
+                break;
+            // Someone holds the bucket of a dirty buffer; wait for them and try again
+            contended->bu_mutex.Lock();
+            contended->bu_mutex.Unlock();
+            continue;
+        }
+
+        BIOChainList issued;
+        IssueWrites(claimed, false, issued);
+        while (!issued.empty()) {
+            auto& bio = issued.front();
+            issued.pop_front();
+            if (auto status = bio.Wait(); status.IsFailure()) {
+                ReportWritebackError(bio);
+                if (result.IsSuccess())
+                    result = status;
+            }
+            bio.Release();
+            ++stats::writebacks;
+        }
+    }
+
+    // Failed writes the flusher did before count as well; report them only once
+    if (device != nullptr) {
+        if (const auto error = device->d_WriteError.exchange(0); error != 0 && result.IsSuccess())
+            result = Result::Failure(error);
+    }
+    return result;
 }
 
 const kdb::RegisterCommand kdbBio("bio", "Display I/O buffers", [](int, const kdb::Argument*) {
@@ -366,19 +889,39 @@ const kdb::RegisterCommand kdbBio("bio", "Display I/O buffers", [](int, const kd
     for (auto& bio : bio_freelist) {
         freelist_avail++;
     }
-    kprintf("lists: %u total, %u bio's free\n", NumberOfBuffers, freelist_avail);
-
-    kprintf("buckets:");
-    for (unsigned int bucket_num = 0; bucket_num < NumberOfBuckets; bucket_num++) {
-        kprintf("%u =>", bucket_num);
-        {
-            if (!bio_bucket[bucket_num].empty()) {
-                for (auto& bio : bio_bucket[bucket_num])
-                    kprintf(" %u(%d)", bio.b_block, bio.b_cflags);
-            } else {
-                kprintf(" (empty)");
-            }
-            kprintf("\n");
+    kprintf(
+        "buffers: %u allocated (%u max), %u free, %u dirty\n", numberOfBuffers,
+        maxNumberOfBuffers, freelist_avail, numberOfDirtyBuffers);
+    kprintf(
+        "writes: %u delayed, %u written back; %u read-aheads; %u clustered\n",
+        static_cast<unsigned int>(stats::delayedWrites.load()),
+        static_cast<unsigned int>(stats::writebacks.load()),
+        static_cast<unsigned int>(stats::readAheads.load()),
+        static_cast<unsigned int>(stats::clustered.load()));
+
+    const uint64_t hits = stats::hits, misses = stats::misses;
+    const uint64_t lookups = hits + misses;
+    kprintf(
+        "lookups: %u hits, %u misses (%u%% hit), %u waits for busy buffers, %u lost races\n",
+        static_cast<unsigned int>(hits), static_cast<unsigned int>(misses),
+        lookups > 0 ? static_cast<unsigned int>((hits * 100) / lookups) : 0,
+        static_cast<unsigned int>(stats::busyWaits.load()),
+        static_cast<unsigned int>(stats::lostRaces.load()));
+
+    unsigned int numUsed = 0, longestChain = 0;
+    for (size_t n = 0; n < numberOfBuckets; n++) {
+        unsigned int chainLength = 0;
+        for (auto& bio : bio_bucket[n].bu_bios) {
+            if (bio.b_cflags & cflag::Busy)
+                kprintf("busy: bucket %u block %u (%d)\n", n, bio.b_block, bio.b_cflags);
+            ++chainLength;
         }
+        if (chainLength > 0)
+            ++numUsed;
+        if (chainLength > longestChain)
+            longestChain = chainLength;
     }
+    kprintf(
+        "buckets: %u total, %u in use, longest chain %u\n", numberOfBuckets, numUsed,
+        longestChain);
 });
@@ -34,6 +34,11 @@ namespace
         void ReadBIO(BIO& bio) override;
         void WriteBIO(BIO& bio) override;
 
+        size_t GetMaximumTransferSize() override
+        {
+            return d_Parent->GetBIODeviceOperations()->GetMaximumTransferSize();
+        }
+
       private:
         blocknr_t slice_first_block = 0;
         blocknr_t slice_length = 0;
@@ -349,7 +349,7 @@ Result ELF64Loader::PrepareForExecute(
      *                      + argc           <=== %rsp(0)
      *
      */
-    constexpr size_t num_auxv_entries = 5;
+    constexpr size_t num_auxv_entries = 6;
     size_t argc, envc;
     const size_t data_bytes_needed =
         userland::CalculateVectorStorageInBytes(argv, argc) +
@@ -389,6 +389,7 @@ Result ELF64Loader::PrepareForExecute(
             Store(stack_ptr, Elf_Auxv{AT_BASE, static_cast<long>(auxargs->aa_interpreter_base)});
             Store(stack_ptr, Elf_Auxv{AT_PHDR, static_cast<long>(auxargs->aa_phdr)});
             Store(stack_ptr, Elf_Auxv{AT_PHENT, static_cast<long>(auxargs->aa_phdr_entries)});
+            Store(stack_ptr, Elf_Auxv{AT_CLOCKPAGE, static_cast<long>(CLOCK_PAGE_ADDR)});
             Store(stack_ptr, Elf_Auxv{AT_NULL, 0});
 
             for (size_t n = 0; n < argc; n++) {
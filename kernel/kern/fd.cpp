@@ -11,6 +11,7 @@
 #include "kernel/lib.h"
 #include "kernel/mm.h"
 #include "kernel/lock.h"
+#include "kernel/pool.h"
 #include "kernel/process.h"
 #include "kernel/result.h"
 
@@ -18,24 +19,14 @@ namespace fd
 {
     namespace
     {
-        constexpr size_t numberOfDescriptors = 500; // XXX shouldn't be static
-
-        util::List<FD> fdFreeList;
-        Spinlock spl_dqueue;
+        // Descriptors are handed back unused, with their mutex intact
+        pool::ObjectPool<FD> fdPool("fd");
 
         util::List<FDType> fdTypes;
         Spinlock spl_fdtypes;
 
     } // unnamed namespace
 
-    void Initialize()
-    {
-        auto h = new FD[numberOfDescriptors];
-        for (unsigned int i = 0; i < numberOfDescriptors; i++, h++) {
-            fdFreeList.push_back(*h);
-        }
-    }
-
     Result
     Allocate(int type, Process& proc, fdindex_t index_from, FD*& fd_out, fdindex_t& index_out)
     {
@@ -53,18 +44,9 @@ namespace fd
         if (dtype == nullptr)
             return Result::Failure(EINVAL);
 
-        // Grab a descriptor from the free list
-        FD& fd = []() -> FD& {
-            SpinlockGuard g(spl_dqueue);
-            if (fdFreeList.empty()) {
-                /* XXX should we wait for a new descriptor, or just give an error? */
-                panic("out of descriptors");
-            }
-            auto& fd = fdFreeList.front();
-            fdFreeList.pop_front();
-            KASSERT(fd.fd_type == FD_TYPE_UNUSED, "descriptor from freelist is not free");
-            return fd;
-        }();
+        // Grab a fresh descriptor
+        FD& fd = fdPool.Allocate();
+        KASSERT(fd.fd_type == FD_TYPE_UNUSED, "descriptor from pool is not free");
 
         // Initialize the descriptor
         fd.fd_type = type;
@@ -205,9 +187,6 @@ Result FD::Close()
     fd_mutex.Unlock();
 
     // Put the descriptor back to the the pool
-    {
-        SpinlockGuard g(fd::spl_dqueue);
-        fd::fdFreeList.push_back(*this);
-    }
+    fd::fdPool.Free(*this);
     return Result::Success();
 }
@@ -24,11 +24,28 @@
  * The overal idea of this code is, when mapping physical address 'pa':
  *
  * - (1) KMEM_DIRECT_PA_START <= pa <= KMEM_DIRECT_PA_END can be mapped 1:1 to kernel
- *       virtual address 'va' where 'va = PA_TO_DIRECT_VA(pa)'
+ *       virtual address 'va' where 'va = PA_TO_DIRECT_VA(pa)'. Memory is
+ *       mapped here permanently using large pages where possible, in which
+ *       case mapping or unmapping it does not do anything.
  * - (2) Addresses outside (1) are dynamically mapped using by finding an
  *       appropriate va which satisfies KMEM_DYNAMIC_VA_START <= va <=
  *       KMEM_DYNAMIC_VA_END
  *
+ * The dynamic range is managed as a vmem-style arena (Bonwick and Adams,
+ * "Magazines and Vmem", 2001):
+ *
+ * - Every span of addresses, free or allocated, is described by a boundary
+ *   tag; tags are kept in address order so that neighbouring free spans can
+ *   be coalesced in O(1).
+ * - Free spans live on segregated free lists, one per power-of-two size. A
+ *   request for n pages is satisfied by the first span on the list for the
+ *   next power of two of n, which is guaranteed to fit (instant fit).
+ * - Allocated spans are hashed by their address. Mapped spans are also indexed
+ *   by the regions of the dynamic range they overlap, so that we can quickly
+ *   find the span containing an arbitrary address.
+ * - One and two page mappings are by far the most common; freed spans of those
+ *   sizes are kept in quantum caches and handed out as-is.
+ * - Boundary tags are carved out of pages allocated on demand.
  */
 #include <machine/param.h>
 #include "kernel/mm.h"
@@ -37,19 +54,317 @@
 #include "kernel/lib.h"
 #include "kernel/lock.h"
 #include "kernel/page.h"
+#include "kernel/pcpu.h"
 #include "kernel/result.h"
 #include "kernel/vm.h"
+#include "kernel-md/interrupts.h"
 #include "kernel-md/md.h"
 #include "kernel-md/vm.h"
 
 namespace {
     constexpr inline auto kmemDebug = false;
-    constexpr inline auto numberOfMappings = PAGE_SIZE / sizeof(KMEM_MAPPING);
+
+    // Number of free lists; list n contains spans of [2^n, 2^(n+1)) pages
+    constexpr inline unsigned int numberOfFreeLists = 32;
+    // Number of buckets used to hash allocated spans
+    constexpr inline unsigned int numberOfHashBuckets = 256;
+    // Spans of up to this number of pages are kept in quantum caches once freed...
+    constexpr inline unsigned int numberOfQuantumCaches = 2;
+    // ... up to this amount per cache
+    constexpr inline unsigned int quantumCacheSize = 16;
+    // We try to always have this number of boundary tags available
+    constexpr inline unsigned int tagReserve = 8;
+    // Boundary tags available before we can allocate pages to hold them
+    constexpr inline unsigned int numberOfBootstrapTags = 16;
+    // Size of the regions used to index the mapped spans
+    constexpr inline size_t pagesPerIndexRegion = 16;
+    constexpr inline size_t numberOfIndexRegions =
+        (KMEM_DYNAMIC_VA_END - KMEM_DYNAMIC_VA_START + 1) / (pagesPerIndexRegion * PAGE_SIZE);
+
+    // Boundary tag, describing a span of the dynamic KVA range
+    struct Segment {
+        addr_t s_virt;             // First address
+        size_t s_pages;            // Length, in pages
+        addr_t s_phys;             // Physical address, if mapped
+        int s_flags;               // Mapping flags, if mapped
+        bool s_free;
+        bool s_mapped;             // Set if hashed and indexed
+        Segment* s_prev;           // Previous span, in address order
+        Segment* s_next;           // Next span, in address order
+        Segment* s_link;           // Next on the free list, hash chain or quantum cache
+        Segment** s_linkprev;      // Pointer to our own pointer on the free list/hash chain
+    };
 
     Spinlock kmem_lock;
-    Page* kmem_page;
-    struct KMEM_MAPPING* kmem_mappings = NULL;
-}
+    // Everything below is protected by kmem_lock
+    bool kmem_initialized = false;
+    bool kmem_growing = false;   // Set when tags are being added...
+    Thread* kmem_grower;         // ... by this thread
+    Segment* kmem_segments;      // All spans, in address order
+    Segment* kmem_free[numberOfFreeLists];
+    Segment* kmem_hash[numberOfHashBuckets];
+    Segment* kmem_index[numberOfIndexRegions]; // Lowest mapped span overlapping each region
+    Segment* kmem_qcache[numberOfQuantumCaches];
+    unsigned int kmem_qcache_count[numberOfQuantumCaches];
+    Segment* kmem_tags;          // Unused boundary tags
+    unsigned int kmem_num_tags;
+    Segment kmem_bootstrap_tags[numberOfBootstrapTags];
+
+    inline unsigned int HighBit(size_t n)
+    {
+        return (sizeof(unsigned long long) * 8 - 1) - __builtin_clzll(n);
+    }
+
+    inline void LinkInsert(Segment*& head, Segment& s)
+    {
+        s.s_link = head;
+        s.s_linkprev = &head;
+        if (head != nullptr)
+            head->s_linkprev = &s.s_link;
+        head = &s;
+    }
+
+    inline void LinkRemove(Segment& s)
+    {
+        *s.s_linkprev = s.s_link;
+        if (s.s_link != nullptr)
+            s.s_link->s_linkprev = s.s_linkprev;
+    }
+
+    inline Segment*& HashBucket(addr_t virt)
+    {
+        return kmem_hash[(virt / PAGE_SIZE) % numberOfHashBuckets];
+    }
+
+    void AddTag(Segment& s)
+    {
+        s.s_link = kmem_tags;
+        kmem_tags = &s;
+        ++kmem_num_tags;
+    }
+
+    Segment& AllocateTag()
+    {
+        KASSERT(kmem_tags != nullptr, "out of kva boundary tags");
+        Segment& s = *kmem_tags;
+        kmem_tags = s.s_link;
+        --kmem_num_tags;
+        s.s_mapped = false;
+        return s;
+    }
+
+    void InsertFree(Segment& s)
+    {
+        s.s_free = true;
+        LinkInsert(kmem_free[HighBit(s.s_pages)], s);
+    }
+
+    void Initialize()
+    {
+        for (auto& s : kmem_bootstrap_tags)
+            AddTag(s);
+
+        Segment& s = AllocateTag();
+        s.s_virt = KMEM_DYNAMIC_VA_START;
+        s.s_pages = (KMEM_DYNAMIC_VA_END - KMEM_DYNAMIC_VA_START + 1) / PAGE_SIZE;
+        s.s_prev = nullptr;
+        s.s_next = nullptr;
+        kmem_segments = &s;
+        InsertFree(s);
+        kmem_initialized = true;
+    }
+
+    /*
+     * Ensures we have enough tags to satisfy the next request; called without
+     * kmem_lock held. While tags are being added, others may use the upper half
+     * of the reserve; the lower half is kept for the thread adding them, as it
+     * may need to map the new tags.
+     */
+    void EnsureTags()
+    {
+        while (true) {
+            {
+                SpinlockGuard g(kmem_lock);
+                if (!kmem_initialized)
+                    Initialize();
+                if (kmem_num_tags >= tagReserve)
+                    return;
+                if (!kmem_growing) {
+                    kmem_growing = true;
+                    kmem_grower = PCPU_GET(curthread);
+                    break;
+                }
+                if (kmem_grower == PCPU_GET(curthread) || kmem_num_tags > tagReserve / 2)
+                    return;
+            }
+
+            // Wait until whoever is adding tags is done
+            md::interrupts::Pause();
+        }
+
+        /*
+         * This will generally use a direct mapping - if not, the reserve will
+         * take care of the recursion. Tag pages are never given back.
+         */
+        Page* p = page_alloc_single(page::flag::NoSleep); // others are spinning on us
+        auto tags = static_cast<Segment*>(
+            kmem_map(p->GetPhysicalAddress(), PAGE_SIZE, vm::flag::Read | vm::flag::Write));
+
+        SpinlockGuard g(kmem_lock);
+        for (size_t n = 0; n < PAGE_SIZE / sizeof(Segment); n++)
+            AddTag(tags[n]);
+        kmem_growing = false;
+        kmem_grower = nullptr;
+    }
+
+    // Must be called with kmem_lock held
+    Segment* FindFreeSegment(size_t pages)
+    {
+        // Instant fit: anything on the list of the next power of two will do
+        unsigned int n = HighBit(pages);
+        if ((pages & (pages - 1)) != 0)
+            n++;
+        for (/* nothing */; n < numberOfFreeLists; n++) {
+            if (kmem_free[n] != nullptr)
+                return kmem_free[n];
+        }
+
+        // Nothing there; larger spans may still be lurking among the smaller ones
+        for (Segment* s = kmem_free[HighBit(pages)]; s != nullptr; s = s->s_link) {
+            if (s->s_pages >= pages)
+                return s;
+        }
+        return nullptr;
+    }
+
+    // Must be called with kmem_lock held
+    void FreeSegment(Segment& s)
+    {
+        // Coalesce with our neighbours where possible
+        if (Segment* next = s.s_next; next != nullptr && next->s_free) {
+            LinkRemove(*next);
+            s.s_pages += next->s_pages;
+            s.s_next = next->s_next;
+            if (s.s_next != nullptr)
+                s.s_next->s_prev = &s;
+            AddTag(*next);
+        }
+        if (Segment* prev = s.s_prev; prev != nullptr && prev->s_free) {
+            LinkRemove(*prev);
+            prev->s_pages += s.s_pages;
+            prev->s_next = s.s_next;
+            if (prev->s_next != nullptr)
+                prev->s_next->s_prev = prev;
+            AddTag(s);
+            InsertFree(*prev);
+            return;
+        }
+        InsertFree(s);
+    }
+
+    // Must be called with kmem_lock held; returns false if there was nothing to flush
+    bool FlushQuantumCaches()
+    {
+        bool flushed = false;
+        for (unsigned int n = 0; n < numberOfQuantumCaches; n++) {
+            while (Segment* s = kmem_qcache[n]) {
+                kmem_qcache[n] = s->s_link;
+                FreeSegment(*s);
+                flushed = true;
+            }
+            kmem_qcache_count[n] = 0;
+        }
+        return flushed;
+    }
+
+    // Must be called with kmem_lock held
+    Segment& AllocateSegment(size_t pages)
+    {
+        if (pages <= numberOfQuantumCaches) {
+            if (Segment* s = kmem_qcache[pages - 1]; s != nullptr) {
+                kmem_qcache[pages - 1] = s->s_link;
+                kmem_qcache_count[pages - 1]--;
+                return *s;
+            }
+        }
+
+        Segment* s = FindFreeSegment(pages);
+        if (s == nullptr && FlushQuantumCaches())
+            s = FindFreeSegment(pages);
+        if (s == nullptr)
+            panic("out of kva (%d pages requested)", pages);
+
+        LinkRemove(*s);
+        s->s_free = false;
+        if (s->s_pages > pages) {
+            // Split; the remainder goes back to the free lists
+            Segment& rest = AllocateTag();
+            rest.s_virt = s->s_virt + pages * PAGE_SIZE;
+            rest.s_pages = s->s_pages - pages;
+            rest.s_prev = s;
+            rest.s_next = s->s_next;
+            if (rest.s_next != nullptr)
+                rest.s_next->s_prev = &rest;
+            s->s_next = &rest;
+            s->s_pages = pages;
+            InsertFree(rest);
+        }
+        return *s;
+    }
+
+    // Must be called with kmem_lock held
+    Segment* LookupSegment(addr_t virt)
+    {
+        for (Segment* s = HashBucket(virt); s != nullptr; s = s->s_link) {
+            if (s->s_virt == virt)
+                return s;
+        }
+        return nullptr;
+    }
+
+    inline size_t IndexRegion(addr_t virt)
+    {
+        return (virt - KMEM_DYNAMIC_VA_START) / (pagesPerIndexRegion * PAGE_SIZE);
+    }
+
+    inline addr_t IndexRegionEnd(size_t region)
+    {
+        return KMEM_DYNAMIC_VA_START + (region + 1) * pagesPerIndexRegion * PAGE_SIZE;
+    }
+
+    // Must be called with kmem_lock held
+    void InsertMapped(Segment& s)
+    {
+        LinkInsert(HashBucket(s.s_virt), s);
+        s.s_mapped = true;
+
+        const auto lastRegion = IndexRegion(s.s_virt + s.s_pages * PAGE_SIZE - 1);
+        for (auto region = IndexRegion(s.s_virt); region <= lastRegion; ++region) {
+            if (kmem_index[region] == nullptr || kmem_index[region]->s_virt > s.s_virt)
+                kmem_index[region] = &s;
+        }
+    }
+
+    // Must be called with kmem_lock held, before 's' is freed
+    void RemoveMapped(Segment& s)
+    {
+        LinkRemove(s);
+        s.s_mapped = false;
+
+        const auto lastRegion = IndexRegion(s.s_virt + s.s_pages * PAGE_SIZE - 1);
+        for (auto region = IndexRegion(s.s_virt); region <= lastRegion; ++region) {
+            if (kmem_index[region] != &s)
+                continue;
+
+            // Replace us by the next mapped span overlapping the region, if any
+            const auto regionEnd = IndexRegionEnd(region);
+            Segment* next = s.s_next;
+            while (next != nullptr && next->s_virt < regionEnd && !next->s_mapped)
+                next = next->s_next;
+            kmem_index[region] = next != nullptr && next->s_virt < regionEnd ? next : nullptr;
+        }
+    }
+} // unnamed namespace
 
 void* kmem_map(addr_t phys, size_t length, int flags)
 {
@@ -74,76 +389,17 @@ void* kmem_map(addr_t phys, size_t length, int flags)
         return (void*)(va + offset);
     }
 
-    if (kmem_mappings == NULL) {
-        /*
-         * Chicken-and-egg problem here: we need a page to store our administration,
-         * but allocating one could invoke kmem_map() to allocate a mapping.
-         *
-         * XXX We just hope that this won't happen for now
-         */
-        kmem_mappings = static_cast<struct KMEM_MAPPING*>(
-            page_alloc_single_mapped(kmem_page, vm::flag::Read | vm::flag::Write));
-        memset(kmem_mappings, 0, PAGE_SIZE);
-    }
+    KASSERT(size > 0, "mapping nothing");
+    EnsureTags();
 
-    /*
-     * Try to locate a sensible location for this mapping; we keep kmem_mappings sorted so we can
-     * easily reclaim virtual space in between.
-     */
-    addr_t virt = KMEM_DYNAMIC_VA_START;
+    addr_t virt;
     {
         SpinlockGuard g(kmem_lock);
-        struct KMEM_MAPPING* kmm = kmem_mappings;
-        unsigned int n = 0;
-        for (/* nothing */; n < numberOfMappings; n++, kmm++) {
-            if (kmm->kmm_size == 0)
-                break; /* end of the line */
-            if (virt + size <= kmm->kmm_virt)
-                break; /* fits here */
-
-            /*
-             * Only reject exact mappings; it's not up to us to determine how the
-             * caller should behave.
-             */
-            if (pa == kmm->kmm_phys && size == kmm->kmm_size) {
-                /* Already mapped */
-                panic(
-                    "XXX range %p-%p already mapped (%p-%p) -> %p", pa, pa + size, kmm->kmm_phys,
-                    kmm->kmm_phys + size, kmm->kmm_virt);
-                return NULL;
-            }
-
-            /*
-             * No fit here; try to place it after this mapping (this is an attempt to
-             * fill up holes)
-             */
-            virt = kmm->kmm_virt + kmm->kmm_size * PAGE_SIZE;
-        }
-
-        if (virt + size >= KMEM_DYNAMIC_VA_END) {
-            /* Out of KVA! XXX This shouldn't panic, but it's weird all-right */
-            panic("out of kva (%p + %x >= %p)", virt, size, KMEM_DYNAMIC_VA_END);
-            return NULL;
-        }
-
-        /*
-         * XXX I wonder how realistic this is and whether it's worth bothering to come up with
-         *     something more clever (there is no reason we couldn't move kmem_mappings)
-         */
-        if (n == numberOfMappings) {
-            /* XXX This shouldn't panic either */
-            panic("out of kva mappings!!");
-            return NULL;
-        }
-
-        /*
-         * Need to insert the mapping at position n.
-         */
-        memmove(&kmem_mappings[n + 1], &kmem_mappings[n], numberOfMappings - n);
-        kmm->kmm_phys = pa;
-        kmm->kmm_size = size;
-        kmm->kmm_flags = flags;
-        kmm->kmm_virt = virt;
+        Segment& s = AllocateSegment(size);
+        s.s_phys = pa;
+        s.s_flags = flags;
+        InsertMapped(s);
+        virt = s.s_virt;
     }
 
     /* Now perform the actual mapping and we're set */
@@ -177,35 +433,30 @@ void kmem_unmap(void* virt, size_t length)
     }
 
     /* We only allow exact mappings to be unmapped */
-    kmem_lock.Lock();
-    struct KMEM_MAPPING* kmm = kmem_mappings;
-    for (unsigned int n = 0; n < numberOfMappings; n++, kmm++) {
-        if (kmm->kmm_size == 0)
-            break; /* end of the line */
-        if (va != kmm->kmm_virt || size != kmm->kmm_size)
-            continue;
-
-        if constexpr (kmemDebug) {
-            kprintf("kmem_unmap(): unmapping: virt=%p len=%d\n", virt, length);
-        }
+    Segment* s;
+    {
+        SpinlockGuard g(kmem_lock);
+        s = LookupSegment(va);
+        if (s == nullptr || s->s_pages != size)
+            panic("kmem_unmap(): virt=%p length=%d not mapped", virt, length);
+        RemoveMapped(*s);
+    }
 
-        memmove(&kmem_mappings[n], &kmem_mappings[n + 1], numberOfMappings - n);
-        /* And free the final one... */
-        for (unsigned int m = numberOfMappings - 1; m > n; m--) {
-            struct KMEM_MAPPING* kmm = &kmem_mappings[m];
-            if (kmm->kmm_size == 0)
-                continue;
-            memset(kmm, 0, sizeof(*kmm));
-            break;
-        }
-        kmem_lock.Unlock();
+    /*
+     * Nobody else can get hold of the addresses while the span is neither mapped
+     * nor free, so we can remove the mapping without holding the lock; this
+     * waits for the other CPU's to flush their TLB.
+     */
+    md::vm::UnmapKernel(va, size);
 
-        md::vm::UnmapKernel(va, size);
-        return;
+    SpinlockGuard g(kmem_lock);
+    if (size <= numberOfQuantumCaches && kmem_qcache_count[size - 1] < quantumCacheSize) {
+        s->s_link = kmem_qcache[size - 1];
+        kmem_qcache[size - 1] = s;
+        kmem_qcache_count[size - 1]++;
+    } else {
+        FreeSegment(*s);
     }
-    kmem_lock.Unlock();
-
-    panic("kmem_unmap(): virt=%p length=%d not mapped", virt, length);
 }
 
 addr_t kmem_get_phys(void* virt)
@@ -217,21 +468,16 @@ addr_t kmem_get_phys(void* virt)
     if (va >= PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START) && va < PA_TO_DIRECT_VA(KMEM_DIRECT_PA_END))
         return (va - PA_TO_DIRECT_VA(KMEM_DIRECT_PA_START)) + offset;
 
-    /* Walk through the mappings */
-    {
+    /*
+     * Start at the lowest mapped span overlapping the region of the address; only
+     * spans within that region need to be considered after it.
+     */
+    if (va >= KMEM_DYNAMIC_VA_START && va <= KMEM_DYNAMIC_VA_END) {
         SpinlockGuard g(kmem_lock);
-        struct KMEM_MAPPING* kmm = kmem_mappings;
-        for (unsigned int n = 0; n < numberOfMappings; n++, kmm++) {
-            if (kmm->kmm_size == 0)
-                break; /* end of the line */
-
-            if (va < kmm->kmm_virt)
-                continue;
-            if (va > kmm->kmm_virt + kmm->kmm_size * PAGE_SIZE)
-                continue;
-
-            addr_t phys = kmm->kmm_phys + ((addr_t)virt - (addr_t)kmm->kmm_virt);
-            return phys;
+        for (Segment* s = kmem_index[IndexRegion(va)]; s != nullptr && s->s_virt <= va;
+             s = s->s_next) {
+            if (s->s_mapped && va < s->s_virt + s->s_pages * PAGE_SIZE)
+                return s->s_phys + (va - s->s_virt) + offset;
         }
     }
 
@@ -240,16 +486,24 @@ addr_t kmem_get_phys(void* virt)
 
 const kdb::RegisterCommand
     kdbKMappings("kmappings", "Display kernel memory mappings", [](int, const kdb::Argument*) {
-        if (kmem_mappings == NULL)
-            return;
-
-        struct KMEM_MAPPING* kmm = kmem_mappings;
-        for (unsigned int n = 0; n < numberOfMappings; n++, kmm++) {
-            if (kmm->kmm_size == 0)
-                break;
-            size_t len = kmm->kmm_size * PAGE_SIZE;
+        size_t free_pages = 0, num_free = 0;
+        for (Segment* s = kmem_segments; s != nullptr; s = s->s_next) {
+            if (s->s_free) {
+                free_pages += s->s_pages;
+                num_free++;
+                continue;
+            }
+            if (!s->s_mapped)
+                continue; // in a quantum cache
+            size_t len = s->s_pages * PAGE_SIZE;
             kprintf(
-                "mapping: va %p-%p pa %p-%p\n", kmm->kmm_virt, kmm->kmm_virt + len - 1,
-                kmm->kmm_phys, kmm->kmm_phys + len - 1);
+                "mapping: va %p-%p pa %p-%p\n", s->s_virt, s->s_virt + len - 1, s->s_phys,
+                s->s_phys + len - 1);
         }
+        size_t cached_pages = 0;
+        for (unsigned int n = 0; n < numberOfQuantumCaches; n++)
+            cached_pages += kmem_qcache_count[n] * (n + 1);
+        kprintf(
+            "%d free span(s) totalling %d KB, %d page(s) in quantum caches, %d spare tag(s)\n",
+            num_free, free_pages * (PAGE_SIZE / 1024), cached_pages, kmem_num_tags);
     });
@@ -5,13 +5,18 @@
  * For conditions of distribution and use, see LICENSE file
  */
 #include <machine/param.h>
+#include "kernel/init.h"
 #include "kernel/kdb.h"
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
 #include "kernel/mm.h"
 #include "kernel/page.h"
+#include "kernel/pcpu.h"
+#include "kernel/pool.h"
 #include "kernel/result.h"
+#include "kernel/thread.h"
 #include "kernel/vm.h"
+#include "kernel-md/md.h"
 
 #undef PAGE_DEBUG
 
@@ -23,6 +28,55 @@
 
 static PageZoneList zones;
 
+/*
+ * Every CPU caches a number of order-0 pages, which it can allocate and free
+ * without touching the zone locks. Pages in the cache are allocated as far as
+ * the zone is concerned; they are refilled from and given back to the zones a
+ * batch at a time.
+ */
+namespace
+{
+    // Number of CPUs which get their own cache; any others use the zones directly
+    constexpr size_t MaximumCPUs = 16;
+    // Number of pages moved between a CPU cache and the zones at once
+    constexpr unsigned int CPUCacheBatchOrder = 4;
+    constexpr unsigned int CPUCacheBatch = 1 << CPUCacheBatchOrder;
+    // A CPU cache holding more pages than this gives a batch back
+    constexpr unsigned int CPUCacheHighWatermark = 4 * CPUCacheBatch;
+    // Zones with fewer available pages than this only hand out a single page to a CPU cache
+    constexpr unsigned int ZoneLowWatermark = 1024;
+
+    struct PageCPUCache {
+        Spinlock pc_lock;
+        PageList pc_pages;
+        unsigned int pc_count = 0;
+    };
+
+    PageCPUCache cpuCache[MaximumCPUs];
+
+    /*
+     * Supply of pre-zeroed pages, kept up to date by the pagezero thread
+     * whenever the system has nothing better to do.
+     */
+    // Number of pre-zeroed pages we try to keep around...
+    constexpr unsigned int ZeroedPagesTarget = 256;
+    // ... provided we have at least this number of pages available
+    constexpr unsigned int ZeroedPagesMinimumAvailable = 4096;
+    // Interval at which the supply is checked
+    constexpr unsigned int ZeroIntervalInMs = 250;
+
+    Spinlock zeroedLock;
+    PageList zeroedPages;
+    unsigned int numZeroedPages = 0;
+
+    // Any CPU's cache will do, so it does not matter if we are moved to another CPU after this
+    PageCPUCache* GetCPUCache()
+    {
+        const size_t cpuid = PCPU_GET(cpuid);
+        return cpuid < MaximumCPUs ? &cpuCache[cpuid] : nullptr;
+    }
+} // unnamed namespace
+
 void Page::AssertSane() const
 {
     KASSERT(p_order >= 0 && p_order < PAGE_NUM_ORDERS, "corrupt page %p", this);
@@ -52,12 +106,11 @@ static inline unsigned int bytes2order(size_t length)
     return order;
 }
 
-void page_free_index(PageZone& z, unsigned int order, unsigned int index)
+static void page_free_index_locked(PageZone& z, unsigned int order, unsigned int index)
 {
     Page& p = z.z_base[index];
     DPRINTF("page_free_index(): order=%u index=%u -> p=%p\n", order, index, &p);
-
-    SpinlockGuard g(z.z_lock);
+    z.z_lock.AssertLocked();
 
     /* Clear the current index; it is available */
     clear_bit(z.z_bitmap, index);
@@ -95,19 +148,105 @@ void page_free_index(PageZone& z, unsigned int order, unsigned int index)
     }
 }
 
+void page_free_index(PageZone& z, unsigned int order, unsigned int index)
+{
+    SpinlockGuard g(z.z_lock);
+    page_free_index_locked(z, order, index);
+}
+
+/* Gives a list of order-0 pages back to their zones, taking each zone lock once */
+static void page_free_list(PageList& pages)
+{
+    while (!pages.empty()) {
+        PageZone& z = *pages.front().p_zone;
+        SpinlockGuard g(z.z_lock);
+        for (auto it = pages.begin(); it != pages.end(); /* nothing */) {
+            Page& p = *it;
+            ++it;
+            if (p.p_zone != &z)
+                continue;
+            pages.remove(p);
+            page_free_index_locked(z, 0, &p - z.z_base);
+        }
+    }
+}
+
+/* Empties all CPU caches; returns the number of pages freed */
+static unsigned int page_drain_cpu_caches()
+{
+    unsigned int count = 0;
+    for (auto& pc : cpuCache) {
+        PageList pages;
+        {
+            SpinlockUnpremptibleGuard g(pc.pc_lock);
+            while (!pc.pc_pages.empty()) {
+                Page& p = pc.pc_pages.front();
+                pc.pc_pages.pop_front();
+                pages.push_back(p);
+                ++count;
+            }
+            pc.pc_count = 0;
+        }
+        page_free_list(pages);
+    }
+    return count;
+}
+
 void page_free(Page& p)
 {
     p.AssertSane();
 
-    PageZone& z = *p.p_zone;
-    page_free_index(z, p.p_order, &p - z.z_base);
+    auto pc = p.p_order == 0 ? GetCPUCache() : nullptr;
+    if (pc == nullptr) {
+        PageZone& z = *p.p_zone;
+        page_free_index(z, p.p_order, &p - z.z_base);
+        return;
+    }
+
+    PageList pages;
+    {
+        SpinlockUnpremptibleGuard g(pc->pc_lock);
+        pc->pc_pages.push_front(p);
+        if (++pc->pc_count <= CPUCacheHighWatermark)
+            return;
+
+        // Too many pages cached; give back the ones we touched least recently
+        for (unsigned int n = 0; n < CPUCacheBatch; ++n) {
+            Page& victim = pc->pc_pages.back();
+            pc->pc_pages.pop_back();
+            pages.push_back(victim);
+        }
+        pc->pc_count -= CPUCacheBatch;
+    }
+    page_free_list(pages);
 }
 
-Page* page_alloc_zone(PageZone& z, unsigned int order)
+static void page_split_locked(PageZone& z, Page& block)
 {
-    DPRINTF("page_alloc_zone(): z=%p, order=%u\n", &z, order);
+    z.z_lock.AssertLocked();
+
+    // Only the first page of a block is marked as allocated; mark the others too
+    const unsigned int index = &block - z.z_base;
+    const unsigned int num_pages = 1 << block.p_order;
+    for (unsigned int n = 0; n < num_pages; n++) {
+        set_bit(z.z_bitmap, index + n);
+        (&block)[n].p_order = 0;
+    }
+}
+
+void page_split(Page& p)
+{
+    p.AssertSane();
 
+    PageZone& z = *p.p_zone;
     SpinlockGuard g(z.z_lock);
+    page_split_locked(z, p);
+}
+
+static Page* page_alloc_zone_locked(PageZone& z, unsigned int order)
+{
+    DPRINTF("page_alloc_zone(): z=%p, order=%u\n", &z, order);
+    z.z_lock.AssertLocked();
 
     /* First step is to figure out the initial order we need to use */
     unsigned int alloc_order = order;
@@ -159,6 +298,84 @@ Page* page_alloc_zone(PageZone& z, unsigned int order)
     return NULL;
 }
 
+Page* page_alloc_zone(PageZone& z, unsigned int order)
+{
+    SpinlockGuard g(z.z_lock);
+    return page_alloc_zone_locked(z, order);
+}
+
+/*
+ * Allocates up to CPUCacheBatch order-0 pages from a zone to refill a CPU cache;
+ * returns the number of pages added.
+ */
+static unsigned int page_alloc_zone_batch(PageZone& z, PageList& pages)
+{
+    SpinlockGuard g(z.z_lock);
+    if (z.z_avail_pages < ZoneLowWatermark) {
+        Page* p = page_alloc_zone_locked(z, 0);
+        if (p == nullptr)
+            return 0;
+        pages.push_back(*p);
+        return 1;
+    }
+
+    /*
+     * Take a single block and chop it up ourselves; this is a lot cheaper than
+     * splitting buddies all the way down for each page.
+     */
+    Page* block = page_alloc_zone_locked(z, CPUCacheBatchOrder);
+    if (block != nullptr) {
+        page_split_locked(z, *block);
+        for (unsigned int n = 0; n < CPUCacheBatch; n++)
+            pages.push_back(block[n]);
+        return CPUCacheBatch;
+    }
+
+    unsigned int count = 0;
+    for (/* nothing */; count < CPUCacheBatch; count++) {
+        Page* p = page_alloc_zone_locked(z, 0);
+        if (p == nullptr)
+            break;
+        pages.push_back(*p);
+    }
+    return count;
+}
+
+static Page* page_alloc_cached(PageCPUCache& pc)
+{
+    {
+        SpinlockUnpremptibleGuard g(pc.pc_lock);
+        if (!pc.pc_pages.empty()) {
+            Page& p = pc.pc_pages.front();
+            pc.pc_pages.pop_front();
+            --pc.pc_count;
+            return &p;
+        }
+    }
+
+    PageList pages;
+    unsigned int count = 0;
+    for (auto& z : zones) {
+        count = page_alloc_zone_batch(z, pages);
+        if (count > 0)
+            break;
+    }
+    if (count == 0)
+        return nullptr;
+
+    Page& p = pages.front();
+    pages.pop_front();
+
+    SpinlockUnpremptibleGuard g(pc.pc_lock);
+    while (!pages.empty()) {
+        Page& q = pages.front();
+        pages.pop_front();
+        pc.pc_pages.push_back(q);
+        ++pc.pc_count;
+    }
+    return &p;
+}
+
 void page_zone_add(addr_t base, size_t length)
 {
     /*
@@ -169,9 +386,22 @@ void page_zone_add(addr_t base, size_t length)
      * - [num_pages] x (struct PAGE) to contain information for a given memory page
      */
     unsigned int num_pages = length / PAGE_SIZE;
-    unsigned int bitmap_size = (num_pages + 7) / 8;
+
+    /*
+     * Buddies are only aligned relative to the start of the zone; to have the
+     * largest blocks aligned in physical memory as well (so they can be mapped
+     * using large pages), we pretend the zone starts at such a boundary. The
+     * pages in front of the actual memory are never freed. This is not worth
+     * it for small zones.
+     */
+    constexpr unsigned int maxBlockPages = 1 << (PAGE_NUM_ORDERS - 1);
+    const unsigned int max_align_pages = num_pages >= 4 * maxBlockPages ? maxBlockPages - 1 : 0;
+
+    const unsigned int max_zone_pages = num_pages + max_align_pages;
+    unsigned int bitmap_size = (max_zone_pages + 7) / 8;
     unsigned int num_admin_pages =
-        (sizeof(PageZone) + bitmap_size + (num_pages * sizeof(Page)) + PAGE_SIZE - 1) / PAGE_SIZE;
+        (sizeof(PageZone) + bitmap_size + (max_zone_pages * sizeof(Page)) + PAGE_SIZE - 1) /
+        PAGE_SIZE;
     DPRINTF(
         "%s: base=%p length=%u -> num_pages=%u, num_admin_pages=%u\n", __func__, base, length,
         num_pages, num_admin_pages);
@@ -187,22 +417,26 @@ void page_zone_add(addr_t base, size_t length)
         z.z_free[n].clear();
     memset(z.z_bitmap, 0xff, bitmap_size);
     z.z_base = reinterpret_cast<Page*>(mem + bitmap_size + sizeof(z));
-    z.z_num_pages = num_pages - num_admin_pages;
     z.z_avail_pages = 0;
-    z.z_phys_addr = base + num_admin_pages * PAGE_SIZE;
+    const addr_t first_phys = base + num_admin_pages * PAGE_SIZE;
+    z.z_phys_addr =
+        max_align_pages > 0 ? first_phys & ~(addr_t(PAGE_SIZE * maxBlockPages) - 1) : first_phys;
+    z.z_first_index = (first_phys - z.z_phys_addr) / PAGE_SIZE;
+    z.z_num_pages = z.z_first_index + num_pages - num_admin_pages;
 
     /* Create the page structures; we mark everything as a order 0 page */
     Page* p = z.z_base;
     for (unsigned int n = 0; n < z.z_num_pages; n++, p++) {
         p->p_zone = &z;
         p->p_order = 0;
+        p->p_owner = nullptr;
     }
 
     /*
      * Now, free all chunks of memory. This is slow, we could do better but for
      * now it'll help guarantee that the implementation is correct.
      */
-    for (int n = 0; n < z.z_num_pages; n++)
+    for (int n = z.z_first_index; n < z.z_num_pages; n++)
         page_free_index(z, 0, n);
 
     /* Add the zone to the list XXX there should be some lock on zones */
@@ -217,20 +451,98 @@ addr_t Page::GetPhysicalAddress() const
     return p_zone->z_phys_addr + index * PAGE_SIZE;
 }
 
-Page* page_alloc_order(int order)
+/* Gives all pre-zeroed pages back; returns the number of pages freed */
+static unsigned int page_drain_zeroed()
+{
+    PageList pages;
+    unsigned int count;
+    {
+        SpinlockUnpremptibleGuard g(zeroedLock);
+        count = numZeroedPages;
+        while (!zeroedPages.empty()) {
+            Page& p = zeroedPages.front();
+            zeroedPages.pop_front();
+            pages.push_back(p);
+        }
+        numZeroedPages = 0;
+    }
+    page_free_list(pages);
+    return count;
+}
+
+static Page* page_alloc_any(int order, int flags)
+{
+    auto pc = order == 0 ? GetCPUCache() : nullptr;
+    while (true) {
+        if (pc != nullptr) {
+            if (Page* page = page_alloc_cached(*pc); page != nullptr)
+                return page;
+        } else {
+            for (auto& z : zones) {
+                Page* page = page_alloc_zone(z, order);
+                if (page != NULL)
+                    return page;
+            }
+        }
+
+        if (flags & page::flag::Try)
+            return nullptr;
+
+        // Out of memory; pages may be lingering in the caches or the pools
+        if (page_drain_cpu_caches() != 0 || page_drain_zeroed() != 0)
+            continue;
+        // Reclaiming takes sleeping locks and unmaps memory, which not everyone can afford
+        if ((flags & page::flag::NoSleep) != 0 || pool::Reclaim() == 0)
+            break;
+    }
+
+    panic("page_alloc(): failed for order %d", order);
+}
+
+/*
+ * Zero-fills a block of pages; 'ahead' is set if the pages are zeroed ahead
+ * of time, in which case the caches are bypassed. Otherwise the caller is
+ * about to use the pages, so they may as well end up in the caches.
+ */
+static void page_zero(Page& p, bool ahead)
+{
+    const size_t num_pages = 1 << p.p_order;
+    char* va = static_cast<char*>(
+        kmem_map(p.GetPhysicalAddress(), num_pages * PAGE_SIZE, vm::flag::Read | vm::flag::Write));
+    if (ahead) {
+        for (size_t n = 0; n < num_pages; n++)
+            md::vm::ZeroPage(va + n * PAGE_SIZE);
+    } else {
+        memset(va, 0, num_pages * PAGE_SIZE);
+    }
+    kmem_unmap(va, num_pages * PAGE_SIZE);
+}
+
+Page* page_alloc_order(int order, int flags)
 {
     /* XXX this function has no lock on zones */
 
     KASSERT(order >= 0 && order < PAGE_NUM_ORDERS, "order %d out of range", order);
     KASSERT(!zones.empty(), "no zones");
 
-    for (auto& z : zones) {
-        Page* page = page_alloc_zone(z, order);
-        if (page != NULL)
-            return page;
+    if ((flags & page::flag::Zero) == 0)
+        return page_alloc_any(order, flags);
+
+    if (order == 0) {
+        SpinlockUnpremptibleGuard g(zeroedLock);
+        if (!zeroedPages.empty()) {
+            Page& p = zeroedPages.front();
+            zeroedPages.pop_front();
+            --numZeroedPages;
+            return &p;
+        }
     }
 
-    panic("page_alloc(): failed for order %d", order);
+    // Nothing suitable pre-zeroed; we'll have to do it ourselves
+    Page* p = page_alloc_any(order, flags);
+    if (p != nullptr)
+        page_zero(*p, false);
+    return p;
 }
 
 void* page_alloc_order_mapped(int order, Page*& p, int vm_flags)
@@ -241,6 +553,17 @@ void* page_alloc_order_mapped(int order, Page*& p, int vm_flags)
     return kmem_map(p->GetPhysicalAddress(), PAGE_SIZE << order, vm_flags);
 }
 
+Page* page_find(addr_t phys)
+{
+    for (auto& z : zones) {
+        if (phys < z.z_phys_addr + z.z_first_index * PAGE_SIZE ||
+            phys >= z.z_phys_addr + z.z_num_pages * PAGE_SIZE)
+            continue;
+        return &z.z_base[(phys - z.z_phys_addr) / PAGE_SIZE];
+    }
+    return nullptr;
+}
+
 Page* page_alloc_length(size_t length) { return page_alloc_order(bytes2order(length)); }
 
 void* page_alloc_length_mapped(size_t length, Page*& p, int vm_flags)
@@ -248,6 +571,42 @@ void* page_alloc_length_mapped(size_t length, Page*& p, int vm_flags)
     return page_alloc_order_mapped(bytes2order(length), p, vm_flags);
 }
 
+namespace
+{
+    Thread* zeroThread;
+
+    void ZeroThread(void*)
+    {
+        while (true) {
+            unsigned int total_pages, avail_pages;
+            page_get_stats(&total_pages, &avail_pages);
+            if (avail_pages >= ZeroedPagesMinimumAvailable) {
+                while (numZeroedPages < ZeroedPagesTarget) {
+                    // Never dig into the reserves for this; just try again later
+                    Page* p = page_alloc_any(0, page::flag::Try);
+                    if (p == nullptr)
+                        break;
+                    page_zero(*p, true);
+
+                    SpinlockUnpremptibleGuard g(zeroedLock);
+                    zeroedPages.push_back(*p);
+                    ++numZeroedPages;
+                }
+            }
+            thread_sleep_ms(ZeroIntervalInMs);
+        }
+    }
+
+    const init::OnInit initZeroThread(init::SubSystem::Thread, init::Order::Middle, []() {
+        if (auto result = kthread_alloc("pagezero", &ZeroThread, nullptr, zeroThread);
+            result.IsFailure())
+            panic("cannot create pagezero thread");
+        // Only run if there is nothing else to do
+        zeroThread->t_priority = THREAD_PRIORITY_IDLE - 1;
+        zeroThread->Resume();
+    });
+} // unnamed namespace
+
 void page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
 {
     /* XXX we need some lock on zones */
@@ -257,17 +616,23 @@ void page_get_stats(unsigned int* total_pages, unsigned int* avail_pages)
     *avail_pages = 0;
     for (auto& z : zones) {
         SpinlockGuard g(z.z_lock);
-        *total_pages += z.z_num_pages;
+        *total_pages += z.z_num_pages - z.z_first_index;
         *avail_pages += z.z_avail_pages;
     }
+
+    // Cached pages are available as well; no need to be exact here
+    for (auto& pc : cpuCache)
+        *avail_pages += pc.pc_count;
+    *avail_pages += numZeroedPages;
 }
 
 static void page_dump(PageZone& z)
 {
+    const unsigned int total = z.z_num_pages - z.z_first_index;
     kprintf(
-        "page_dump: zone=%p total=%u avail=%u (%u KB of %u KB in use)\n", &z, z.z_num_pages,
-        z.z_avail_pages, (z.z_num_pages - z.z_avail_pages) * (PAGE_SIZE / 1024),
-        z.z_num_pages * (PAGE_SIZE / 1024));
+        "page_dump: zone=%p total=%u avail=%u (%u KB of %u KB in use)\n", &z, total,
+        z.z_avail_pages, (total - z.z_avail_pages) * (PAGE_SIZE / 1024),
+        total * (PAGE_SIZE / 1024));
     for (unsigned int order = 0; order < PAGE_NUM_ORDERS; order++) {
         kprintf(" order %u: ", order);
         int n = 0;
@@ -281,4 +646,9 @@ const kdb::RegisterCommand kdbPages("pages", "Display page zones", [](int, const
     for (auto& z : zones) {
         page_dump(z);
     }
+    for (unsigned int n = 0; n < MaximumCPUs; n++) {
+        if (cpuCache[n].pc_count > 0)
+            kprintf("cpu %u: %u page(s) cached\n", n, cpuCache[n].pc_count);
+    }
+    kprintf("%u pre-zeroed page(s)\n", numZeroedPages);
 });
@@ -7,6 +7,8 @@
 #include "kernel/lib.h"
 #include "kernel/pcpu.h"
 #include "kernel/result.h"
+#include "kernel/schedule.h"
+#include "kernel/slab.h"
 #include "kernel/thread.h"
 
 void pcpu_init(struct PCPU* pcpu)
@@ -18,10 +20,16 @@ void pcpu_init(struct PCPU* pcpu)
         panic("cannot create idlethread");
     pcpu->nested_irq = 0;
 
+    // Give the CPU its own magazines so that most allocations need not take any lock
+    slab::InitCPU(*pcpu);
+
     /*
      * Hook the idle thread to its specific CPU and set the appropriate priority;
      * it must only be run as a last-resort.
      */
     pcpu->idlethread->t_affinity = pcpu->cpuid;
     pcpu->idlethread->t_priority = THREAD_PRIORITY_IDLE;
+
+    // Hand the CPU its own runqueue; this must be done before the idle thread is resumed
+    scheduler::InitCPU(*pcpu);
 }
@@ -7,7 +7,9 @@
 #include "kernel/pool.h"
 #include "kernel/lib.h"
 #include "kernel/kdb.h"
+#include "kernel/kmem.h"
 #include "kernel/mm.h"
+#include "kernel/pcpu.h"
 #include "kernel/vm.h"
 #include "kernel-md/param.h"
 
@@ -15,79 +17,351 @@ namespace pool
 {
     namespace
     {
-        util::List<Pool> allPools;
-    }
+        Mutex allPoolsMutex{"allpools"};
+        util::List<Pool> allPools; // [allPoolsMutex]
+
+        // Slabs are grown until they hold at least this number of items...
+        constexpr size_t MinimumItemsPerSlab = 8;
+        // ... or reach this order
+        constexpr unsigned int MaximumSlabOrder = 3;
+        // Granularity of the slab colouring
+        constexpr size_t CacheLineSize = 64;
+        // Number of items exchanged between a per-CPU free list and the slabs at once
+        constexpr size_t CPUBatchSize = CPUFreeListSize / 2 + 1;
 
-    Pool::Pool(const char* name, const size_t itemSize)
-        : p_Mutex("poolmtx")
-        , p_ItemSize(itemSize)
+        constexpr size_t RoundUp(size_t n, size_t granularity)
+        {
+            return (n + granularity - 1) & ~(granularity - 1);
+        }
+    } // unnamed namespace
+
+    Pool::Pool(
+        const char* name, const size_t itemSize, size_t alignment, Hook constructor,
+        Hook destructor)
+        : p_ItemSize(itemSize), p_Constructor(constructor), p_Destructor(destructor)
     {
-        KASSERT(itemSize >= sizeof(Item), "item size too small");
-        KASSERT(itemSize <= PAGE_SIZE, "cannot handle pool items larger than a page");
         KASSERT(strlen(name) < sizeof(p_Name), "name too long");
         strcpy(p_Name, name);
 
+        if (alignment < sizeof(Item))
+            alignment = sizeof(Item);
+        KASSERT((alignment & (alignment - 1)) == 0, "alignment %d not a power of two", alignment);
+
+        // Constructed items must keep their contents while free, so link them after the item
+        p_LinkOffset = p_Constructor != nullptr ? RoundUp(itemSize, sizeof(Item)) : 0;
+        p_Stride = RoundUp(p_LinkOffset + sizeof(Item), alignment);
+        if (p_Stride < itemSize)
+            p_Stride = RoundUp(itemSize, alignment);
+        KASSERT(p_Stride <= PAGE_SIZE, "cannot handle pool items larger than a page");
+
+        // Use the smallest slab that holds enough items
+        while (p_SlabOrder < MaximumSlabOrder &&
+               GetItemsPerSlab(p_SlabOrder) < MinimumItemsPerSlab)
+            ++p_SlabOrder;
+        p_ItemsPerSlab = GetItemsPerSlab(p_SlabOrder);
+
+        // Whatever is left can be used to offset the items of consecutive slabs
+        p_ColourStep = alignment > CacheLineSize ? alignment : CacheLineSize;
+        p_MaximumColour = GetSlabSize() - SlabHeaderSize - p_ItemsPerSlab * p_Stride;
+
+        MutexGuard g(allPoolsMutex);
         allPools.push_back(*this);
     }
 
     Pool::~Pool()
     {
-        allPools.remove(*this);
+        {
+            MutexGuard g(allPoolsMutex);
+            allPools.remove(*this);
+        }
+
+        Shrink();
+        KASSERT(p_NumSlabs == 0, "destroying pool '%s' with %d item(s) in use", p_Name,
+                p_ItemsInUse);
+    }
+
+    // Any CPU's list will do, so it does not matter if we are moved to another CPU after this
+    Pool::CPUFreeList* Pool::GetCPUFreeList()
+    {
+        const size_t cpuid = PCPU_GET(cpuid);
+        return cpuid < MaximumCPUs ? &p_CPU[cpuid] : nullptr;
     }
 
     void* Pool::AllocateItem()
     {
-        MutexGuard g(p_Mutex);
+        auto cf = GetCPUFreeList();
+        if (cf != nullptr) {
+            SpinlockUnpremptibleGuard g(cf->cf_lock);
+            if (cf->cf_count > 0)
+                return cf->cf_item[--cf->cf_count];
+        }
 
-        while(true) {
-            if (!p_AvailableItems.empty()) {
-                auto& item = p_AvailableItems.front();
-                p_AvailableItems.pop_front();
-                return reinterpret_cast<void*>(&item);
-            }
+        // Nothing cached; grab a batch from the slabs so the next allocations will be fast
+        void* items[CPUBatchSize];
+        size_t numItems = cf != nullptr ? CPUBatchSize : 1;
+        {
+            MutexGuard g(p_Mutex);
+            for (size_t n = 0; n < numItems; ++n)
+                items[n] = AllocateFromSlab();
+        }
 
-            // TODO: see if we are allowed to grow
-            Grow();
+        if (cf != nullptr) {
+            SpinlockUnpremptibleGuard g(cf->cf_lock);
+            while (numItems > 1 && cf->cf_count < CPUFreeListSize)
+                cf->cf_item[cf->cf_count++] = items[--numItems];
         }
+
+        // Someone else filled the list in the meantime; give back what did not fit
+        if (numItems > 1) {
+            MutexGuard g(p_Mutex);
+            while (numItems > 1)
+                FreeToSlab(items[--numItems]);
+        }
+        return items[0];
     }
 
     void Pool::FreeItem(void* ptr)
     {
-        auto item = reinterpret_cast<Item*>(ptr);
-        new (item) Item();
+        auto cf = GetCPUFreeList();
+        if (cf == nullptr) {
+            MutexGuard g(p_Mutex);
+            FreeToSlab(ptr);
+            return;
+        }
+
+        void* items[CPUBatchSize];
+        size_t numItems = 0;
+        {
+            SpinlockUnpremptibleGuard g(cf->cf_lock);
+            if (cf->cf_count < CPUFreeListSize) {
+                cf->cf_item[cf->cf_count++] = ptr;
+                return;
+            }
+
+            // List is full; move a batch back to the slabs to make room
+            while (numItems < CPUBatchSize)
+                items[numItems++] = cf->cf_item[--cf->cf_count];
+            cf->cf_item[cf->cf_count++] = ptr;
+        }
 
         MutexGuard g(p_Mutex);
-        p_AvailableItems.push_back(*item);
+        for (size_t n = 0; n < numItems; ++n)
+            FreeToSlab(items[n]);
     }
 
-    void Pool::Grow()
+    // Must be called with p_Mutex held
+    void Pool::CreateSlab()
     {
-        Page* page{};
-        auto ptr = page_alloc_single_mapped(page, vm::flag::Read | vm::flag::Write);
-        KASSERT(page != nullptr, "deal with out of memory");
-        p_AllocatedPages.push_back(*page);
-
-        const auto itemsPerPage = PAGE_SIZE / p_ItemSize;
-        auto item = static_cast<Item*>(ptr);
-        for(int n = 0; n < itemsPerPage; ++n) {
-            new (item) Item();
-            p_AvailableItems.push_back(*item);
-            item = reinterpret_cast<Item*>(reinterpret_cast<char*>(item) + p_ItemSize);
+        p_Mutex.AssertLocked();
+
+        Page* page;
+        auto mem = static_cast<char*>(
+            page_alloc_order_mapped(p_SlabOrder, page, vm::flag::Read | vm::flag::Write));
+        KASSERT(mem != nullptr, "out of memory growing pool '%s'", p_Name);
+
+        auto slab = new (mem + GetSlabSize() - SlabHeaderSize) Slab;
+        slab->s_pool = this;
+        slab->s_page = page;
+        slab->s_base = mem + p_NextColour;
+        for (size_t n = 0; n < (1 << p_SlabOrder); ++n)
+            page[n].p_owner = slab;
+
+        p_NextColour += p_ColourStep;
+        if (p_NextColour > p_MaximumColour)
+            p_NextColour = 0;
+
+        // Construct all items and link them, lowest address first
+        for (size_t n = p_ItemsPerSlab; n > 0; --n) {
+            auto ptr = slab->s_base + (n - 1) * p_Stride;
+            if (p_Constructor != nullptr)
+                p_Constructor(ptr);
+            auto& link = GetLink(ptr);
+            link.i_next = slab->s_free;
+            slab->s_free = &link;
         }
+
+        p_EmptySlabs.push_back(*slab);
+        ++p_NumSlabs;
     }
 
-    const kdb::RegisterCommand kdbPool("pool", "Display memory pools", [](int, const kdb::Argument*) {
-        auto countItems = [](auto& p) {
+    /*
+     * Gives a slab obtained using DetachEmptySlabs() back to the page allocator;
+     * returns the number of pages freed. Must be called without p_Mutex held, as
+     * we may be called on behalf of the page allocator itself.
+     */
+    size_t Pool::DestroySlab(Slab& slab)
+    {
+        KASSERT(slab.s_inuse == 0, "destroying slab with %d item(s) in use", slab.s_inuse);
+
+        if (p_Destructor != nullptr) {
+            for (size_t n = 0; n < p_ItemsPerSlab; ++n)
+                p_Destructor(slab.s_base + n * p_Stride);
+        }
+
+        auto page = slab.s_page;
+        for (size_t n = 0; n < (1 << p_SlabOrder); ++n)
+            page[n].p_owner = nullptr;
+
+        auto mem = reinterpret_cast<char*>(&slab) + SlabHeaderSize - GetSlabSize();
+        kmem_unmap(mem, GetSlabSize());
+        page_free(*page);
+        return 1 << p_SlabOrder;
+    }
+
+    // Must be called with p_Mutex held
+    void* Pool::AllocateFromSlab()
+    {
+        p_Mutex.AssertLocked();
+
+        Slab* slab;
+        if (!p_PartialSlabs.empty()) {
+            slab = &p_PartialSlabs.front();
+        } else {
+            if (p_EmptySlabs.empty())
+                CreateSlab();
+            slab = &p_EmptySlabs.front();
+            p_EmptySlabs.pop_front();
+            p_PartialSlabs.push_front(*slab);
+        }
+
+        auto link = slab->s_free;
+        slab->s_free = link->i_next;
+        ++slab->s_inuse;
+        ++p_ItemsInUse;
+        if (slab->s_inuse == p_ItemsPerSlab) {
+            p_PartialSlabs.remove(*slab);
+            p_FullSlabs.push_back(*slab);
+        }
+        return reinterpret_cast<char*>(link) - p_LinkOffset;
+    }
+
+    // Must be called with p_Mutex held
+    void Pool::FreeToSlab(void* ptr)
+    {
+        p_Mutex.AssertLocked();
+
+        auto page = page_find(kmem_get_phys(ptr));
+        KASSERT(page != nullptr && page->p_owner != nullptr, "%p is not a pool item", ptr);
+        auto& slab = *static_cast<Slab*>(page->p_owner);
+        KASSERT(slab.s_pool == this, "freeing %p to wrong pool '%s'", ptr, p_Name);
+        KASSERT(slab.s_inuse > 0, "freeing %p to unused slab", ptr);
+
+        if (slab.s_inuse == p_ItemsPerSlab) {
+            p_FullSlabs.remove(slab);
+            p_PartialSlabs.push_front(slab);
+        }
+
+        auto& link = GetLink(ptr);
+        link.i_next = slab.s_free;
+        slab.s_free = &link;
+        --slab.s_inuse;
+        --p_ItemsInUse;
+        if (slab.s_inuse > 0)
+            return;
+
+        // Keep the slab for now; Shrink() will give it back if memory is needed
+        p_PartialSlabs.remove(slab);
+        p_EmptySlabs.push_back(slab);
+    }
+
+    // Must be called with p_Mutex held
+    void Pool::DrainCPUFreeLists()
+    {
+        p_Mutex.AssertLocked();
+
+        for (auto& cf : p_CPU) {
+            void* items[CPUFreeListSize];
+            size_t numItems = 0;
+            {
+                SpinlockUnpremptibleGuard g(cf.cf_lock);
+                while (cf.cf_count > 0)
+                    items[numItems++] = cf.cf_item[--cf.cf_count];
+            }
+            for (size_t n = 0; n < numItems; ++n)
+                FreeToSlab(items[n]);
+        }
+    }
+
+    // Must be called with p_Mutex held; moves all unused slabs to 'slabs'
+    void Pool::DetachEmptySlabs(SlabList& slabs)
+    {
+        p_Mutex.AssertLocked();
+        DrainCPUFreeLists();
+
+        while (!p_EmptySlabs.empty()) {
+            auto& slab = p_EmptySlabs.front();
+            p_EmptySlabs.pop_front();
+            --p_NumSlabs;
+            slabs.push_back(slab);
+        }
+    }
+
+    size_t Pool::Shrink()
+    {
+        SlabList slabs;
+        {
+            MutexGuard g(p_Mutex);
+            DetachEmptySlabs(slabs);
+        }
+
+        size_t pagesFreed = 0;
+        while (!slabs.empty()) {
+            auto& slab = slabs.front();
+            slabs.pop_front();
+            pagesFreed += DestroySlab(slab);
+        }
+        return pagesFreed;
+    }
+
+    // Called from kdb; this does not lock anything
+    void Pool::Dump()
+    {
+        auto countSlabs = [](auto& list) {
             size_t count{};
-            for(auto& item: p) { ++count; }
+            for (auto& slab : list) {
+                ++count;
+            }
             return count;
         };
 
-        for(auto& pool: allPools) {
-            kprintf("pool %p '%s': %d page(s) allocated, %d items available\n",
-             &pool, pool.p_Name,
-             countItems(pool.p_AllocatedPages),
-             countItems(pool.p_AvailableItems));
+        const size_t capacity = p_NumSlabs * p_ItemsPerSlab;
+        kprintf(
+            "pool %p '%s': %d byte items, %d slab(s) of %d KB, %d/%d items in use, "
+            "%d empty slab(s)\n",
+            this, p_Name, p_ItemSize, p_NumSlabs, GetSlabSize() / 1024, p_ItemsInUse, capacity,
+            countSlabs(p_EmptySlabs));
+    }
+
+    /*
+     * Called by the page allocator when it runs out of memory; it does not hold
+     * any of its locks while doing so. The slabs are only collected while we hold
+     * the pool locks: they are given back once we no longer hold any of them, so
+     * that kmem_unmap() and page_free() are never called with a pool lock held.
+     */
+    size_t Reclaim()
+    {
+        MutexGuard g(allPoolsMutex);
+
+        Pool::SlabList slabs;
+        for (auto& pool : allPools) {
+            // Skip busy pools; we may well be called on behalf of one of them
+            if (!pool.p_Mutex.TryLock())
+                continue;
+            pool.DetachEmptySlabs(slabs);
+            pool.p_Mutex.Unlock();
         }
+
+        size_t pagesFreed = 0;
+        while (!slabs.empty()) {
+            auto& slab = slabs.front();
+            slabs.pop_front();
+            pagesFreed += slab.s_pool->DestroySlab(slab);
+        }
+        return pagesFreed;
+    }
+
+    const kdb::RegisterCommand kdbPool("pool", "Display memory pools", [](int, const kdb::Argument*) {
+        for (auto& pool : allPools)
+            pool.Dump();
     });
-}
+} // namespace pool
@@ -5,13 +5,24 @@
  * For conditions of distribution and use, see LICENSE file
  */
 /*
- * This contains the scheduler; it has two queues: a runqueue (containing all
- * threads that can run) and a sleepqueue (threads which cannot run). The
- * current thread is never on either of these queues; the reason is that the
+ * This contains the scheduler. Every CPU has its own runqueue (containing
+ * all threads that can run on that CPU, sorted by priority) along with a
+ * timer wheel of threads sleeping with a timeout; threads that are suspended
+ * without a timeout live on a global sleepqueue. Each queue has its own lock,
+ * so CPUs only contend when they wake up threads for one another or when an
+ * idle CPU steals work from a busy one.
+ *
+ * There is no periodic tick: whenever we schedule, the CPU-local timer is armed
+ * for the end of the timeslice or the next timeout, whichever comes first. An
+ * idle CPU without timeouts does not arm it at all and sleeps until it is
+ * interrupted; CPUs that must act on a thread we resumed are sent an IPI.
+ *
+ * The current thread is never on a runqueue; the reason is that the
  * administration of threads is distinct from the scheduler, and having the
  * scheduler re-add a thread that has expired its timeslice back to the
  * runqueue avoids nasty races (as well as being much easier to follow)
  */
+#include <ananas/util/vector.h>
 #include "kernel/kdb.h"
 #include "kernel/lock.h"
 #include "kernel/init.h"
@@ -28,6 +39,223 @@
 
 namespace scheduler
 {
+    using SchedLock = Spinlock;
+    using SchedLockGuard = SpinlockUnpremptibleGuard;
+
+    /*
+     * Runnable threads, indexed by priority: every priority level has its own
+     * list and a bitmap tracks which levels are non-empty. Adding and removing
+     * a thread is O(1), and so is locating the highest priority thread.
+     */
+    struct PriorityQueue {
+        static constexpr int numberOfLevels = THREAD_PRIORITY_IDLE + 1;
+        static constexpr int bitsPerWord = 64;
+        static constexpr int numberOfWords = numberOfLevels / bitsPerWord;
+        static_assert(numberOfLevels % bitsPerWord == 0);
+
+        void Add(Thread& t)
+        {
+            const auto level = t.t_priority;
+            KASSERT(level >= 0 && level < numberOfLevels, "invalid priority %d", level);
+            pq_level[level].push_back(t);
+            pq_bitmap[level / bitsPerWord] |= 1ULL << (level % bitsPerWord);
+        }
+
+        void Remove(Thread& t)
+        {
+            const auto level = t.t_priority;
+            pq_level[level].remove(t);
+            if (pq_level[level].empty())
+                pq_bitmap[level / bitsPerWord] &= ~(1ULL << (level % bitsPerWord));
+        }
+
+        // Returns the first thread, in priority order, for which func() holds
+        template<typename Func>
+        Thread* Find(Func func)
+        {
+            for (int w = 0; w < numberOfWords; ++w) {
+                for (auto bits = pq_bitmap[w]; bits != 0; bits &= bits - 1) {
+                    const auto level = w * bitsPerWord + __builtin_ctzll(bits);
+                    for (auto& t : pq_level[level]) {
+                        if (func(t))
+                            return &t;
+                    }
+                }
+            }
+            return nullptr;
+        }
+
+        thread::SchedulerThreadList pq_level[numberOfLevels];
+        uint64_t pq_bitmap[numberOfWords]{};
+    };
+
+    /*
+     * Threads sleeping with a timeout, kept in a hierarchical timing wheel:
+     * level 0 has a slot for each of the next 64 ticks, and every following
+     * level covers 64 times the range of the previous one. Whenever a level
+     * wraps around, the current slot of the level above is cascaded down.
+     * Adding and removing a thread is O(1), and expiring costs O(expired)
+     * plus the occasional cascade. Every level has a bitmap of non-empty
+     * slots, which allows us to skip ahead to the next event directly.
+     */
+    struct TimerWheel {
+        static constexpr int slotBits = 6;
+        static constexpr int slotsPerLevel = 1 << slotBits;
+        static constexpr tick_t slotMask = slotsPerLevel - 1;
+        static constexpr int numberOfLevels = 4;
+        static constexpr tick_t maxDelta = (1ULL << (numberOfLevels * slotBits)) - 1;
+        static_assert(slotsPerLevel == 64, "slot bitmap must fit in an uint64_t");
+
+        TimerWheel(tick_t now) : tw_now(now) {}
+
+        void Add(Thread& t)
+        {
+            Insert(t, tw_now + 1);
+        }
+
+        void Remove(Thread& t)
+        {
+            const auto slot = t.t_sched_slot;
+            tw_slot[slot].remove(t);
+            if (tw_slot[slot].empty())
+                tw_bitmap[slot / slotsPerLevel] &= ~(1ULL << (slot % slotsPerLevel));
+        }
+
+        // Calls func() for every thread whose timeout is at or before 'now'
+        template<typename Func>
+        void Expire(tick_t now, Func func)
+        {
+            while (true) {
+                tick_t next;
+                if (!GetNextEvent(next) || time::IsTickAfter(next, now)) {
+                    // Nothing happens until 'now'; skip ahead
+                    if (time::IsTickBefore(tw_now, now))
+                        tw_now = now;
+                    return;
+                }
+
+                tw_now = next;
+                for (int level = 1; level < numberOfLevels; ++level) {
+                    if ((tw_now & ((1ULL << (level * slotBits)) - 1)) != 0)
+                        break; // level below did not wrap
+                    Cascade(level * slotsPerLevel + ((tw_now >> (level * slotBits)) & slotMask));
+                }
+
+                const int slotIndex = tw_now & slotMask;
+                auto& slot = tw_slot[slotIndex];
+                while (!slot.empty()) {
+                    auto& t = slot.front();
+                    slot.pop_front();
+                    func(t);
+                }
+                tw_bitmap[0] &= ~(1ULL << slotIndex);
+            }
+        }
+
+        /*
+         * Yields the next tick at which something happens, either a thread
+         * that expires or a cascade which may yield one; returns false if
+         * the wheel is empty.
+         */
+        bool GetNextEvent(tick_t& next) const
+        {
+            bool found = false;
+            for (int level = 0; level < numberOfLevels; ++level) {
+                const auto bitmap = tw_bitmap[level];
+                if (bitmap == 0)
+                    continue;
+
+                // Look for the first non-empty slot after the current one; the current
+                // slot itself was already processed, so it will be reached last
+                const int shift = level * slotBits;
+                const int first = ((tw_now >> shift) + 1) & slotMask;
+                const auto rotated =
+                    first == 0 ? bitmap : (bitmap >> first) | (bitmap << (slotsPerLevel - first));
+                const auto t = ((tw_now >> shift) + __builtin_ctzll(rotated) + 1) << shift;
+                if (!found || time::IsTickBefore(t, next))
+                    next = t;
+                found = true;
+            }
+            return found;
+        }
+
+        template<typename Func>
+        void ForEach(Func func)
+        {
+            for (auto& slot : tw_slot) {
+                for (auto& t : slot)
+                    func(t);
+            }
+        }
+
+      private:
+        // Places the thread in the wheel; it will not expire before 'earliest'
+        void Insert(Thread& t, tick_t earliest)
+        {
+            const auto slot = GetSlot(t.t_timeout, earliest);
+            t.t_sched_slot = slot;
+            tw_slot[slot].push_back(t);
+            tw_bitmap[slot / slotsPerLevel] |= 1ULL << (slot % slotsPerLevel);
+        }
+
+        int GetSlot(tick_t expires, tick_t earliest) const
+        {
+            if (time::IsTickBefore(expires, earliest))
+                expires = earliest;
+            // Anything too far away is parked in the top level and cascaded until it fits
+            if (expires - tw_now > maxDelta)
+                expires = tw_now + maxDelta;
+
+            const auto delta = expires - tw_now;
+            int level = 0;
+            while (delta >> ((level + 1) * slotBits) != 0)
+                ++level;
+            return level * slotsPerLevel + ((expires >> (level * slotBits)) & slotMask);
+        }
+
+        void Cascade(int slotIndex)
+        {
+            thread::SchedulerThreadList threads;
+            auto& slot = tw_slot[slotIndex];
+            while (!slot.empty()) {
+                auto& t = slot.front();
+                slot.pop_front();
+                threads.push_back(t);
+            }
+            tw_bitmap[slotIndex / slotsPerLevel] &= ~(1ULL << (slotIndex % slotsPerLevel));
+
+            while (!threads.empty()) {
+                auto& t = threads.front();
+                threads.pop_front();
+                // We are cascading for the current tick, so this tick is still to be processed
+                Insert(t, tw_now);
+            }
+        }
+
+        tick_t tw_now; // last tick processed
+        thread::SchedulerThreadList tw_slot[numberOfLevels * slotsPerLevel];
+        uint64_t tw_bitmap[numberOfLevels]{};
+    };
+
+    struct RunQueue {
+        RunQueue(PCPU& pcpu)
+            : rq_pcpu(pcpu), rq_cpuid(pcpu.cpuid), rq_idleThread(*pcpu.idlethread),
+              rq_timeouts(time::GetTicks())
+        {
+        }
+
+        PCPU& rq_pcpu;
+        const int rq_cpuid;
+        Thread& rq_idleThread;
+
+        SchedLock rq_lock;
+        PriorityQueue rq_threads;                // runnable threads
+        TimerWheel rq_timeouts;                  // threads sleeping with a timeout
+
+        // Number of threads on rq_threads; may be inspected without holding rq_lock
+        util::atomic<int> rq_numThreads{0};
+    };
+
     namespace
     {
         // If set, ensure scheduler invariants hold. These really hurt performance and tend to hide
@@ -35,11 +263,13 @@ namespace scheduler
         constexpr bool isProveActive = false;
         bool isActive = false;
 
-        using SchedLock = Spinlock;
-        using SchedLockGuard = SpinlockUnpremptibleGuard;
+        // Time a thread may run before another thread of the same priority gets a chance
+        constexpr uint64_t timesliceInNs = 10'000'000; // 10 ms
 
-        SchedLock schedLock;
-        thread::SchedulerThreadList sched_runqueue;
+        // All runqueues, indexed by CPU ID; only altered before the scheduler is launched
+        util::vector<RunQueue*> runQueues;
+
+        SchedLock sleepQueueLock;
         thread::SchedulerThreadList sched_sleepqueue;
 
         struct NotOnAnyQueue {
@@ -55,7 +285,7 @@ namespace scheduler
             constexpr static inline bool onSleepQueue = true;
         };
 
-        // Must be called with schedLock held
+        // Walks every queue without locking them; only to be used while debugging
         template<typename What>
         void Prove(Thread& t)
         {
@@ -70,8 +300,12 @@ namespace scheduler
                 return false;
             };
 
-            const auto onRunQueue = onQueue(sched_runqueue, t);
-            const auto onSleepQueue = onQueue(sched_sleepqueue, t);
+            bool onRunQueue = false;
+            bool onSleepQueue = onQueue(sched_sleepqueue, t);
+            for (auto rq : runQueues) {
+                onRunQueue |= rq->rq_threads.Find([&](Thread& s) { return &s == &t; }) != nullptr;
+                rq->rq_timeouts.ForEach([&](Thread& s) { onSleepQueue |= &s == &t; });
+            }
             if (onRunQueue == What::onRunQueue && onSleepQueue == What::onSleepQueue)
                 return;
             panic(
@@ -80,75 +314,158 @@ namespace scheduler
                 What::onRunQueue, What::onSleepQueue, onRunQueue, onSleepQueue);
         }
 
-        // Must be called with schedLock held
-        void AddThreadToRunQueue(Thread& t)
+        RunQueue& GetRunQueueForThread(Thread& t)
         {
-            Prove<NotOnAnyQueue>(t);
-
-            for (auto& s : sched_runqueue) {
-                KASSERT(&s != &t, "thread %p already in runqueue", &t);
-                if (s.t_priority <= t.t_priority)
-                    continue; // lower or equal priority to thread to insert, skip
+            if (t.t_affinity != THREAD_AFFINITY_ANY)
+                return *runQueues[t.t_affinity];
+            return *PCPU_GET(runqueue);
+        }
 
-                sched_runqueue.insert(s, t);
+        // Must be called with rq.rq_lock held
+        void AddThreadToRunQueue(RunQueue& rq, Thread& t)
+        {
+            // The idle thread is never queued; it is what we run if there is nothing else
+            if (&t == &rq.rq_idleThread)
                 return;
-            }
-            sched_runqueue.push_back(t);
+            KASSERT(
+                (t.t_sched_flags & THREAD_SCHED_QUEUED) == 0, "thread %p already in runqueue", &t);
+
+            ++rq.rq_numThreads;
+            t.t_sched_flags |= THREAD_SCHED_QUEUED;
+            rq.rq_threads.Add(t);
         }
 
-        // Must be called with schedLock held
-        void WakeupSleepingThreads()
+        // Must be called with rq.rq_lock held
+        void RemoveThreadFromRunQueue(RunQueue& rq, Thread& t)
         {
-            if (sched_sleepqueue.empty())
-                return;
+            rq.rq_threads.Remove(t);
+            --rq.rq_numThreads;
+            t.t_sched_flags &= ~THREAD_SCHED_QUEUED;
+        }
 
-            Thread& t = sched_sleepqueue.front();
-            if ((t.t_flags & THREAD_FLAG_TIMEOUT) == 0)
-                return;
-            if (time::IsTickBefore(time::GetTicks(), t.t_timeout))
-                return;
+        // Must be called with rq.rq_lock held
+        void WakeupSleepingThreads(RunQueue& rq)
+        {
+            rq.rq_timeouts.Expire(time::GetTicks(), [&](Thread& t) {
+                AddThreadToRunQueue(rq, t);
+                t.t_sched_flags &= ~THREAD_SCHED_SUSPENDED;
+                t.t_flags &= ~THREAD_FLAG_TIMEOUT;
+            });
+        }
 
-            sched_sleepqueue.remove(t);
-            AddThreadToRunQueue(t);
-            t.t_sched_flags &= ~THREAD_SCHED_SUSPENDED;
-            t.t_flags &= ~THREAD_FLAG_TIMEOUT;
+        // Must be called with rq.rq_lock held
+        Thread* PickNextThreadToSchedule(RunQueue& rq, Thread& curThread)
+        {
+            // Threads may still be switching away on another CPU; leave them be
+            auto t = rq.rq_threads.Find(
+                [&](Thread& t) { return !t.IsActive() || &t == &curThread; });
+            if (t != nullptr)
+                RemoveThreadFromRunQueue(rq, *t);
+            return t;
         }
 
-        // Must be called with schedLock held
-        Thread& PickNextThreadToSchedule(Thread& curThread, const int cpuid)
+        // Must be called without any runqueue locks held, with interrupts disabled
+        Thread* StealThread(RunQueue& rq)
         {
-            KASSERT(!sched_runqueue.empty(), "runqueue cannot be empty");
-            for (auto& t : sched_runqueue) {
-                if (t.t_affinity != THREAD_AFFINITY_ANY && t.t_affinity != cpuid)
-                    continue; // not possible on this CPU
-                if (t.IsActive() && &t != &curThread)
-                    continue;
-                return t;
+            const int numCPUs = runQueues.size();
+            for (int n = 1; n < numCPUs; ++n) {
+                auto& victim = *runQueues[(rq.rq_cpuid + n) % numCPUs];
+                if (victim.rq_numThreads.load(util::memory_order::relaxed) == 0)
+                    continue; // nothing to steal here
+
+                victim.rq_lock.Lock();
+                auto t = victim.rq_threads.Find([](Thread& t) {
+                    return t.t_affinity == THREAD_AFFINITY_ANY && !t.IsActive();
+                });
+                if (t != nullptr)
+                    RemoveThreadFromRunQueue(victim, *t);
+                victim.rq_lock.Unlock();
+                if (t != nullptr)
+                    return t;
             }
-            panic("nothing on the runqueue for cpu %u", cpuid);
+            return nullptr;
         }
 
-        // Must be called with schedLock held
-        void AddThreadToSleepQueue(Thread& t)
+        // Must be called with rq.rq_lock held
+        void AddThreadToTimeoutQueue(RunQueue& rq, Thread& t)
         {
-            if (t.t_flags & THREAD_FLAG_TIMEOUT) {
-                for (auto& st : sched_sleepqueue) {
-                    if ((st.t_flags & THREAD_FLAG_TIMEOUT) &&
-                        time::IsTickBefore(st.t_timeout, t.t_timeout))
-                        continue; // st wakes up earlier than we do
-                    sched_sleepqueue.insert(st, t);
-                    return;
-                }
+            t.t_sched_cpu = rq.rq_cpuid;
+            rq.rq_timeouts.Add(t);
+        }
+
+        // Must be called with rq.rq_lock held and interrupts disabled
+        void ArmTimer(RunQueue& rq, Thread& newThread)
+        {
+            const auto now = time::GetNanosecondsSinceBoot();
+
+            // The idle thread can run for as long as it likes
+            bool haveDeadline = &newThread != &rq.rq_idleThread;
+            uint64_t deadline = now + timesliceInNs;
+
+            if (tick_t next; rq.rq_timeouts.GetNextEvent(next)) {
+                const auto nextInNs = time::TicksToNanoseconds(next);
+                if (!haveDeadline || nextInNs < deadline)
+                    deadline = nextInNs;
+                haveDeadline = true;
+            }
+
+            if (!haveDeadline) {
+                md::timer::ArmOneShot(0); // nothing to do until we are interrupted
+                return;
+            }
+            md::timer::ArmOneShot(deadline > now ? deadline - now : 1);
+        }
+
+        void RequestReschedule(RunQueue& rq)
+        {
+            if (rq.rq_cpuid == PCPU_GET(cpuid))
+                thread::GetCurrent().t_flags |= THREAD_FLAG_RESCHEDULE;
+            else
+                md::smp::Reschedule(rq.rq_cpuid);
+        }
+
+        /*
+         * Called after thread t has been placed on runqueue rq; ensures someone will act on
+         * it without waiting for a timer to expire. Must be called with interrupts disabled.
+         */
+        void KickCPU(RunQueue& rq, Thread& t)
+        {
+            if (!scheduler::IsActive() || &t == &rq.rq_idleThread)
+                return;
+
+            // Preempt the target CPU if it is running something less important
+            auto curThread = rq.rq_pcpu.curthread;
+            if (curThread != nullptr && t.t_priority < curThread->t_priority) {
+                RequestReschedule(rq);
+                return;
+            }
+
+            // Otherwise, have an idle CPU steal it if we can
+            if (t.t_affinity != THREAD_AFFINITY_ANY)
+                return;
+            for (auto idleRQ : runQueues) {
+                if (idleRQ->rq_pcpu.curthread != &idleRQ->rq_idleThread)
+                    continue;
+                RequestReschedule(*idleRQ);
+                break;
             }
-            sched_sleepqueue.push_back(t);
         }
 
     } // unnamed namespace
 
+    void InitCPU(PCPU& pcpu)
+    {
+        auto rq = new RunQueue(pcpu);
+        if (runQueues.size() <= pcpu.cpuid)
+            runQueues.resize(pcpu.cpuid + 1);
+        runQueues[pcpu.cpuid] = rq;
+        pcpu.runqueue = rq;
+    }
+
     void InitThread(Thread& t)
     {
         {
-            SchedLockGuard g(schedLock);
+            SchedLockGuard g(sleepQueueLock);
             Prove<NotOnAnyQueue>(t);
 
             // New threads are initially suspended
@@ -159,7 +476,35 @@ namespace scheduler
 
     void ResumeThread(Thread& t)
     {
-        SchedLockGuard g(schedLock);
+        /*
+         * A thread with a timeout is on the timer wheel of the CPU it went to sleep on; resume it
+         * there. The flag and CPU can only be trusted with that runqueue's lock held, as the wheel
+         * may be expiring the thread concurrently.
+         */
+        while (t.t_flags & THREAD_FLAG_TIMEOUT) {
+            auto& rq = *runQueues[t.t_sched_cpu];
+            SchedLockGuard g(rq.rq_lock);
+            if ((t.t_flags & THREAD_FLAG_TIMEOUT) == 0) {
+                // Expired while we were acquiring the lock; nothing left to do if it is runnable
+                if (!t.IsSuspended())
+                    return;
+                break;
+            }
+            if (t.t_sched_cpu != rq.rq_cpuid && t.IsSuspended())
+                continue; // went to sleep elsewhere meanwhile; try that CPU instead
+            if (!t.IsSuspended() && scheduler::IsActive())
+                panic("resuming nonsuspended thread %p", &t);
+            Prove<OnlyOnSleepQueue>(t);
+
+            rq.rq_timeouts.Remove(t);
+            AddThreadToRunQueue(rq, t);
+            t.t_sched_flags &= ~THREAD_SCHED_SUSPENDED;
+            t.t_flags &= ~THREAD_FLAG_TIMEOUT;
+            KickCPU(rq, t);
+            return;
+        }
+
+        SchedLockGuard g(sleepQueueLock);
 
         // XXX This condition is likely obsoleted...
         if (!t.IsSuspended() && scheduler::IsActive())
@@ -169,20 +514,34 @@ namespace scheduler
         Prove<OnlyOnSleepQueue>(t);
 
         sched_sleepqueue.remove(t);
-        AddThreadToRunQueue(t);
+
+        auto& rq = GetRunQueueForThread(t);
+        rq.rq_lock.Lock();
+        AddThreadToRunQueue(rq, t);
         t.t_sched_flags &= ~THREAD_SCHED_SUSPENDED;
-        t.t_flags &= ~THREAD_FLAG_TIMEOUT;
+        KickCPU(rq, t);
+        rq.rq_lock.Unlock();
     }
 
     void SuspendThread(Thread& t)
     {
-        SchedLockGuard g(schedLock);
-
+        KASSERT(&t == &thread::GetCurrent(), "suspending thread %p which is not current", &t);
         KASSERT(!t.IsSuspended(), "suspending thread %p that is already suspended", &t);
-        Prove<OnlyOnRunQueue>(t);
 
-        sched_runqueue.remove(t);
-        AddThreadToSleepQueue(t);
+        if (t.t_flags & THREAD_FLAG_TIMEOUT) {
+            auto& rq = *PCPU_GET(runqueue);
+            SchedLockGuard g(rq.rq_lock);
+            Prove<NotOnAnyQueue>(t);
+
+            AddThreadToTimeoutQueue(rq, t);
+            t.t_sched_flags |= THREAD_SCHED_SUSPENDED;
+            return;
+        }
+
+        SchedLockGuard g(sleepQueueLock);
+        Prove<NotOnAnyQueue>(t);
+
+        sched_sleepqueue.push_back(t);
         t.t_sched_flags |= THREAD_SCHED_SUSPENDED;
     }
 
@@ -190,32 +549,30 @@ namespace scheduler
     {
         /*
          * Note that interrupts must be disabled - this is important because we are about to
-         * remove the thread from the schedulers runqueue, and it will not be re-added again.
+         * turn the thread into a zombie, and it will never be re-added to a runqueue again.
          * Thus, if a context switch would occur, the final exiting code will not be run.
          */
-        schedLock.LockUnpremptible();
+        auto& rq = *PCPU_GET(runqueue);
+        rq.rq_lock.LockUnpremptible();
 
-        Prove<OnlyOnRunQueue>(t);
-        sched_runqueue.remove(t);
+        Prove<NotOnAnyQueue>(t);
 
         /*
-         * Turn the thread into a zombie; we'll soon be letting go of the scheduler lock, but all
+         * Turn the thread into a zombie; we'll soon be letting go of the runqueue lock, but all
          * resources are gone and the thread can be destroyed from now on - interrupts are disabled,
          * so we'll be certain to clear the active flag. A thread which is an inactive zombie won't
          * be scheduled anymore because it's on neither runqueue nor sleepqueue; the scheduler won't
          * know about the thread at all.
          */
         t.t_flags |= THREAD_FLAG_ZOMBIE;
-        /* Let go of the scheduler lock but leave interrupts disabled */
-        schedLock.Unlock();
+        /* Let go of the runqueue lock but leave interrupts disabled */
+        rq.rq_lock.Unlock();
 
         // Note: we expect the caller to clean up and reschedule() !
     }
 
     extern "C" void scheduler_release(Thread* old)
     {
-        SchedLockGuard g(schedLock);
-
         /* Release the old thread; it is now safe to schedule it elsewhere */
         old->t_sched_flags &= ~THREAD_SCHED_ACTIVE;
     }
@@ -223,60 +580,71 @@ namespace scheduler
     void Schedule()
     {
         auto& curThread = thread::GetCurrent();
-        const int cpuid = PCPU_GET(cpuid);
+        auto& rq = *PCPU_GET(runqueue);
 
         /*
-         * Grab the scheduler lock and disable interrupts; note that they need not be
+         * Grab the runqueue lock and disable interrupts; note that they need not be
          * enabled - this happens in interrupt context, which needs to clean up
          * before another interrupt can be handled.
          */
-        auto state = schedLock.LockUnpremptible();
+        auto state = rq.rq_lock.LockUnpremptible();
 
         // Cancel any rescheduling as we are about to schedule here
         curThread.t_flags &= ~THREAD_FLAG_RESCHEDULE;
 
-        /*
-         * See if the first item on the sleepqueue is worth waking up; we'll only
-         * look at the first item as we expect them to be added in a sorted way.
-         */
-        WakeupSleepingThreads();
-
-        // Pick the next thread to schedule
-        auto& newThread = PickNextThreadToSchedule(curThread, cpuid);
-
-        // Sanity checks
-        KASSERT(!newThread.IsSuspended(), "activating suspended thread %p", &newThread);
-        KASSERT(
-            &newThread == &curThread || !newThread.IsActive(), "activating active thread %p",
-            &newThread);
-        Prove<OnlyOnRunQueue>(newThread);
+        // Wake up every thread on this CPU whose timeout has expired
+        WakeupSleepingThreads(rq);
 
         /*
          * If the current thread is not suspended, this means it got interrupted
-         * involuntary and must be placed back on the running queue; otherwise it
-         * must have been placed on the runqueue already. We'll add it to the back,
-         * in order to obtain round-robin scheduling within each priority level.
+         * involuntary and must be placed back on the runqueue. We'll add it to the
+         * back, in order to obtain round-robin scheduling within each priority
+         * level. It may already be queued if it was resumed while it was still
+         * running; in that case, whichever CPU it was queued on will pick it up.
          *
          * We must also take care not to re-add zombie threads; these must not be
          * re-added to either scheduler queue.
          */
-        if (!curThread.IsSuspended() && !curThread.IsZombie()) {
-            sched_runqueue.remove(curThread);
-            AddThreadToRunQueue(curThread);
+        if (!curThread.IsSuspended() && !curThread.IsZombie() &&
+            (curThread.t_sched_flags & THREAD_SCHED_QUEUED) == 0)
+            AddThreadToRunQueue(rq, curThread);
+
+        // Pick the next thread to schedule
+        auto newThread = PickNextThreadToSchedule(rq, curThread);
+        if (newThread == nullptr) {
+            /*
+             * Nothing to do on this CPU; try to steal work from the others. Our own
+             * lock is released while doing so, this avoids lock-order issues.
+             */
+            rq.rq_lock.Unlock();
+            newThread = StealThread(rq);
+            rq.rq_lock.Lock();
+            if (newThread == nullptr)
+                newThread = &rq.rq_idleThread;
         }
 
+        // Sanity checks
+        KASSERT(!newThread->IsSuspended(), "activating suspended thread %p", newThread);
+        KASSERT(
+            newThread == &curThread || !newThread->IsActive(), "activating active thread %p",
+            newThread);
+        Prove<NotOnAnyQueue>(*newThread);
+
         /*
          * Schedule our new thread; by marking it as active, it will not be picked up by another
          * CPU.
          */
-        newThread.t_sched_flags |= THREAD_SCHED_ACTIVE;
-        PCPU_SET(curthread, &newThread);
+        newThread->t_sched_flags |= THREAD_SCHED_ACTIVE;
+        PCPU_SET(curthread, newThread);
+
+        // Ensure we'll be back when the timeslice ends or the next timeout expires
+        ArmTimer(rq, *newThread);
 
-        // Now unlock the scheduler lock but do _not_ enable interrupts
-        schedLock.Unlock();
+        // Now unlock the runqueue lock but do _not_ enable interrupts
+        rq.rq_lock.Unlock();
 
-        if (&curThread != &newThread) {
-            auto& prev = md::thread::SwitchTo(newThread, curThread);
+        if (&curThread != newThread) {
+            auto& prev = md::thread::SwitchTo(*newThread, curThread);
             scheduler_release(&prev);
         }
 
@@ -313,7 +681,7 @@ namespace
     void kdbPrintThread(Thread& t)
     {
         kprintf(
-            "  thread %p '%s' sched_flags %d flags 0x%x\n", &t, t.t_name, t.t_sched_flags,
+            "  thread %p '%s' sched_flags %d flags 0x%x\n", &t, t.t_name, t.t_sched_flags.load(),
             t.t_flags);
         kprintf("    process %d state %d\n", t.t_process.p_pid, t.t_process.p_state);
         if (auto& w = t.t_sqwaiter; w.w_sq) {
@@ -326,9 +694,14 @@ namespace
 
 const kdb::RegisterCommand
     kdbScheduler("scheduler", "Display scheduler status", [](int, const kdb::Argument*) {
-        kprintf("runqueue\n");
-        for (auto& s : scheduler::sched_runqueue) {
-            kdbPrintThread(s);
+        for (auto rq : scheduler::runQueues) {
+            kprintf("cpu %d runqueue (%d threads)\n", rq->rq_cpuid, rq->rq_numThreads.load());
+            rq->rq_threads.Find([](Thread& t) {
+                kdbPrintThread(t);
+                return false;
+            });
+            kprintf("cpu %d timeouts\n", rq->rq_cpuid);
+            rq->rq_timeouts.ForEach([](Thread& t) { kdbPrintThread(t); });
         }
         kprintf("sleepqueue\n");
         for (auto& s : scheduler::sched_sleepqueue) {
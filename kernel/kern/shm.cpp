@@ -7,11 +7,13 @@
 #include <ananas/errno.h>
 #include <sys/shm.h>
 #include "kernel/lib.h"
+#include "kernel/page.h"
 #include "kernel/shm.h"
 #include "kernel/process.h"
 #include "kernel/vm.h"
 #include "kernel/vmarea.h"
 #include "kernel/vmspace.h"
+#include "kernel-md/md.h"
 #include "kernel-md/param.h"
 
 namespace shm {
@@ -33,9 +35,24 @@ namespace shm {
         KASSERT((size & (PAGE_SIZE - 1)) == 0, "size not a multiple of PAGE_SIZE");
         const auto numPages = size / PAGE_SIZE;
         shm_pages.resize(numPages);
-        for (size_t n = 0; n < numPages; ++n) {
-            shm_pages[n] = &vmpage::Allocate(vmpage::flag::Promoted);
+        for (size_t n = 0; n < numPages; /* nothing */) {
+            // Prefer contiguous memory so that the segment can be mapped using large pages
+            constexpr size_t pagesPerLargePage = LARGE_PAGE_SIZE / PAGE_SIZE;
+            Page* p = nullptr;
+            if (numPages - n >= pagesPerLargePage)
+                p = page_alloc_order(LARGE_PAGE_ORDER, page::flag::Zero | page::flag::Try);
+            if (p != nullptr) {
+                page_split(*p);
+                for (size_t i = 0; i < pagesPerLargePage; ++i, ++n) {
+                    shm_pages[n] = &vmpage::Allocate(vmpage::flag::Promoted, p[i]);
+                    shm_pages[n]->Unlock();
+                }
+                continue;
+            }
+
+            shm_pages[n] = &vmpage::Allocate(vmpage::flag::Promoted, page::flag::Zero);
             shm_pages[n]->Unlock();
+            ++n;
         }
 
         MutexGuard g(mtx_shm);
@@ -87,18 +104,27 @@ namespace shm {
         const auto virt = vs.ReserveAdressRange(length);
         int flags = vm::flag::Private | vm::flag::User | vm::flag::Read | vm::flag::Write;
         VMArea* va;
-        vs.Map({ virt, virt + length }, 0, flags, flags, va);
+        vs.MapTo({ virt, virt + length }, flags, va);
 
         kprintf("shm %p id %d pid %d: mapping to %p\n", &sm, sm.shm_id, proc.p_pid, virt);
 
-        addr_t mapVirt = virt;
-        for(size_t n = 0; n < sm.shm_pages.size(); ++n) {
-            auto& p = *sm.shm_pages[n];
-            p.Lock();
-            p.Ref();
-            p.Map(vs, *va, mapVirt);
-            p.Unlock();
-            mapVirt += PAGE_SIZE;
+        for(auto p: sm.shm_pages) {
+            p->Lock();
+            p->Ref();
+            p->Unlock();
+        }
+
+        // Map physically contiguous runs at once; these may end up as large pages
+        const auto numPages = sm.shm_pages.size();
+        for(size_t n = 0; n < numPages; /* nothing */) {
+            const addr_t phys = sm.shm_pages[n]->GetPage()->GetPhysicalAddress();
+            size_t runLength = 1;
+            while (n + runLength < numPages &&
+                   sm.shm_pages[n + runLength]->GetPage()->GetPhysicalAddress() ==
+                       phys + runLength * PAGE_SIZE)
+                ++runLength;
+            md::vm::MapPages(vs, virt + n * PAGE_SIZE, phys, runLength, flags);
+            n += runLength;
         }
 
         {
@@ -0,0 +1,675 @@
+/*-
+ * SPDX-License-Identifier: Zlib
+ *
+ * Copyright (c) 2009-2018 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+/*
+ * Kernel memory allocator; this is a slab allocator with per-CPU magazines,
+ * as described in Bonwick and Adams, "Magazines and Vmem" (2001).
+ *
+ * - Requests are rounded up to one of a fixed set of size classes, each of
+ *   which has its own cache. Anything beyond the largest class is allocated
+ *   from the page allocator directly.
+ * - Every object is preceded by an ObjectHeader, which tells us which slab the
+ *   object came from once it is freed. Large allocations have no header, so
+ *   that a page-sized request needs only a single page; they are page-aligned
+ *   and recorded in a hash table instead.
+ * - Caches carve their objects from slabs of 2^order pages. Slabs that
+ *   become completely unused are handed back to the page allocator, except
+ *   for a single one which we keep around to prevent thrashing.
+ * - On top of the slabs, every CPU has two magazines per cache: stacks of
+ *   free objects which it can allocate from and free to while only disabling
+ *   interrupts. If both are exhausted, a full or empty magazine is exchanged
+ *   with the depot of the cache, which is protected by the cache mutex.
+ * - Objects in the depot may keep otherwise unused slabs alive; the reaper
+ *   thread periodically frees the magazines that were not needed during the
+ *   last interval (the working set algorithm from the paper)
+ */
+#include <ananas/types.h>
+#include <ananas/util/atomic.h>
+#include "kernel/init.h"
+#include "kernel/kdb.h"
+#include "kernel/kmem.h"
+#include "kernel/lib.h"
+#include "kernel/lock.h"
+#include "kernel/mm.h"
+#include "kernel/page.h"
+#include "kernel/pcpu.h"
+#include "kernel/result.h"
+#include "kernel/slab.h"
+#include "kernel/thread.h"
+#include "kernel/vm.h"
+#include "kernel-md/interrupts.h"
+#include "kernel-md/param.h"
+
+namespace slab
+{
+    namespace
+    {
+        // Number of objects a single magazine can hold
+        constexpr size_t MagazineSize = 14;
+        // Maximum number of full and empty magazines each kept in a depot
+        constexpr size_t DepotLimit = 16;
+        // Slabs are grown until they hold at least this number of objects...
+        constexpr size_t MinimumObjectsPerSlab = 8;
+        // ... or reach this order
+        constexpr unsigned int MaximumSlabOrder = 3;
+        // Number of completely unused slabs a cache keeps
+        constexpr size_t EmptySlabsToKeep = 1;
+        // Interval at which unneeded depot magazines are freed
+        constexpr unsigned int ReapIntervalInMs = 15000;
+
+        // Number of buckets of the large allocation hash table
+        constexpr size_t NumberOfLargeBuckets = 64;
+
+        // Header preceding every object allocated from a cache
+        struct ObjectHeader {
+            void* oh_slab;       // Slab containing the object
+            uintptr_t oh_unused; // Keeps objects 16-byte aligned
+        };
+        static_assert(sizeof(ObjectHeader) == 16, "object alignment would be broken");
+
+        // Object sizes of the caches, including the header
+        constexpr size_t sizeClasses[] = {32,  48,  64,   96,   128,  192,  256, 384,
+                                          512, 768, 1024, 1536, 2048, 3072, 4096};
+        constexpr size_t NumberOfSizeClasses = sizeof(sizeClasses) / sizeof(sizeClasses[0]);
+        constexpr size_t LargestSizeClass = sizeClasses[NumberOfSizeClasses - 1];
+        constexpr size_t SizeClassGranularity = 16;
+
+        // Maps a length, in units of SizeClassGranularity, to the size class to use
+        struct SizeClassIndex {
+            uint8_t sci_class[LargestSizeClass / SizeClassGranularity + 1]{};
+        };
+
+        constexpr SizeClassIndex BuildSizeClassIndex()
+        {
+            SizeClassIndex sci;
+            size_t sizeClass = 0;
+            for (size_t n = 0; n < sizeof(sci.sci_class); ++n) {
+                while (sizeClasses[sizeClass] < n * SizeClassGranularity)
+                    ++sizeClass;
+                sci.sci_class[n] = sizeClass;
+            }
+            return sci;
+        }
+
+        constexpr auto sizeClassIndex = BuildSizeClassIndex();
+
+        struct Magazine {
+            Magazine* m_next = nullptr;
+            size_t m_rounds = 0;
+            void* m_round[MagazineSize];
+
+            bool IsEmpty() const { return m_rounds == 0; }
+            bool IsFull() const { return m_rounds == MagazineSize; }
+            void* Pop() { return m_round[--m_rounds]; }
+            void Push(void* obj) { m_round[m_rounds++] = obj; }
+        };
+
+        // Magazines of a single CPU for a single cache; only used with interrupts disabled
+        struct CPUCache {
+            Magazine* cc_loaded = nullptr;
+            Magazine* cc_previous = nullptr;
+        };
+    } // unnamed namespace
+
+    struct CPUCaches {
+        CPUCache cc_cache[NumberOfSizeClasses];
+    };
+
+    namespace
+    {
+        // Overlays a free object
+        struct FreeObject {
+            FreeObject* fo_next;
+        };
+
+        class Cache;
+
+        // Slab administration; stored at the start of the slab itself
+        struct Slab : util::List<Slab>::NodePtr {
+            Cache* sl_cache = nullptr;
+            Page* sl_page = nullptr;
+            FreeObject* sl_free = nullptr; // Available objects
+            size_t sl_inuse = 0;           // Number of objects handed out
+        };
+        typedef util::List<Slab> SlabList;
+
+        constexpr size_t SlabHeaderSize =
+            (sizeof(Slab) + SizeClassGranularity - 1) & ~(SizeClassGranularity - 1);
+
+        ObjectHeader& GetHeader(void* ptr) { return static_cast<ObjectHeader*>(ptr)[-1]; }
+
+        Magazine* AllocateMagazine();
+        void FreeMagazine(Magazine* m);
+
+        /*
+         * A cache of objects of a single size. Everything marked [c] is protected by
+         * c_mutex. Caches without an index (i.e. the magazine cache) do not use
+         * magazines.
+         */
+        class Cache
+        {
+          public:
+            Cache(const char* name, size_t objectSize, int index);
+            Cache(const Cache&) = delete;
+            Cache& operator=(const Cache&) = delete;
+
+            void* Allocate();
+            void Free(void* ptr);
+            void Reap();
+            void Dump() const;
+
+          private:
+            size_t GetObjectsPerSlab(unsigned int order) const
+            {
+                return ((PAGE_SIZE << order) - SlabHeaderSize) / c_objectSize;
+            }
+            CPUCache* GetCPUCache() const;
+
+            void* AllocateFromCPU(CPUCache& cc);
+            bool FreeToCPU(CPUCache& cc, void* ptr);
+            void* AllocateFromDepot();
+            bool FreeToDepot(void* ptr);
+            void ReturnMagazine(Magazine* m);
+            void* AllocateFromSlab();
+            void FreeToSlab(void* ptr);
+            void CreateSlab();
+            void DestroySlab(Slab& slab);
+
+            Mutex c_mutex{"slab"};
+            char c_name[16];
+            const size_t c_objectSize;
+            const int c_index;
+            unsigned int c_slabOrder = 0;
+            size_t c_objectsPerSlab = 0;
+
+            SlabList c_partialSlabs;              // [c]
+            SlabList c_fullSlabs;                 // [c]
+            SlabList c_emptySlabs;                // [c]
+            size_t c_numSlabs = 0;                // [c]
+            size_t c_numEmptySlabs = 0;           // [c]
+            size_t c_objectsInUse = 0;            // [c] Also counts objects in magazines
+            Magazine* c_fullMagazines = nullptr;  // [c]
+            Magazine* c_emptyMagazines = nullptr; // [c]
+            size_t c_numFullMagazines = 0;        // [c]
+            size_t c_numEmptyMagazines = 0;       // [c]
+            size_t c_minFullMagazines = 0;        // [c] Lowest count since the last reap
+            size_t c_minEmptyMagazines = 0;       // [c] Lowest count since the last reap
+        };
+
+        template<typename T>
+        void Swap(T& a, T& b)
+        {
+            T t = a;
+            a = b;
+            b = t;
+        }
+
+        Magazine* PopMagazine(Magazine*& list, size_t& count)
+        {
+            auto m = list;
+            if (m != nullptr) {
+                list = m->m_next;
+                --count;
+            }
+            return m;
+        }
+
+        void PushMagazine(Magazine*& list, size_t& count, Magazine* m)
+        {
+            m->m_next = list;
+            list = m;
+            ++count;
+        }
+
+        Cache::Cache(const char* name, size_t objectSize, int index)
+            : c_objectSize(objectSize), c_index(index)
+        {
+            KASSERT(strlen(name) < sizeof(c_name), "name too long");
+            strcpy(c_name, name);
+
+            // Use the smallest slab that holds enough objects
+            while (c_slabOrder < MaximumSlabOrder &&
+                   GetObjectsPerSlab(c_slabOrder) < MinimumObjectsPerSlab)
+                ++c_slabOrder;
+            c_objectsPerSlab = GetObjectsPerSlab(c_slabOrder);
+        }
+
+        // Must be called with interrupts disabled
+        CPUCache* Cache::GetCPUCache() const
+        {
+            if (c_index < 0)
+                return nullptr;
+            auto caches = PCPU_GET(slabcaches);
+            return caches != nullptr ? &caches->cc_cache[c_index] : nullptr;
+        }
+
+        void* Cache::AllocateFromCPU(CPUCache& cc)
+        {
+            if (cc.cc_loaded == nullptr || cc.cc_loaded->IsEmpty()) {
+                if (cc.cc_previous == nullptr || cc.cc_previous->IsEmpty())
+                    return nullptr;
+                Swap(cc.cc_loaded, cc.cc_previous);
+            }
+            return cc.cc_loaded->Pop();
+        }
+
+        bool Cache::FreeToCPU(CPUCache& cc, void* ptr)
+        {
+            if (cc.cc_loaded == nullptr || cc.cc_loaded->IsFull()) {
+                if (cc.cc_previous == nullptr || cc.cc_previous->IsFull())
+                    return false;
+                Swap(cc.cc_loaded, cc.cc_previous);
+            }
+            cc.cc_loaded->Push(ptr);
+            return true;
+        }
+
+        void* Cache::AllocateFromDepot()
+        {
+            if (c_index < 0)
+                return nullptr;
+
+            Magazine* full;
+            {
+                MutexGuard g(c_mutex);
+                full = PopMagazine(c_fullMagazines, c_numFullMagazines);
+                if (c_numFullMagazines < c_minFullMagazines)
+                    c_minFullMagazines = c_numFullMagazines;
+            }
+            if (full == nullptr)
+                return nullptr;
+
+            /*
+             * Load the full magazine; we may have been moved to a different CPU in
+             * the meantime, but that does not matter as the magazine we replace is
+             * handed back to the depot whatever its contents.
+             */
+            void* obj;
+            Magazine* old = full;
+            {
+                register_t state = md::interrupts::SaveAndDisable();
+                if (auto cc = GetCPUCache(); cc != nullptr) {
+                    old = cc->cc_previous;
+                    cc->cc_previous = cc->cc_loaded;
+                    cc->cc_loaded = full;
+                }
+                obj = full->Pop();
+                md::interrupts::Restore(state);
+            }
+
+            if (old != nullptr)
+                ReturnMagazine(old);
+            return obj;
+        }
+
+        bool Cache::FreeToDepot(void* ptr)
+        {
+            if (c_index < 0)
+                return false;
+
+            Magazine* empty;
+            {
+                MutexGuard g(c_mutex);
+                empty = PopMagazine(c_emptyMagazines, c_numEmptyMagazines);
+                if (c_numEmptyMagazines < c_minEmptyMagazines)
+                    c_minEmptyMagazines = c_numEmptyMagazines;
+            }
+            if (empty == nullptr)
+                empty = AllocateMagazine();
+
+            Magazine* old = empty;
+            {
+                register_t state = md::interrupts::SaveAndDisable();
+                if (auto cc = GetCPUCache(); cc != nullptr) {
+                    old = cc->cc_previous;
+                    cc->cc_previous = cc->cc_loaded;
+                    cc->cc_loaded = empty;
+                }
+                empty->Push(ptr);
+                md::interrupts::Restore(state);
+            }
+
+            if (old != nullptr)
+                ReturnMagazine(old);
+            return true;
+        }
+
+        void Cache::ReturnMagazine(Magazine* m)
+        {
+            {
+                MutexGuard g(c_mutex);
+                if (m->IsFull() && c_numFullMagazines < DepotLimit) {
+                    PushMagazine(c_fullMagazines, c_numFullMagazines, m);
+                    return;
+                }
+
+                // Partially filled or too many objects cached; give them back to the slabs
+                while (!m->IsEmpty())
+                    FreeToSlab(m->Pop());
+                if (c_numEmptyMagazines < DepotLimit) {
+                    PushMagazine(c_emptyMagazines, c_numEmptyMagazines, m);
+                    return;
+                }
+            }
+            FreeMagazine(m);
+        }
+
+        // Must be called with c_mutex held
+        void Cache::CreateSlab()
+        {
+            c_mutex.AssertLocked();
+
+            Page* page;
+            auto mem = static_cast<char*>(
+                page_alloc_order_mapped(c_slabOrder, page, vm::flag::Read | vm::flag::Write));
+            KASSERT(mem != nullptr, "out of memory growing cache '%s'", c_name);
+
+            auto slab = new (mem) Slab;
+            slab->sl_cache = this;
+            slab->sl_page = page;
+
+            auto obj = mem + SlabHeaderSize;
+            for (size_t n = 0; n < c_objectsPerSlab; ++n, obj += c_objectSize) {
+                auto oh = new (obj) ObjectHeader{slab, 0};
+                auto fo = reinterpret_cast<FreeObject*>(oh + 1);
+                fo->fo_next = slab->sl_free;
+                slab->sl_free = fo;
+            }
+
+            c_emptySlabs.push_back(*slab);
+            ++c_numEmptySlabs;
+            ++c_numSlabs;
+        }
+
+        // Must be called with c_mutex held
+        void Cache::DestroySlab(Slab& slab)
+        {
+            c_mutex.AssertLocked();
+            KASSERT(slab.sl_inuse == 0, "destroying slab with %d object(s) in use", slab.sl_inuse);
+
+            auto page = slab.sl_page;
+            --c_numSlabs;
+            kmem_unmap(&slab, PAGE_SIZE << c_slabOrder);
+            page_free(*page);
+        }
+
+        void* Cache::AllocateFromSlab()
+        {
+            MutexGuard g(c_mutex);
+
+            Slab* slab;
+            if (!c_partialSlabs.empty()) {
+                slab = &c_partialSlabs.front();
+            } else {
+                if (c_emptySlabs.empty())
+                    CreateSlab();
+                slab = &c_emptySlabs.front();
+                c_emptySlabs.pop_front();
+                --c_numEmptySlabs;
+                c_partialSlabs.push_front(*slab);
+            }
+
+            auto fo = slab->sl_free;
+            slab->sl_free = fo->fo_next;
+            ++slab->sl_inuse;
+            ++c_objectsInUse;
+            if (slab->sl_inuse == c_objectsPerSlab) {
+                c_partialSlabs.remove(*slab);
+                c_fullSlabs.push_back(*slab);
+            }
+            return fo;
+        }
+
+        // Must be called with c_mutex held
+        void Cache::FreeToSlab(void* ptr)
+        {
+            c_mutex.AssertLocked();
+
+            auto& slab = *static_cast<Slab*>(GetHeader(ptr).oh_slab);
+            KASSERT(slab.sl_cache == this, "freeing %p to wrong cache '%s'", ptr, c_name);
+            KASSERT(slab.sl_inuse > 0, "freeing %p to unused slab", ptr);
+
+            if (slab.sl_inuse == c_objectsPerSlab) {
+                c_fullSlabs.remove(slab);
+                c_partialSlabs.push_front(slab);
+            }
+
+            auto fo = static_cast<FreeObject*>(ptr);
+            fo->fo_next = slab.sl_free;
+            slab.sl_free = fo;
+            --slab.sl_inuse;
+            --c_objectsInUse;
+            if (slab.sl_inuse > 0)
+                return;
+
+            // Slab is no longer used; keep it if we have few of those
+            c_partialSlabs.remove(slab);
+            if (c_numEmptySlabs < EmptySlabsToKeep) {
+                c_emptySlabs.push_back(slab);
+                ++c_numEmptySlabs;
+            } else {
+                DestroySlab(slab);
+            }
+        }
+
+        void* Cache::Allocate()
+        {
+            // Fast path: take an object from one of our own magazines
+            {
+                void* obj = nullptr;
+                register_t state = md::interrupts::SaveAndDisable();
+                if (auto cc = GetCPUCache(); cc != nullptr)
+                    obj = AllocateFromCPU(*cc);
+                md::interrupts::Restore(state);
+                if (obj != nullptr)
+                    return obj;
+            }
+
+            if (auto obj = AllocateFromDepot(); obj != nullptr)
+                return obj;
+            return AllocateFromSlab();
+        }
+
+        void Cache::Free(void* ptr)
+        {
+            // Fast path: put the object in one of our own magazines
+            {
+                bool freed = false;
+                register_t state = md::interrupts::SaveAndDisable();
+                if (auto cc = GetCPUCache(); cc != nullptr)
+                    freed = FreeToCPU(*cc, ptr);
+                md::interrupts::Restore(state);
+                if (freed)
+                    return;
+            }
+
+            if (FreeToDepot(ptr))
+                return;
+
+            MutexGuard g(c_mutex);
+            FreeToSlab(ptr);
+        }
+
+        // Frees the depot magazines that were not needed since the previous call
+        void Cache::Reap()
+        {
+            Magazine* unneeded = nullptr;
+            size_t numUnneeded = 0;
+            {
+                MutexGuard g(c_mutex);
+                for (; c_minFullMagazines > 0; --c_minFullMagazines) {
+                    auto m = PopMagazine(c_fullMagazines, c_numFullMagazines);
+                    while (!m->IsEmpty())
+                        FreeToSlab(m->Pop());
+                    PushMagazine(unneeded, numUnneeded, m);
+                }
+                for (; c_minEmptyMagazines > 0; --c_minEmptyMagazines) {
+                    auto m = PopMagazine(c_emptyMagazines, c_numEmptyMagazines);
+                    PushMagazine(unneeded, numUnneeded, m);
+                }
+                c_minFullMagazines = c_numFullMagazines;
+                c_minEmptyMagazines = c_numEmptyMagazines;
+            }
+
+            while (auto m = PopMagazine(unneeded, numUnneeded))
+                FreeMagazine(m);
+        }
+
+        // Called from kdb; this does not lock anything
+        void Cache::Dump() const
+        {
+            const size_t slabSize = PAGE_SIZE << c_slabOrder;
+            const size_t capacity = c_numSlabs * c_objectsPerSlab;
+            kprintf(
+                "%s: %d byte objects, %d slab(s) of %d KB, %d/%d objects in use (%d%%)\n", c_name,
+                c_objectSize, c_numSlabs, slabSize / 1024, c_objectsInUse, capacity,
+                capacity > 0 ? (c_objectsInUse * 100) / capacity : 0);
+            kprintf(
+                "  %d empty slab(s), %d bytes unusable per slab, depot: %d full / %d empty\n",
+                c_numEmptySlabs, slabSize - SlabHeaderSize - c_objectsPerSlab * c_objectSize,
+                c_numFullMagazines, c_numEmptyMagazines);
+        }
+
+        // Caches are constructed in place; we cannot allocate memory for them
+        alignas(Cache) char cacheStorage[NumberOfSizeClasses][sizeof(Cache)];
+        alignas(Cache) char magazineCacheStorage[sizeof(Cache)];
+
+        Cache& GetCache(size_t index) { return *reinterpret_cast<Cache*>(cacheStorage[index]); }
+        Cache& GetMagazineCache() { return *reinterpret_cast<Cache*>(magazineCacheStorage); }
+
+        Magazine* AllocateMagazine() { return new (GetMagazineCache().Allocate()) Magazine; }
+
+        void FreeMagazine(Magazine* m) { GetMagazineCache().Free(m); }
+
+        namespace stats
+        {
+            util::atomic<size_t> largeAllocations;
+            util::atomic<size_t> largeBytes;
+        } // namespace stats
+
+        struct LargeAllocation {
+            LargeAllocation* la_next;
+            void* la_ptr;
+            Page* la_page;
+            size_t la_length; // Length of the mapping
+        };
+
+        Mutex largeMutex{"slablarge"};
+        LargeAllocation* largeBucket[NumberOfLargeBuckets]; // [largeMutex]
+
+        LargeAllocation*& GetLargeBucket(const void* ptr)
+        {
+            return largeBucket[(reinterpret_cast<addr_t>(ptr) / PAGE_SIZE) % NumberOfLargeBuckets];
+        }
+
+        void* AllocateLarge(size_t len)
+        {
+            auto la = new LargeAllocation;
+            la->la_ptr =
+                page_alloc_length_mapped(len, la->la_page, vm::flag::Read | vm::flag::Write);
+            KASSERT(la->la_ptr != nullptr, "out of memory allocating %u bytes", len);
+            la->la_length = PAGE_SIZE << la->la_page->p_order;
+            ++stats::largeAllocations;
+            stats::largeBytes += la->la_length;
+
+            MutexGuard g(largeMutex);
+            auto& bucket = GetLargeBucket(la->la_ptr);
+            la->la_next = bucket;
+            bucket = la;
+            return la->la_ptr;
+        }
+
+        // Returns false if ptr is not a large allocation
+        bool FreeLarge(void* ptr)
+        {
+            LargeAllocation* la;
+            {
+                MutexGuard g(largeMutex);
+                auto prev = &GetLargeBucket(ptr);
+                while (*prev != nullptr && (*prev)->la_ptr != ptr)
+                    prev = &(*prev)->la_next;
+                la = *prev;
+                if (la == nullptr)
+                    return false;
+                *prev = la->la_next;
+            }
+
+            --stats::largeAllocations;
+            stats::largeBytes -= la->la_length;
+            kmem_unmap(la->la_ptr, la->la_length);
+            page_free(*la->la_page);
+            delete la;
+            return true;
+        }
+
+    } // unnamed namespace
+
+    void* Allocate(size_t len)
+    {
+        const size_t size = len + sizeof(ObjectHeader);
+        if (size > LargestSizeClass)
+            return AllocateLarge(len);
+
+        const auto index =
+            sizeClassIndex.sci_class[(size + SizeClassGranularity - 1) / SizeClassGranularity];
+        return GetCache(index).Allocate();
+    }
+
+    void Free(void* ptr)
+    {
+        if (ptr == nullptr)
+            return;
+
+        // Large allocations are page-aligned; objects from a cache may be as well
+        if ((reinterpret_cast<addr_t>(ptr) & (PAGE_SIZE - 1)) == 0 && FreeLarge(ptr))
+            return;
+        static_cast<Slab*>(GetHeader(ptr).oh_slab)->sl_cache->Free(ptr);
+    }
+
+    void Initialize()
+    {
+        new (magazineCacheStorage) Cache("magazine", sizeof(Magazine) + sizeof(ObjectHeader), -1);
+        for (size_t n = 0; n < NumberOfSizeClasses; ++n) {
+            char name[16];
+            sprintf(name, "kmalloc-%d", static_cast<int>(sizeClasses[n]));
+            new (cacheStorage[n]) Cache(name, sizeClasses[n], n);
+        }
+    }
+
+    void InitCPU(PCPU& pcpu) { pcpu.slabcaches = new CPUCaches; }
+
+    namespace
+    {
+        Thread* reaperThread;
+
+        void ReaperThread(void*)
+        {
+            while (true) {
+                thread_sleep_ms(ReapIntervalInMs);
+                for (size_t n = 0; n < NumberOfSizeClasses; ++n)
+                    GetCache(n).Reap();
+            }
+        }
+
+        const init::OnInit initReaper(init::SubSystem::Thread, init::Order::Middle, []() {
+            if (auto result = kthread_alloc("slabreap", &ReaperThread, nullptr, reaperThread);
+                result.IsFailure())
+                panic("cannot create slabreap thread");
+            reaperThread->Resume();
+        });
+    } // unnamed namespace
+
+    const kdb::RegisterCommand
+        kdbMalloc("malloc", "Display kernel memory caches", [](int, const kdb::Argument*) {
+            for (size_t n = 0; n < NumberOfSizeClasses; ++n)
+                GetCache(n).Dump();
+            GetMagazineCache().Dump();
+            kprintf(
+                "large allocations: %d using %d KB\n", stats::largeAllocations.load(),
+                stats::largeBytes.load() / 1024);
+        });
+
+} // namespace slab
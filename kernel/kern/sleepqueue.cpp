@@ -16,14 +16,11 @@ namespace
 {
     void WakeupWaiter(sleep_queue::Waiter& waiter)
     {
-        auto& curThread = thread::GetCurrent();
         auto& waitingThread = *waiter.w_thread;
 
+        // Resuming takes care of preemption if the waiter is more important than us
         waiter.w_signalled = true;
         waitingThread.Resume();
-
-        if (curThread.t_priority < waitingThread.t_priority)
-            curThread.t_flags |= THREAD_FLAG_RESCHEDULE;
     }
 } // unnamed namespace
 
@@ -162,8 +162,8 @@ void Thread::Suspend()
 
 void thread_sleep_ms(unsigned int ms)
 {
-    unsigned int msPerTick = 1000 / time::GetPeriodicyInHz();
-    tick_t num_ticks = ms / msPerTick;
+    // Round up, so that we sleep at least the requested amount of time
+    tick_t num_ticks = (static_cast<tick_t>(ms) * time::GetPeriodicyInHz() + 999) / 1000;
     if (num_ticks == 0)
         num_ticks = 1; // delay at least one tick
     thread::SleepUntilTick(time::GetTicks() + num_ticks);
@@ -5,22 +5,113 @@
  * For conditions of distribution and use, see LICENSE file
  */
 #include <ananas/types.h>
+#include <ananas/clockpage.h>
+#include <ananas/util/atomic.h>
+#include <machine/param.h>
 #include "kernel/time.h"
+#include "kernel/lib.h"
 #include "kernel/lock.h"
+#include "kernel/page.h"
 #include "kernel/pcpu.h"
 #include "kernel/schedule.h"
 #include "kernel/thread.h"
+#include "kernel/vm.h"
+#include "kernel-md/interrupts.h"
+#include "kernel-md/md.h"
 
 namespace time
 {
     namespace
     {
-        // XXX Maybe using a spinlock here isn't such a good idea - we could benefit much more
-        //     from atomic add/subtract/compare...
-        Spinlock time_lock;
-        tick_t ticks = 0;
-        struct timespec time_boot;
-        struct timespec time_current;
+        constexpr uint64_t nsPerSecond = 1'000'000'000;
+        constexpr int multShift = 32;
+
+        // Frequency estimates that are off by more than this are rejected as bogus
+        constexpr uint64_t maxFrequencyCorrectionInPPM = 10'000;
+        // Minimum interval between synchronisations to estimate the frequency
+        constexpr time_t minimumSyncIntervalInSeconds = 16;
+
+        /*
+         * The clock converts the free-running MD counter to nanoseconds since boot
+         * using a fixed-point multiplier; the realtime clock is a fixed offset to
+         * that. Readers never lock: they take a snapshot of the state and retry if
+         * it was updated meanwhile (a sequence lock). Writers are serialised by
+         * clockLock and keep clockSeq odd while updating.
+         */
+        struct ClockState {
+            uint64_t cs_counterBase;   // counter value at which cs_nsBase was valid
+            uint64_t cs_nsBase;        // nanoseconds since boot at cs_counterBase
+            uint64_t cs_mult;          // nanoseconds per counter tick, 32.32 fixed point
+            int64_t cs_realtimeOffset; // nanoseconds from the epoch to boot
+        };
+
+        Spinlock clockLock;
+        util::atomic<uint32_t> clockSeq;
+        ClockState clockState;
+
+        // Copy of clockState for userland, which uses the same sequence lock protocol
+        Page* clockPage = nullptr;
+        ANANAS_CLOCK_PAGE* clockPageData = nullptr;
+
+        // Last synchronisation with the external reference, protected by clockLock
+        bool haveSyncPoint = false;
+        uint64_t syncCounter;
+        time_t syncSeconds;
+
+        ClockState ReadClockState()
+        {
+            while (true) {
+                const auto seq = clockSeq.load(util::memory_order::acquire);
+                if (seq & 1) {
+                    md::interrupts::Pause(); // writer active
+                    continue;
+                }
+                const ClockState cs = clockState;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (clockSeq.load(util::memory_order::relaxed) == seq)
+                    return cs;
+            }
+        }
+
+        // Must be called with clockLock held
+        void WriteClockPage(const ClockState& cs)
+        {
+            auto& cp = *clockPageData;
+            __atomic_store_n(&cp.cp_seq, cp.cp_seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            cp.cp_counter_base = cs.cs_counterBase;
+            cp.cp_ns_base = cs.cs_nsBase;
+            cp.cp_mult = cs.cs_mult;
+            cp.cp_shift = multShift;
+            cp.cp_realtime_offset = cs.cs_realtimeOffset;
+            __atomic_store_n(&cp.cp_seq, cp.cp_seq + 1, __ATOMIC_RELEASE);
+        }
+
+        // Must be called with clockLock held
+        void WriteClockState(const ClockState& cs)
+        {
+            clockSeq.fetch_add(1, util::memory_order::relaxed);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            clockState = cs;
+            clockSeq.fetch_add(1, util::memory_order::release);
+
+            if (clockPageData != nullptr)
+                WriteClockPage(cs);
+        }
+
+        uint64_t CounterToNanoseconds(const ClockState& cs, uint64_t counter)
+        {
+            // Counters of different CPUs may be slightly out of sync; never go back in time
+            if (counter < cs.cs_counterBase)
+                return cs.cs_nsBase;
+            const auto delta = static_cast<unsigned __int128>(counter - cs.cs_counterBase);
+            return cs.cs_nsBase + static_cast<uint64_t>((delta * cs.cs_mult) >> multShift);
+        }
+
+        uint64_t FrequencyToMult(uint64_t freqInHz)
+        {
+            return (nsPerSecond << multShift) / freqInHz;
+        }
 
         // DateToSerialDayNumber() is inspired by
         // http://howardhinnant.github.io/date_algorithms.html, days_from_civil()
@@ -50,28 +141,65 @@ namespace time
             ts.tv_nsec = 0;
         }
 
-        void AddTick(struct timespec& ts)
+        struct timespec NanosecondsToTS(int64_t ns)
         {
-            ts.tv_nsec += 1000000000 / GetPeriodicyInHz();
-            while (ts.tv_nsec >= 1000000000) {
-                ts.tv_sec++;
-                ts.tv_nsec -= 1000000000;
-            }
+            struct timespec ts;
+            ts.tv_sec = ns / nsPerSecond;
+            ts.tv_nsec = ns % nsPerSecond;
+            return ts;
+        }
+
+        // Converts a relative timeout to ticks, rounding up so we never expire too soon
+        tick_t NanosecondsToTicks(uint64_t ns)
+        {
+            const auto nsPerTick = nsPerSecond / GetPeriodicyInHz();
+            return (ns + nsPerTick - 1) / nsPerTick;
         }
     } // unnamed namespace
 
     unsigned int GetPeriodicyInHz()
     {
         // XXX make me configurable in some way
-        return 100;
+        return 10000;
     }
 
-    tick_t GetTicks()
+    void InitializeClock()
     {
-        SpinlockUnpremptibleGuard g(time_lock);
-        return ticks;
+        SpinlockUnpremptibleGuard g(clockLock);
+        ClockState cs{};
+        cs.cs_counterBase = md::timer::ReadCounter();
+        cs.cs_mult = FrequencyToMult(md::timer::GetCounterFrequency());
+        WriteClockState(cs);
     }
 
+    void InitializeClockPage()
+    {
+        auto cp = static_cast<ANANAS_CLOCK_PAGE*>(
+            page_alloc_single_mapped(clockPage, vm::flag::Read | vm::flag::Write));
+        KASSERT(cp != nullptr, "cannot allocate clock page");
+        memset(cp, 0, PAGE_SIZE);
+
+        SpinlockUnpremptibleGuard g(clockLock);
+        clockPageData = cp;
+        WriteClockPage(clockState);
+        // Only advertise the page once it holds sensible values
+        __atomic_store_n(&cp->cp_version, CLOCK_PAGE_VERSION, __ATOMIC_RELEASE);
+    }
+
+    Page& GetClockPage()
+    {
+        KASSERT(clockPage != nullptr, "clock page not initialized");
+        return *clockPage;
+    }
+
+    uint64_t GetNanosecondsSinceBoot()
+    {
+        const auto cs = ReadClockState();
+        return CounterToNanoseconds(cs, md::timer::ReadCounter());
+    }
+
+    tick_t GetTicks() { return GetNanosecondsSinceBoot() / (nsPerSecond / GetPeriodicyInHz()); }
+
     void SetTime(const struct tm& tm)
     {
         struct timespec ts;
@@ -81,54 +209,68 @@ namespace time
 
     void SetTime(const struct timespec& ts)
     {
-        SpinlockUnpremptibleGuard g(time_lock);
-        time_current = ts;
+        const int64_t ns = ts.tv_sec * static_cast<int64_t>(nsPerSecond) + ts.tv_nsec;
+        SpinlockUnpremptibleGuard g(clockLock);
+        auto cs = clockState;
+        cs.cs_realtimeOffset = ns - CounterToNanoseconds(cs, md::timer::ReadCounter());
+        WriteClockState(cs);
     }
 
-    struct timespec GetTime()
+    void Synchronize(const struct tm& tm)
     {
-        SpinlockUnpremptibleGuard g(time_lock);
-        return time_current;
-    }
+        struct timespec ts;
+        TMtoTS(tm, ts);
 
-    struct timespec GetTimeSinceBoot()
-    {
-        SpinlockUnpremptibleGuard g(time_lock);
-        return time_boot;
+        SpinlockUnpremptibleGuard g(clockLock);
+        const auto counter = md::timer::ReadCounter();
+        auto cs = clockState;
+
+        /*
+         * Use the counter ticks passed since the previous synchronisation to
+         * correct our idea of the counter frequency; the time since boot
+         * continues from where it is now, at the new rate. Estimates that are
+         * way off likely mean the reference was altered, so we only restart
+         * measuring in that case.
+         */
+        if (haveSyncPoint && ts.tv_sec - syncSeconds >= minimumSyncIntervalInSeconds) {
+            const auto freqInHz = (counter - syncCounter) / (ts.tv_sec - syncSeconds);
+            const auto currentFreqInHz = (nsPerSecond << multShift) / cs.cs_mult;
+            const auto diff = freqInHz > currentFreqInHz ? freqInHz - currentFreqInHz
+                                                         : currentFreqInHz - freqInHz;
+            if (diff <= currentFreqInHz / 1'000'000 * maxFrequencyCorrectionInPPM) {
+                cs.cs_nsBase = CounterToNanoseconds(cs, counter);
+                cs.cs_counterBase = counter;
+                cs.cs_mult = FrequencyToMult(freqInHz);
+            }
+        }
+        if (!haveSyncPoint || ts.tv_sec - syncSeconds >= minimumSyncIntervalInSeconds) {
+            haveSyncPoint = true;
+            syncCounter = counter;
+            syncSeconds = ts.tv_sec;
+        }
+
+        // Step the realtime clock to the reference; the drift is gone from now on
+        const int64_t ns = ts.tv_sec * static_cast<int64_t>(nsPerSecond) + ts.tv_nsec;
+        cs.cs_realtimeOffset = ns - CounterToNanoseconds(cs, counter);
+        WriteClockState(cs);
     }
 
-    void OnTick()
+    struct timespec GetTime()
     {
-        // This should only be called in the boot CPU
-
-        // Increment system tick count
-        {
-            SpinlockUnpremptibleGuard g(time_lock);
-            ticks++;
-
-            // Update the timestamp - XXX we should synchronise every now and then with
-            // the RTC. XXX we can use the TSC to get a much more accurate value than
-            // this
-            AddTick(time_boot);
-            AddTick(time_current);
-        }
+        const auto cs = ReadClockState();
+        const auto ns = CounterToNanoseconds(cs, md::timer::ReadCounter());
+        return NanosecondsToTS(ns + cs.cs_realtimeOffset);
     }
 
+    struct timespec GetTimeSinceBoot() { return NanosecondsToTS(GetNanosecondsSinceBoot()); }
+
     tick_t TimevalToTicks(const timeval& tv)
     {
-        const auto hz = GetPeriodicyInHz();
-        const auto ticksPerMs = 1'000'000 / hz;
-        tick_t t = tv.tv_sec * hz;
-        t += tv.tv_usec / ticksPerMs;
-        return t;
+        return NanosecondsToTicks(tv.tv_sec * nsPerSecond + tv.tv_usec * 1000);
     }
 
     tick_t TimespecToTicks(const timespec& ts)
     {
-        const auto hz = GetPeriodicyInHz();
-        const auto ticksPerNs = 1'000'000'000 / hz;
-        tick_t t = ts.tv_sec * hz;
-        t += ts.tv_nsec / ticksPerNs;
-        return t;
+        return NanosecondsToTicks(ts.tv_sec * nsPerSecond + ts.tv_nsec);
     }
 } // namespace time
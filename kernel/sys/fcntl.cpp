@@ -43,6 +43,21 @@ Result sys_fcntl(const fdindex_t hindex, const int cmd, const void* in, void* ou
         case F_SETFL: {
             return Result::Failure(EPERM);
         }
+        case F_ADVISE: {
+            if (fd->fd_type != FD_TYPE_FILE)
+                return Result::Failure(EBADF);
+            auto& file = fd->fd_data.d_vfs_file;
+            switch (int advice = (int)(uintptr_t)in; advice) {
+                case POSIX_FADV_NORMAL:
+                case POSIX_FADV_RANDOM:
+                case POSIX_FADV_SEQUENTIAL:
+                    file.f_advice = advice;
+                    file.f_ra_size = 0;
+                    return Result::Success();
+                default:
+                    return Result::Failure(EINVAL);
+            }
+        }
         default:
             return Result::Failure(EINVAL);
     }
@@ -0,0 +1,34 @@
+/*-
+ * SPDX-License-Identifier: Zlib
+ *
+ * Copyright (c) 2009-2018 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include <ananas/types.h>
+#include <ananas/errno.h>
+#include "kernel/bio.h"
+#include "kernel/fd.h"
+#include "kernel/result.h"
+#include "kernel/vfs/dentry.h"
+#include "kernel/vfs/types.h"
+#include "syscall.h"
+
+Result sys_fsync(const fdindex_t index)
+{
+    FD* fd;
+    if (auto result = syscall_get_fd(FD_TYPE_FILE, index, fd); result.IsFailure())
+        return result;
+
+    auto& file = fd->fd_data.d_vfs_file;
+    if (file.f_device != nullptr)
+        return bsync(file.f_device);
+
+    // We do not track which buffers belong to which file, so write back its entire filesystem
+    auto dentry = file.f_dentry;
+    if (dentry == nullptr || dentry->d_inode == nullptr)
+        return Result::Failure(EINVAL);
+    auto device = dentry->d_inode->i_fs->fs_device;
+    if (device == nullptr)
+        return Result::Success(); // not backed by a device; nothing to write back
+    return bsync(device);
+}
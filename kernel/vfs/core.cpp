@@ -33,6 +33,29 @@ Result vfs_bread(struct VFS_MOUNTED_FS* fs, blocknr_t block, struct BIO** bio)
     return bio2->b_status;
 }
 
+Result vfs_bget(struct VFS_MOUNTED_FS* fs, blocknr_t block, struct BIO** bio)
+{
+    if (!vfs_is_filesystem_sane(fs))
+        return Result::Failure(EIO);
+
+    BIO* bio2;
+    if (auto result = bget(
+            fs->fs_device, block * (fs->fs_block_size / BIO_SECTOR_SIZE), fs->fs_block_size, bio2);
+        result.IsFailure())
+        return result;
+    *bio = bio2;
+    return Result::Success();
+}
+
+void vfs_breada(struct VFS_MOUNTED_FS* fs, blocknr_t block, size_t count)
+{
+    if (!vfs_is_filesystem_sane(fs))
+        return;
+
+    breada(
+        fs->fs_device, block * (fs->fs_block_size / BIO_SECTOR_SIZE), fs->fs_block_size, count);
+}
+
 size_t vfs_filldirent(void** dirents, size_t left, ino_t inum, const char* name, int namelen)
 {
     /*
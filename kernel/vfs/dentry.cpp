@@ -12,67 +12,268 @@
  *
  * We try to keep as much entries in memory as possible, only overwriting
  * them if we really need to.
+ *
+ * Entries are hashed on (parent, name hash) into buckets. Every bucket has a
+ * lock, which serialises changes to its chain and to the state (inode,
+ * negative/pending) of its entries, and a sequence number which is odd while
+ * the chain is being changed. This allows lookups of entries that are already
+ * cached to be done without any locks:
+ *
+ * - The chain is walked with interrupts disabled, after the per-CPU reader
+ *   sequence number is made odd. Entries are only handed back to the pool
+ *   once every CPU has been seen outside of such a walk; until then, the
+ *   memory remains a DEntry.
+ * - A reference is only taken if the refcount isn't deadRefCount, which is
+ *   what entries that are being recycled are set to.
+ * - If the bucket's sequence number changed during all this, the result is
+ *   thrown away and the lookup is retried with the bucket lock held.
+ *
+ * Unreferenced entries are kept on an LRU list, where negative ones have a
+ * list of their own: these are recycled first, and we don't let them take up
+ * more than a part of the cache. The LRU lists are maintained lazily: a
+ * lockless lookup may reference an entry on a LRU list, in which case it is
+ * removed once it is encountered there. Locking is as follows:
+ *
+ * [l] dcache_mtx, protecting the LRU lists and freelist
+ * [h] Lock of the bucket the dentry is hashed on
+ *
+ * Locks must be taken in this order.
  */
 #include <ananas/types.h>
+#include "kernel/condvar.h"
 #include "kernel/init.h"
 #include "kernel/kdb.h"
 #include "kernel/lib.h"
 #include "kernel/lock.h"
 #include "kernel/mm.h"
+#include "kernel/pcpu.h"
+#include "kernel/pool.h"
 #include "kernel/result.h"
 #include "kernel/vfs/types.h"
 #include "kernel/vfs/dentry.h"
 #include "kernel/vfs/mount.h"
 #include "kernel/vfs/icache.h"
+#include "kernel-md/interrupts.h"
 
 namespace
 {
+    constexpr size_t initialCacheItems = 32;
+    constexpr size_t growCacheIncrement = 32;
+
+    // Number of dentries we allocate before recycling unreferenced ones
+    constexpr size_t maximumCacheItems = 16384;
+    // Number of unreferenced negative entries we keep before recycling them
+    constexpr size_t maximumUnusedNegativeItems = maximumCacheItems / 8;
+    // Average number of dentries per bucket we aim for once the cache is full
+    constexpr size_t dentriesPerBucket = 4;
+
+    // Number of CPUs that can perform lockless lookups; any others always lock
+    constexpr size_t maximumLocklessCPUs = 16;
+    // Number of entries a lockless lookup inspects before giving up
+    constexpr size_t maximumLocklessSteps = 64;
+
+    // Refcount of entries that are being recycled; these can no longer be referenced
+    constexpr refcount_t deadRefCount = ~refcount_t{0};
+
+    constexpr unsigned int CalculateBucketShift()
+    {
+        unsigned int shift = 1;
+        while ((size_t(1) << shift) * dentriesPerBucket < maximumCacheItems)
+            ++shift;
+        return shift;
+    }
+
+    constexpr unsigned int bucketShift = CalculateBucketShift(); // log2 of the number of buckets
+    constexpr size_t numberOfBuckets = size_t(1) << bucketShift;
+
+    struct BucketNode {
+        static util::List<DEntry>::Node& Get(DEntry& d) { return d.d_NodeBucket; }
+    };
+    using DEntryBucketList =
+        util::List<DEntry, util::List<DEntry>::nodeptr_accessor<BucketNode>>;
+
+    struct Bucket {
+        Mutex bu_mutex{"dcachebucket"};
+        ConditionVariable bu_cv_pending{"dcachepending"}; // Signalled once entries are filled
+        util::atomic<unsigned int> bu_seq;                 // Odd while the chain is changed
+        DEntryBucketList bu_dentries;
+    };
+
+    struct alignas(64) LocklessReader {
+        util::atomic<unsigned int> lr_seq; // Odd while a lockless lookup is in progress
+    };
+
+    Bucket* dcache_bucket;
+    LocklessReader locklessReader[maximumLocklessCPUs];
+
     Mutex dcache_mtx{"dcache"};
-    util::List<DEntry> dcache_inuse;
-    util::List<DEntry> dcache_free;
+    util::List<DEntry> dcache_lru;          // [l] unreferenced entries, most recently used first
+    util::List<DEntry> dcache_negative_lru; // [l] likewise, but only negative entries
+    util::List<DEntry> dcache_free;         // [l] entries that are not hashed
+    size_t numberOfDEntries = 0;            // [l]
+    size_t numberOfUnusedNegative = 0;      // [l] number of entries on dcache_negative_lru
+    pool::ObjectPool<DEntry> dentryPool("dentry");
+
+    // FNV-1a
+    uint32_t HashName(const char* name)
+    {
+        uint32_t hash = 2166136261;
+        for (; *name != '\0'; ++name)
+            hash = (hash ^ static_cast<unsigned char>(*name)) * 16777619;
+        return hash;
+    }
 
-    constexpr size_t initialCacheItems = 32;
-    constexpr size_t growCacheIncrement = 2;
+    // Fibonacci hashing; the top bits are the best mixed
+    Bucket& BucketForEntry(const DEntry& parent, uint32_t hash)
+    {
+        const uint64_t key = hash ^ (reinterpret_cast<uintptr_t>(&parent) >> 4);
+        return dcache_bucket[(key * 0x9e3779b97f4a7c15ULL) >> (64 - bucketShift)];
+    }
+
+    // Only valid for entries that are hashed, i.e. which are not a root dentry
+    Bucket& BucketForDEntry(const DEntry& d) { return BucketForEntry(*d.d_parent, d.d_hash); }
+
+    bool IsPending(const DEntry& d)
+    {
+        return d.d_inode == nullptr && (d.d_flags & DENTRY_FLAG_NEGATIVE) == 0;
+    }
+
+    bool Matches(const DEntry& d, const DEntry& parent, const char* entry, uint32_t hash)
+    {
+        return d.d_parent == &parent && d.d_hash == hash && strcmp(d.d_entry, entry) == 0;
+    }
+
+    // Adds a reference, unless the entry is being recycled
+    bool TryRef(DEntry& d)
+    {
+        auto refs = d.d_refcount.load();
+        do {
+            if (refs == deadRefCount)
+                return false;
+        } while (!d.d_refcount.compare_exchange_weak(refs, refs + 1));
+        return true;
+    }
+
+    void Hash(Bucket& bucket, DEntry& d)
+    {
+        bucket.bu_mutex.AssertLocked();
+        ++bucket.bu_seq;
+        bucket.bu_dentries.push_front(d);
+        ++bucket.bu_seq;
+    }
+
+    void Unhash(Bucket& bucket, DEntry& d)
+    {
+        bucket.bu_mutex.AssertLocked();
+        ++bucket.bu_seq;
+        bucket.bu_dentries.remove(d);
+        ++bucket.bu_seq;
 
-    inline void dcache_lock() { dcache_mtx.Lock(); }
+        // Anyone waiting for the entry must look again
+        bucket.bu_cv_pending.Broadcast();
+    }
+
+    void RemoveFromLRU(DEntry& d)
+    {
+        dcache_mtx.AssertLocked();
+        d.d_lru->remove(d);
+        if (d.d_lru == &dcache_negative_lru)
+            --numberOfUnusedNegative;
+        d.d_lru = nullptr;
+    }
 
-    inline void dcache_unlock() { dcache_mtx.Unlock(); }
+    void AddToLRU(DEntry& d)
+    {
+        dcache_mtx.AssertLocked();
+        if (d.d_flags & DENTRY_FLAG_NEGATIVE) {
+            d.d_lru = &dcache_negative_lru;
+            ++numberOfUnusedNegative;
+        } else {
+            d.d_lru = &dcache_lru;
+        }
+        d.d_lru->push_front(d);
+    }
 
     void GrowCache(size_t numberOfItems)
     {
+        dcache_mtx.AssertLocked();
         for (size_t i = 0; i < numberOfItems; i++)
-            dcache_free.push_back(*new DEntry);
+            dcache_free.push_back(dentryPool.Allocate());
+        numberOfDEntries += numberOfItems;
     }
 
-    DEntry& FindEntryToUse()
+    /*
+     * Claims the least recently used entry on the given list which has no
+     * references; it is unhashed, removed from the list and has its refcount
+     * set to deadRefCount. Entries which were referenced while on the list are
+     * removed from it as we go.
+     */
+    DEntry* ClaimUnusedEntry(util::List<DEntry>& lru)
     {
         dcache_mtx.AssertLocked();
+        for (auto rit = lru.rbegin(); rit != lru.rend(); /* nothing */) {
+            auto& d = *rit;
+            ++rit;
+
+            auto& bucket = BucketForDEntry(d);
+            MutexGuard g(bucket.bu_mutex);
+            refcount_t expected = 0;
+            if (!d.d_refcount.compare_exchange_strong(expected, deadRefCount)) {
+                RemoveFromLRU(d);
+                continue;
+            }
+
+            Unhash(bucket, d);
+            RemoveFromLRU(d);
+            return &d;
+        }
+        return nullptr;
+    }
+
+    // Lets go of everything a claimed entry refers to; must be called without any locks held
+    void ReleaseClaimedEntry(DEntry& d)
+    {
+        if (d.d_inode != nullptr) {
+            vfs_deref_inode(*d.d_inode);
+            d.d_inode = nullptr;
+        }
+        if (d.d_parent != nullptr) {
+            dentry_deref(*d.d_parent);
+            d.d_parent = nullptr;
+        }
+    }
 
+    // Obtains an entry that is not hashed; must be called without any locks held
+    DEntry& FindEntryToUse()
+    {
+        dcache_mtx.Lock();
         while (true) {
             if (!dcache_free.empty()) {
                 DEntry& d = dcache_free.front();
                 dcache_free.pop_front();
+                dcache_mtx.Unlock();
                 return d;
             }
 
-            /*
-             * Our dcache is ordered from old-to-new, so we'll start at the back and
-             * take anything which has no refs and isn't a root dentry.
-             */
-            for (auto it = dcache_inuse.rbegin(); it != dcache_inuse.rend(); /* nothing */) {
-                auto& d = *it;
-                ++it;
-                if (d.d_refcount == 0 && (d.d_flags & DENTRY_FLAG_ROOT) == 0) {
-                    // This dentry should be good to use - remove any backing inode it has,
-                    // as we will overwrite it
-                    if (d.d_inode != nullptr) {
-                        vfs_deref_inode(*d.d_inode);
-                        d.d_inode = nullptr;
-                    }
-
-                    dcache_inuse.remove(d);
-                    return d;
-                }
+            // Negative entries are cheap to re-create; don't let them crowd out the others
+            DEntry* d = nullptr;
+            if (numberOfUnusedNegative > maximumUnusedNegativeItems)
+                d = ClaimUnusedEntry(dcache_negative_lru);
+
+            if (d == nullptr && numberOfDEntries < maximumCacheItems) {
+                GrowCache(growCacheIncrement);
+                continue;
+            }
+
+            // Cache is full; we need to sacrifice the least recently used item
+            if (d == nullptr)
+                d = ClaimUnusedEntry(dcache_negative_lru);
+            if (d == nullptr)
+                d = ClaimUnusedEntry(dcache_lru);
+            if (d != nullptr) {
+                dcache_mtx.Unlock();
+                ReleaseClaimedEntry(*d);
+                return *d;
             }
 
             // Still nothing - grow the cache and try again
@@ -82,167 +283,269 @@ namespace
         // NOTREACHED
     }
 
-} // unnamed namespace
+    void ReleaseUnhashed(DEntry& d)
+    {
+        MutexGuard g(dcache_mtx);
+        dcache_free.push_front(d);
+    }
+
+    // Waits until every lockless lookup that is currently in progress is done
+    void WaitForLocklessLookups()
+    {
+        for (auto& reader : locklessReader) {
+            const auto seq = reader.lr_seq.load();
+            if ((seq & 1) == 0)
+                continue;
+            while (reader.lr_seq.load() == seq)
+                md::interrupts::Pause();
+        }
+    }
+
+    /*
+     * Attempts to find a filled entry without taking any locks; returns a
+     * referenced entry on success. Returns nullptr if the entry isn't there,
+     * still pending or if we raced with a change, in which case the caller
+     * should fall back to the locked lookup.
+     */
+    DEntry* LookupLockless(Bucket& bucket, const DEntry& parent, const char* entry, uint32_t hash)
+    {
+        const auto state = md::interrupts::SaveAndDisable();
+        const size_t cpuid = PCPU_GET(cpuid);
+        if (cpuid >= maximumLocklessCPUs) {
+            md::interrupts::Restore(state);
+            return nullptr;
+        }
+        auto& reader = locklessReader[cpuid];
+        ++reader.lr_seq;
+
+        DEntry* found = nullptr;
+        bool valid = false;
+        if (const auto seq = bucket.bu_seq.load(); (seq & 1) == 0) {
+            size_t steps = 0;
+            for (auto& d : bucket.bu_dentries) {
+                if (++steps > maximumLocklessSteps)
+                    break;
+                if (!Matches(d, parent, entry, hash))
+                    continue;
+                if (TryRef(d)) {
+                    found = &d;
+                    valid = bucket.bu_seq.load() == seq && !IsPending(d);
+                }
+                break;
+            }
+        }
+
+        ++reader.lr_seq;
+        md::interrupts::Restore(state);
+
+        if (found != nullptr && !valid) {
+            dentry_deref(*found);
+            found = nullptr;
+        }
+        return found;
+    }
+
+    /*
+     * Locates an entry in the bucket, waiting for it to be filled if it is
+     * pending. On success, an extra ref to the entry is added for the caller.
+     */
+    DEntry* FindEntry(Bucket& bucket, const DEntry& parent, const char* entry, uint32_t hash)
+    {
+        bucket.bu_mutex.AssertLocked();
+    restart:
+        for (auto& d : bucket.bu_dentries) {
+            if (!Matches(d, parent, entry, hash))
+                continue;
+
+            if (IsPending(d)) {
+                // Someone else is looking the entry up; wait until they are done
+                bucket.bu_cv_pending.Wait(bucket.bu_mutex);
+                goto restart;
+            }
 
-static void dentry_deref_locked(DEntry& de);
+            // Entries that are hashed are never dead, so we can always add a ref here (the
+            // original refcount may be zero, so we can't use dentry_ref())
+            ++d.d_refcount;
+            return &d;
+        }
+        return nullptr;
+    }
+
+    // Common code to change the state of a dentry; wakes up anyone waiting for it
+    void SetState(DEntry& de, INode* inode, bool negative)
+    {
+        INode* old_inode;
+        if (de.d_flags & DENTRY_FLAG_ROOT) {
+            // Not hashed, so nothing can be waiting for it
+            old_inode = de.d_inode;
+            de.d_inode = inode;
+        } else {
+            auto& bucket = BucketForDEntry(de);
+            MutexGuard g(bucket.bu_mutex);
+            old_inode = de.d_inode;
+            de.d_inode = inode;
+            if (negative)
+                de.d_flags |= DENTRY_FLAG_NEGATIVE;
+            else
+                de.d_flags &= ~DENTRY_FLAG_NEGATIVE;
+            bucket.bu_cv_pending.Broadcast();
+        }
+
+        if (old_inode != nullptr)
+            vfs_deref_inode(*old_inode);
+    }
+
+} // unnamed namespace
 
 DEntry& dcache_create_root_dentry(struct VFS_MOUNTED_FS* fs)
 {
-    MutexGuard g(dcache_mtx);
-
     DEntry& d = FindEntryToUse();
 
+    // Root dentries are never hashed nor placed on a LRU list, so they will never be recycled
     d.d_fs = fs;
     d.d_refcount = 1; /* filesystem itself */
     d.d_inode = NULL; /* supplied by the file system */
     d.d_flags = DENTRY_FLAG_ROOT;
     strcpy(d.d_entry, "/");
-    dcache_inuse.push_front(d);
-
     return d;
 }
 
 /*
- *
- * Attempts to look up a given entry for a parent dentry. Returns a referenced
- * dentry entry on success.
- *
- * The only way for this function to return NULL is that the lookup is
- * currently pending; this means the attempt to is be retried.
+ * Looks up a given entry for a parent dentry. Returns a referenced dentry
+ * entry; if it was not yet in the cache, it is pending and the caller must
+ * fill it using dcache_set_inode() or dcache_set_negative(). If the entry is
+ * pending because someone else is looking it up, we wait until they are done.
  *
  * Note that this function must be called with a referenced dentry to ensure it
  * will not go away. This ref is not touched by this function.
  */
 DEntry* dcache_lookup(DEntry& parent, const char* entry)
 {
-    dcache_lock();
-
-    /*
-     * XXX This is just a simple linear search which attempts to avoid
-     * overhead by moving recent entries to the start.
-     */
-    for (auto& d : dcache_inuse) {
-        if (d.d_parent != &parent || strcmp(d.d_entry, entry) != 0)
-            continue;
-
-        /*
-         * It's quite possible that this inode is still pending; if that is the
-         * case, our caller should sleep and wait for the other caller to finish
-         * up.
-         *
-         * XXX We shouldn't burden the caller with this!
-         */
-        if (d.d_inode == nullptr && (d.d_flags & DENTRY_FLAG_NEGATIVE) == 0) {
-            dcache_unlock();
-            return nullptr;
-        }
-
-        // Add an extra ref to the dentry; we'll be giving it to the caller. Don't use dentry_ref()
-        // here as the original refcount may be zero.
-        ++d.d_refcount;
-
-        // Push the the item to the head of the cache
-        dcache_inuse.remove(d);
-        dcache_inuse.push_front(d);
-        dcache_unlock();
-        return &d;
+    const auto hash = HashName(entry);
+    auto& bucket = BucketForEntry(parent, hash);
+    if (auto d = LookupLockless(bucket, parent, entry, hash); d != nullptr)
+        return d;
+
+    bucket.bu_mutex.Lock();
+    if (auto d = FindEntry(bucket, parent, entry, hash); d != nullptr) {
+        bucket.bu_mutex.Unlock();
+        return d;
     }
 
-    // Item was not found; need to make a new one
+    // Item was not found; need to make a new one without holding our bucket lock
+    bucket.bu_mutex.Unlock();
     DEntry& d = FindEntryToUse();
+    bucket.bu_mutex.Lock();
+    if (auto other = FindEntry(bucket, parent, entry, hash); other != nullptr) {
+        // Someone else added the entry while we were unlocked; use theirs
+        bucket.bu_mutex.Unlock();
+        ReleaseUnhashed(d);
+        return other;
+    }
 
-    // Add an explicit ref to the parent dentry; it will be referenced by our new dentry */
+    // Add an explicit ref to the parent dentry; it will be referenced by our new dentry
     dentry_ref(parent);
 
     /* Initialize the item */
-    memset(&d, 0, sizeof(d)); // XXX Is this really necessary?
     d.d_fs = parent.d_fs;
     d.d_refcount = 1; // the caller
     d.d_parent = &parent;
     d.d_inode = NULL;
     d.d_flags = 0;
+    d.d_hash = hash;
     strcpy(d.d_entry, entry);
-    dcache_inuse.push_front(d);
-    dcache_unlock();
+    Hash(bucket, d);
+    bucket.bu_mutex.Unlock();
     return &d;
 }
 
 void dcache_purge_old_entries()
 {
-    MutexGuard g(dcache_mtx);
-    for (auto it = dcache_inuse.begin(); it != dcache_inuse.end(); /* nothing */) {
-        auto& d = *it;
-        ++it;
-        if (d.d_refcount > 0 || (d.d_flags & DENTRY_FLAG_ROOT))
-            continue; // in use or root, skip
+    /*
+     * Recycle every entry without references; as this releases the references
+     * to their parents, keep going until nothing is left.
+     */
+    while (true) {
+        util::List<DEntry> purged;
+        {
+            MutexGuard g(dcache_mtx);
+            util::List<DEntry>* lrus[] = {&dcache_negative_lru, &dcache_lru};
+            for (auto lru : lrus) {
+                while (auto d = ClaimUnusedEntry(*lru))
+                    purged.push_back(*d);
+            }
+        }
+        if (purged.empty())
+            break;
 
-        // Get rid of any backing inode; this is why we are called
-        if (d.d_inode != nullptr) {
-            vfs_deref_inode(*d.d_inode);
-            d.d_inode = nullptr;
+        // Lockless lookups may still be looking at the entries; wait until they are done
+        WaitForLocklessLookups();
+
+        size_t numPurged = 0;
+        while (!purged.empty()) {
+            auto& d = purged.front();
+            purged.pop_front();
+
+            // Get rid of any backing inode; this is why we are called
+            ReleaseClaimedEntry(d);
+
+            // Hand the entry back in its pristine state; we'll grow again if needed
+            d.~DEntry();
+            new (&d) DEntry;
+            dentryPool.Free(d);
+            ++numPurged;
         }
 
-        dcache_inuse.remove(d);
-        dcache_free.push_front(d);
+        MutexGuard g(dcache_mtx);
+        numberOfDEntries -= numPurged;
     }
 }
 
 void dcache_set_inode(DEntry& de, INode& inode)
 {
-#if 0
-	/* XXX NOTYET - negative flag is cleared to keep the entry alive */
-	KASSERT((de->d_flags & DENTRY_FLAG_NEGATIVE), "entry is not negative");
-#endif
-
-    /* If we already have an inode, deref it; we don't care about it anymore */
-    if (de.d_inode != NULL)
-        vfs_deref_inode(*de.d_inode);
-
     /* Increase the refcount - the cache will have a ref to the inode now */
     vfs_ref_inode(inode);
-    de.d_inode = &inode;
+
+    /* If we already have an inode, it is dereffed; we don't care about it anymore */
+    SetState(de, &inode, false);
+}
+
+void dcache_set_negative(DEntry& de) { SetState(de, nullptr, true); }
+
+void dcache_set_pending(DEntry& de)
+{
+    KASSERT((de.d_flags & DENTRY_FLAG_ROOT) == 0, "root dentry cannot be pending");
+    auto& bucket = BucketForDEntry(de);
+    MutexGuard g(bucket.bu_mutex);
+    KASSERT(de.d_inode == nullptr, "pending entry with inode?");
     de.d_flags &= ~DENTRY_FLAG_NEGATIVE;
 }
 
 void dentry_ref(DEntry& d)
 {
-    KASSERT(d.d_refcount > 0, "invalid refcount %d", d.d_refcount);
+    KASSERT(d.d_refcount > 0, "invalid refcount %d", d.d_refcount.load());
     d.d_refcount++;
 }
 
-static void dentry_deref_locked(DEntry& d)
+void dentry_deref(DEntry& d)
 {
-    KASSERT(d.d_refcount > 0, "invalid refcount %d", d.d_refcount);
-
-    // Remove a reference; if this brings us to zero, we need to remove it
-    if (--d.d_refcount > 0)
-        return;
-
-    // We do not free backing inodes here - the reason is that we don't know
-    // how they are to be re-looked up.
-
-    // Free our reference to the parent
-    if (d.d_parent != nullptr) {
-        dentry_deref_locked(*d.d_parent);
-        d.d_parent = nullptr;
+    // If this isn't the final reference, we needn't do anything else
+    auto refs = d.d_refcount.load();
+    while (refs > 1 && refs != deadRefCount) {
+        if (d.d_refcount.compare_exchange_weak(refs, refs - 1))
+            return;
     }
-}
 
-void dentry_unlink(DEntry& de)
-{
+    // We do not free backing inodes here - the reason is that we don't know
+    // how they are to be re-looked up. Instead, the entry remains cached.
     MutexGuard g(dcache_mtx);
-
-    de.d_flags |= DENTRY_FLAG_NEGATIVE;
-    if (de.d_inode != nullptr)
-        vfs_deref_inode(*de.d_inode);
-    de.d_inode = nullptr;
+    refs = d.d_refcount--;
+    KASSERT(refs > 0 && refs != deadRefCount, "invalid refcount %d", refs);
+    if (refs == 1 && d.d_lru == nullptr && (d.d_flags & DENTRY_FLAG_ROOT) == 0)
+        AddToLRU(d);
 }
 
-void dentry_deref(DEntry& de)
-{
-    MutexGuard g(dcache_mtx);
-    dentry_deref_locked(de);
-}
+void dentry_unlink(DEntry& de) { dcache_set_negative(de); }
 
 size_t dentry_construct_path(char* dest, size_t n, DEntry& dentry)
 {
@@ -290,25 +593,32 @@ size_t dentry_construct_path(char* dest, size_t n, DEntry& dentry)
 const kdb::RegisterCommand kdbDCache("dcache", "Show dentry cache", [](int, const kdb::Argument*) {
     /* XXX Don't lock; this is for debugging purposes only */
     int n = 0;
-    for (auto& d : dcache_inuse) {
-        kprintf(
-            "dcache_entry=%p, parent=%p, inode=%p, reverse name=%s[%d]", &d, d.d_parent, d.d_inode,
-            d.d_entry, d.d_refcount);
-        for (DEntry* curde = d.d_parent; curde != NULL; curde = curde->d_parent)
-            kprintf(",%s[%d]", curde->d_entry, curde->d_refcount);
-        kprintf("',flags=0x%x, refcount=%d\n", d.d_flags, d.d_refcount);
-        n++;
+    for (size_t bucketNum = 0; bucketNum < numberOfBuckets; ++bucketNum) {
+        for (auto& d : dcache_bucket[bucketNum].bu_dentries) {
+            kprintf(
+                "dcache_entry=%p, parent=%p, inode=%p, reverse name=%s[%d]", &d, d.d_parent,
+                d.d_inode, d.d_entry, d.d_refcount.load());
+            for (DEntry* curde = d.d_parent; curde != NULL; curde = curde->d_parent)
+                kprintf(",%s[%d]", curde->d_entry, curde->d_refcount.load());
+            kprintf("',flags=0x%x, refcount=%d\n", d.d_flags, d.d_refcount.load());
+            n++;
+        }
     }
-    kprintf("dentry cache contains %u entries\n", n);
+    kprintf(
+        "dentry cache contains %u entries, %u unused negative (%u allocated)\n", n,
+        numberOfUnusedNegative, numberOfDEntries);
 });
 
 namespace
 {
     const init::OnInit initDEntryCache(init::SubSystem::VFS, init::Order::First, []() {
+        dcache_bucket = new Bucket[numberOfBuckets];
+
         /*
-         * Make an initial empty cache; we allocate one big pool and set up pointers to the
-         * items as necessary. We may choose to shrink/expand this pool later on.
+         * Make an initial empty cache; entries are allocated from the dentry pool, which
+         * takes back the ones dcache_purge_old_entries() gets rid of.
          */
+        MutexGuard g(dcache_mtx);
         GrowCache(initialCacheItems);
     });
 
@@ -5,61 +5,337 @@
  * For conditions of distribution and use, see LICENSE file
  */
 #include <ananas/types.h>
+#include <ananas/flags.h>
 #include "kernel/bio.h"
 #include "kernel/device.h"
 #include "kernel/lib.h"
+#include "kernel/mm.h"
 #include "kernel/result.h"
 #include "kernel/vfs/core.h"
 #include "kernel/vfs/dentry.h"
 #include "kernel/vfs/generic.h"
 #include "kernel/vfs/icache.h"
 
-Result vfs_generic_lookup(DEntry& parent, INode*& destinode, const char* dentry)
+/*
+ * In-memory index of the names in a directory; this is a hash table which
+ * doubles in size as it fills up.
+ */
+struct DirectoryIndex {
+    struct Entry {
+        Entry* e_next;
+        ino_t e_inum;
+        uint32_t e_hash;
+        char e_name[1]; // allocated to fit the name
+    };
+
+    Entry** di_bucket = nullptr;
+    size_t di_num_buckets = 0;
+    size_t di_num_entries = 0;
+    unsigned int di_gen = 0; // i_dirindex_gen at the time the index was detached
+};
+
+namespace
 {
-    char buf[1024]; /* XXX */
+    // Directories with fewer entries than this are not worth keeping an index for
+    constexpr size_t MinimumIndexedEntries = 32;
+    constexpr size_t InitialIndexBuckets = 64;
+    // Average number of entries per bucket after which the index is grown
+    constexpr size_t MaximumEntriesPerBucket = 2;
+
+    // FNV-1a
+    uint32_t HashName(const char* name)
+    {
+        uint32_t hash = 2166136261;
+        for (; *name != '\0'; ++name)
+            hash = (hash ^ static_cast<unsigned char>(*name)) * 16777619;
+        return hash;
+    }
+
+    void ResizeIndex(DirectoryIndex& index, size_t num_buckets)
+    {
+        auto buckets = new DirectoryIndex::Entry*[num_buckets];
+        for (size_t n = 0; n < num_buckets; ++n)
+            buckets[n] = nullptr;
+
+        for (size_t n = 0; n < index.di_num_buckets; ++n) {
+            while (auto entry = index.di_bucket[n]) {
+                index.di_bucket[n] = entry->e_next;
+                auto& bucket = buckets[entry->e_hash % num_buckets];
+                entry->e_next = bucket;
+                bucket = entry;
+            }
+        }
+
+        delete[] index.di_bucket;
+        index.di_bucket = buckets;
+        index.di_num_buckets = num_buckets;
+    }
+
+    void AddToIndex(DirectoryIndex& index, const char* name, ino_t inum)
+    {
+        if (index.di_num_entries >= index.di_num_buckets * MaximumEntriesPerBucket)
+            ResizeIndex(
+                index, index.di_num_buckets > 0 ? index.di_num_buckets * 2 : InitialIndexBuckets);
+
+        const size_t name_len = strlen(name);
+        auto entry = static_cast<DirectoryIndex::Entry*>(
+            kmalloc(sizeof(DirectoryIndex::Entry) + name_len));
+        entry->e_inum = inum;
+        entry->e_hash = HashName(name);
+        memcpy(entry->e_name, name, name_len + 1);
+
+        auto& bucket = index.di_bucket[entry->e_hash % index.di_num_buckets];
+        entry->e_next = bucket;
+        bucket = entry;
+        ++index.di_num_entries;
+    }
+
+    const DirectoryIndex::Entry* FindInIndex(const DirectoryIndex& index, const char* name)
+    {
+        if (index.di_num_buckets == 0)
+            return nullptr;
+        const auto hash = HashName(name);
+        for (auto entry = index.di_bucket[hash % index.di_num_buckets]; entry != nullptr;
+             entry = entry->e_next) {
+            if (entry->e_hash == hash && strcmp(entry->e_name, name) == 0)
+                return entry;
+        }
+        return nullptr;
+    }
+
+    void RemoveFromIndex(DirectoryIndex& index, const char* name)
+    {
+        if (index.di_num_buckets == 0)
+            return;
+        const auto hash = HashName(name);
+        for (auto entry = &index.di_bucket[hash % index.di_num_buckets]; *entry != nullptr;
+             entry = &(*entry)->e_next) {
+            if ((*entry)->e_hash != hash || strcmp((*entry)->e_name, name) != 0)
+                continue;
+            auto removed = *entry;
+            *entry = removed->e_next;
+            kfree(removed);
+            --index.di_num_entries;
+            return;
+        }
+    }
+
+    void FreeIndex(DirectoryIndex* index)
+    {
+        if (index == nullptr)
+            return;
+        for (size_t n = 0; n < index->di_num_buckets; ++n) {
+            while (auto entry = index->di_bucket[n]) {
+                index->di_bucket[n] = entry->e_next;
+                kfree(entry);
+            }
+        }
+        delete[] index->di_bucket;
+        delete index;
+    }
 
     /*
-     * XXX This is a very naive implementation which does not use the
-     * possible directory index.
+     * Looks up a name by reading the directory from front to back. If an index
+     * is supplied, the entire directory is read and every name is added to it.
      */
-    INode& parent_inode = *parent.d_inode;
-    KASSERT(S_ISDIR(parent_inode.i_sb.st_mode), "supplied inode is not a directory");
-
-    /* Rewind the directory back; we'll be traversing it from front to back */
-    struct VFS_FILE dirf;
-    memset(&dirf, 0, sizeof(dirf));
-    dirf.f_offset = 0;
-    dirf.f_dentry = &parent;
-    while (1) {
-        if (!vfs_is_filesystem_sane(parent_inode.i_fs))
-            return Result::Failure(EIO);
+    Result ScanDirectory(DEntry& parent, const char* dentry, ino_t& inum, DirectoryIndex* index)
+    {
+        char buf[1024]; /* XXX */
 
-        auto result = vfs_read(&dirf, buf, sizeof(buf));
-        if (result.IsFailure())
-            return result;
-        auto buf_len = result.AsValue();
-        if (buf_len == 0)
-            return Result::Failure(ENOENT);
+        INode& parent_inode = *parent.d_inode;
+        KASSERT(S_ISDIR(parent_inode.i_sb.st_mode), "supplied inode is not a directory");
+
+        /* Rewind the directory back; we'll be traversing it from front to back */
+        struct VFS_FILE dirf;
+        memset(&dirf, 0, sizeof(dirf));
+        dirf.f_offset = 0;
+        dirf.f_dentry = &parent;
+        bool found = false;
+        while (1) {
+            if (!vfs_is_filesystem_sane(parent_inode.i_fs))
+                return Result::Failure(EIO);
 
-        char* cur_ptr = buf;
-        while (buf_len > 0) {
-            struct VFS_DIRENT* de = (struct VFS_DIRENT*)cur_ptr;
-            buf_len -= DE_LENGTH(de);
-            cur_ptr += DE_LENGTH(de);
+            auto result = vfs_read(&dirf, buf, sizeof(buf));
+            if (result.IsFailure())
+                return result;
+            auto buf_len = result.AsValue();
+            if (buf_len == 0)
+                return found ? Result::Success() : Result::Failure(ENOENT);
+
+            char* cur_ptr = buf;
+            while (buf_len > 0) {
+                struct VFS_DIRENT* de = (struct VFS_DIRENT*)cur_ptr;
+                buf_len -= DE_LENGTH(de);
+                cur_ptr += DE_LENGTH(de);
 
 #ifdef DEBUG_VFS_LOOKUP
-            kprintf("vfs_generic_lookup('%s'): comparing with '%s'\n", dentry, de->de_name);
+                kprintf("vfs_generic_lookup('%s'): comparing with '%s'\n", dentry, de->de_name);
 #endif
+                if (index != nullptr)
+                    AddToIndex(*index, de->de_name, de->de_inum);
 
-            if (strcmp(de->de_name, dentry) != 0)
-                continue;
+                if (found || strcmp(de->de_name, dentry) != 0)
+                    continue;
 
-            /* Found it! */
-            return vfs_get_inode(parent_inode.i_fs, de->de_inum, destinode);
+                /* Found it! */
+                inum = de->de_inum;
+                found = true;
+                if (index == nullptr)
+                    return Result::Success();
+            }
         }
     }
+
+} // unnamed namespace
+
+Result vfs_generic_lookup(DEntry& parent, INode*& destinode, const char* dentry)
+{
+    ino_t inum;
+    if (auto result = ScanDirectory(parent, dentry, inum, nullptr); result.IsFailure())
+        return result;
+    return vfs_get_inode(parent.d_inode->i_fs, inum, destinode);
 }
 
+Result vfs_generic_lookup_indexed(DEntry& parent, INode*& destinode, const char* dentry)
+{
+    INode& parent_inode = *parent.d_inode;
+    parent_inode.Lock();
+    if (auto index = parent_inode.i_dirindex; index != nullptr) {
+        // The index is complete, so anything that isn't in there does not exist
+        auto entry = FindInIndex(*index, dentry);
+        const ino_t inum = entry != nullptr ? entry->e_inum : 0;
+        parent_inode.Unlock();
+        if (entry == nullptr)
+            return Result::Failure(ENOENT);
+        return vfs_get_inode(parent_inode.i_fs, inum, destinode);
+    }
+    const auto gen = parent_inode.i_dirindex_gen;
+    parent_inode.Unlock();
+
+    // No index yet; build one while we scan the directory
+    auto index = new DirectoryIndex;
+    ino_t inum;
+    auto result = ScanDirectory(parent, dentry, inum, index);
+    if (result.IsSuccess() || result.AsErrno() == ENOENT) {
+        // Only keep the index if the directory wasn't changed while we were scanning it
+        parent_inode.Lock();
+        if (parent_inode.i_dirindex == nullptr && parent_inode.i_dirindex_gen == gen &&
+            index->di_num_entries >= MinimumIndexedEntries) {
+            parent_inode.i_dirindex = index;
+            index = nullptr;
+        }
+        parent_inode.Unlock();
+    }
+    FreeIndex(index);
+
+    if (result.IsFailure())
+        return result;
+    return vfs_get_inode(parent_inode.i_fs, inum, destinode);
+}
+
+DirectoryIndex* vfs_begin_directory_change(INode& inode)
+{
+    inode.Lock();
+    auto index = inode.i_dirindex;
+    inode.i_dirindex = nullptr;
+    ++inode.i_dirindex_gen;
+    if (index != nullptr)
+        index->di_gen = inode.i_dirindex_gen;
+    inode.Unlock();
+    return index;
+}
+
+void vfs_end_directory_change(
+    INode& inode, DirectoryIndex* index, bool changed, const char* removed_name,
+    const char* added_name, ino_t added_inum)
+{
+    if (index == nullptr)
+        return;
+
+    // If the change failed, we can't tell how much of it made it to the directory
+    if (changed) {
+        inode.Lock();
+        // Anyone else changing the directory meanwhile will have bumped the generation
+        if (inode.i_dirindex == nullptr && inode.i_dirindex_gen == index->di_gen) {
+            if (removed_name != nullptr)
+                RemoveFromIndex(*index, removed_name);
+            if (added_name != nullptr)
+                AddToIndex(*index, added_name, added_inum);
+            inode.i_dirindex = index;
+            index = nullptr;
+        }
+        inode.Unlock();
+    }
+    FreeIndex(index);
+}
+
+void vfs_discard_directory_index(INode& inode)
+{
+    FreeIndex(inode.i_dirindex);
+    inode.i_dirindex = nullptr;
+    ++inode.i_dirindex_gen;
+}
+
+namespace
+{
+    constexpr unsigned int InitialReadAheadBlocks = 4;
+    constexpr unsigned int MaximumReadAheadBlocks = 32;
+
+    /*
+     * Starts reading the blocks following a read of blocks [first, last]. As long
+     * as the file is read sequentially, the window doubles every time we issue
+     * more read-ahead; any seek collapses it.
+     */
+    void ReadAhead(struct VFS_FILE& file, INode& inode, blocknr_t first, blocknr_t last)
+    {
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        if (file.f_advice == POSIX_FADV_RANDOM)
+            return;
+
+        if (file.f_advice == POSIX_FADV_SEQUENTIAL) {
+            file.f_ra_size = MaximumReadAheadBlocks;
+        } else if (first != file.f_ra_next) {
+            // Not sequential; stop reading ahead until it is again
+            file.f_ra_size = 0;
+            file.f_ra_ahead = 0;
+            return;
+        } else if (file.f_ra_size == 0) {
+            file.f_ra_size = InitialReadAheadBlocks;
+        } else if (file.f_ra_ahead > last + file.f_ra_size / 2) {
+            return; // wait until the reader has consumed half of the window
+        } else if (file.f_ra_size < MaximumReadAheadBlocks) {
+            file.f_ra_size *= 2;
+        }
+
+        const blocknr_t num_blocks = (inode.i_sb.st_size + fs->fs_block_size - 1) /
+                                     (blocknr_t)fs->fs_block_size;
+        blocknr_t block = file.f_ra_ahead > first + 1 ? file.f_ra_ahead : first + 1;
+        blocknr_t end = last + 1 + file.f_ra_size;
+        if (end > num_blocks)
+            end = num_blocks;
+        // Issue runs of consecutive disk blocks together so that they can be clustered
+        blocknr_t run_start = 0;
+        size_t run_length = 0;
+        for (/* nothing */; block < end; block++) {
+            blocknr_t cur_block;
+            if (auto result = inode.i_iops->block_map(inode, block, cur_block, false);
+                result.IsFailure())
+                break;
+            if (run_length > 0 && cur_block == run_start + run_length) {
+                ++run_length;
+                continue;
+            }
+            if (run_length > 0)
+                vfs_breada(fs, run_start, run_length);
+            run_start = cur_block;
+            run_length = 1;
+        }
+        if (run_length > 0)
+            vfs_breada(fs, run_start, run_length);
+        file.f_ra_ahead = block;
+    }
+} // unnamed namespace
+
 Result vfs_generic_read(struct VFS_FILE* file, void* buf, size_t len)
 {
     INode& inode = *file->f_dentry->d_inode;
@@ -74,6 +350,12 @@ Result vfs_generic_read(struct VFS_FILE* file, void* buf, size_t len)
         left = inode.i_sb.st_size - file->f_offset;
     }
 
+    // Get the disk busy with what we will need next while we copy the current blocks
+    if (left > 0)
+        ReadAhead(
+            *file, inode, file->f_offset / (blocknr_t)fs->fs_block_size,
+            (file->f_offset + left - 1) / (blocknr_t)fs->fs_block_size);
+
     while (left > 0) {
         if (!vfs_is_filesystem_sane(inode.i_fs))
             return Result::Failure(EIO);
@@ -104,6 +386,7 @@ Result vfs_generic_read(struct VFS_FILE* file, void* buf, size_t len)
         left -= chunk_len;
         file->f_offset += chunk_len;
     }
+    file->f_ra_next = file->f_offset / (blocknr_t)fs->fs_block_size;
     return Result::Success(read);
 }
 
@@ -119,9 +402,14 @@ Result vfs_generic_write(struct VFS_FILE* file, const void* buf, size_t len)
 
     int inode_dirty = 0;
     while (left > 0) {
+        /*
+         * Only blocks beyond the end of the file are created; st_blocks cannot be
+         * used to determine this as its unit is filesystem-specific.
+         */
+        const blocknr_t num_blocks = (inode.i_sb.st_size + fs->fs_block_size - 1) /
+                                     (blocknr_t)fs->fs_block_size;
         blocknr_t logical_block = file->f_offset / (blocknr_t)fs->fs_block_size;
-        bool create =
-            logical_block >= inode.i_sb.st_blocks; // XXX is this correct with sparse files?
+        bool create = logical_block >= num_blocks; // XXX is this correct with sparse files?
 
         if (!vfs_is_filesystem_sane(inode.i_fs))
             return Result::Failure(EIO);
@@ -138,11 +426,20 @@ Result vfs_generic_write(struct VFS_FILE* file, const void* buf, size_t len)
         if (chunk_len > left)
             chunk_len = left;
 
-        // Grab the next block
-        /* TODO Only read the block if it's a new one or we're not replacing everything
-         * If (create || chunk_len == fs->fs_block_size), we don't _need_ the data... */
-        if (auto result = vfs_bread(fs, cur_block, &bio); result.IsFailure())
+        /*
+         * Grab the next block; there is no need to read it if it's a new one or
+         * we're replacing everything. New blocks are not cleared by the
+         * filesystem, so we must clear whatever we don't write.
+         */
+        if (create || chunk_len == fs->fs_block_size) {
+            if (auto result = vfs_bget(fs, cur_block, &bio); result.IsFailure())
+                return result;
+            auto data = static_cast<char*>(bio->Data());
+            memset(data, 0, cur_offset);
+            memset(data + cur_offset + chunk_len, 0, fs->fs_block_size - cur_offset - chunk_len);
+        } else if (auto result = vfs_bread(fs, cur_block, &bio); result.IsFailure()) {
             return result;
+        }
 
         /* Copy as much to the block as we can */
         KASSERT(chunk_len > 0, "attempt to handle empty chunk");
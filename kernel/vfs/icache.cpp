@@ -5,26 +5,73 @@
  * For conditions of distribution and use, see LICENSE file
  */
 #include <ananas/types.h>
+#include "kernel/condvar.h"
 #include "kernel/init.h"
 #include "kernel/kdb.h"
 #include "kernel/lib.h"
 #include "kernel/lock.h"
 #include "kernel/mm.h"
 #include "kernel/result.h"
-#include "kernel/schedule.h" // XXX
 #include "kernel/vmpage.h"
 #include "kernel/vfs/core.h"
 #include "kernel/vfs/dentry.h"
+#include "kernel/vfs/generic.h"
 #include "kernel/vfs/icache.h"
 
+/*
+ * Inodes are hashed on (filesystem, inode number) into buckets, each of which
+ * has a lock of its own. Inodes without references stay hashed, but are also
+ * placed on a LRU list; the least recently used is recycled once the cache is
+ * full. Locking works as follows:
+ *
+ * [h] Lock of the bucket the inode is hashed on
+ * [i] Inode lock
+ * [l] icache_mtx, protecting the LRU list and freelist
+ *
+ * Locks must be taken in this order. An inode is on the LRU list if and only
+ * if it is hashed and has no references. INODE_FLAG_PENDING is [h]: it is
+ * cleared with the bucket lock held, after which the bucket's condition
+ * variable is broadcast. A pending inode belongs to whoever is filling it,
+ * who does so without holding the inode lock; nobody else touches it.
+ */
 namespace
 {
     constexpr size_t initialCacheItems = 32;
-    constexpr size_t growCacheIncrement = 2;
+    constexpr size_t growCacheIncrement = 32;
+
+    // Number of inodes we allocate before recycling unreferenced ones
+    constexpr size_t maximumCacheItems = 16384;
+    // Average number of inodes per bucket we aim for once the cache is full
+    constexpr size_t inodesPerBucket = 4;
+
+    constexpr unsigned int CalculateBucketShift()
+    {
+        unsigned int shift = 1;
+        while ((size_t(1) << shift) * inodesPerBucket < maximumCacheItems)
+            ++shift;
+        return shift;
+    }
+
+    constexpr unsigned int bucketShift = CalculateBucketShift(); // log2 of the number of buckets
+    constexpr size_t numberOfBuckets = size_t(1) << bucketShift;
+
+    struct BucketNode {
+        static util::List<INode>::Node& Get(INode& inode) { return inode.i_NodeBucket; }
+    };
+    using INodeBucketList = util::List<INode, util::List<INode>::nodeptr_accessor<BucketNode>>;
+
+    struct Bucket {
+        Mutex bu_mutex{"icachebucket"};
+        ConditionVariable bu_cv_pending{"icachepending"}; // Signalled once inodes are filled
+        INodeBucketList bu_inodes;
+    };
+
+    Bucket* icache_bucket;
 
     Mutex icache_mtx{"icache"};
-    util::List<INode> icache_inuse;
-    util::List<INode> icache_free;
+    util::List<INode> icache_lru;  // [l] unreferenced inodes, most recently used first
+    util::List<INode> icache_free; // [l] inodes that are not hashed
+    size_t numberOfINodes = 0;     // [l]
 
     inline void icache_lock() { icache_mtx.Lock(); }
 
@@ -37,79 +84,125 @@ namespace
         KASSERT((i.i_flags & INODE_FLAG_GONE) == 0, "referencing gone inode");
     }
 
+    // Fibonacci hashing; the top bits are the best mixed
+    Bucket& BucketForINode(const VFS_MOUNTED_FS* fs, ino_t inum)
+    {
+        const uint64_t key = inum ^ (reinterpret_cast<uintptr_t>(fs) >> 4);
+        return icache_bucket[(key * 0x9e3779b97f4a7c15ULL) >> (64 - bucketShift)];
+    }
+
     void GrowCache(size_t numberOfItems)
     {
+        icache_assert_locked();
         for (size_t i = 0; i < numberOfItems; i++)
             icache_free.push_back(*new INode);
+        numberOfINodes += numberOfItems;
     }
 
-    bool PurgeEntries()
+    // Frees the pages belonging to the inode; must be called with the inode locked
+    void FreeINodePages(INode& inode)
     {
-        icache_assert_locked();
-        icache_unlock();
+        inode.i_pages.for_each([](auto, VMPage* vp) {
+            vp->Lock();
+            vp->Deref();
+        });
+        inode.i_pages.clear();
+    }
 
-        /*
-         * Remove any stale entries from the dentry cache - this will release their
-         * inodes, which means we will be able to purge them from the icache.
-         */
-        dcache_purge_old_entries();
+    // Throws the contents of an inode away; must be called with the inode locked and unhashed
+    void DiscardINode(INode& inode, bool prepared)
+    {
+        struct VFS_MOUNTED_FS* fs = inode.i_fs;
+        if (prepared && fs->fs_fsops->discard_inode != NULL)
+            fs->fs_fsops->discard_inode(inode);
 
-        int num_purged = 0;
-        icache_lock();
-        for (auto rit = icache_inuse.rbegin(); rit != icache_inuse.rend(); /* nothing */) {
-            auto& inode = *rit;
-            ++rit;
+        FreeINodePages(inode);
+        vfs_discard_directory_index(inode);
 
-            /*
-             * Skip any pending items (we are not responsible for their cleanup (and
-             * to do so would be to introduce a race in vfs_read_inode()) and anything
-             * that still has references.
-             */
-            inode.Lock();
-            if (inode.i_refcount > 0 || (inode.i_flags & INODE_FLAG_PENDING)) {
-                inode.Unlock();
+        inode.i_refcount = -1; // in case someone tries to use it
+        inode.i_privdata = nullptr;
+        inode.i_flags = INODE_FLAG_GONE;
+    }
+
+    /*
+     * Claims the least recently used inode without references; it is removed
+     * from the LRU list and its bucket, and returned locked. As the bucket and
+     * inode locks must be taken before the icache lock, we can only try to lock
+     * them here.
+     */
+    INode* ClaimUnusedINode(Bucket*& contendedBucket)
+    {
+        icache_assert_locked();
+        for (auto rit = icache_lru.rbegin(); rit != icache_lru.rend(); ++rit) {
+            auto& inode = *rit;
+            auto& bucket = BucketForINode(inode.i_fs, inode.i_inum);
+            if (!bucket.bu_mutex.TryLock()) {
+                if (contendedBucket == nullptr)
+                    contendedBucket = &bucket;
                 continue;
             }
+            if (!inode.i_mutex.TryLock()) {
+                bucket.bu_mutex.Unlock();
+                continue;
+            }
+            KASSERT(inode.i_refcount == 0, "inode %p with refs on lru list", &inode);
 
-            // Throw the actual inode away
-            struct VFS_MOUNTED_FS* fs = inode.i_fs;
-            if (fs->fs_fsops->discard_inode != NULL)
-                fs->fs_fsops->discard_inode(inode);
-
-            // Free pages belonging on the inode
-            for (auto vp : inode.i_pages)
-                vp->Deref();
-            inode.i_pages.clear();
-
-            inode.i_refcount = -1; // in case someone tries to use it
-            inode.i_privdata = nullptr;
-            inode.i_flags |= INODE_FLAG_GONE;
-            inode.Unlock();
-
-            // Move the inode to the freelist as we can re-use it again
-            icache_inuse.remove(inode);
-            icache_free.push_back(inode);
-            num_purged++;
+            icache_lru.remove(inode);
+            bucket.bu_inodes.remove(inode);
+            bucket.bu_mutex.Unlock();
+            return &inode;
         }
-
-        return num_purged > 0;
+        return nullptr;
     }
 
+    // Obtains an inode that is not hashed; must be called without any bucket locks held
     INode& icache_find_item_to_use()
     {
-        icache_assert_locked();
-
+        bool purgedDEntries = false;
+        icache_lock();
         while (true) {
             if (!icache_free.empty()) {
                 /* Got one! */
                 auto& inode = icache_free.front();
                 icache_free.pop_front();
+                icache_unlock();
                 return inode;
             }
 
-            // Freelist is empty; we need to sacrifice an item from the cache
-            if (PurgeEntries())
+            if (numberOfINodes < maximumCacheItems) {
+                GrowCache(growCacheIncrement);
                 continue;
+            }
+
+            // Cache is full; we need to sacrifice the least recently used item
+            Bucket* contendedBucket = nullptr;
+            if (auto inode = ClaimUnusedINode(contendedBucket); inode != nullptr) {
+                icache_unlock();
+                DiscardINode(*inode, true);
+                inode->Unlock();
+                return *inode;
+            }
+
+            if (contendedBucket != nullptr) {
+                // All candidates were in use; wait for one of them and try again
+                icache_unlock();
+                contendedBucket->bu_mutex.Lock();
+                contendedBucket->bu_mutex.Unlock();
+                icache_lock();
+                continue;
+            }
+
+            if (!purgedDEntries) {
+                /*
+                 * Remove any stale entries from the dentry cache - this will release their
+                 * inodes, which means they end up on the LRU list so we can recycle them.
+                 */
+                icache_unlock();
+                dcache_purge_old_entries();
+                purgedDEntries = true;
+                icache_lock();
+                continue;
+            }
 
             // Nothing available; allocate some extra items
             GrowCache(growCacheIncrement);
@@ -118,6 +211,82 @@ namespace
         // NOTREACHED
     }
 
+    void ReleaseUnhashed(INode& inode)
+    {
+        MutexGuard g(icache_mtx);
+        icache_free.push_front(inode);
+    }
+
+    /*
+     * Locates an inode in the bucket, waiting for it to be filled if it is
+     * pending. On success, an extra ref to the inode will be added (for the
+     * caller to free) and the inode is returned.
+     */
+    INode* FindINode(Bucket& bucket, struct VFS_MOUNTED_FS* fs, ino_t inum)
+    {
+        bucket.bu_mutex.AssertLocked();
+    restart:
+        for (auto& inode : bucket.bu_inodes) {
+            if (inode.i_fs != fs || inode.i_inum != inum)
+                continue;
+
+            /*
+             * It's quite possible that this inode is still pending; if that
+             * is the case, sleep until the other caller finishes up. The
+             * pending flag is protected by the bucket lock, so we needn't
+             * (and mustn't, as it isn't ours) lock the inode for this.
+             */
+            if (inode.i_flags & INODE_FLAG_PENDING) {
+                bucket.bu_cv_pending.Wait(bucket.bu_mutex);
+                goto restart;
+            }
+
+            /*
+             * Now, we must increase the inode's refcount. It could be anything
+             * from zero upwards, so we can't use vfs_ref_inode() to ref it. If
+             * it was zero, the inode is on the LRU list and must leave it.
+             */
+            inode.Lock();
+            if (inode.i_refcount++ == 0) {
+                MutexGuard g(icache_mtx);
+                icache_lru.remove(inode);
+            }
+            inode.Unlock();
+            return &inode;
+        }
+        return nullptr;
+    }
+
+    // Marks a pending inode as filled and wakes up anyone waiting for it
+    void CompletePendingINode(INode& inode)
+    {
+        auto& bucket = BucketForINode(inode.i_fs, inode.i_inum);
+        MutexGuard g(bucket.bu_mutex);
+        inode.i_flags &= ~INODE_FLAG_PENDING;
+        bucket.bu_cv_pending.Broadcast();
+    }
+
+    /*
+     * Throws away a pending inode that could not be filled; the caller must
+     * hold its only reference.
+     */
+    void AbandonPendingINode(INode& inode, bool prepared)
+    {
+        auto& bucket = BucketForINode(inode.i_fs, inode.i_inum);
+        {
+            MutexGuard g(bucket.bu_mutex);
+            bucket.bu_inodes.remove(inode);
+            bucket.bu_cv_pending.Broadcast();
+        }
+
+        inode.Lock();
+        KASSERT(
+            inode.i_refcount == 1, "abandoning pending inode with refcount %d", inode.i_refcount);
+        DiscardINode(inode, prepared);
+        inode.Unlock();
+        ReleaseUnhashed(inode);
+    }
+
 } // unnamed namespace
 
 void vfs_deref_inode(INode& inode)
@@ -125,14 +294,34 @@ void vfs_deref_inode(INode& inode)
     inode_assert_sane(inode);
 
     inode.Lock();
+    if (auto release = inode.i_fs->fs_fsops->release_inode;
+        release != nullptr && inode.i_refcount == 1) {
+        // Releasing may need I/O, so don't hold the lock; our reference keeps the inode
+        inode.Unlock();
+        release(inode);
+        inode.Lock();
+    }
     KASSERT(
         inode.i_refcount > 0, "dereffing inode %p with invalid refcount %d", &inode,
         inode.i_refcount);
-    --inode.i_refcount;
+    if (--inode.i_refcount == 0) {
+        // Never free the backing inode here - we don't have to! We will only recycle it
+        // once it is the least recently used and we need a fresh inode
+        KASSERT((inode.i_flags & INODE_FLAG_PENDING) == 0, "dropping last ref to pending inode");
+        MutexGuard g(icache_mtx);
+        icache_lru.push_front(inode);
+    }
     inode.Unlock();
+}
+
+void vfs_drop_inode_pages(INode& inode)
+{
+    inode_assert_sane(inode);
 
-    // Never free the backing inode here - we don't have to! We will get rid of
-    // it once we need a fresh inode (PurgeEntries() does this)
+    inode.Lock();
+    KASSERT(inode.i_refcount == 1, "dropping pages of inode with refcount %d", inode.i_refcount);
+    FreeINodePages(inode);
+    inode.Unlock();
 }
 
 void vfs_ref_inode(INode& inode)
@@ -147,75 +336,42 @@ void vfs_ref_inode(INode& inode)
 
 /*
  * Searches find an inode in the cache; adds a pending entry if it's not found.
- * Will return the cache item; the inode is NULL if a pending item was added,
- * the result is NULL if a pending inode is already in the cache.
+ * Waits until any pending entry already in the cache is filled.
  *
- * On success, an extra ref to the inode will be added (for the caller to free)
- * and the locked inode is returned.
+ * An extra ref to the inode will be added (for the caller to free) and the
+ * inode is returned. If it is pending, the caller must fill it out.
  */
-static INode* icache_lookup_locked(struct VFS_MOUNTED_FS* fs, ino_t inum)
+static INode* icache_lookup(struct VFS_MOUNTED_FS* fs, ino_t inum)
 {
-    icache_lock();
-
-    /*
-     * XXX This is just a simple linear search which attempts to avoid
-     * overhead by moving recent entries to the start
-     */
-    for (auto& inode : icache_inuse) {
-        if (inode.i_fs != fs || inode.i_inum != inum)
-            continue;
-
-        // We found the inode - lock it so that it won't go
-        inode.Lock();
-
-        /*
-         * It's quite possible that this inode is still pending; if that
-         * is the case, our caller should sleep and wait for the other
-         * caller to finish up.
-         */
-        if (inode.i_flags & INODE_FLAG_PENDING) {
-            inode.Unlock();
-            icache_unlock();
-            kprintf("icache_lookup(): pending item, waiting\n");
-            return nullptr;
-        }
-
-        /*
-         * Now, we must increase the inode's refcount. It could be anything
-         * from zero upwards, so we can't use vfs_ref_inode() to ref it.
-         *
-         * Note that we cannot safely do this if we are dropping the icache lock,
-         * because this creates a race: the item may be removed while we are
-         * waiting for the inode lock.
-         */
-        ++inode.i_refcount;
-        KASSERT(inode.i_refcount >= 1, "huh?");
-
-        /*
-         * Push the the item to the head of the cache; we expect the caller to
-         * free it once done, which will decrease the refcount to zero, which is
-         * fine as we delay freeing inodes if possible.
-         */
-        icache_inuse.remove(inode);
-        icache_inuse.push_front(inode);
-        icache_unlock();
-        return &inode;
+    auto& bucket = BucketForINode(fs, inum);
+    bucket.bu_mutex.Lock();
+    if (auto inode = FindINode(bucket, fs, inum); inode != nullptr) {
+        bucket.bu_mutex.Unlock();
+        return inode;
     }
 
-    /* Fetch a new item and place it at the head; it's most recently used after all */
+    // Inode is not in the cache; get a new one without holding our bucket lock
+    bucket.bu_mutex.Unlock();
     auto& inode = icache_find_item_to_use();
-    icache_inuse.push_front(inode);
+    bucket.bu_mutex.Lock();
+    if (auto other = FindINode(bucket, fs, inum); other != nullptr) {
+        // Someone else added the inode while we were unlocked; use theirs
+        bucket.bu_mutex.Unlock();
+        ReleaseUnhashed(inode);
+        return other;
+    }
 
     // Fill out some basic information
-    inode.Lock();
     inode.i_refcount = 1; // caller
     inode.i_flags = INODE_FLAG_PENDING;
     inode.i_fs = fs;
     inode.i_inum = inum;
+    inode.i_privdata = nullptr;
     inode.i_sb.st_dev = (dev_t)(uintptr_t)fs->fs_device;
     inode.i_sb.st_rdev = (dev_t)(uintptr_t)fs->fs_device;
     inode.i_sb.st_blksize = fs->fs_block_size;
-    icache_unlock();
+    bucket.bu_inodes.push_front(inode);
+    bucket.bu_mutex.Unlock();
     return &inode;
 }
 
@@ -225,23 +381,14 @@ static INode* icache_lookup_locked(struct VFS_MOUNTED_FS* fs, ino_t inum)
 Result vfs_get_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, INode*& destinode)
 {
     /*
-     * Wait until we obtain a cache spot - this waits for pending inodes to be
-     * finished up. By ensuring we fill the cache we ensure the inode can only
-     * exist a single time.
+     * Obtain a cache spot - this waits for pending inodes to be finished up. By
+     * ensuring we fill the cache we ensure the inode can only exist a single time.
      */
-    INode* inode = nullptr;
-    while (true) {
-        inode = icache_lookup_locked(fs, inum);
-        if (inode != nullptr)
-            break;
-        /* XXX There should be a wakeup signal of some kind */
-        scheduler::Schedule();
-    }
+    INode* inode = icache_lookup(fs, inum);
     KASSERT(inode->i_fs == fs, "wtf?");
 
     if ((inode->i_flags & INODE_FLAG_PENDING) == 0) {
         /* Already have the inode cached -> return it (refcount will already be incremented) */
-        inode->Unlock();
         destinode = inode;
         return Result::Success();
     }
@@ -253,26 +400,24 @@ Result vfs_get_inode(struct VFS_MOUNTED_FS* fs, ino_t inum, INode*& destinode)
     if (fs->fs_fsops->prepare_inode != NULL)
         result = fs->fs_fsops->prepare_inode(*inode);
     if (result.IsFailure()) {
-        inode->Unlock();
-        vfs_deref_inode(*inode); /* throws it away */
+        AbandonPendingINode(*inode, false);
         return result;
     }
 
     /*
      * Read the inode - multiple callers for the same inum will not reach
-     * this point (they keep rescheduling, waiting for us to deal with it)
+     * this point (they sleep, waiting for us to deal with it). Note that we
+     * do not hold the inode lock while doing so; the inode is ours alone.
      */
     result = fs->fs_fsops->read_inode(*inode, inum);
     if (result.IsFailure()) {
-        inode->Unlock();
-        vfs_deref_inode(*inode); /* throws it away */
+        AbandonPendingINode(*inode, true);
         return result;
     }
 
     // Inode is complete
     KASSERT(inode->i_refcount == 1, "fresh inode refcount incorrect");
-    inode->i_flags &= ~INODE_FLAG_PENDING;
-    inode->Unlock();
+    CompletePendingINode(*inode);
     destinode = inode;
     return Result::Success();
 }
@@ -286,29 +431,37 @@ void vfs_dump_inode(INode& inode)
     kprintf("  uid/gid = %u:%u\n", sb->st_uid, sb->st_gid);
     kprintf("  size    = %u\n", (uint32_t)sb->st_size); /* XXX for now */
     kprintf("  blksize = %u\n", sb->st_blksize);
-    for (auto vp : inode.i_pages) {
-        vp->Dump("    ");
-    }
+    inode.i_pages.for_each([](auto, VMPage* vp) { vp->Dump("    "); });
 }
 
 const kdb::RegisterCommand kdbICache("icache", "Show inode cache", [](int, const kdb::Argument*) {
     int n = 0;
-    for (auto& inode : icache_inuse) {
-        kprintf("inode=%p, inum=%lx\n", &inode, inode.i_inum);
-        if ((inode.i_flags & INODE_FLAG_PENDING) == 0)
-            vfs_dump_inode(inode);
-        n++;
+    for (size_t bucketNum = 0; bucketNum < numberOfBuckets; ++bucketNum) {
+        for (auto& inode : icache_bucket[bucketNum].bu_inodes) {
+            kprintf("inode=%p, inum=%lx\n", &inode, inode.i_inum);
+            if ((inode.i_flags & INODE_FLAG_PENDING) == 0)
+                vfs_dump_inode(inode);
+            n++;
+        }
     }
-    kprintf("Inode cache contains %u entries\n", n);
+    int numUnused = 0;
+    for ([[maybe_unused]] auto& inode : icache_lru)
+        numUnused++;
+    kprintf(
+        "Inode cache contains %u entries, %u unreferenced (%u allocated)\n", n, numUnused,
+        numberOfINodes);
 });
 
 namespace
 {
     const init::OnInit initInodeCache(init::SubSystem::VFS, init::Order::First, []() {
+        icache_bucket = new Bucket[numberOfBuckets];
+
         /*
-         * Make an initial empty cache; we allocate one big pool and set up pointers to the
-         * items as necessary. We may choose to shrink/expand this pool later on.
+         * Make an initial empty cache; the cache grows as needed, up to
+         * maximumCacheItems after which unused items are recycled.
          */
+        MutexGuard g(icache_mtx);
         GrowCache(initialCacheItems);
     });
 
@@ -104,10 +104,7 @@ Result vfs_mount(const char* from, const char* to, const char* type)
     DEntry* dentry_root = fs->fs_root_dentry;
     if (auto result = vfs_lookup(NULL, dentry_root, to);
         result.IsSuccess() && dentry_root != fs->fs_root_dentry) {
-        if (dentry_root->d_inode != NULL)
-            vfs_deref_inode(*dentry_root->d_inode);
-        vfs_ref_inode(*root_inode);
-        dentry_root->d_inode = root_inode;
+        dcache_set_inode(*dentry_root, *root_inode);
     }
 
     return Result::Success();
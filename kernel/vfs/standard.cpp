@@ -10,10 +10,10 @@
 #include "kernel/lib.h"
 #include "kernel/mm.h"
 #include "kernel/result.h"
-#include "kernel/schedule.h" // XXX
 #include "kernel/vfs/core.h"
 #include "kernel/vfs/dentry.h"
 #include "kernel/vfs/generic.h"
+#include "kernel/vfs/icache.h"
 #include "kernel/vfs/mount.h"
 
 namespace {
@@ -297,16 +297,10 @@ vfs_lookup_internal(DEntry* curdentry, const char* name, DEntry*& ditem, bool& f
         /*
          * See if the item is in the cache; we will add it otherwise since we we
          * use the cache to look for items. Note that dcache_lookup() returns a
-         * _reffed_ dentry, which is why we don't take it ourselves.
+         * _reffed_ dentry, which is why we don't take it ourselves. If someone
+         * else is looking the entry up, it waits until they are done.
          */
-        DEntry* dentry;
-        while (1) {
-            dentry = dcache_lookup(*curdentry, next_lookup);
-            if (dentry != nullptr)
-                break;
-            /* XXX There should be a wakeup signal of some kind */
-            scheduler::Schedule();
-        }
+        DEntry* dentry = dcache_lookup(*curdentry, next_lookup);
         if constexpr (vfsDebugLookup) {
             kprintf(
                 "partial lookup for %p:'%s' -> dentry %p (flags %u)", curdentry, next_lookup, dentry,
@@ -338,12 +332,13 @@ vfs_lookup_internal(DEntry* curdentry, const char* name, DEntry*& ditem, bool& f
         if (result.IsSuccess()) {
             /*
              * Lookup worked; we have a single-reffed inode now. We have to hook it
-             * up to the dentry cache, which can re-use the reference we have for it.
+             * up to the dentry cache, which takes a reference of its own.
              */
-            dentry->d_inode = inode;
+            dcache_set_inode(*dentry, *inode);
+            vfs_deref_inode(*inode);
         } else {
             /* Lookup failed; make the entry cache negative */
-            dentry->d_flags |= DENTRY_FLAG_NEGATIVE;
+            dcache_set_negative(*dentry);
             /* No need to touch ditem; it'll be set already to the new dentry (and we can get to the
              * parent from there) */
             return result;
@@ -416,12 +411,7 @@ Result vfs_create(DEntry* parent, struct VFS_FILE* file, const char* dentry, int
         return result;
     }
 
-    /*
-     * Excellent, the path works but the final entry doesn't. Mark the directory
-     * entry as pending (as we are creating it) - this prevents it from going
-     * away.
-     */
-    de->d_flags &= ~DENTRY_FLAG_NEGATIVE;
+    /* Excellent, the path works but the final entry doesn't */
     KASSERT(
         de->d_parent != nullptr && de->d_parent->d_inode != nullptr,
         "attempt to create entry without a parent inode");
@@ -435,11 +425,21 @@ Result vfs_create(DEntry* parent, struct VFS_FILE* file, const char* dentry, int
     if (!vfs_is_filesystem_sane(parentinode->i_fs))
         return Result::Failure(EIO);
 
+    /*
+     * Mark the directory entry as pending (as we are creating it) - anyone
+     * looking it up will wait until we are done.
+     */
+    dcache_set_pending(*de);
+
     /* Dear filesystem, create a new inode for us */
+    auto index = vfs_begin_directory_change(*parentinode);
     result = parentinode->i_iops->create(*parentinode, de, mode);
+    vfs_end_directory_change(
+        *parentinode, index, result.IsSuccess() && de->d_inode != nullptr, nullptr, de->d_entry,
+        de->d_inode != nullptr ? de->d_inode->i_inum : 0);
     if (result.IsFailure()) {
         /* Failure; remark the directory entry (we don't own it anymore) and report the failure */
-        de->d_flags |= DENTRY_FLAG_NEGATIVE;
+        dcache_set_negative(*de);
     } else {
         /* Success; report the inode we created */
         vfs_make_file(file, *de);
@@ -492,7 +492,11 @@ Result vfs_unlink(struct VFS_FILE* file)
     if (!vfs_is_filesystem_sane(inode.i_fs))
         return Result::Failure(EIO);
 
-    if (auto result = inode.i_iops->unlink(inode, *file->f_dentry); result.IsFailure())
+    auto index = vfs_begin_directory_change(inode);
+    auto result = inode.i_iops->unlink(inode, *file->f_dentry);
+    vfs_end_directory_change(
+        inode, index, result.IsSuccess(), file->f_dentry->d_entry, nullptr, 0);
+    if (result.IsFailure())
         return result;
 
     /*
@@ -561,7 +565,22 @@ Result vfs_rename(struct VFS_FILE* file, DEntry* parent, const char* dest)
     }
 
     /* All seems to be in order; ask the filesystem to deal with the change */
+    const ino_t inum = file->f_dentry->d_inode->i_inum;
+    auto parent_index = vfs_begin_directory_change(*parent_inode);
+    DirectoryIndex* dest_index = nullptr;
+    if (dest_inode != parent_inode)
+        dest_index = vfs_begin_directory_change(*dest_inode);
     result = parent_inode->i_iops->rename(*parent_inode, *file->f_dentry, *dest_inode, *de);
+    if (dest_inode != parent_inode) {
+        vfs_end_directory_change(
+            *parent_inode, parent_index, result.IsSuccess(), file->f_dentry->d_entry, nullptr, 0);
+        vfs_end_directory_change(
+            *dest_inode, dest_index, result.IsSuccess(), nullptr, de->d_entry, inum);
+    } else {
+        vfs_end_directory_change(
+            *parent_inode, parent_index, result.IsSuccess(), file->f_dentry->d_entry,
+            de->d_entry, inum);
+    }
     if (result.IsFailure()) {
         /* If something went wrong, ensure to free the new dentry */
         dentry_deref(*de);
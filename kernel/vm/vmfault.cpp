@@ -7,8 +7,10 @@
 #include <ananas/types.h>
 #include <ananas/errno.h>
 #include <ananas/util/utility.h>
+#include "kernel/cmdline.h"
 #include "kernel/kmem.h"
 #include "kernel/lib.h"
+#include "kernel/page.h"
 #include "kernel/result.h"
 #include "kernel/vmarea.h"
 #include "kernel/vmspace.h"
@@ -16,11 +18,30 @@
 #include "kernel/vfs/core.h"
 #include "kernel/vfs/dentry.h"
 #include "kernel/vm.h"
+#include "kernel-md/md.h"
+#include "kernel-md/param.h"
 
 #include "kernel/process.h"
 
 namespace
 {
+    // Number of pages around a file-backed read fault to map as well, unless overridden
+    constexpr size_t DefaultFaultAroundPages = 16;
+    constexpr size_t MaximumFaultAroundPages = 32;
+
+    // The fault-around window can be changed using 'faultaround=n' on the command line
+    size_t GetFaultAroundPages()
+    {
+        static const size_t faultAroundPages = []() -> size_t {
+            const char* value = cmdline_get_string("faultaround");
+            if (value == nullptr)
+                return DefaultFaultAroundPages;
+            const size_t numPages = strtoul(value, nullptr, 10);
+            return numPages < MaximumFaultAroundPages ? numPages : MaximumFaultAroundPages;
+        }();
+        return faultAroundPages;
+    }
+
     Result read_data(DEntry& dentry, void* buf, off_t offset, size_t len)
     {
         struct VFS_FILE f;
@@ -80,7 +101,7 @@ namespace
 
         // Update the vm page to contain our new address
         vmpage->vp_page = p;
-        vmpage->vp_flags &= ~vmpage::flag::Pending;
+        vmpage::MarkINodePageFilled(*va.va_dentry->d_inode, *vmpage);
         return vmpage;
     }
 
@@ -139,6 +160,191 @@ namespace
         vmpage.Unlock();
         return new_vp;
     }
+
+    // Returns whether 'virt' is fully backed by the dentry and not yet mapped
+    bool CanFaultAround(VMArea& va, const VAInterval& interval, const addr_t virt)
+    {
+        if (virt < interval.begin || virt >= interval.end)
+            return false;
+        if (virt - va.va_virt + PAGE_SIZE > va.va_dlength)
+            return false; // not fully backed; needs to be copied by a proper fault
+        return va.va_pages[(virt - interval.begin) / PAGE_SIZE] == nullptr;
+    }
+
+    // Maps locked page cache page 'vp' read-only at 'virt' and unlocks it
+    void MapCachedPage(
+        VMSpace& vs, VMArea& va, const VAInterval& interval, const addr_t virt, VMPage& vp)
+    {
+        // The page cache holds a reference as well, so a write will always copy the page
+        vp.Ref();
+        va.va_pages[(virt - interval.begin) / PAGE_SIZE] = &vp;
+        vp.Map(vs, va, virt);
+        vp.Unlock();
+    }
+
+    /*
+     * Reads the pages from 'virt' up to 'end' that are not cached yet using a
+     * single read, and maps them; stops at the first page that is cached or
+     * cannot be faulted around. Returns the number of pages read.
+     */
+    size_t ReadAhead(
+        VMSpace& vs, VMArea& va, const VAInterval& interval, const addr_t virt, const addr_t end)
+    {
+        auto& inode = *va.va_dentry->d_inode;
+        const off_t offset = virt - va.va_virt + va.va_doffset;
+
+        size_t numPages = 0;
+        while (virt + numPages * PAGE_SIZE < end &&
+               CanFaultAround(va, interval, virt + numPages * PAGE_SIZE) &&
+               inode.i_pages.lookup(offset / PAGE_SIZE + numPages) == nullptr)
+            ++numPages;
+        if (numPages == 0)
+            return 0;
+
+        // Reading ahead is merely an optimisation; do not dig into the reserves for it
+        int order = 0;
+        while ((1U << order) < numPages)
+            ++order;
+        Page* p = page_alloc_order(order, page::flag::Try);
+        if (p == nullptr)
+            return 0;
+        page_split(*p);
+
+        // Someone may have beaten us to some of the pages; only read up to the first one
+        VMPage* vmpages[MaximumFaultAroundPages];
+        size_t numPending = 0;
+        for (/* nothing */; numPending < numPages; ++numPending) {
+            auto vmpage = vmpage::LookupOrCreateINodePage(
+                inode, offset + numPending * PAGE_SIZE, vmpage::flag::Pending);
+            if ((vmpage->vp_flags & vmpage::flag::Pending) == 0) {
+                vmpage.Unlock();
+                break;
+            }
+            vmpages[numPending] = vmpage.Extract();
+        }
+
+        if (numPending > 0) {
+            const size_t length = numPending * PAGE_SIZE;
+            auto buf = static_cast<char*>(
+                kmem_map(p->GetPhysicalAddress(), length, vm::flag::Read | vm::flag::Write));
+
+            size_t read_length = length;
+            const off_t size = inode.i_sb.st_size;
+            if (offset + static_cast<off_t>(read_length) > size) {
+                // Zero out everything after the part we will read so we don't leak any data
+                read_length = offset < size ? size - offset : 0;
+                memset(buf + read_length, 0, length - read_length);
+            }
+
+            const auto result = read_data(*va.va_dentry, buf, offset, read_length);
+            kmem_unmap(buf, length);
+            KASSERT(result.IsSuccess(), "cannot deal with error %d", result.AsStatusCode()); // XXX
+        }
+
+        for (size_t n = numPending; n < (1U << order); ++n)
+            page_free(p[n]);
+        for (size_t n = 0; n < numPending; ++n) {
+            auto& vmpage = *vmpages[n];
+            vmpage.vp_page = &p[n];
+            vmpage::MarkINodePageFilled(inode, vmpage);
+            MapCachedPage(vs, va, interval, virt + n * PAGE_SIZE, vmpage);
+        }
+        return numPending;
+    }
+
+    /*
+     * Maps the pages of the fault-around window surrounding 'faultVirt' which
+     * are not yet mapped, to spare us the faults on them; this is typically
+     * the case for program text. Only pages which are fully backed by the
+     * dentry are considered, as these can be mapped straight from the page
+     * cache: they are mapped read-only, so the usual COW logic will take
+     * over once they are written to.
+     *
+     * If 'readMissing' is set, the pages directly following 'faultVirt' that
+     * are not cached are read ahead using a single read; any other page is
+     * only mapped if it is cached already.
+     */
+    void FaultAround(
+        VMSpace& vs, VMArea& va, const VAInterval& interval, const addr_t faultVirt,
+        const bool readMissing)
+    {
+        const auto numPages = GetFaultAroundPages();
+        if (numPages <= 1)
+            return;
+
+        auto& inode = *va.va_dentry->d_inode;
+        const addr_t windowStart = faultVirt - ((faultVirt / PAGE_SIZE) % numPages) * PAGE_SIZE;
+        const addr_t windowEnd = windowStart + numPages * PAGE_SIZE;
+        for (addr_t virt = windowStart; virt < windowEnd; virt += PAGE_SIZE) {
+            if (virt == faultVirt || !CanFaultAround(va, interval, virt))
+                continue;
+
+            if (readMissing && virt == faultVirt + PAGE_SIZE) {
+                const auto numRead = ReadAhead(vs, va, interval, virt, windowEnd);
+                if (numRead > 0) {
+                    virt += (numRead - 1) * PAGE_SIZE;
+                    continue;
+                }
+            }
+
+            const off_t offset = virt - va.va_virt + va.va_doffset;
+            auto cachedPage = inode.i_pages.lookup(offset / PAGE_SIZE);
+            if (cachedPage == nullptr)
+                continue;
+            cachedPage->Lock();
+            if (cachedPage->vp_flags & vmpage::flag::Pending) {
+                // Someone else is still reading it; not worth waiting for
+                cachedPage->Unlock();
+                continue;
+            }
+            MapCachedPage(vs, va, interval, virt, *cachedPage);
+        }
+    }
+
+    /*
+     * Backs the entire large page containing 'virt' by a single block of
+     * memory, so that it can be mapped using a large page. This is only done
+     * for anonymous memory, if the area covers the large page and nothing in
+     * it is mapped yet; returns false if this is not the case or the memory
+     * cannot be had, in which case the caller must map a single page instead.
+     */
+    bool HandleAnonymousLargePageFault(
+        VMSpace& vs, VMArea& va, const VAInterval& interval, const addr_t virt)
+    {
+        constexpr size_t pagesPerLargePage = LARGE_PAGE_SIZE / PAGE_SIZE;
+        if (va.va_dentry != nullptr || (va.va_flags & vm::flag::MD) != 0)
+            return false;
+
+        const addr_t largeVirt = virt & ~(LARGE_PAGE_SIZE - 1);
+        if (largeVirt < interval.begin || largeVirt + LARGE_PAGE_SIZE > interval.end)
+            return false;
+        const auto page_index = (largeVirt - interval.begin) / PAGE_SIZE;
+        for (size_t n = 0; n < pagesPerLargePage; ++n) {
+            if (va.va_pages[page_index + n] != nullptr)
+                return false;
+        }
+
+        // Do not try too hard; we can always fall back to small pages
+        Page* p = page_alloc_order(LARGE_PAGE_ORDER, page::flag::Zero | page::flag::Try);
+        if (p == nullptr)
+            return false;
+        const addr_t phys = p->GetPhysicalAddress();
+        if ((phys & (LARGE_PAGE_SIZE - 1)) != 0) {
+            page_free(*p);
+            return false;
+        }
+
+        // Every page is administered on its own, so that they can be shared and freed as usual
+        page_split(*p);
+        const int vp_flags = (va.va_flags & vm::flag::Write) ? vmpage::flag::Promoted : 0;
+        for (size_t n = 0; n < pagesPerLargePage; ++n) {
+            auto& vp = vmpage::Allocate(vp_flags, p[n]);
+            va.va_pages[page_index + n] = &vp;
+            vp.Unlock();
+        }
+        md::vm::MapPages(vs, largeVirt, phys, pagesPerLargePage, va.va_flags);
+        return true;
+    }
 } // unnamed namespace
 
 
@@ -167,10 +373,11 @@ Result VMSpace::HandleFault(addr_t virt, const int fault_flags)
 {
     //kprintf(">> HandleFault(): vs=%p, virt=%p, flags=0x%x\n", this, virt, fault_flags);
 
-    // Walk through the areas one by one
-    for (auto& [interval, va ] : vs_areamap) {
-        if (!(virt >= va->va_virt && (virt < (va->va_virt + va->va_len))))
-            continue;
+    // Areas do not overlap, so at most a single one can contain the address
+    if (auto it = vs_areamap.find_by_value(virt); it != vs_areamap.end()) {
+        auto& [interval, va] = *it;
+        if (va->va_flags & vm::flag::MD)
+            return Result::Failure(EFAULT); // always fully mapped; this is a protection fault
 
         // See if we have this page mapped
         const auto alignedVirt = virt & ~(PAGE_SIZE - 1);
@@ -199,12 +406,24 @@ Result VMSpace::HandleFault(addr_t virt, const int fault_flags)
         // inode
         VMPage* new_vp = nullptr;
         if (va->va_dentry != nullptr) {
+            const off_t offset = alignedVirt - va->va_virt + va->va_doffset;
+            const bool wasCached =
+                va->va_dentry->d_inode->i_pages.lookup(offset / PAGE_SIZE) != nullptr;
             new_vp = HandleDEntryBackedFault(*this, *va, interval, alignedVirt);
+
+            // On a read, chances are that the pages around it will be read too
+            if (new_vp != nullptr && (fault_flags & vm::flag::Write) == 0) {
+                AssignPageToVirtualAddress(*this, *va, interval, alignedVirt, *new_vp);
+                new_vp->Unlock();
+                FaultAround(*this, *va, interval, alignedVirt, !wasCached);
+                return Result::Success();
+            }
         }
         if (new_vp == nullptr) {
             // We need a new VM page here; this is an anonymous mapping which we need to back
-            new_vp = &vmpage::Allocate(0);
-            new_vp->Zero(*this, *va, alignedVirt);
+            if (HandleAnonymousLargePageFault(*this, *va, interval, alignedVirt))
+                return Result::Success();
+            new_vp = &vmpage::Allocate(0, page::flag::Zero);
         }
 
         AssignPageToVirtualAddress(*this, *va, interval, alignedVirt, *new_vp);
@@ -9,6 +9,7 @@
 #include "kernel/lib.h"
 #include "kernel/result.h"
 #include "kernel/mm.h"
+#include "kernel/pool.h"
 #include "kernel/vmpage.h"
 #include "kernel/vmarea.h"
 #include "kernel/vmspace.h"
@@ -19,9 +20,14 @@
 
 #include "kernel/process.h"
 
+namespace
+{
+    pool::Pool vmpagePool("vmpage", sizeof(VMPage), alignof(VMPage));
+}
+
 namespace vmpage
 {
-    VMPage& Allocate(int flags)
+    VMPage& Allocate(int flags, int page_flags)
     {
         KASSERT((flags & vmpage::flag::Pending) == 0, "allocating pending page here?");
 
@@ -29,33 +35,72 @@ namespace vmpage
         new_page->Lock();
 
         // Hook a page to here as well, as the caller needs it anyway
-        new_page->vp_page = page_alloc_single();
+        new_page->vp_page = page_alloc_single(page_flags);
         KASSERT(new_page->vp_page != nullptr, "out of pages");
         return *new_page;
     }
 
-    util::locked<VMPage> LookupOrCreateINodePage(INode& inode, off_t offs, int flags)
+    VMPage& Allocate(int flags, Page& page)
     {
-        inode.Lock();
-        for (auto vp: inode.i_pages) {
-            if (vp->vp_offset != offs)
-                continue;
+        KASSERT((flags & vmpage::flag::Pending) == 0, "allocating pending page here?");
+
+        auto new_page = new VMPage(flags);
+        new_page->Lock();
+        new_page->vp_page = &page;
+        return *new_page;
+    }
 
-            // Page is already present; return it
-            vp->Lock();
+    util::locked<VMPage> LookupOrCreateINodePage(INode& inode, off_t offs, int flags)
+    {
+        KASSERT((offs & (PAGE_SIZE - 1)) == 0, "offset %d not page-aligned", (int)offs);
+        const auto index = offs / PAGE_SIZE;
+
+        /*
+         * Pages stay until the inode is discarded, which cannot happen while we
+         * hold a reference to it - so there is no need to lock anything to find
+         * them.
+         */
+        auto vp = inode.i_pages.lookup(index);
+        if (vp == nullptr) {
+            inode.Lock();
+            vp = inode.i_pages.lookup(index);
+            if (vp == nullptr) {
+                // Not yet present; create a new page and return it
+                vp = new VMPage(offs, flags);
+                vp->Lock();
+                inode.i_pages.insert(index, vp);
+                if (flags & vmpage::flag::Pending)
+                    inode.i_pages.set_tag(index, vmpage::tag::Pending);
+                inode.Unlock();
+                return util::locked<VMPage>(*vp);
+            }
             inode.Unlock();
-            return util::locked<VMPage>(*vp);
         }
 
-        // Not yet present; create a new page and return it
-        auto vp = new VMPage(offs, flags);
+        // Page is already present; return it
         vp->Lock();
-        inode.i_pages.push_back(vp);
-        inode.Unlock();
         return util::locked<VMPage>(*vp);
     }
+
+    void MarkINodePageFilled(INode& inode, VMPage& vp)
+    {
+        vp.AssertLocked();
+        vp.vp_flags &= ~vmpage::flag::Pending;
+
+        inode.Lock();
+        inode.i_pages.clear_tag(vp.vp_offset / PAGE_SIZE, vmpage::tag::Pending);
+        inode.Unlock();
+    }
+}
+
+void* VMPage::operator new(size_t len)
+{
+    KASSERT(len == sizeof(VMPage), "unexpected length %d", len);
+    return vmpagePool.AllocateItem();
 }
 
+void VMPage::operator delete(void* ptr) { vmpagePool.FreeItem(ptr); }
+
 VMPage::~VMPage()
 {
     vp_mtx.AssertLocked();
@@ -124,16 +169,6 @@ void VMPage::Map(VMSpace& vs, VMArea& va, addr_t virt)
     md::vm::MapPages(vs, virt, p->GetPhysicalAddress(), 1, flags);
 }
 
-void VMPage::Zero(VMSpace& vs, VMArea& va, addr_t virt)
-{
-    KASSERT(vs.IsCurrent(), "zero outside active vmspace");
-
-    // Clear the page XXX This is unfortunate, we should have a supply of pre-zeroed pages
-    Page* p = GetPage();
-    md::vm::MapPages(vs, virt, p->GetPhysicalAddress(), 1, vm::flag::Read | vm::flag::Write);
-    memset((void*)virt, 0, PAGE_SIZE);
-}
-
 VMPage& VMPage::Clone(VMSpace& vs, VMArea& va_source, addr_t virt)
 {
     KASSERT((vp_flags & vmpage::flag::Pending) == 0, "trying to clone a pending page");
@@ -39,6 +39,31 @@ namespace
         vs.vs_areamap.clear();
     }
 
+    // Frees everything except the machine-dependent areas, which are set up by md::vmspace::Init()
+    void FreeNonMDAreas(VMSpace& vs)
+    {
+        for (auto it = vs.vs_areamap.begin(); it != vs.vs_areamap.end(); /* nothing */) {
+            auto va = it->value;
+            if (va->va_flags & vm::flag::MD) {
+                ++it;
+                continue;
+            }
+            vs.vs_areamap.remove(it->interval);
+            delete va;
+            it = vs.vs_areamap.begin();
+        }
+    }
+
+    bool OverlapsMDArea(VMSpace& vs, const VAInterval& interval)
+    {
+        for (auto it = vs.vs_areamap.lower_bound_by_value(interval.begin);
+             it != vs.vs_areamap.end() && it->interval.begin < interval.end; ++it) {
+            if (it->value->va_flags & vm::flag::MD)
+                return true;
+        }
+        return false;
+    }
+
     void MigratePagesToNewVA(VMArea& va, const VAInterval& interval, VMArea& newVA)
     {
         addr_t currentVa = interval.begin;
@@ -74,10 +99,17 @@ namespace
 
     void FreeRange(VMSpace& vs, const VAInterval& range_to_free)
     {
-        for (auto [ vaInterval, va ]: vs.vs_areamap) {
+        // Areas are sorted and do not overlap; only consecutive areas can overlap the range
+        while (true) {
+            auto it = vs.vs_areamap.lower_bound_by_value(range_to_free.begin);
+            if (it == vs.vs_areamap.end())
+                return;
+            const auto vaInterval = it->interval;
+            auto va = it->value;
+
             if (vaInterval == range_to_free) {
                 // Interval matches as-if with what to free; this is easy
-                vs.vs_areamap.remove(va);
+                vs.vs_areamap.remove(vaInterval);
                 delete va;
                 return;
             }
@@ -85,10 +117,10 @@ namespace
             // See if there is any overlap
             const auto overlap = vaInterval.overlap(range_to_free);
             if (overlap.empty())
-                continue; // not within our area, skip
+                return; // area is beyond our range, so are all others
 
             // Disconnect the matching va; this allows us to insert the new ranges
-            vs.vs_areamap.remove(va);
+            vs.vs_areamap.remove(vaInterval);
 
             // Determine the new intervals if we'd free this range
             const auto interval_1 = VAInterval{ vaInterval.begin, overlap.begin };
@@ -108,9 +140,8 @@ namespace
                 migrateToNewRange(interval_2);
             }
 
-            // Throw the old va away, we've split it up as needed
+            // Throw the old va away, we've split it up as needed; the range may cover more areas
             delete va;
-            return;
         }
     }
 } // unnamed namespace
@@ -122,7 +153,11 @@ addr_t VMSpace::ReserveAdressRange(size_t len)
      * addresses which may get ugly.
      */
     addr_t virt = vs_next_mapping;
-    vs_next_mapping = RoundUpToPage(vs_next_mapping + len);
+    if (len >= LARGE_PAGE_SIZE) {
+        // Align large ranges so that they can be mapped using large pages
+        virt = (virt + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    }
+    vs_next_mapping = RoundUpToPage(virt + len);
     return virt;
 }
 
@@ -143,13 +178,13 @@ void vmspace_destroy(VMSpace& vs)
     FreeAllAreas(vs);
 
     KASSERT(!vs.IsCurrent(), "destroying active vmspace");
+    md::vmspace::Destroy(vs);
     while(!vs.vs_md_pages.empty()) {
         auto& page = vs.vs_md_pages.front();
         vs.vs_md_pages.pop_front();
 
         page_free(page);
     }
-    md::vmspace::Destroy(vs);
     delete &vs;
 }
 
@@ -159,6 +194,8 @@ Result VMSpace::Map(
 {
     if (vaInterval.empty())
         return Result::Failure(EINVAL);
+    if (OverlapsMDArea(*this, vaInterval))
+        return Result::Failure(EINVAL);
 
     // Make sure the range is unused
     FreeRange(*this, vaInterval);
@@ -215,25 +252,18 @@ Result VMSpace::Map(size_t len /* bytes */, uint32_t flags, VMArea*& va_out)
 
 void VMSpace::PrepareForExecute()
 {
-    // Throw all non-MD mappings away - this should only leave the kernel stack in place
-    for (auto it = vs_areamap.begin(); it != vs_areamap.end(); /* nothing */) {
-        auto va = it->value;
-        if (va->va_flags & vm::flag::MD) {
-            ++it;
-            continue;
-        }
-        vs_areamap.remove(va);
-        delete va;
-        it = vs_areamap.begin();
-    }
+    // Throw all non-MD mappings away
+    FreeNonMDAreas(*this);
 }
 
 Result VMSpace::Clone(VMSpace& vs_dest)
 {
-    FreeAllAreas(vs_dest);
+    FreeNonMDAreas(vs_dest);
 
     /* Now copy everything over that isn't private */
     for (auto& [srcInterval, va_src ]: vs_areamap) {
+        if (va_src->va_flags & vm::flag::MD)
+            continue; // already present in vs_dest
         VMArea* va_dst;
         if (auto result = vs_dest.MapTo(srcInterval, va_src->va_flags, va_dst);
             result.IsFailure())
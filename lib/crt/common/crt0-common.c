@@ -7,11 +7,14 @@
 /*
  * Init functionality; largely inspired by NetBSD's lib/csu/common/crt0-common.c.
  */
+#include <ananas/types.h>
 #include <stdlib.h>
+#include <machine/elf.h>
 
 extern int main(int argc, char** argv, char** envp);
 extern void exit(int);
 char** environ;
+Elf_Auxv* __elf_aux_vector;
 
 #define __hidden __attribute__((__visibility__("hidden")))
 
@@ -26,8 +29,11 @@ void __start(unsigned long* stk, void (*cleanup)() /* provided by rtld-elf */)
     int argc = *stk++;
     char** argv = (char**)stk;
     stk += argc + 1 /* terminating null */;
-    environ = (char**)stk++;
-    void* auxv = stk;
+    environ = (char**)stk;
+    while (*stk != 0)
+        stk++; /* skip envp */
+    stk++;     /* skip null */
+    __elf_aux_vector = (Elf_Auxv*)stk;
     if (&_DYNAMIC != NULL)
         atexit(cleanup);
     atexit(_fini);
@@ -21,7 +21,8 @@ int fcntl(int fildes, int cmd, ...)
         case F_SETFD:
         case F_SETFL:
         case F_GETFD:
-        case F_GETFL: {
+        case F_GETFL:
+        case F_ADVISE: {
             statuscode_t status = sys_fcntl(fildes, cmd, (void*)(uintptr_t)va_arg(va, int), NULL);
             return map_statuscode(status);
         }
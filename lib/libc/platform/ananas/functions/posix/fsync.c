@@ -4,6 +4,13 @@
  * Copyright (c) 2009-2018 Rink Springer <rink@rink.nu>
  * For conditions of distribution and use, see LICENSE file
  */
+#include <ananas/types.h>
+#include <ananas/syscalls.h>
 #include <unistd.h>
+#include "_map_statuscode.h"
 
-int fsync(int fd) { return 0; }
+int fsync(int fd)
+{
+    statuscode_t status = sys_fsync(fd);
+    return map_statuscode(status);
+}
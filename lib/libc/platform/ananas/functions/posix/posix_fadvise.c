@@ -0,0 +1,21 @@
+/*-
+ * SPDX-License-Identifier: Zlib
+ *
+ * Copyright (c) 2009-2018 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include <ananas/types.h>
+#include <ananas/syscalls.h>
+#include <fcntl.h>
+#include "_map_statuscode.h"
+
+int posix_fadvise(int fd, off_t offset, off_t len, int advice)
+{
+    /* The kernel only keeps advice for the file as a whole */
+    (void)offset;
+    (void)len;
+    statuscode_t status = sys_fcntl(fd, F_ADVISE, (void*)(uintptr_t)advice, NULL);
+    if (ananas_statuscode_is_failure(status))
+        return ananas_statuscode_extract_errno(status);
+    return 0;
+}
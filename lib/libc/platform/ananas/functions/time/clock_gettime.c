@@ -5,12 +5,87 @@
  * For conditions of distribution and use, see LICENSE file
  */
 #include <ananas/types.h>
+#include <ananas/clockpage.h>
 #include <ananas/syscalls.h>
+#include <machine/elf.h>
 #include <time.h>
 #include "_map_statuscode.h"
 
+extern Elf_Auxv* __elf_aux_vector; /* set by crt0 */
+
+static inline uint64_t read_counter(void)
+{
+    uint32_t lo, hi;
+    __asm __volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * Locates the clock page using the auxiliary vector; the result is cached in
+ * clock_page_addr, where 1 means there is no page.
+ */
+static const struct ANANAS_CLOCK_PAGE* find_clock_page(void)
+{
+    static uintptr_t clock_page_addr;
+    uintptr_t addr = __atomic_load_n(&clock_page_addr, __ATOMIC_RELAXED);
+    if (addr == 0) {
+        addr = 1;
+        for (const Elf_Auxv* av = __elf_aux_vector; av != NULL && av->a_type != AT_NULL; av++) {
+            if (av->a_type == AT_CLOCKPAGE) {
+                addr = (uintptr_t)av->a_un.a_ptr;
+                break;
+            }
+        }
+        __atomic_store_n(&clock_page_addr, addr, __ATOMIC_RELAXED);
+    }
+    return addr != 1 ? (const struct ANANAS_CLOCK_PAGE*)addr : NULL;
+}
+
+/*
+ * Reads the time from the kernel-provided clock page; returns zero if this is
+ * not possible, in which case we have to ask the kernel.
+ */
+static int clock_gettime_from_page(clockid_t id, struct timespec* ts)
+{
+    const struct ANANAS_CLOCK_PAGE* cp = find_clock_page();
+    if (cp == NULL || __atomic_load_n(&cp->cp_version, __ATOMIC_ACQUIRE) != CLOCK_PAGE_VERSION)
+        return 0;
+
+    uint64_t ns;
+    int64_t offset;
+    while (1) {
+        const uint32_t seq = __atomic_load_n(&cp->cp_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue; /* kernel is updating the page */
+
+        const uint64_t counter_base = cp->cp_counter_base;
+        const uint64_t ns_base = cp->cp_ns_base;
+        const uint64_t mult = cp->cp_mult;
+        const uint32_t shift = cp->cp_shift;
+        offset = cp->cp_realtime_offset;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&cp->cp_seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        const uint64_t counter = read_counter();
+        ns = ns_base;
+        if (counter > counter_base)
+            ns += (uint64_t)(((unsigned __int128)(counter - counter_base) * mult) >> shift);
+        break;
+    }
+
+    if (id == CLOCK_REALTIME)
+        ns += offset;
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+    return 1;
+}
+
 int clock_gettime(clockid_t id, struct timespec* ts)
 {
+    if ((id == CLOCK_MONOTONIC || id == CLOCK_REALTIME) && clock_gettime_from_page(id, ts))
+        return 0;
+
     statuscode_t status = sys_clock_gettime(id, ts);
     return map_statuscode(status);
 }
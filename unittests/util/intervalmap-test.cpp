@@ -209,3 +209,96 @@ TEST(IntervalMap, FindWithIntervalDoesNotYieldOverlappingMatches)
     const auto it = map.find_interval(completeInterval);
     EXPECT_EQ(map.end(), it);
 }
+
+namespace {
+    // Fills the map with [n * 10, n * 10 + 5) for n = 0 .. numIntervals - 1, in a scrambled order
+    constexpr int numIntervals = 50;
+
+    Interval NthInterval(int n) {
+        return Interval{ static_cast<IntervalValueType>(n * 10), static_cast<IntervalValueType>(n * 10 + 5) };
+    }
+
+    void FillMap(IntervalMap& map) {
+        for(int n = 0; n < numIntervals; ++n) {
+            const auto index = (n * 7) % numIntervals;
+            map.insert(NthInterval(index), Sentinel{index});
+        }
+    }
+}
+
+TEST(IntervalMap, InsertManyItemsMaintainsOrdering)
+{
+    IntervalMap map;
+    FillMap(map);
+    ASSERT_EQ(numIntervals, map.size());
+
+    int count{};
+    for(const auto& [ interval, value ]: map) {
+        EXPECT_EQ(NthInterval(count), interval);
+        EXPECT_EQ(Sentinel{count}, value);
+        ++count;
+    }
+    EXPECT_EQ(numIntervals, count);
+}
+
+TEST(IntervalMap, FindFindsValuesGivenManyIntervals)
+{
+    IntervalMap map;
+    FillMap(map);
+    for(const auto n: helpers::every_value<IntervalValueType>()) {
+        const auto it = map.find_by_value(n);
+        const auto index = n / 10;
+        if (n >= 0 && index < numIntervals && NthInterval(index).contains(n)) {
+            ASSERT_NE(map.end(), it);
+            EXPECT_EQ(Sentinel{index}, it->value);
+        } else {
+            EXPECT_EQ(map.end(), it);
+        }
+    }
+}
+
+TEST(IntervalMap, LowerBoundByValueYieldsContainingOrNextInterval)
+{
+    IntervalMap map;
+    FillMap(map);
+
+    auto it = map.lower_bound_by_value(-1);
+    ASSERT_NE(map.end(), it);
+    EXPECT_EQ(NthInterval(0), it->interval);
+
+    it = map.lower_bound_by_value(12);
+    ASSERT_NE(map.end(), it);
+    EXPECT_EQ(NthInterval(1), it->interval);
+
+    it = map.lower_bound_by_value(15);
+    ASSERT_NE(map.end(), it);
+    EXPECT_EQ(NthInterval(2), it->interval);
+
+    it = map.lower_bound_by_value(numIntervals * 10);
+    EXPECT_EQ(map.end(), it);
+}
+
+TEST(IntervalMap, FindAndRemoveIntervalGivenManyIntervals)
+{
+    IntervalMap map;
+    FillMap(map);
+
+    for(int n = 0; n < numIntervals; n += 2) {
+        const auto it = map.find_interval(NthInterval(n));
+        ASSERT_NE(map.end(), it);
+        EXPECT_EQ(Sentinel{n}, it->value);
+        EXPECT_TRUE(map.remove(NthInterval(n)));
+        EXPECT_FALSE(map.remove(NthInterval(n)));
+    }
+    EXPECT_EQ(numIntervals / 2, map.size());
+
+    for(int n = 0; n < numIntervals; ++n) {
+        const auto it = map.find_by_value(NthInterval(n).begin);
+        if (n % 2 == 0) {
+            EXPECT_EQ(map.end(), it);
+        } else {
+            ASSERT_NE(map.end(), it);
+            EXPECT_EQ(Sentinel{n}, it->value);
+        }
+    }
+}
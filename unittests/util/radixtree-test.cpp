@@ -0,0 +1,185 @@
+/*-
+ * SPDX-License-Identifier: Zlib
+ *
+ * Copyright (c) 2009-2021 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include <gtest/gtest.h>
+#include <vector>
+#include "../../include/ananas/util/radix_tree.h"
+
+namespace {
+    using RadixTree = util::radix_tree<int>;
+
+    constexpr unsigned int tagA = 0;
+    constexpr unsigned int tagB = 1;
+
+    int values[4] = { 1, 2, 3, 4 };
+
+    std::vector<RadixTree::index_type> CollectIndices(RadixTree& tree) {
+        std::vector<RadixTree::index_type> result;
+        tree.for_each([&](auto index, int*) { result.push_back(index); });
+        return result;
+    }
+
+    std::vector<RadixTree::index_type> CollectTaggedIndices(RadixTree& tree, unsigned int tag) {
+        std::vector<RadixTree::index_type> result;
+        tree.for_each_tagged(tag, [&](auto index, int*) { result.push_back(index); });
+        return result;
+    }
+}
+
+TEST(RadixTree, InitialTreeIsEmpty)
+{
+    RadixTree tree;
+    EXPECT_TRUE(tree.empty());
+    EXPECT_EQ(nullptr, tree.lookup(0));
+    EXPECT_EQ(nullptr, tree.lookup(12345));
+    EXPECT_TRUE(CollectIndices(tree).empty());
+}
+
+TEST(RadixTree, InsertAndLookup)
+{
+    RadixTree tree;
+    EXPECT_TRUE(tree.insert(5, &values[0]));
+    EXPECT_FALSE(tree.empty());
+    EXPECT_EQ(&values[0], tree.lookup(5));
+    EXPECT_EQ(nullptr, tree.lookup(4));
+    EXPECT_EQ(nullptr, tree.lookup(6));
+    EXPECT_EQ(nullptr, tree.lookup(5 + 64));
+}
+
+TEST(RadixTree, InsertRefusesUsedIndex)
+{
+    RadixTree tree;
+    EXPECT_TRUE(tree.insert(5, &values[0]));
+    EXPECT_FALSE(tree.insert(5, &values[1]));
+    EXPECT_EQ(&values[0], tree.lookup(5));
+}
+
+TEST(RadixTree, TreeGrowsToHoldLargeIndices)
+{
+    RadixTree tree;
+    const RadixTree::index_type large = 1UL << 40;
+    const RadixTree::index_type largest = ~0UL;
+    EXPECT_TRUE(tree.insert(3, &values[0]));
+    EXPECT_TRUE(tree.insert(large, &values[1]));
+    EXPECT_TRUE(tree.insert(largest, &values[2]));
+    EXPECT_EQ(&values[0], tree.lookup(3));
+    EXPECT_EQ(&values[1], tree.lookup(large));
+    EXPECT_EQ(&values[2], tree.lookup(largest));
+    EXPECT_EQ(nullptr, tree.lookup(large + 1));
+
+    const auto indices = CollectIndices(tree);
+    ASSERT_EQ(3, indices.size());
+    EXPECT_EQ(3, indices[0]);
+    EXPECT_EQ(large, indices[1]);
+    EXPECT_EQ(largest, indices[2]);
+}
+
+TEST(RadixTree, ForEachVisitsInOrder)
+{
+    RadixTree tree;
+    for (RadixTree::index_type n = 1000; n > 0; --n)
+        tree.insert(n * 37, &values[n % 4]);
+
+    const auto indices = CollectIndices(tree);
+    ASSERT_EQ(1000, indices.size());
+    for (size_t n = 0; n < indices.size(); ++n)
+        EXPECT_EQ((n + 1) * 37, indices[n]);
+}
+
+TEST(RadixTree, RemoveRemovesOnlyThatEntry)
+{
+    RadixTree tree;
+    tree.insert(1, &values[0]);
+    tree.insert(100, &values[1]);
+    EXPECT_EQ(&values[1], tree.remove(100));
+    EXPECT_EQ(nullptr, tree.remove(100));
+    EXPECT_EQ(nullptr, tree.lookup(100));
+    EXPECT_EQ(&values[0], tree.lookup(1));
+    EXPECT_TRUE(tree.insert(100, &values[2]));
+    EXPECT_EQ(&values[2], tree.lookup(100));
+}
+
+TEST(RadixTree, ClearRemovesEverything)
+{
+    RadixTree tree;
+    tree.insert(1, &values[0]);
+    tree.insert(1UL << 20, &values[1]);
+    tree.clear();
+    EXPECT_TRUE(tree.empty());
+    EXPECT_EQ(nullptr, tree.lookup(1));
+    EXPECT_EQ(nullptr, tree.lookup(1UL << 20));
+    EXPECT_TRUE(CollectIndices(tree).empty());
+}
+
+TEST(RadixTree, TagsRequireAnEntry)
+{
+    RadixTree tree;
+    EXPECT_FALSE(tree.set_tag(7, tagA));
+    EXPECT_FALSE(tree.get_tag(7, tagA));
+    EXPECT_FALSE(tree.any_tagged(tagA));
+}
+
+TEST(RadixTree, TagsAreIndependent)
+{
+    RadixTree tree;
+    tree.insert(7, &values[0]);
+    tree.insert(4096, &values[1]);
+    EXPECT_TRUE(tree.set_tag(7, tagA));
+    EXPECT_TRUE(tree.set_tag(4096, tagB));
+
+    EXPECT_TRUE(tree.get_tag(7, tagA));
+    EXPECT_FALSE(tree.get_tag(7, tagB));
+    EXPECT_FALSE(tree.get_tag(4096, tagA));
+    EXPECT_TRUE(tree.get_tag(4096, tagB));
+    EXPECT_TRUE(tree.any_tagged(tagA));
+    EXPECT_TRUE(tree.any_tagged(tagB));
+
+    tree.clear_tag(7, tagA);
+    EXPECT_FALSE(tree.get_tag(7, tagA));
+    EXPECT_FALSE(tree.any_tagged(tagA));
+    EXPECT_TRUE(tree.any_tagged(tagB));
+}
+
+TEST(RadixTree, TagsSurviveGrowth)
+{
+    RadixTree tree;
+    tree.insert(7, &values[0]);
+    tree.set_tag(7, tagA);
+    tree.insert(1UL << 30, &values[1]);
+    EXPECT_TRUE(tree.get_tag(7, tagA));
+    EXPECT_TRUE(tree.any_tagged(tagA));
+    tree.clear_tag(7, tagA);
+    EXPECT_FALSE(tree.any_tagged(tagA));
+}
+
+TEST(RadixTree, ForEachTaggedOnlyVisitsTaggedEntries)
+{
+    RadixTree tree;
+    for (RadixTree::index_type n = 0; n < 500; ++n) {
+        tree.insert(n * 11, &values[n % 4]);
+        if (n % 3 == 0)
+            tree.set_tag(n * 11, tagB);
+    }
+
+    const auto indices = CollectTaggedIndices(tree, tagB);
+    ASSERT_EQ(167, indices.size());
+    for (size_t n = 0; n < indices.size(); ++n)
+        EXPECT_EQ(n * 33, indices[n]);
+    EXPECT_TRUE(CollectTaggedIndices(tree, tagA).empty());
+}
+
+TEST(RadixTree, RemoveClearsTags)
+{
+    RadixTree tree;
+    tree.insert(7, &values[0]);
+    tree.insert(8, &values[1]);
+    tree.set_tag(7, tagA);
+    tree.set_tag(8, tagA);
+    tree.remove(7);
+    EXPECT_TRUE(tree.any_tagged(tagA));
+    tree.remove(8);
+    EXPECT_FALSE(tree.any_tagged(tagA));
+}